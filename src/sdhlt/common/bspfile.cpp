@@ -537,6 +537,61 @@ void            WriteBSPFile(const char* const filename)
 }
 
 
+// =====================================================================================
+//  GetBSPLump / SetBSPLump
+//      The loaded data of one lump, in the layout it has in memory
+// =====================================================================================
+static void*    BSPLumpData(const int lump, int** count, int* elementsize, int* maxsize)
+{
+    switch (lump)
+    {
+#define BSPLUMP(array, num, max) *count = &num; *elementsize = sizeof(array[0]); *maxsize = (max); return array;
+    case LUMP_PLANES:       BSPLUMP(g_dplanes, g_numplanes, sizeof(g_dplanes))
+    case LUMP_LEAFS:        BSPLUMP(g_dleafs, g_numleafs, sizeof(g_dleafs))
+    case LUMP_VERTEXES:     BSPLUMP(g_dvertexes, g_numvertexes, sizeof(g_dvertexes))
+    case LUMP_NODES:        BSPLUMP(g_dnodes, g_numnodes, sizeof(g_dnodes))
+    case LUMP_TEXINFO:      BSPLUMP(g_texinfo, g_numtexinfo, sizeof(g_texinfo))
+    case LUMP_FACES:        BSPLUMP(g_dfaces, g_numfaces, sizeof(g_dfaces))
+    case LUMP_CLIPNODES:    BSPLUMP(g_dclipnodes, g_numclipnodes, sizeof(g_dclipnodes))
+    case LUMP_MARKSURFACES: BSPLUMP(g_dmarksurfaces, g_nummarksurfaces, sizeof(g_dmarksurfaces))
+    case LUMP_SURFEDGES:    BSPLUMP(g_dsurfedges, g_numsurfedges, sizeof(g_dsurfedges))
+    case LUMP_EDGES:        BSPLUMP(g_dedges, g_numedges, sizeof(g_dedges))
+    case LUMP_MODELS:       BSPLUMP(g_dmodels, g_nummodels, sizeof(g_dmodels))
+    case LUMP_LIGHTING:     BSPLUMP(g_dlightdata, g_lightdatasize, g_max_map_lightdata)
+    case LUMP_VISIBILITY:   BSPLUMP(g_dvisdata, g_visdatasize, sizeof(g_dvisdata))
+    case LUMP_ENTITIES:     BSPLUMP(g_dentdata, g_entdatasize, sizeof(g_dentdata))
+    case LUMP_TEXTURES:     BSPLUMP(g_dtexdata, g_texdatasize, g_max_map_miptex)
+#undef BSPLUMP
+    default:
+        Error("BSPLumpData: bad lump %i", lump);
+        return NULL;
+    }
+}
+
+int             GetBSPLump(const int lump, const void** data)
+{
+    int*            count;
+    int             elementsize, maxsize;
+
+    *data = BSPLumpData(lump, &count, &elementsize, &maxsize);
+    return *count * elementsize;
+}
+
+void            SetBSPLump(const int lump, const void* const data, const int size)
+{
+    int*            count;
+    int             elementsize, maxsize;
+    void*           dest;
+
+    dest = BSPLumpData(lump, &count, &elementsize, &maxsize);
+    if (size % elementsize || size > maxsize)
+    {
+        Error("SetBSPLump: bad size %i for lump %i", size, lump);
+    }
+    memcpy(dest, data, size);
+    *count = size / elementsize;
+}
+
 #ifdef PLATFORM_CAN_CALC_EXTENT
 // =====================================================================================
 //  GetFaceExtents (with PLATFORM_CAN_CALC_EXTENT on)
@@ -355,6 +355,8 @@ extern int      CompressVis(const byte* const src, const unsigned int src_length
 extern void     LoadBSPImage(dheader_t* header);
 extern void     LoadBSPFile(const char* const filename);
 extern void     WriteBSPFile(const char* const filename);
+extern int      GetBSPLump(int lump, const void** data);   // returns the size in bytes
+extern void     SetBSPLump(int lump, const void* data, int size);
 extern void     PrintBSPFileSizes();
 #ifdef PLATFORM_CAN_CALC_EXTENT
 extern void		WriteExtentFile (const char *const filename);
@@ -0,0 +1,357 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cmdlib.h"
+#include "messages.h"
+#include "log.h"
+#include "filelib.h"
+#include "blockmem.h"
+#include "mathlib.h"
+#include "bspfile.h"
+#include "cache.h"
+
+#include <string>
+#include <vector>
+
+bool            g_cache = DEFAULT_CACHE;
+
+#define CACHE_IDENT "SDHLTCACHE1"                          // change the number when the layout changes
+
+typedef struct
+{
+    std::string     filename;
+    unsigned long long hash;
+}
+cacheinput_t;
+
+static std::vector<cacheinput_t> g_cacheinputs;
+
+// =====================================================================================
+//  CacheKey
+//      64 bit FNV-1a
+// =====================================================================================
+CacheKey::CacheKey()
+{
+    m_hash = 14695981039346656037ULL;
+    addString(g_Program);
+    addString(SDHLT_VERSIONSTRING);
+    addString(CACHE_IDENT);
+}
+
+void            CacheKey::add(const void* const data, const size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    size_t          i;
+
+    for (i = 0; i < size; i++)
+    {
+        m_hash = (m_hash ^ p[i]) * 1099511628211ULL;
+    }
+}
+
+void            CacheKey::addString(const char* const string)
+{
+    add(string, strlen(string) + 1);
+}
+
+void            CacheKey::addLump(const int lump)
+{
+    const void*     data;
+    const int       size = GetBSPLump(lump, &data);
+
+    add(&lump, sizeof(lump));
+    add(&size, sizeof(size));
+    add(data, size);
+}
+
+static unsigned long long HashFile(const char* const filename)
+{
+    CacheKey        key;
+    char*           buffer;
+    int             length;
+
+    if (!q_exists(filename))
+    {
+        return 0;
+    }
+    length = LoadFile(filename, &buffer);
+    key.add(&length, sizeof(length));
+    key.add(buffer, length);
+    Free(buffer);
+    return key.value();
+}
+
+void            CacheKey::addFile(const char* const filename)
+{
+    const unsigned long long hash = HashFile(filename);
+
+    addString(filename);
+    add(&hash, sizeof(hash));
+}
+
+void            CacheKey::addArguments(const int argc, char** const argv)
+{
+    // options that change how the tool runs but not what it writes, and how many values follow them
+    static const struct { const char* name; int values; } ignored[] =
+    {
+        {"-threads", 1}, {"-dev", 1}, {"-low", 0}, {"-high", 0}, {"-estimate", 0}, {"-noestimate", 0},
+        {"-verbose", 0}, {"-chart", 0}, {"-nolog", 0}, {"-noinfo", 0}, {"-noresetlog", 0},
+        {"-profile", 0}, {"-deterministic", 0}, {"-cache", 0}, {"-incremental", 0},
+    };
+    int             i, j;
+
+    for (i = 1; i < argc; i++)
+    {
+        for (j = 0; j < (int)(sizeof(ignored) / sizeof(ignored[0])); j++)
+        {
+            if (!strcasecmp(argv[i], ignored[j].name))
+            {
+                break;
+            }
+        }
+        if (j < (int)(sizeof(ignored) / sizeof(ignored[0])))
+        {
+            i += ignored[j].values;
+            continue;
+        }
+        addString(argv[i]);
+    }
+}
+
+// =====================================================================================
+//  CacheInputFile
+// =====================================================================================
+void            CacheInputFile(const char* const filename)
+{
+    cacheinput_t    input;
+    size_t          i;
+
+    if (!g_cache)
+    {
+        return;
+    }
+    for (i = 0; i < g_cacheinputs.size(); i++)
+    {
+        if (g_cacheinputs[i].filename == filename)
+        {
+            return;
+        }
+    }
+    input.filename = filename;
+    input.hash = HashFile(filename);
+    g_cacheinputs.push_back(input);
+}
+
+// =====================================================================================
+//  LoadCache
+// =====================================================================================
+typedef struct
+{
+    const char*     data;
+    int             left;
+}
+cachereader_t;
+
+static bool     CacheRead(cachereader_t* const reader, void* const dest, const int size)
+{
+    if (size < 0 || size > reader->left)
+    {
+        return false;
+    }
+    memcpy(dest, reader->data, size);
+    reader->data += size;
+    reader->left -= size;
+    return true;
+}
+
+static bool     CacheReadBlock(cachereader_t* const reader, const char** const data, int* const size)
+{
+    if (!CacheRead(reader, size, sizeof(*size)) || *size < 0 || *size > reader->left)
+    {
+        return false;
+    }
+    *data = reader->data;
+    reader->data += *size;
+    reader->left -= *size;
+    return true;
+}
+
+static bool     CacheReadString(cachereader_t* const reader, std::string& string)
+{
+    const char*     data;
+    int             size;
+
+    if (!CacheReadBlock(reader, &data, &size))
+    {
+        return false;
+    }
+    string.assign(data, size);
+    return true;
+}
+
+// returns NULL if it all matches, else what didn't
+static const char* ReadCache(cachereader_t* const reader, const CacheKey& key,
+                             const int* const lumps, const int numlumps, const char* const* const files, const int numfiles,
+                             std::vector<const char*>& lumpdata, std::vector<int>& lumpsizes,
+                             std::vector<const char*>& filedata, std::vector<int>& filesizes)
+{
+    char            ident[sizeof(CACHE_IDENT)];
+    unsigned long long value;
+    std::string     string;
+    int             count, i;
+
+    if (!CacheRead(reader, ident, sizeof(ident)) || memcmp(ident, CACHE_IDENT, sizeof(ident)))
+    {
+        return "not a cache file of this version";
+    }
+    if (!CacheRead(reader, &value, sizeof(value)) || value != key.value())
+    {
+        return "the bsp, options or entities differ";
+    }
+
+    if (!CacheRead(reader, &count, sizeof(count)))
+    {
+        return "file is damaged";
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (!CacheReadString(reader, string) || !CacheRead(reader, &value, sizeof(value)))
+        {
+            return "file is damaged";
+        }
+        if (HashFile(string.c_str()) != value)
+        {
+            static std::string reason;
+            reason = string + " has changed";
+            return reason.c_str();
+        }
+    }
+
+    lumpdata.resize(numlumps);
+    lumpsizes.resize(numlumps);
+    for (i = 0; i < numlumps; i++)
+    {
+        int             lump;
+
+        if (!CacheRead(reader, &lump, sizeof(lump)) || lump != lumps[i]
+            || !CacheReadBlock(reader, &lumpdata[i], &lumpsizes[i]))
+        {
+            return "file is damaged";
+        }
+    }
+    filedata.resize(numfiles);
+    filesizes.resize(numfiles);
+    for (i = 0; i < numfiles; i++)
+    {
+        if (!CacheReadString(reader, string) || string != files[i]
+            || !CacheReadBlock(reader, &filedata[i], &filesizes[i]))
+        {
+            return "file is damaged";
+        }
+    }
+    return NULL;
+}
+
+bool            LoadCache(const char* const mapname, const char* const name, const CacheKey& key,
+                          const int* const lumps, const int numlumps, const char* const* const files, const int numfiles)
+{
+    char            filename[_MAX_PATH];
+    char*           buffer;
+    cachereader_t   reader;
+    std::vector<const char*> lumpdata, filedata;
+    std::vector<int> lumpsizes, filesizes;
+    const char*     reason;
+    int             i;
+
+    if (!g_cache)
+    {
+        return false;
+    }
+    safe_snprintf(filename, _MAX_PATH, "%s.%scache", mapname, name);
+    if (!q_exists(filename))
+    {
+        Log("Cache miss: no %s\n", filename);
+        return false;
+    }
+    reader.left = LoadFile(filename, &buffer);
+    reader.data = buffer;
+    reason = ReadCache(&reader, key, lumps, numlumps, files, numfiles, lumpdata, lumpsizes, filedata, filesizes);
+    if (reason)
+    {
+        Log("Cache miss: %s\n", reason);
+        Free(buffer);
+        return false;
+    }
+
+    for (i = 0; i < numlumps; i++)
+    {
+        SetBSPLump(lumps[i], lumpdata[i], lumpsizes[i]);
+    }
+    for (i = 0; i < numfiles; i++)
+    {
+        char            path[_MAX_PATH];
+
+        safe_snprintf(path, _MAX_PATH, "%s%s", mapname, files[i]);
+        SaveFile(path, filedata[i], filesizes[i]);
+    }
+    Free(buffer);
+    Log("Cache hit: reusing the output of the last run with the same inputs from %s\n", filename);
+    return true;
+}
+
+// =====================================================================================
+//  WriteCache
+// =====================================================================================
+static void     CacheWriteBlock(FILE* const f, const void* const data, const int size)
+{
+    SafeWrite(f, &size, sizeof(size));
+    SafeWrite(f, data, size);
+}
+
+void            WriteCache(const char* const mapname, const char* const name, const CacheKey& key,
+                           const int* const lumps, const int numlumps, const char* const* const files, const int numfiles)
+{
+    char            filename[_MAX_PATH];
+    const unsigned long long value = key.value();
+    const int       numinputs = (int)g_cacheinputs.size();
+    FILE*           f;
+    int             i;
+
+    if (!g_cache)
+    {
+        return;
+    }
+    safe_snprintf(filename, _MAX_PATH, "%s.%scache", mapname, name);
+    f = SafeOpenWrite(filename);
+    SafeWrite(f, CACHE_IDENT, sizeof(CACHE_IDENT));
+    SafeWrite(f, &value, sizeof(value));
+    SafeWrite(f, &numinputs, sizeof(numinputs));
+    for (i = 0; i < numinputs; i++)
+    {
+        CacheWriteBlock(f, g_cacheinputs[i].filename.c_str(), (int)g_cacheinputs[i].filename.size());
+        SafeWrite(f, &g_cacheinputs[i].hash, sizeof(g_cacheinputs[i].hash));
+    }
+    for (i = 0; i < numlumps; i++)
+    {
+        const void*     data;
+        const int       size = GetBSPLump(lumps[i], &data);
+
+        SafeWrite(f, &lumps[i], sizeof(lumps[i]));
+        CacheWriteBlock(f, data, size);
+    }
+    for (i = 0; i < numfiles; i++)
+    {
+        char            path[_MAX_PATH];
+        char*           buffer;
+        int             length;
+
+        safe_snprintf(path, _MAX_PATH, "%s%s", mapname, files[i]);
+        length = LoadFile(path, &buffer);
+        CacheWriteBlock(f, files[i], (int)strlen(files[i]));
+        CacheWriteBlock(f, buffer, length);
+        Free(buffer);
+    }
+    fclose(f);
+    Log("Cache written to %s\n", filename);
+}
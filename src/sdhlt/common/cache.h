@@ -0,0 +1,54 @@
+#ifndef CACHE_H__
+#define CACHE_H__
+
+#if _MSC_VER >= 1000
+#pragma once
+#endif
+
+#include "cmdlib.h"
+
+#define DEFAULT_CACHE false
+
+extern bool     g_cache;                                   // reuse the output of a run with the same inputs "-cache"
+
+// =====================================================================================
+//  CacheKey
+//      A hash of everything the output of a tool depends on: the tool and its version, the
+//      options that change the output, and whichever lumps, files and entities the tool adds.
+// =====================================================================================
+class CacheKey
+{
+public:
+    CacheKey();
+
+    void            add(const void* data, size_t size);
+    void            addString(const char* string);
+    void            addLump(int lump);                     // the lump as currently loaded
+    void            addFile(const char* filename);         // contents, or that the file doesn't exist
+    void            addArguments(int argc, char** argv);   // leaves out -threads, -low, -chart and the like
+
+    unsigned long long value() const
+    {
+        return m_hash;
+    }
+
+private:
+    unsigned long long m_hash;
+};
+
+// a file the output depends on that the tool found while running, such as a wad or a .rad file;
+// a later run only reuses the cache if these still have the same contents
+extern void     CacheInputFile(const char* filename);
+
+// =====================================================================================
+//  LoadCache / WriteCache
+//      mapname.<name>cache holds the key of the last run, the input files it read, and the
+//      lumps and files (given as extensions of mapname) it produced. LoadCache puts these
+//      back and returns true if the key and the input files still match.
+// =====================================================================================
+extern bool     LoadCache(const char* mapname, const char* name, const CacheKey& key,
+                          const int* lumps, int numlumps, const char* const* files, int numfiles);
+extern void     WriteCache(const char* mapname, const char* name, const CacheKey& key,
+                           const int* lumps, int numlumps, const char* const* files, int numfiles);
+
+#endif //**/ CACHE_H__
@@ -0,0 +1,422 @@
+#ifdef SYSTEM_WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cmdlib.h"
+#include "messages.h"
+#include "log.h"
+#include "mathlib.h"
+#include "threads.h"
+#include "profile.h"
+
+#ifdef SYSTEM_POSIX
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include <stdarg.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+bool            g_profile = DEFAULT_PROFILE;
+
+typedef struct
+{
+    std::string     name;
+    int             parent;                                // -1 at the top level
+    int             calls;
+    double          start;                                 // first call, seconds after the tool started
+    double          wall;
+    double          cpu;                                   // process cpu time, -1 when not known
+    long long       items;
+    long            peakrss;                               // kB, process peak at the end of the phase
+    std::vector<double> busy;                              // per thread
+    std::vector<double> idle;
+}
+profilerecord_t;
+
+static std::vector<profilerecord_t> g_profilerecords;      // protected by g_profilelock
+static threadlock_t g_profilelock("profile records");
+static const double g_profilestart = I_FloatTime();
+static thread_local ProfilePhase* t_profilephase = NULL;   // innermost open phase of this thread
+
+// =====================================================================================
+//  GetProcessCPUTime
+//      User and system time of all threads of the process, in seconds
+// =====================================================================================
+double          GetProcessCPUTime()
+{
+#ifdef SYSTEM_WIN32
+    FILETIME        creation, exited, kernel, user;
+
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel, &user))
+    {
+        return 0.0;
+    }
+    return (((__int64)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime)
+          + ((__int64)user.dwHighDateTime << 32 | user.dwLowDateTime)) / 10000000.0;
+#endif
+#ifdef SYSTEM_POSIX
+    struct rusage   usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0.0;
+    }
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0
+         + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+#endif
+}
+
+// =====================================================================================
+//  GetPeakRSS
+// =====================================================================================
+long            GetPeakRSS()
+{
+#ifdef SYSTEM_WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return 0;
+    }
+    return (long)(counters.PeakWorkingSetSize / 1024);
+#endif
+#ifdef SYSTEM_POSIX
+    struct rusage   usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;                         // bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// =====================================================================================
+//  FindProfileRecord
+//      Caller must hold g_profilelock
+// =====================================================================================
+static int      FindProfileRecord(const char* const name, const int parent)
+{
+    int             i;
+
+    for (i = 0; i < (int)g_profilerecords.size(); i++)
+    {
+        if (g_profilerecords[i].parent == parent && g_profilerecords[i].name == name)
+        {
+            return i;
+        }
+    }
+
+    profilerecord_t record;
+    record.name = name;
+    record.parent = parent;
+    record.calls = 0;
+    record.start = I_FloatTime() - g_profilestart;
+    record.wall = 0.0;
+    record.cpu = 0.0;
+    record.items = 0;
+    record.peakrss = 0;
+    g_profilerecords.push_back(record);
+    return i;
+}
+
+// adds busy[] to times[], or wall - busy[] when idle is set
+static void     AddThreadTimes(std::vector<double>& times, const int numthreads, const double* const busy, const bool idle, const double wall)
+{
+    int             i;
+
+    if ((int)times.size() < numthreads)
+    {
+        times.resize(numthreads, 0.0);
+    }
+    for (i = 0; i < numthreads; i++)
+    {
+        times[i] += idle ? wall - busy[i] : busy[i];
+    }
+}
+
+// =====================================================================================
+//  ProfilePhase
+// =====================================================================================
+ProfilePhase::ProfilePhase(const char* const name, const long long items)
+{
+    m_phase = -1;
+    m_items = items;
+    m_outer = NULL;
+    if (!g_profile)
+    {
+        return;
+    }
+
+    m_outer = t_profilephase;
+    ThreadLock(g_profilelock);
+    m_phase = FindProfileRecord(name, m_outer ? m_outer->m_phase : -1);
+    ThreadUnlock(g_profilelock);
+    t_profilephase = this;
+
+    m_start = I_FloatTime();
+    m_startcpu = GetProcessCPUTime();
+}
+
+ProfilePhase::~ProfilePhase()
+{
+    if (m_phase < 0)
+    {
+        return;
+    }
+
+    const double    wall = I_FloatTime() - m_start;
+    const double    cpu = GetProcessCPUTime() - m_startcpu;
+    const long      peakrss = GetPeakRSS();
+
+    ThreadLock(g_profilelock);
+    profilerecord_t& record = g_profilerecords[m_phase];
+    record.calls++;
+    record.wall += wall;
+    if (record.cpu >= 0)
+    {
+        record.cpu += cpu;
+    }
+    record.items += m_items;
+    record.peakrss = qmax(record.peakrss, peakrss);
+    ThreadUnlock(g_profilelock);
+
+    t_profilephase = m_outer;
+}
+
+// =====================================================================================
+//  ProfileThreads
+// =====================================================================================
+void            ProfileThreads(const int numthreads, const double* const busy, const double wall)
+{
+    if (!g_profile || !t_profilephase)
+    {
+        return;
+    }
+
+    ThreadLock(g_profilelock);
+    profilerecord_t& record = g_profilerecords[t_profilephase->m_phase];
+    AddThreadTimes(record.busy, numthreads, busy, false, wall);
+    AddThreadTimes(record.idle, numthreads, busy, true, wall);
+    ThreadUnlock(g_profilelock);
+}
+
+// =====================================================================================
+//  ProfileRecord
+// =====================================================================================
+void            ProfileRecord(const char* const name, const double start, const double end, const long long items, const int numthreads, const double* const busy)
+{
+    if (!g_profile)
+    {
+        return;
+    }
+
+    const long      peakrss = GetPeakRSS();
+
+    ThreadLock(g_profilelock);
+    profilerecord_t& record = g_profilerecords[FindProfileRecord(name, t_profilephase ? t_profilephase->m_phase : -1)];
+    if (!record.calls)
+    {
+        record.start = start - g_profilestart;
+    }
+    record.calls++;
+    record.wall += end - start;
+    record.cpu = -1;
+    record.items += items;
+    record.peakrss = qmax(record.peakrss, peakrss);
+    if (busy)
+    {
+        AddThreadTimes(record.busy, numthreads, busy, false, end - start);
+    }
+    ThreadUnlock(g_profilelock);
+}
+
+// =====================================================================================
+//  WriteProfile
+//      Each tool writes one line of <map>.profile.json, keyed by its name, and keeps the
+//      lines the other tools wrote, so the file covers the whole compile. The counts of each
+//      lock are written with it and logged.
+// =====================================================================================
+static void     AppendFormat(std::string& out, const char* const format, ...)
+{
+    char            text[1024];
+    va_list         argptr;
+
+    va_start(argptr, format);
+    vsnprintf(text, sizeof(text), format, argptr);
+    va_end(argptr);
+    out += text;
+}
+
+static void     AppendTimes(std::string& out, const char* const key, const std::vector<double>& times)
+{
+    size_t          i;
+
+    AppendFormat(out, ", \"%s\": [", key);
+    for (i = 0; i < times.size(); i++)
+    {
+        AppendFormat(out, i ? ", %.4f" : "%.4f", times[i]);
+    }
+    out += "]";
+}
+
+static void     AppendLocks(std::string& out)
+{
+    const threadlockstats_t* stats;
+    bool            first = true;
+
+    out += "[";
+    for (stats = GetThreadLockStats(); stats; stats = stats->next)
+    {
+        if (!stats->locks)
+        {
+            continue;
+        }
+        AppendFormat(out, "%s{\"name\": \"%s\", \"locks\": %lld, \"waits\": %lld, \"wait\": %.4f}",
+                     first ? "" : ", ", stats->name, stats->locks, stats->waits, stats->waittime);
+        first = false;
+    }
+    out += "]";
+}
+
+static void     AppendPhases(std::string& out, const int parent)
+{
+    bool            first = true;
+    size_t          i;
+
+    out += "[";
+    for (i = 0; i < g_profilerecords.size(); i++)
+    {
+        const profilerecord_t& record = g_profilerecords[i];
+
+        if (record.parent != parent)
+        {
+            continue;
+        }
+        out += first ? "{" : ", {";
+        first = false;
+
+        out += "\"name\": \"";
+        for (const char c : record.name)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+            }
+            out += c;
+        }
+        AppendFormat(out, "\", \"calls\": %d, \"start\": %.4f, \"wall\": %.4f", record.calls, record.start, record.wall);
+        if (record.cpu >= 0)
+        {
+            AppendFormat(out, ", \"cpu\": %.4f", record.cpu);
+        }
+        AppendFormat(out, ", \"items\": %lld, \"peakrss_kb\": %ld", record.items, record.peakrss);
+        if (!record.busy.empty())
+        {
+            AppendTimes(out, "busy", record.busy);
+        }
+        if (!record.idle.empty())
+        {
+            AppendTimes(out, "idle", record.idle);
+        }
+        out += ", \"phases\": ";
+        AppendPhases(out, (int)i);
+        out += "}";
+    }
+    out += "]";
+}
+
+void            WriteProfile(const char* const mapname)
+{
+    char            filename[_MAX_PATH];
+    std::vector<std::string> lines;
+    std::string     entry;
+    std::string     key;
+    FILE*           f;
+    size_t          i;
+
+    if (!g_profile)
+    {
+        return;
+    }
+
+    safe_snprintf(filename, _MAX_PATH, "%s.profile.json", mapname);
+    key = std::string("\"") + g_Program + "\":";
+
+    AppendFormat(entry, "%s {\"time\": %lld, \"threads\": %d, \"wall\": %.4f, \"cpu\": %.4f, \"peakrss_kb\": %ld, \"phases\": ",
+                 key.c_str(), (long long)time(NULL), g_numthreads, I_FloatTime() - g_profilestart, GetProcessCPUTime(), GetPeakRSS());
+    AppendPhases(entry, -1);
+    entry += ", \"locks\": ";
+    AppendLocks(entry);
+    entry += "}";
+
+    // keep the entries of the other tools
+    f = fopen(filename, "r");
+    if (f)
+    {
+        std::string     text;
+        int             c;
+
+        do
+        {
+            c = fgetc(f);
+            if (c != EOF && c != '\n')
+            {
+                text += (char)c;
+                continue;
+            }
+            while (!text.empty() && (text.back() == '\r' || text.back() == ','))
+            {
+                text.pop_back();
+            }
+            if (!text.empty() && text[0] == '"')
+            {
+                lines.push_back(text.compare(0, key.size(), key) ? text : entry);
+            }
+            text.clear();
+        }
+        while (c != EOF);
+        fclose(f);
+    }
+    for (i = 0; i < lines.size(); i++)
+    {
+        if (lines[i] == entry)
+        {
+            break;
+        }
+    }
+    if (i == lines.size())
+    {
+        lines.push_back(entry);
+    }
+
+    f = fopen(filename, "w");
+    if (!f)
+    {
+        Warning("Couldn't write profile to %s", filename);
+        return;
+    }
+    fprintf(f, "{\n");
+    for (i = 0; i < lines.size(); i++)
+    {
+        fprintf(f, "%s%s\n", lines[i].c_str(), i + 1 < lines.size() ? "," : "");
+    }
+    fprintf(f, "}\n");
+    fclose(f);
+    LogThreadLockStats();
+    Log("Profile written to %s\n", filename);
+}
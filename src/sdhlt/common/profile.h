@@ -0,0 +1,52 @@
+#ifndef PROFILE_H__
+#define PROFILE_H__
+
+#if _MSC_VER >= 1000
+#pragma once
+#endif
+
+#include "cmdlib.h"
+
+#define DEFAULT_PROFILE false
+
+extern bool     g_profile;                                 // write <map>.profile.json "-profile"
+
+// =====================================================================================
+//  ProfilePhase
+//      Times a named phase from construction to destruction. Phases opened while another
+//      one is open on the same thread are nested under it, and phases with the same name
+//      under the same parent are added together. Does nothing unless -profile is set.
+// =====================================================================================
+class ProfilePhase
+{
+public:
+    ProfilePhase(const char* const name, const long long items = 0);
+    ~ProfilePhase();
+
+    void            addItems(const long long items)
+    {
+        m_items += items;
+    }
+
+private:
+    int             m_phase;
+    double          m_start;
+    double          m_startcpu;
+    long long       m_items;
+    ProfilePhase*   m_outer;
+
+    friend void     ProfileThreads(int numthreads, const double* busy, double wall);
+    friend void     ProfileRecord(const char* name, double start, double end, long long items, int numthreads, const double* busy);
+};
+
+// per-thread busy time of a RunThreadsOn, added to the innermost open phase of the calling thread
+extern void     ProfileThreads(int numthreads, const double* busy, double wall);
+// a phase that the caller timed itself with I_FloatTime, such as work spread over the tasks of another phase
+extern void     ProfileRecord(const char* name, double start, double end, long long items, int numthreads, const double* busy);
+
+extern double   GetProcessCPUTime();
+extern long     GetPeakRSS();                              // in kB
+
+extern void     WriteProfile(const char* const mapname);
+
+#endif //**/ PROFILE_H__
@@ -0,0 +1,55 @@
+#ifndef SURFACEFILE_H__
+#define SURFACEFILE_H__
+#include "cmdlib.h"
+
+#if _MSC_VER >= 1000
+#pragma once
+#endif
+
+// Binary layout of the hull files (.p0-.p3 surfaces and .b0-.b3 detail brushes)
+// passed from HLCSG to HLBSP. HLCSG -texthulls writes the old text format instead,
+// which HLBSP still reads; the two are told apart by the magic number.
+//
+// The file is a surfacefile_header_t followed by chunks. Each chunk is a
+// surfacefile_chunk_t and 'length' bytes of data, so unknown chunks can be skipped.
+// Points are written as doubles, in native byte order.
+
+#define SURFACEFILE_MAGIC   (('F' << 24) + ('S' << 16) + ('L' << 8) + 'H') // "HLSF"
+#define SURFACEFILE_VERSION 1
+
+typedef struct
+{
+    int             magic;
+    int             version;
+} surfacefile_header_t;
+
+typedef enum
+{
+    surfacechunk_face = 1,                                 // surfacefile_face_t, numpoints * 3 doubles
+    surfacechunk_brush,                                    // detail brush: (surfacefile_side_t, numpoints * 3 doubles) per side
+    surfacechunk_endmodel                                  // no data
+}
+surfacechunk_t;
+
+typedef struct
+{
+    int             type;                                  // surfacechunk_t
+    int             length;                                // bytes of data after this header
+} surfacefile_chunk_t;
+
+typedef struct
+{
+    int             detaillevel;
+    int             planenum;
+    int             texinfo;
+    int             contents;
+    int             numpoints;
+} surfacefile_face_t;
+
+typedef struct
+{
+    int             planenum;
+    int             numpoints;
+} surfacefile_side_t;
+
+#endif //SURFACEFILE_H__
@@ -13,6 +13,7 @@
 #include "log.h"
 #include "threads.h"
 #include "blockmem.h"
+#include "mathlib.h"
 
 #ifdef SYSTEM_POSIX
 #ifdef HAVE_SYS_TIME_H
@@ -29,62 +30,95 @@
 
 #include "hlassert.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
 q_threadpriority g_threadpriority = DEFAULT_THREAD_PRIORITY;
+bool            g_deterministic = DEFAULT_DETERMINISTIC;
 
 #define THREADTIMES_SIZE 100
 #define THREADTIMES_SIZEf (float)(THREADTIMES_SIZE)
 
-static int      dispatch = 0;
+// GetThreadWork hands out runs of work items, a share of the remaining work that shrinks
+// towards the end of the run so the threads finish together, but never more than one
+// THREADWORK_MAXSHARE'th of the whole so the progress report stays smooth
+#define THREADWORK_SPLIT 4
+#define THREADWORK_MAXSHARE 200
+#define THREADREPORT_INTERVAL 50                           // ms between progress reports
+
+static std::atomic<int> dispatch(0);
 static int      workcount = 0;
+static int      workmaxchunk = 1;
+static int      workrun = 0;                               // which RunThreadsOn the dispatch belongs to
+static int      reported = 0;                              // dispatch the progress has been reported up to
 static int      oldf = 0;
 static bool     pacifier = false;
 static bool     threaded = false;
 static double   threadstart = 0;
 static double   threadtimes[THREADTIMES_SIZE];
+static double   threadbusy[MAX_THREADS];                   // time each thread of the last RunThreadsOn ran for
 
-int             GetThreadWork()
+// the run of work items this thread took from dispatch
+static thread_local int t_workrun = -1;
+static thread_local int t_worknext = 0;
+static thread_local int t_workend = 0;
+
+static void     StartThreadWork(int workcnt, bool showpacifier)
+{
+    int             i;
+
+    threadstart = I_FloatTime();
+    for (i = 0; i < THREADTIMES_SIZE; i++)
+    {
+        threadtimes[i] = 0;
+    }
+    workrun++;
+    dispatch = 0;
+    workcount = workcnt;
+    workmaxchunk = qmax(1, workcnt / THREADWORK_MAXSHARE);
+    reported = 0;
+    oldf = 0;
+    pacifier = showpacifier;
+
+    if (workcount < 0)
+    {
+        Developer(DEVELOPER_LEVEL_ERROR, "RunThreadsOn: negative workcount(%i)\n", workcount);
+    }
+    hlassume(workcount >= 0, assume_BadWorkcount);
+}
+
+// =====================================================================================
+//  ReportThreadWork
+//      Prints the progress of the work handed out since the last report. Only ever called
+//      by the thread that started the run, so the workers never wait on the console.
+// =====================================================================================
+static void     ReportThreadWork()
 {
-    int             r, f, i;
+    int             current, d, f, i;
     double          ct, finish, finish2, finish3;
 	static const char *s1 = NULL; // avoid frequent call of Localize() in PrintConsole
 	static const char *s2 = NULL;
 
-    ThreadLock();
 	if (s1 == NULL)
 		s1 = Localize ("  (%d%%: est. time to completion %ld/%ld/%ld secs)   ");
 	if (s2 == NULL)
 		s2 = Localize ("  (%d%%: est. time to completion <1 sec)   ");
 
-    if (dispatch == 0)
-    {
-        oldf = 0;
-    }
-
-    if (dispatch > workcount)
-    {
-        Developer(DEVELOPER_LEVEL_ERROR, "dispatch > workcount!!!\n");
-        ThreadUnlock();
-        return -1;
-    }
-    if (dispatch == workcount)
-    {
-        Developer(DEVELOPER_LEVEL_MESSAGE, "dispatch == workcount, work is complete\n");
-        ThreadUnlock();
-        return -1;
-    }
-    if (dispatch < 0)
+    current = qmin((int)dispatch, workcount);
+    if (current == reported)
     {
-        Developer(DEVELOPER_LEVEL_ERROR, "negative dispatch!!!\n");
-        ThreadUnlock();
-        return -1;
+        return;
     }
 
-    f = THREADTIMES_SIZE * dispatch / workcount;
     if (pacifier)
     {
+        // the last item handed out, as GetThreadWork used to print it
 		PrintConsole
-			("\r%6d /%6d", dispatch, workcount);
+			("\r%6d /%6d", current - 1, workcount);
 
+        f = THREADTIMES_SIZE * (current - 1) / workcount;
         if (f != oldf)
         {
             ct = I_FloatTime();
@@ -121,46 +155,135 @@ int             GetThreadWork()
     }
     else
     {
-        if (f != oldf)
+        // every item handed out since the last report, so the same ticks are printed
+        // however the work was split up
+        for (d = reported; d < current; d++)
         {
-            oldf = f;
-            switch (f)
+            f = THREADTIMES_SIZE * d / workcount;
+            if (f != oldf)
             {
-            case 10:
-            case 20:
-            case 30:
-            case 40:
-            case 50:
-            case 60:
-            case 70:
-            case 80:
-            case 90:
-            case 100:
+                oldf = f;
+                switch (f)
+                {
+                case 10:
+                case 20:
+                case 30:
+                case 40:
+                case 50:
+                case 60:
+                case 70:
+                case 80:
+                case 90:
+                case 100:
 /*
-            case 5:
-            case 15:
-            case 25:
-            case 35:
-            case 45:
-            case 55:
-            case 65:
-            case 75:
-            case 85:
-            case 95:
+                case 5:
+                case 15:
+                case 25:
+                case 35:
+                case 45:
+                case 55:
+                case 65:
+                case 75:
+                case 85:
+                case 95:
 */
-				PrintConsole
-					("%d%%...", f);
-            default:
-                break;
+					PrintConsole
+						("%d%%...", f);
+                default:
+                    break;
+                }
             }
         }
     }
+    reported = current;
+}
+
+// =====================================================================================
+//  threadlock_t
+// =====================================================================================
+static threadlockstats_t* threadlocks = NULL;              // every lock, filled in before main runs
+static threadlockstats_t globallock = {"ThreadLock", 0, 0, 0.0, NULL};
+
+threadlock_t::threadlock_t(const char* const name)
+{
+    stats.name = name;
+    stats.locks = 0;
+    stats.waits = 0;
+    stats.waittime = 0.0;
+    stats.next = threadlocks;
+    threadlocks = &stats;
+}
+
+void            ThreadLock(threadlock_t& lock)
+{
+    if (!lock.mutex.try_lock())
+    {
+        double          start = I_FloatTime();
+
+        lock.mutex.lock();
+        lock.stats.waits++;
+        lock.stats.waittime += I_FloatTime() - start;
+    }
+    lock.stats.locks++;
+}
+
+void            ThreadUnlock(threadlock_t& lock)
+{
+    lock.mutex.unlock();
+}
+
+const threadlockstats_t* GetThreadLockStats()
+{
+    globallock.next = threadlocks;
+    return &globallock;
+}
+
+// =====================================================================================
+//  LogThreadLockStats
+// =====================================================================================
+void            LogThreadLockStats()
+{
+    const threadlockstats_t* stats;
+
+    Log("%-28s %12s %10s %10s\n", "Lock", "locks", "waits", "wait secs");
+    for (stats = GetThreadLockStats(); stats; stats = stats->next)
+    {
+        if (stats->locks)
+        {
+            Log("%-28s %12lld %10lld %10.3f\n", stats->name, stats->locks, stats->waits, stats->waittime);
+        }
+    }
+}
+
+int             GetThreadWork()
+{
+    int             next, chunk;
+
+    if (t_workrun == workrun && t_worknext < t_workend)
+    {
+        return t_worknext++;
+    }
 
-    r = dispatch;
-    dispatch++;
+    next = dispatch.load(std::memory_order_relaxed);
+    do
+    {
+        if (next >= workcount)
+        {
+            Developer(DEVELOPER_LEVEL_MESSAGE, "dispatch == workcount, work is complete\n");
+            return -1;
+        }
+        chunk = (workcount - next) / (g_numthreads * THREADWORK_SPLIT);
+        chunk = qmax(1, qmin(chunk, workmaxchunk));
+    }
+    while (!dispatch.compare_exchange_weak(next, next + chunk, std::memory_order_relaxed));
 
-    ThreadUnlock();
-    return r;
+    t_workrun = workrun;
+    t_worknext = next + 1;
+    t_workend = next + chunk;
+#ifdef SINGLE_THREADED
+    ReportThreadWork();
+#endif
+    return next;
 }
 
 q_threadfunction workfunction;
@@ -191,6 +314,116 @@ void            RunThreadsOnIndividual(int workcnt, bool showpacifier, q_threadf
 
 #ifndef SINGLE_THREADED
 
+// =====================================================================================
+//  Thread pool
+//      The worker threads are started by the first RunThreadsOn and then sleep between
+//      runs, rather than being created and joined for every one. The thread that calls
+//      RunThreadsOn reports the progress while it waits for them.
+// =====================================================================================
+q_threadfunction q_entry;
+
+static void     StartPoolThread(int threadnum);
+void            threads_InitCrit();
+void            threads_UninitCrit();
+
+// never freed, the workers are still waiting on them when the process exits
+static std::mutex* poolmutex = new std::mutex;
+static std::condition_variable* poolstart = new std::condition_variable;
+static std::condition_variable* pooldone = new std::condition_variable;
+static int      poolsize = 0;                              // workers started
+static int      poolrun = 0;                               // bumped for each RunThreadsOn
+static int      poolthreads = 0;                           // workers taking part in the current run
+static int      poolbusy = 0;                              // of those, still running q_entry
+
+static void     PoolWorker(int threadnum)
+{
+    int             run = 0;
+    double          start;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(*poolmutex);
+            poolstart->wait(lock, [&] { return poolrun != run; });
+            run = poolrun;
+            if (threadnum >= poolthreads)
+            {
+                continue;
+            }
+        }
+
+        start = I_FloatTime();
+        q_entry(threadnum);
+        threadbusy[threadnum] = I_FloatTime() - start;
+
+        {
+            std::lock_guard<std::mutex> lock(*poolmutex);
+            if (--poolbusy == 0)
+            {
+                pooldone->notify_one();
+            }
+        }
+    }
+}
+
+static void     RunPool(q_threadfunction func)
+{
+    int             i;
+
+    q_entry = func;
+    for (i = poolsize; i < g_numthreads; i++)
+    {
+        StartPoolThread(i);
+    }
+    poolsize = qmax(poolsize, g_numthreads);
+
+    std::unique_lock<std::mutex> lock(*poolmutex);
+    poolthreads = g_numthreads;
+    poolbusy = g_numthreads;
+    poolrun++;
+    poolstart->notify_all();
+
+    while (poolbusy)
+    {
+        pooldone->wait_for(lock, std::chrono::milliseconds(THREADREPORT_INTERVAL));
+        lock.unlock();
+        ReportThreadWork();
+        lock.lock();
+    }
+    lock.unlock();
+    ReportThreadWork();
+    q_entry = NULL;
+}
+
+void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func)
+{
+    double          start, end;
+
+    StartThreadWork(workcnt, showpacifier);
+    start = threadstart;
+#ifdef SYSTEM_POSIX
+    if (pacifier)
+    {
+        setbuf(stdout, NULL);
+    }
+#endif
+
+    threads_InitCrit();
+    RunPool(func);
+    threads_UninitCrit();
+    threaded = false;
+
+    end = I_FloatTime();
+    if (pacifier)
+    {
+		PrintConsole
+			("\r%60s\r", "");
+    }
+    Log(" (%.2f seconds)\n", end - start);
+    ProfileThreads(g_numthreads, threadbusy, end - start);
+}
+
+
 /*====================
 | Begin SYSTEM_WIN32
 =*/
@@ -273,7 +506,15 @@ void            ThreadLock()
     {
         return;
     }
-    EnterCriticalSection(&crit);
+    if (!TryEnterCriticalSection(&crit))
+    {
+        double          start = I_FloatTime();
+
+        EnterCriticalSection(&crit);
+        globallock.waits++;
+        globallock.waittime += I_FloatTime() - start;
+    }
+    globallock.locks++;
     if (enter)
     {
         Warning("Recursive ThreadLock\n");
@@ -295,14 +536,40 @@ void            ThreadUnlock()
     LeaveCriticalSection(&crit);
 }
 
-q_threadfunction q_entry;
-
-static DWORD WINAPI ThreadEntryStub(LPVOID pParam)
+static DWORD WINAPI PoolThreadStub(LPVOID pParam)
 {
-    q_entry((int)pParam);
+    PoolWorker((int)(intptr_t)pParam);
     return 0;
 }
 
+static void     StartPoolThread(int threadnum)
+{
+    DWORD           threadid;
+    HANDLE          hThread = CreateThread(NULL,
+                                           0,
+                                           (LPTHREAD_START_ROUTINE) PoolThreadStub,
+                                           (LPVOID)(intptr_t) threadnum,
+                                           0,
+                                           &threadid);
+
+    if (hThread == NULL)
+    {
+        LPVOID          lpMsgBuf;
+
+        FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
+                      FORMAT_MESSAGE_FROM_SYSTEM |
+                      FORMAT_MESSAGE_IGNORE_INSERTS, NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),       // Default language
+                      (LPTSTR) & lpMsgBuf, 0, NULL);
+        // Display the string.
+        Developer(DEVELOPER_LEVEL_ERROR, "CreateThread #%d failed : %s\n", threadnum, lpMsgBuf);
+        Fatal(assume_THREAD_ERROR, "Unable to create thread #%d", threadnum);
+        // Free the buffer.
+        LocalFree(lpMsgBuf);
+    }
+    CheckFatal();
+    CloseHandle(hThread);                                  // the thread runs until the process exits
+}
+
 void            threads_InitCrit()
 {
     InitializeCriticalSection(&crit);
@@ -314,109 +581,6 @@ void            threads_UninitCrit()
     DeleteCriticalSection(&crit);
 }
 
-void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func)
-{
-    DWORD           threadid[MAX_THREADS];
-    HANDLE          threadhandle[MAX_THREADS];
-    int             i;
-    double          start, end;
-
-    threadstart = I_FloatTime();
-    start = threadstart;
-    for (i = 0; i < THREADTIMES_SIZE; i++)
-    {
-        threadtimes[i] = 0;
-    }
-    dispatch = 0;
-    workcount = workcnt;
-    oldf = -1;
-    pacifier = showpacifier;
-    threaded = true;
-    q_entry = func;
-
-    if (workcount < dispatch)
-    {
-        Developer(DEVELOPER_LEVEL_ERROR, "RunThreadsOn: Workcount(%i) < dispatch(%i)\n", workcount, dispatch);
-    }
-    hlassume(workcount >= dispatch, assume_BadWorkcount);
-
-    //
-    // Create all the threads (suspended)
-    //
-    threads_InitCrit();
-    for (i = 0; i < g_numthreads; i++)
-    {
-        HANDLE          hThread = CreateThread(NULL,
-                                               0,
-                                               (LPTHREAD_START_ROUTINE) ThreadEntryStub,
-                                               (LPVOID) i,
-                                               CREATE_SUSPENDED,
-                                               &threadid[i]);
-
-        if (hThread != NULL)
-        {
-            threadhandle[i] = hThread;
-        }
-        else
-        {
-            LPVOID          lpMsgBuf;
-
-            FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
-                          FORMAT_MESSAGE_FROM_SYSTEM |
-                          FORMAT_MESSAGE_IGNORE_INSERTS, NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),       // Default language
-                          (LPTSTR) & lpMsgBuf, 0, NULL);
-            // Process any inserts in lpMsgBuf.
-            // ...
-            // Display the string.
-            Developer(DEVELOPER_LEVEL_ERROR, "CreateThread #%d [%08X] failed : %s\n", i, threadhandle[i], lpMsgBuf);
-            Fatal(assume_THREAD_ERROR, "Unable to create thread #%d", i);
-            // Free the buffer.
-            LocalFree(lpMsgBuf);
-        }
-    }
-    CheckFatal();
-
-    // Start all the threads
-    for (i = 0; i < g_numthreads; i++)
-    {
-        if (ResumeThread(threadhandle[i]) == 0xFFFFFFFF)
-        {
-            LPVOID          lpMsgBuf;
-
-            FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER |
-                          FORMAT_MESSAGE_FROM_SYSTEM |
-                          FORMAT_MESSAGE_IGNORE_INSERTS, NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),       // Default language
-                          (LPTSTR) & lpMsgBuf, 0, NULL);
-            // Process any inserts in lpMsgBuf.
-            // ...
-            // Display the string.
-            Developer(DEVELOPER_LEVEL_ERROR, "ResumeThread #%d [%08X] failed : %s\n", i, threadhandle[i], lpMsgBuf);
-            Fatal(assume_THREAD_ERROR, "Unable to start thread #%d", i);
-            // Free the buffer.
-            LocalFree(lpMsgBuf);
-        }
-    }
-    CheckFatal();
-
-    // Wait for threads to complete
-    for (i = 0; i < g_numthreads; i++)
-    {
-        Developer(DEVELOPER_LEVEL_MESSAGE, "WaitForSingleObject on thread #%d [%08X]\n", i, threadhandle[i]);
-        WaitForSingleObject(threadhandle[i], INFINITE);
-    }
-    threads_UninitCrit();
-
-    q_entry = NULL;
-    threaded = false;
-    end = I_FloatTime();
-    if (pacifier)
-    {
-		PrintConsole
-			("\r%60s\r", "");
-    }
-    Log(" (%.2f seconds)\n", end - start);
-}
-
 #endif
 
 /*=
@@ -466,14 +630,21 @@ void            ThreadSetDefault()
     }
 }
 
-typedef void*    pthread_addr_t;
 pthread_mutex_t* my_mutex;
 
 void            ThreadLock()
 {
     if (my_mutex)
     {
-        pthread_mutex_lock(my_mutex);
+        if (pthread_mutex_trylock(my_mutex) != 0)
+        {
+            double          start = I_FloatTime();
+
+            pthread_mutex_lock(my_mutex);
+            globallock.waits++;
+            globallock.waittime += I_FloatTime() - start;
+        }
+        globallock.locks++;
     }
 }
 
@@ -485,71 +656,16 @@ void            ThreadUnlock()
     }
 }
 
-q_threadfunction q_entry;
-
-static void*    CDECL ThreadEntryStub(void* pParam)
+static void*    CDECL PoolThreadStub(void* pParam)
 {
-    q_entry((int)(intptr_t)pParam);
+    PoolWorker((int)(intptr_t)pParam);
     return NULL;
 }
 
-void            threads_InitCrit()
-{
-    pthread_mutexattr_t mattrib;
-
-    if (!my_mutex)
-    {
-        my_mutex = (pthread_mutex_t*)Alloc(sizeof(*my_mutex));
-        if (pthread_mutexattr_init(&mattrib) == -1)
-        {
-            Error("pthread_mutex_attr_init failed");
-        }
-        if (pthread_mutex_init(my_mutex, &mattrib) == -1)
-        {
-            Error("pthread_mutex_init failed");
-        }
-    }
-}
-
-void            threads_UninitCrit()
-{
-    Free(my_mutex);
-    my_mutex = NULL;
-}
-
-/*
- * =============
- * RunThreadsOn
- * =============
- */
-void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func)
+static void     StartPoolThread(int threadnum)
 {
-    int             i;
-    pthread_t       work_threads[MAX_THREADS];
-    pthread_addr_t  status;
+    pthread_t       thread;
     pthread_attr_t  attrib;
-    double          start, end;
-
-    threadstart = I_FloatTime();
-    start = threadstart;
-    for (i = 0; i < THREADTIMES_SIZE; i++)
-    {
-        threadtimes[i] = 0;
-    }
-
-    dispatch = 0;
-    workcount = workcnt;
-    oldf = -1;
-    pacifier = showpacifier;
-    threaded = true;
-    q_entry = func;
-
-    if (pacifier)
-    {
-        setbuf(stdout, NULL);
-    }
-
-    threads_InitCrit();
 
     if (pthread_attr_init(&attrib) == -1)
     {
@@ -561,36 +677,39 @@ void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction fu
         Error("pthread_attr_setstacksize failed");
     }
 #endif
-
-    for (i = 0; i < g_numthreads; i++)
+    if (pthread_attr_setdetachstate(&attrib, PTHREAD_CREATE_DETACHED) == -1)
     {
-        if (pthread_create(&work_threads[i], &attrib, ThreadEntryStub, (void*)(intptr_t)i) == -1)
-        {
-            Error("pthread_create failed");
-        }
+        Error("pthread_attr_setdetachstate failed");
     }
-
-    for (i = 0; i < g_numthreads; i++)
+    if (pthread_create(&thread, &attrib, PoolThreadStub, (void*)(intptr_t)threadnum) == -1)
     {
-        if (pthread_join(work_threads[i], &status) == -1)
-        {
-            Error("pthread_join failed");
-        }
+        Error("pthread_create failed");
     }
+    pthread_attr_destroy(&attrib);
+}
 
-    threads_UninitCrit();
-
-    q_entry = NULL;
-    threaded = false;
+void            threads_InitCrit()
+{
+    pthread_mutexattr_t mattrib;
 
-    end = I_FloatTime();
-    if (pacifier)
+    if (!my_mutex)
     {
-		PrintConsole
-			("\r%60s\r", "");
+        my_mutex = (pthread_mutex_t*)Alloc(sizeof(*my_mutex));
+        if (pthread_mutexattr_init(&mattrib) == -1)
+        {
+            Error("pthread_mutex_attr_init failed");
+        }
+        if (pthread_mutex_init(my_mutex, &mattrib) == -1)
+        {
+            Error("pthread_mutex_init failed");
+        }
     }
+}
 
-    Log(" (%.2f seconds)\n", end - start);
+void            threads_UninitCrit()
+{
+    Free(my_mutex);
+    my_mutex = NULL;
 }
 
 #endif /*SYSTEM_POSIX */
@@ -635,27 +754,20 @@ void            ThreadUnlock()
 
 void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func)
 {
-    int             i;
     double          start, end;
 
-    dispatch = 0;
-    workcount = workcnt;
-    oldf = -1;
-    pacifier = showpacifier;
-    threadstart = I_FloatTime();
+    StartThreadWork(workcnt, showpacifier);
     start = threadstart;
-    for (i = 0; i < THREADTIMES_SIZE; i++)
-    {
-        threadtimes[i] = 0.0;
-    }
 
     if (pacifier)
     {
         setbuf(stdout, NULL);
     }
     func(0);
+    ReportThreadWork();
 
     end = I_FloatTime();
+    threadbusy[0] = end - start;
 
     if (pacifier)
     {
@@ -664,6 +776,7 @@ void            RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction fu
     }
 
     Log(" (%.2f seconds)\n", end - start);
+    ProfileThreads(g_numthreads, threadbusy, end - start);
 }
 
 #endif
@@ -1,6 +1,9 @@
 #ifndef THREADS_H__
 #define THREADS_H__
 #include "cmdlib.h" //--vluzacn
+#include "profile.h"
+
+#include <mutex>
 
 #if _MSC_VER >= 1000
 #pragma once
@@ -26,9 +29,11 @@ typedef void    (*q_threadfunction) (int);
 #endif
 
 #define DEFAULT_THREAD_PRIORITY eThreadPriorityNormal
+#define DEFAULT_DETERMINISTIC false
 
 extern int      g_numthreads;
 extern q_threadpriority g_threadpriority;
+extern bool     g_deterministic;                           // same output for any thread count "-deterministic"
 
 extern void     ThreadSetPriority(q_threadpriority type);
 extern void     ThreadSetDefault();
@@ -36,6 +41,36 @@ extern int      GetThreadWork();
 extern void     ThreadLock();
 extern void     ThreadUnlock();
 
+// =====================================================================================
+//  threadlock_t
+//      A lock for one piece of shared data, so that threads working on different data
+//      don't wait for each other on ThreadLock. Define them at file scope. Each lock counts
+//      how often it was taken, and how often and for how long a thread had to wait for it.
+// =====================================================================================
+typedef struct threadlockstats_s
+{
+    const char*     name;
+    long long       locks;
+    long long       waits;
+    double          waittime;                              // seconds
+    struct threadlockstats_s* next;
+}
+threadlockstats_t;
+
+class threadlock_t
+{
+public:
+    threadlock_t(const char* const name);
+
+    std::mutex      mutex;
+    threadlockstats_t stats;                               // protected by mutex
+};
+
+extern void     ThreadLock(threadlock_t& lock);
+extern void     ThreadUnlock(threadlock_t& lock);
+extern const threadlockstats_t* GetThreadLockStats();      // ThreadLock and every threadlock_t
+extern void     LogThreadLockStats();
+
 extern void     RunThreadsOnIndividual(int workcnt, bool showpacifier, q_threadfunction);
 extern void     RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction);
 
@@ -44,7 +79,7 @@ extern void     threads_InitCrit();
 extern void     threads_UninitCrit();
 #endif
 
-#define NamedRunThreadsOn(n,p,f) { Log("%s\n", Localize(#f ":")); RunThreadsOn(n,p,f); }
-#define NamedRunThreadsOnIndividual(n,p,f) { Log("%s\n", Localize(#f ":")); RunThreadsOnIndividual(n,p,f); }
+#define NamedRunThreadsOn(n,p,f) { Log("%s\n", Localize(#f ":")); ProfilePhase phase_(#f, n); RunThreadsOn(n,p,f); }
+#define NamedRunThreadsOnIndividual(n,p,f) { Log("%s\n", Localize(#f ":")); ProfilePhase phase_(#f, n); RunThreadsOnIndividual(n,p,f); }
 
 #endif //**/ THREADS_H__
@@ -15,6 +15,7 @@
 #include "blockmem.h"
 #include "filelib.h"
 #include "threads.h"
+#include "cache.h"
 #include "winding.h"
 #include "cmdlinecfg.h"
 
@@ -48,6 +49,8 @@
 #define DEFAULT_NOCLIPNODEMERGE	false
 #define DEFAULT_LEAKONLY        false
 #define DEFAULT_WATERVIS        false
+#define DEFAULT_PARALLELHULLS	true
+#define DEFAULT_PARALLELSUBTREES	true
 #define DEFAULT_CHART           true //seedee
 #define DEFAULT_INFO            true
 
@@ -174,7 +177,11 @@ node_t;
 extern void     SubdivideFace(face_t* f, face_t** prevptr);
 extern node_t*  SolidBSP(const surfchain_t* const surfhead, 
 						 brush_t *detailbrushes, 
+						 const int hullnum, 
 						 bool report_progress);
+extern void     SolidBSPHulls(const surfchain_t* const surfheads[NUM_HULLS], 
+							  brush_t* const detailbrushes[NUM_HULLS], 
+							  node_t* nodes[NUM_HULLS]);
 
 //=============================================================================
 // merge.c
@@ -198,11 +205,11 @@ typedef struct portal_s
 }
 portal_t;
 
-extern node_t   g_outside_node;                            // portals outside the world face this
+extern node_t   g_outside_node[NUM_HULLS];                 // portals outside the world face this, one per hull
 
 extern void     AddPortalToNodes(portal_t* p, node_t* front, node_t* back);
 extern void     RemovePortalFromNode(portal_t* portal, node_t* l);
-extern void     MakeHeadnodePortals(node_t* node, const vec3_t mins, const vec3_t maxs);
+extern void     MakeHeadnodePortals(node_t* node, const vec3_t mins, const vec3_t maxs, const int hullnum);
 
 extern void     FreePortals(node_t* node);
 extern void     WritePortalfile(node_t* headnode);
@@ -250,6 +257,11 @@ extern brush_t *BrushFromBox (const vec3_t mins, const vec3_t maxs);
 extern void		CalcBrushBounds (const brush_t *b, vec3_t &mins, vec3_t &maxs);
 
 extern node_t*  AllocNode();
+extern void     FreeNode(node_t* n);
+
+extern void     SetBspPool(const int hullnum);
+extern void     FreeBspPool(const int hullnum);
+extern void     LogBspPoolStats();
 
 extern bool     CheckFaceForHint(const face_t* const f);
 extern bool     CheckFaceForSkip(const face_t* const f);
@@ -308,6 +320,8 @@ extern char		g_extentfilename[_MAX_PATH];
 extern bool     g_bUseNullTex;
 
 extern bool		g_nohull2;
+extern bool		g_parallelhulls;
+extern bool		g_parallelsubtrees;
 
 extern face_t*  NewFaceFromFace(const face_t* const in);
 extern void     SplitFace(face_t* in, const dplane_t* const split, face_t** front, face_t** back);
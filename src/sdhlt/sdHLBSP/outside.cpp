@@ -121,7 +121,7 @@ static void FreeDetailNode_r (node_t *n)
 	for (i = 0; i < 2; i++)
 	{
 		FreeDetailNode_r (n->children[i]);
-		free (n->children[i]);
+		FreeNode (n->children[i]);
 		n->children[i] = NULL;
 	}
 	face_t *f, *next;
@@ -394,6 +394,7 @@ void            LoadAllowableOutsideList(const char* const filename)
         safe_snprintf(fname, len, "%s", filename);
     }
 
+    CacheInputFile(fname);
     if (q_exists(fname))
     {
         if ((i = LoadFile(fname, &pData)))
@@ -503,13 +504,13 @@ node_t*         FillOutside(node_t* node, const bool leakfile, const unsigned hu
         return node;
     }
 
-	if(!g_outside_node.portals)
+	if(!g_outside_node[hullnum].portals)
 	{
 		Warning("No outside node portal found in hull %i, no filling performed for this hull",hullnum);
 		return node;
 	}
 
-    s = !(g_outside_node.portals->nodes[1] == &g_outside_node);
+    s = !(g_outside_node[hullnum].portals->nodes[1] == &g_outside_node[hullnum]);
 
     // first check to see if an occupied leaf is hit
     outleafs = 0;
@@ -532,7 +533,7 @@ node_t*         FillOutside(node_t* node, const bool leakfile, const unsigned hu
         }
     }
 
-    ret = RecursiveFillOutside(g_outside_node.portals->nodes[s], false);
+    ret = RecursiveFillOutside(g_outside_node[hullnum].portals->nodes[s], false);
 
     if (leakfile)
     {
@@ -582,7 +583,7 @@ node_t*         FillOutside(node_t* node, const bool leakfile, const unsigned hu
 
     // now go back and fill things in
     valid++;
-    RecursiveFillOutside(g_outside_node.portals->nodes[s], true);
+    RecursiveFillOutside(g_outside_node[hullnum].portals->nodes[s], true);
 
     // remove faces and nodes from filled in leafs  
     c_falsenodes = 0;
@@ -655,7 +656,7 @@ void			RemoveUnused_r (node_t* node)
 void			FillInside (node_t* node)
 {
 	int i;
-	g_outside_node.empty = 0;
+	g_outside_node[0].empty = 0;
 	ResetMark_r (node);
     for (i = 1; i < g_numentities; i++)
     {
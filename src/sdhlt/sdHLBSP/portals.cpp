@@ -2,7 +2,7 @@
 
 #include "bsp5.h"
 
-node_t          g_outside_node;                            // portals outside the world face this
+node_t          g_outside_node[NUM_HULLS];                 // portals outside the world face this, one per hull
 
 //=============================================================================
 
@@ -84,10 +84,10 @@ void            RemovePortalFromNode(portal_t* portal, node_t* l)
  * ================
  * MakeHeadnodePortals
  * 
- * The created portals will face the global g_outside_node
+ * The created portals will face g_outside_node[hullnum]
  * ================
  */
-void            MakeHeadnodePortals(node_t* node, const vec3_t mins, const vec3_t maxs)
+void            MakeHeadnodePortals(node_t* node, const vec3_t mins, const vec3_t maxs, const int hullnum)
 {
     vec3_t          bounds[2];
     int             i, j, n;
@@ -103,8 +103,8 @@ void            MakeHeadnodePortals(node_t* node, const vec3_t mins, const vec3_
         bounds[1][i] = maxs[i] + SIDESPACE;
     }
 
-    g_outside_node.contents = CONTENTS_SOLID;
-    g_outside_node.portals = NULL;
+    g_outside_node[hullnum].contents = CONTENTS_SOLID;
+    g_outside_node[hullnum].portals = NULL;
 
     for (i = 0; i < 3; i++)
     {
@@ -129,7 +129,7 @@ void            MakeHeadnodePortals(node_t* node, const vec3_t mins, const vec3_
             }
             p->plane = *pl;
             p->winding = new Winding(*pl);
-            AddPortalToNodes(p, node, &g_outside_node);
+            AddPortalToNodes(p, node, &g_outside_node[hullnum]);
         }
     }
 
@@ -15,7 +15,11 @@
 #include <windows.h>
 #endif
 
+#include <atomic>
+#include <vector>
+
 #include "bsp5.h"
+#include "surfacefile.h"
 
 /*
 
@@ -42,8 +46,18 @@ vec3_t          g_hull_size[NUM_HULLS][2] =
         {-16, -16, -18},    {16, 16, 18}
     }                                                     
 };
-static FILE*    polyfiles[NUM_HULLS];
-static FILE*    brushfiles[NUM_HULLS];
+// a hull file from HLCSG, either text read with fscanf or binary (see surfacefile.h) loaded in one read
+typedef struct
+{
+    FILE*           file;                                  // text format
+    char*           data;                                  // binary format, without the header
+    int             size;
+    int             pos;
+    char            name[_MAX_PATH];
+} surfacefile_t;
+
+static surfacefile_t polyfiles[NUM_HULLS];
+static surfacefile_t brushfiles[NUM_HULLS];
 int             g_hullnum = 0;
 
 static face_t*  validfaces[MAX_INTERNAL_MAP_PLANES];
@@ -74,6 +88,7 @@ bool            g_bUseNullTex = DEFAULT_NULLTEX; // "-nonulltex"
 
 
 bool g_nohull2 = false;
+bool g_parallelhulls = DEFAULT_PARALLELHULLS;
 
 bool g_viewportal = false;
 
@@ -441,6 +456,184 @@ void            SplitFace(face_t* in, const dplane_t* const split, face_t** fron
     }
 }
 
+// =====================================================================================
+//  Object pools
+//      Faces, surfaces, portals, nodes, sides and brushes are carved from slabs, one set
+//      of pools per hull. Each thread carves from its own block and keeps its own free
+//      lists, and the blocks of a hull are released in one go once the hull is written.
+//      Every object carries its pool in a small header, so it can be freed by any thread
+//      and in any phase.
+// =====================================================================================
+#define BSPPOOL_BLOCKSIZE	65536
+#define BSPPOOL_DEFAULT		NUM_HULLS                  // for objects made outside the hull phases; never released
+
+typedef enum
+{
+	bsppool_face = 0,
+	bsppool_surface,
+	bsppool_portal,
+	bsppool_node,
+	bsppool_side,
+	bsppool_brush,
+	bsppool_count
+}
+bsppooltype_t;
+
+static const char* const g_bsppoolnames[bsppool_count] = {"faces", "surfaces", "portals", "nodes", "sides", "brushes"};
+static const size_t g_bsppoolsizes[bsppool_count] = {sizeof(face_t), sizeof(surface_t), sizeof(portal_t), sizeof(node_t), sizeof(side_t), sizeof(brush_t)};
+
+typedef struct
+{
+	short			pool;
+	short			type;
+	int				pad;                                   // keeps the object 8 byte aligned
+}
+bsppoolheader_t;
+
+typedef struct
+{
+	std::vector<char*> blocks;                             // protected by g_bsppoollock
+	int				generation;                            // bumped when the blocks are released
+	std::atomic<int> live;
+	std::atomic<int> peak;
+}
+bsppool_t;
+
+typedef struct
+{
+	int				generation;
+	char*			next;                                  // unused part of the current block
+	int				numleft;
+	bsppoolheader_t* freelist;                             // linked through the objects
+}
+bsppoolcache_t;
+
+static bsppool_t g_bsppools[NUM_HULLS + 1][bsppool_count];
+static int      g_bsppoolpeak[bsppool_count];              // largest live count of any hull
+static threadlock_t g_bsppoollock("BSP pool blocks");
+static thread_local int t_bsppool = BSPPOOL_DEFAULT;
+static thread_local bsppoolcache_t t_bsppoolcaches[NUM_HULLS + 1][bsppool_count];
+
+static size_t   BspPoolObjectSize(const int type)
+{
+	return (sizeof(bsppoolheader_t) + g_bsppoolsizes[type] + 7) & ~(size_t)7;
+}
+
+static bsppoolcache_t* GetBspPoolCache(const int poolnum, const int type)
+{
+	bsppoolcache_t*	cache = &t_bsppoolcaches[poolnum][type];
+
+	if (cache->generation != g_bsppools[poolnum][type].generation)
+	{
+		memset(cache, 0, sizeof(bsppoolcache_t));
+		cache->generation = g_bsppools[poolnum][type].generation;
+	}
+	return cache;
+}
+
+static void*    AllocBspObject(const int type)
+{
+	const int		poolnum = t_bsppool;
+	bsppool_t*		pool = &g_bsppools[poolnum][type];
+	bsppoolcache_t*	cache = GetBspPoolCache(poolnum, type);
+	const size_t	size = BspPoolObjectSize(type);
+	bsppoolheader_t* header;
+
+	if (cache->freelist)
+	{
+		header = cache->freelist;
+		cache->freelist = *(bsppoolheader_t**)(header + 1);
+	}
+	else
+	{
+		if (cache->numleft == 0)
+		{
+			char*			block = (char*)malloc(BSPPOOL_BLOCKSIZE);
+
+			hlassume(block != NULL, assume_NoMemory);
+			ThreadLock(g_bsppoollock);
+			pool->blocks.push_back(block);
+			ThreadUnlock(g_bsppoollock);
+			cache->next = block;
+			cache->numleft = BSPPOOL_BLOCKSIZE / size;
+		}
+		header = (bsppoolheader_t*)cache->next;
+		cache->next += size;
+		cache->numleft--;
+	}
+	memset(header, 0, size);
+	header->pool = poolnum;
+	header->type = type;
+
+	int				live = ++pool->live;
+	int				peak = pool->peak;
+	while (live > peak && !pool->peak.compare_exchange_weak(peak, live))
+		;
+	return header + 1;
+}
+
+static void     FreeBspObject(void* object)
+{
+	bsppoolheader_t* header = (bsppoolheader_t*)object - 1;
+	bsppoolcache_t*	cache = GetBspPoolCache(header->pool, header->type);
+
+	*(bsppoolheader_t**)object = cache->freelist;
+	cache->freelist = header;
+	g_bsppools[header->pool][header->type].live--;
+}
+
+// =====================================================================================
+//  SetBspPool
+//      Selects the pool that the calling thread allocates from
+// =====================================================================================
+void            SetBspPool(const int hullnum)
+{
+	t_bsppool = hullnum;
+}
+
+// =====================================================================================
+//  FreeBspPool
+//      Releases every object allocated for a hull. Nothing of the hull may be used after.
+// =====================================================================================
+void            FreeBspPool(const int hullnum)
+{
+	int				type;
+
+	for (type = 0; type < bsppool_count; type++)
+	{
+		bsppool_t*		pool = &g_bsppools[hullnum][type];
+
+		for (char* block : pool->blocks)
+		{
+			free(block);
+		}
+		pool->blocks.clear();
+		pool->generation++;
+		g_bsppoolpeak[type] = qmax(g_bsppoolpeak[type], (int)pool->peak);
+		pool->live = 0;
+		pool->peak = 0;
+	}
+	if (t_bsppool == hullnum)
+	{
+		t_bsppool = BSPPOOL_DEFAULT;
+	}
+}
+
+// =====================================================================================
+//  LogBspPoolStats
+// =====================================================================================
+void            LogBspPoolStats()
+{
+	int				type;
+
+	Verbose("Peak live objects in one hull:\n");
+	for (type = 0; type < bsppool_count; type++)
+	{
+		Verbose("%10s %8d (%.1f MB)\n", g_bsppoolnames[type], g_bsppoolpeak[type], 
+			g_bsppoolpeak[type] * BspPoolObjectSize(type) / 1048576.0);
+	}
+}
+
 // =====================================================================================
 //  AllocFace
 // =====================================================================================
@@ -448,8 +641,7 @@ face_t*         AllocFace()
 {
     face_t*         f;
 
-    f = (face_t*)malloc(sizeof(face_t));
-    memset(f, 0, sizeof(face_t));
+    f = (face_t*)AllocBspObject(bsppool_face);
 
     f->planenum = -1;
 
@@ -461,7 +653,7 @@ face_t*         AllocFace()
 // =====================================================================================
 void            FreeFace(face_t* f)
 {
-    free(f);
+    FreeBspObject(f);
 }
 
 // =====================================================================================
@@ -469,12 +661,7 @@ void            FreeFace(face_t* f)
 // =====================================================================================
 surface_t*      AllocSurface()
 {
-    surface_t*      s;
-
-    s = (surface_t*)malloc(sizeof(surface_t));
-    memset(s, 0, sizeof(surface_t));
-
-    return s;
+    return (surface_t*)AllocBspObject(bsppool_surface);
 }
 
 // =====================================================================================
@@ -482,7 +669,7 @@ surface_t*      AllocSurface()
 // =====================================================================================
 void            FreeSurface(surface_t* s)
 {
-    free(s);
+    FreeBspObject(s);
 }
 
 // =====================================================================================
@@ -490,12 +677,7 @@ void            FreeSurface(surface_t* s)
 // =====================================================================================
 portal_t*       AllocPortal()
 {
-    portal_t*       p;
-
-    p = (portal_t*)malloc(sizeof(portal_t));
-    memset(p, 0, sizeof(portal_t));
-
-    return p;
+    return (portal_t*)AllocBspObject(bsppool_portal);
 }
 
 // =====================================================================================
@@ -503,16 +685,13 @@ portal_t*       AllocPortal()
 // =====================================================================================
 void            FreePortal(portal_t* p) // consider: inline
 {
-    free(p);
+    FreeBspObject(p);
 }
 
 
 side_t *AllocSide ()
 {
-	side_t *s;
-	s = (side_t *)malloc (sizeof (side_t));
-	memset (s, 0, sizeof (side_t));
-	return s;
+	return (side_t *)AllocBspObject (bsppool_side);
 }
 
 void FreeSide (side_t *s)
@@ -521,7 +700,7 @@ void FreeSide (side_t *s)
 	{
 		delete s->w;
 	}
-	free (s);
+	FreeBspObject (s);
 	return;
 }
 
@@ -536,10 +715,7 @@ side_t *NewSideFromSide (const side_t *s)
 
 brush_t *AllocBrush ()
 {
-	brush_t *b;
-	b = (brush_t *)malloc (sizeof (brush_t));
-	memset (b, 0, sizeof (brush_t));
-	return b;
+	return (brush_t *)AllocBspObject (bsppool_brush);
 }
 
 void FreeBrush (brush_t *b)
@@ -553,7 +729,7 @@ void FreeBrush (brush_t *b)
 			FreeSide (s);
 		}
 	}
-	free (b);
+	FreeBspObject (b);
 	return;
 }
 
@@ -719,12 +895,15 @@ void CalcBrushBounds (const brush_t *b, vec3_t &mins, vec3_t &maxs)
 // =====================================================================================
 node_t*         AllocNode()
 {
-    node_t*         n;
-
-    n = (node_t*)malloc(sizeof(node_t));
-    memset(n, 0, sizeof(node_t));
+    return (node_t*)AllocBspObject(bsppool_node);
+}
 
-    return n;
+// =====================================================================================
+//  FreeNode
+// =====================================================================================
+void            FreeNode(node_t* n)
+{
+    FreeBspObject(n);
 }
 
 // =====================================================================================
@@ -953,10 +1132,100 @@ static          facestyle_e SetFaceType(face_t* f)
     return f->facestyle;
 }
 
+// =====================================================================================
+//  OpenSurfaceFile
+//      Binary hull files are read into memory in one go, text ones are parsed as they are read
+// =====================================================================================
+static void     OpenSurfaceFile(surfacefile_t* const file, const char* const name)
+{
+    FILE*           f;
+    surfacefile_header_t header;
+
+    memset(file, 0, sizeof(surfacefile_t));
+    safe_strncpy(file->name, name, _MAX_PATH);
+
+    f = fopen(name, "rb");
+    if (!f)
+        Error("Can't open %s", name);
+
+    if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == SURFACEFILE_MAGIC)
+    {
+        if (header.version != SURFACEFILE_VERSION)
+        {
+            Error("%s is version %i, expected version %i; run HLCSG again", name, header.version, SURFACEFILE_VERSION);
+        }
+        file->size = q_filelength(f) - sizeof(header);
+        file->data = (char*)malloc(file->size + 1);
+        hlassume(file->data != NULL, assume_NoMemory);
+        SafeRead(f, file->data, file->size);
+        fclose(f);
+        return;
+    }
+    fclose(f);
+
+    file->file = fopen(name, "r");
+    if (!file->file)
+        Error("Can't open %s", name);
+}
+
+static void     CloseSurfaceFile(surfacefile_t* const file)
+{
+    if (file->file)
+    {
+        fclose(file->file);
+        file->file = NULL;
+    }
+    if (file->data)
+    {
+        free(file->data);
+        file->data = NULL;
+    }
+}
+
+// =====================================================================================
+//  ReadSurfaceChunk
+//      Returns the type of the next chunk of a binary hull file, or -1 at the end of the file
+// =====================================================================================
+static int      ReadSurfaceChunk(surfacefile_t* const file, const char** data, int* length)
+{
+    surfacefile_chunk_t chunk;
+
+    while (1)
+    {
+        if (file->pos == file->size)
+        {
+            return -1;
+        }
+        if (file->size - file->pos < (int)sizeof(chunk))
+        {
+            Error("%s: unexpected end of file", file->name);
+        }
+        memcpy(&chunk, file->data + file->pos, sizeof(chunk));
+        file->pos += sizeof(chunk);
+        if (chunk.length < 0 || chunk.length > file->size - file->pos)
+        {
+            Error("%s: bad chunk length %i", file->name, chunk.length);
+        }
+        *data = file->data + file->pos;
+        *length = chunk.length;
+        file->pos += chunk.length;
+
+        switch (chunk.type)
+        {
+        case surfacechunk_face:
+        case surfacechunk_brush:
+        case surfacechunk_endmodel:
+            return chunk.type;
+        default:
+            break;                                         // skip unknown chunks
+        }
+    }
+}
+
 // =====================================================================================
 //  ReadSurfs
 // =====================================================================================
-static surfchain_t* ReadSurfs(FILE* file)
+static surfchain_t* ReadSurfs(surfacefile_t* file)
 {
     int             r;
 	int				detaillevel;
@@ -966,18 +1235,57 @@ static surfchain_t* ReadSurfs(FILE* file)
     double          v[3];
     int             line = 0;
 	double			inaccuracy, inaccuracy_count = 0.0, inaccuracy_total = 0.0, inaccuracy_max = 0.0;
+	const char*		points = NULL;
 
     // read in the polygons
     while (1)
     {
-		if (file == polyfiles[2] && g_nohull2)
+		if (file == &polyfiles[2] && g_nohull2)
 			break;
         line++;
-        r = fscanf(file, "%i %i %i %i %i\n", &detaillevel, &planenum, &g_texinfo, &contents, &numpoints);
-        if (r == 0 || r == -1)
-        {
-            return NULL;
-        }
+		if (file->data)
+		{
+			const char*		data;
+			int				length;
+			surfacefile_face_t face;
+
+			r = ReadSurfaceChunk(file, &data, &length);
+			if (r == -1)
+			{
+				return NULL;
+			}
+			if (r == surfacechunk_endmodel)
+			{
+				planenum = -1;
+			}
+			else
+			{
+				if (r != surfacechunk_face || length < (int)sizeof(face))
+				{
+					Error("ReadSurfs (chunk %i): unexpected chunk in %s", line, file->name);
+				}
+				memcpy(&face, data, sizeof(face));
+				detaillevel = face.detaillevel;
+				planenum = face.planenum;
+				g_texinfo = face.texinfo;
+				contents = face.contents;
+				numpoints = face.numpoints;
+				if (numpoints < 0 || length != (int)(sizeof(face) + numpoints * 3 * sizeof(double)))
+				{
+					Error("ReadSurfs (chunk %i): bad face in %s", line, file->name);
+				}
+				points = data + sizeof(face);
+			}
+			r = 5;
+		}
+		else
+		{
+			r = fscanf(file->file, "%i %i %i %i %i\n", &detaillevel, &planenum, &g_texinfo, &contents, &numpoints);
+			if (r == 0 || r == -1)
+			{
+				return NULL;
+			}
+		}
         if (planenum == -1)                                // end of model
         {
 			Developer (DEVELOPER_LEVEL_MEGASPAM, "inaccuracy: average %.8f max %.8f\n", inaccuracy_total / inaccuracy_count, inaccuracy_max);
@@ -1008,17 +1316,21 @@ static surfchain_t* ReadSurfs(FILE* file)
         {
             Verbose("ReadSurfs (line %i): skipping a surface", line);
 
+			if (file->data)
+			{
+				continue;
+			}
             for (i = 0; i < numpoints; i++)
             {
                 line++;
                 //Verbose("skipping line %d", line);
-                r = fscanf(file, "%lf %lf %lf\n", &v[0], &v[1], &v[2]);
+                r = fscanf(file->file, "%lf %lf %lf\n", &v[0], &v[1], &v[2]);
                 if (r != 3)
                 {
                     Error("::ReadSurfs (face_skip), fscanf of points failed at line %i", line);
                 }
             }
-            fscanf(file, "\n");
+            fscanf(file->file, "\n");
             continue;
         }
 
@@ -1035,12 +1347,19 @@ static surfchain_t* ReadSurfs(FILE* file)
 
         for (i = 0; i < f->numpoints; i++)
         {
-            line++;
-            r = fscanf(file, "%lf %lf %lf\n", &v[0], &v[1], &v[2]);
-            if (r != 3)
-            {
-                Error("::ReadSurfs (face_normal), fscanf of points failed at line %i", line);
-            }
+			if (file->data)
+			{
+				memcpy(v, points + i * sizeof(v), sizeof(v));
+			}
+			else
+			{
+				line++;
+				r = fscanf(file->file, "%lf %lf %lf\n", &v[0], &v[1], &v[2]);
+				if (r != 3)
+				{
+					Error("::ReadSurfs (face_normal), fscanf of points failed at line %i", line);
+				}
+			}
             VectorCopy(v, f->pts[i]);
 			 if (DEVELOPER_LEVEL_MEGASPAM <= g_developer)
 			 {
@@ -1051,21 +1370,49 @@ static surfchain_t* ReadSurfs(FILE* file)
 				inaccuracy_max = qmax (inaccuracy, inaccuracy_max);
 			}
         }
-        fscanf(file, "\n");
+		if (!file->data)
+		{
+			fscanf(file->file, "\n");
+		}
     }
 
     return SurflistFromValidFaces();
 }
-static brush_t *ReadBrushes (FILE *file)
+static brush_t *ReadBrushes (surfacefile_t *file)
 {
 	brush_t *brushes = NULL;
 	while (1)
 	{
-		if (file == brushfiles[2] && g_nohull2)
+		if (file == &brushfiles[2] && g_nohull2)
 			break;
 		int r;
 		int brushinfo;
-		r = fscanf (file, "%i\n", &brushinfo);
+		const char *data = NULL;
+		int length = 0;
+		if (file->data)
+		{
+			r = ReadSurfaceChunk (file, &data, &length);
+			if (r == surfacechunk_endmodel)
+			{
+				brushinfo = -1;
+			}
+			else if (r == surfacechunk_brush)
+			{
+				brushinfo = 0;
+			}
+			else if (r == -1)
+			{
+				r = 0;
+			}
+			else
+			{
+				Error ("ReadBrushes: unexpected chunk in %s", file->name);
+			}
+		}
+		else
+		{
+			r = fscanf (file->file, "%i\n", &brushinfo);
+		}
 		if (r == 0 || r == -1)
 		{
 			if (brushes == NULL)
@@ -1091,14 +1438,38 @@ static brush_t *ReadBrushes (FILE *file)
 		{
 			int planenum;
 			int numpoints;
-			r = fscanf (file, "%i %u\n", &planenum, &numpoints);
-			if (r != 2)
+			if (file->data)
 			{
-				Error ("ReadBrushes: get side failed");
+				surfacefile_side_t side;
+				if (length == 0)
+				{
+					break;
+				}
+				if (length < (int)sizeof (side))
+				{
+					Error ("ReadBrushes: get side failed");
+				}
+				memcpy (&side, data, sizeof (side));
+				data += sizeof (side);
+				length -= sizeof (side);
+				planenum = side.planenum;
+				numpoints = side.numpoints;
+				if (numpoints < 0 || length < (int)(numpoints * 3 * sizeof (double)))
+				{
+					Error ("ReadBrushes: get point failed");
+				}
 			}
-			if (planenum == -1)
+			else
 			{
-				break;
+				r = fscanf (file->file, "%i %u\n", &planenum, &numpoints);
+				if (r != 2)
+				{
+					Error ("ReadBrushes: get side failed");
+				}
+				if (planenum == -1)
+				{
+					break;
+				}
 			}
 			side_t *s;
 			s = AllocSide ();
@@ -1108,10 +1479,19 @@ static brush_t *ReadBrushes (FILE *file)
 			for (x = 0; x < numpoints; x++)
 			{
 				double v[3];
-				r = fscanf (file, "%lf %lf %lf\n", &v[0], &v[1], &v[2]);
-				if (r != 3)
+				if (file->data)
 				{
-					Error ("ReadBrushes: get point failed");
+					memcpy (v, data, sizeof (v));
+					data += sizeof (v);
+					length -= sizeof (v);
+				}
+				else
+				{
+					r = fscanf (file->file, "%lf %lf %lf\n", &v[0], &v[1], &v[2]);
+					if (r != 3)
+					{
+						Error ("ReadBrushes: get point failed");
+					}
 				}
 				VectorCopy (v, s->w->m_Points[numpoints - 1 - x]);
 			}
@@ -1124,6 +1504,56 @@ static brush_t *ReadBrushes (FILE *file)
 }
 
 
+// =====================================================================================
+//  AddClipHullBounds
+//      Grows the model bounds by the surfaces of a clipping hull
+// =====================================================================================
+static void     AddClipHullBounds(dmodel_t* model, const surfchain_t* const surfs, const int modnum, const int hullnum)
+{
+	if (surfs->mins[0] > surfs->maxs[0])
+	{
+		Developer (DEVELOPER_LEVEL_MESSAGE, "model %d hull %d empty\n", modnum, hullnum);
+	}
+	else
+	{
+		vec3_t mins, maxs;
+		int i;
+		VectorSubtract (surfs->mins, g_hull_size[hullnum][0], mins);
+		VectorSubtract (surfs->maxs, g_hull_size[hullnum][1], maxs);
+		for (i = 0; i < 3; i++)
+		{
+			if (mins[i] > maxs[i])
+			{
+				vec_t tmp;
+				tmp = (mins[i] + maxs[i]) / 2;
+				mins[i] = tmp;
+				maxs[i] = tmp;
+			}
+		}
+		for (i = 0; i < 3; i++)
+		{
+			model->maxs[i] = qmax (model->maxs[i], maxs[i]);
+			model->mins[i] = qmin (model->mins[i], mins[i]);
+		}
+	}
+}
+
+// =====================================================================================
+//  Parallel hulls
+//      For the world, the node trees of all hulls are built at the same time by
+//      SolidBSPHulls. Filling, portal freeing and writing stay on the main thread in hull
+//      order, so the bsp file is the same as when the hulls are built one by one.
+// =====================================================================================
+typedef struct
+{
+	const surfchain_t* surfs[NUM_HULLS];
+	brush_t*		detailbrushes[NUM_HULLS];
+	node_t*			nodes[NUM_HULLS];
+}
+hullbuild_t;
+
+static hullbuild_t g_hullbuild;
+
 // =====================================================================================
 //  ProcessModel
 // =====================================================================================
@@ -1135,11 +1565,12 @@ static bool     ProcessModel()
     dmodel_t*       model;
     int             startleafs;
 
-    surfs = ReadSurfs(polyfiles[0]);
+	SetBspPool (0);
+    surfs = ReadSurfs(&polyfiles[0]);
 
     if (!surfs)
         return false;                                      // all models are done
-	detailbrushes = ReadBrushes (brushfiles[0]);
+	detailbrushes = ReadBrushes (&brushfiles[0]);
 
     hlassume(g_nummodels < MAX_MAP_MODELS, assume_MAX_MAP_MODELS);
 
@@ -1182,10 +1613,35 @@ static bool     ProcessModel()
 		}
 	}
 
-    // SolidBSP generates a node tree
-    nodes = SolidBSP(surfs,
-		detailbrushes,
-		modnum==0);
+	bool parallelhulls = g_parallelhulls && g_numthreads > 1 && modnum == 0 && !g_noclip;
+	if (parallelhulls)
+	{
+		// read the clipping hulls now, so that all hulls can be built at once
+		g_hullbuild.surfs[0] = surfs;
+		g_hullbuild.detailbrushes[0] = detailbrushes;
+		for (g_hullnum = 1; g_hullnum < NUM_HULLS; g_hullnum++)
+		{
+			SetBspPool (g_hullnum);
+			surfs = ReadSurfs(&polyfiles[g_hullnum]);
+			g_hullbuild.surfs[g_hullnum] = surfs;
+			g_hullbuild.detailbrushes[g_hullnum] = ReadBrushes (&brushfiles[g_hullnum]);
+			AddClipHullBounds (model, surfs, modnum, g_hullnum);
+		}
+		g_hullnum = 0;
+
+		Log("SolidBSP [hulls 0-%d] ", NUM_HULLS - 1);
+		SolidBSPHulls(g_hullbuild.surfs, g_hullbuild.detailbrushes, g_hullbuild.nodes);
+		SetBspPool (0);
+		nodes = g_hullbuild.nodes[0];
+	}
+	else
+	{
+		// SolidBSP generates a node tree
+		nodes = SolidBSP(surfs,
+			detailbrushes,
+			0,
+			modnum==0);
+	}
 
     // build all the portals in the bsp tree
     // some portals are solid polygons, and some are paths to other leafs
@@ -1245,6 +1701,7 @@ static bool     ProcessModel()
 		VectorFill (nodes->maxs, 0);
 	}
     WriteDrawNodes(nodes);
+	FreeBspPool (0);
     model->numfaces = g_numfaces - model->firstface;
     model->visleafs = g_numleafs - startleafs;
 
@@ -1264,40 +1721,21 @@ static bool     ProcessModel()
     // the clipping hulls are simpler
     for (g_hullnum = 1; g_hullnum < NUM_HULLS; g_hullnum++)
     {
-        surfs = ReadSurfs(polyfiles[g_hullnum]);
-		detailbrushes = ReadBrushes (brushfiles[g_hullnum]);
+		SetBspPool (g_hullnum);
+		if (parallelhulls)
 		{
-			int hullnum = g_hullnum;
-			if (surfs->mins[0] > surfs->maxs[0])
-			{
-				Developer (DEVELOPER_LEVEL_MESSAGE, "model %d hull %d empty\n", modnum, hullnum);
-			}
-			else
-			{
-				vec3_t mins, maxs;
-				int i;
-				VectorSubtract (surfs->mins, g_hull_size[hullnum][0], mins);
-				VectorSubtract (surfs->maxs, g_hull_size[hullnum][1], maxs);
-				for (i = 0; i < 3; i++)
-				{
-					if (mins[i] > maxs[i])
-					{
-						vec_t tmp;
-						tmp = (mins[i] + maxs[i]) / 2;
-						mins[i] = tmp;
-						maxs[i] = tmp;
-					}
-				}
-				for (i = 0; i < 3; i++)
-				{
-					model->maxs[i] = qmax (model->maxs[i], maxs[i]);
-					model->mins[i] = qmin (model->mins[i], mins[i]);
-				}
-			}
+			nodes = g_hullbuild.nodes[g_hullnum];
+		}
+		else
+		{
+			surfs = ReadSurfs(&polyfiles[g_hullnum]);
+			detailbrushes = ReadBrushes (&brushfiles[g_hullnum]);
+			AddClipHullBounds (model, surfs, modnum, g_hullnum);
+			nodes = SolidBSP(surfs,
+				detailbrushes, 
+				g_hullnum,
+				modnum==0);
 		}
-        nodes = SolidBSP(surfs,
-			detailbrushes, 
-			modnum==0);
         if (g_nummodels == 1 && !g_nofill)                   // assume non-world bmodels are simple
         {
             nodes = FillOutside(nodes, (g_bLeaked != true), g_hullnum);
@@ -1318,6 +1756,7 @@ static bool     ProcessModel()
 	        model->headnode[g_hullnum] = g_numclipnodes;
 		    WriteClipNodes(nodes);
 		}
+		FreeBspPool (g_hullnum);
     }
 	skipclip:
 
@@ -1395,6 +1834,9 @@ static void     Usage()
     Log("    -chart         : display bsp statitics\n");
     Log("    -low | -high   : run program an altered priority level\n");
     Log("    -nolog         : don't generate the compile logfiles\n");
+    Log("    -profile       : write phase timings to mapname.profile.json\n");
+    Log("    -deterministic : same output for any thread count\n");
+    Log("    -cache         : reuse the output of the last run with the same inputs\n");
     Log("    -threads #     : manually specify the number of threads to run\n");
 #ifdef SYSTEM_WIN32
     Log("    -estimate      : display estimated time during compile\n");
@@ -1407,6 +1849,8 @@ static void     Usage()
 
 
 	Log("    -nohull2       : Don't generate hull 2 (the clipping hull for large monsters and pushables)\n");
+	Log("    -noparallelhulls: Don't build the world hulls at the same time (uses less memory)\n");
+	Log("    -noparallelsubtrees: Don't build detail subtrees on other threads\n");
 
 	Log("    -viewportal    : Show portal boundaries in 'mapname_portal.pts' file\n");
 
@@ -1446,6 +1890,9 @@ static void     Settings()
     Log("developer           [ %7d ] [ %7d ]\n", g_developer, DEFAULT_DEVELOPER);
     Log("chart               [ %7s ] [ %7s ]\n", g_chart ? "on" : "off", DEFAULT_CHART ? "on" : "off");
     Log("estimate            [ %7s ] [ %7s ]\n", g_estimate ? "on" : "off", DEFAULT_ESTIMATE ? "on" : "off");
+    Log("profile             [ %7s ] [ %7s ]\n", g_profile ? "on" : "off", DEFAULT_PROFILE ? "on" : "off");
+    Log("deterministic       [ %7s ] [ %7s ]\n", g_deterministic ? "on" : "off", DEFAULT_DETERMINISTIC ? "on" : "off");
+    Log("cache               [ %7s ] [ %7s ]\n", g_cache ? "on" : "off", DEFAULT_CACHE ? "on" : "off");
     Log("max texture memory  [ %7d ] [ %7d ]\n", g_max_map_miptex, DEFAULT_MAX_MAP_MIPTEX);
 
     switch (g_threadpriority)
@@ -1478,16 +1925,48 @@ static void     Settings()
     Log("max node size       [ %7d ] [ %7d ] (Min %d) (Max %d)\n",
         g_maxnode_size, DEFAULT_MAXNODE_SIZE, MIN_MAXNODE_SIZE, MAX_MAXNODE_SIZE);
 	Log("remove hull 2       [ %7s ] [ %7s ]\n", g_nohull2? "on": "off", "off");
+	Log("parallel hulls      [ %7s ] [ %7s ]\n", g_parallelhulls? "on": "off", DEFAULT_PARALLELHULLS? "on": "off");
+	Log("parallel subtrees   [ %7s ] [ %7s ]\n", g_parallelsubtrees? "on": "off", DEFAULT_PARALLELSUBTREES? "on": "off");
     Log("\n\n");
 }
 
+// =====================================================================================
+//  CloseHullFiles
+// =====================================================================================
+static void     CloseHullFiles(const char* const filename)
+{
+    int             i;
+    char            name[_MAX_PATH];
+
+	// Because the bsp file has been updated, these polyfiles are no longer valid.
+    for (i = 0; i < NUM_HULLS; i++)
+    {
+		sprintf (name, "%s.p%i", filename, i);
+		CloseSurfaceFile (&polyfiles[i]);
+		unlink (name);
+		sprintf(name, "%s.b%i", filename, i);
+		CloseSurfaceFile (&brushfiles[i]);
+		unlink (name);
+    }
+	safe_snprintf (name, _MAX_PATH, "%s.hsz", filename);
+	unlink (name);
+	safe_snprintf (name, _MAX_PATH, "%s.pln", filename);
+	unlink (name);
+}
+
 // =====================================================================================
 //  ProcessFile
 // =====================================================================================
-static void     ProcessFile(const char* const filename)
+static void     ProcessFile(const char* const filename, CacheKey& key)
 {
     int             i;
     char            name[_MAX_PATH];
+    int             lumps[HEADER_LUMPS];
+#ifdef PLATFORM_CAN_CALC_EXTENT
+    const char*     files[] = {".prt", ".ext"};
+#else
+    const char*     files[] = {".prt"};
+#endif
 
     // delete existing files
     safe_snprintf(g_portfilename, _MAX_PATH, "%s.prt", filename);
@@ -1506,14 +1985,9 @@ static void     ProcessFile(const char* const filename)
     {
                    //mapname.p[0-3]
 		sprintf(name, "%s.p%i", filename, i);
-        polyfiles[i] = fopen(name, "r");
-
-        if (!polyfiles[i])
-            Error("Can't open %s", name);
+		OpenSurfaceFile (&polyfiles[i], name);
 		sprintf(name, "%s.b%i", filename, i);
-		brushfiles[i] = fopen(name, "r");
-		if (!brushfiles[i])
-			Error("Can't open %s", name);
+		OpenSurfaceFile (&brushfiles[i], name);
     }
 	{
 		FILE			*f;
@@ -1554,6 +2028,30 @@ static void     ProcessFile(const char* const filename)
 
     Settings(); // AJM: moved here due to info_compile_parameters entity
 
+    // the output only depends on what csg wrote, so a cache hit can skip straight to writing it
+    for (i = 0; i < HEADER_LUMPS; i++)
+    {
+        lumps[i] = i;
+        key.addLump(i);
+    }
+    for (i = 0; i < NUM_HULLS; i++)
+    {
+        sprintf(name, "%s.p%i", filename, i);
+        key.addFile(name);
+        sprintf(name, "%s.b%i", filename, i);
+        key.addFile(name);
+    }
+    safe_snprintf(name, _MAX_PATH, "%s.hsz", filename);
+    key.addFile(name);
+    safe_snprintf(name, _MAX_PATH, "%s.pln", filename);
+    key.addFile(name);
+    if (g_cache && !g_viewportal && LoadCache(filename, "bsp", key, lumps, HEADER_LUMPS, files, sizeof(files) / sizeof(files[0])))
+    {
+        WriteBSPFile(g_bspfilename);
+        CloseHullFiles(filename);
+        return;
+    }
+
 	{
 		char name[_MAX_PATH];
 		safe_snprintf (name, _MAX_PATH, "%s.pln", filename);
@@ -1590,26 +2088,18 @@ static void     ProcessFile(const char* const filename)
     // process each model individually
     while (ProcessModel())
         ;
+	LogBspPoolStats ();
 
     // write the updated bsp file out
     FinishBSPFile();
 
-	// Because the bsp file has been updated, these polyfiles are no longer valid.
-    for (i = 0; i < NUM_HULLS; i++)
+    // a leak leaves the .pts and .lin files to look at, so don't let a cache hit hide it
+    if (!g_bLeaked && !g_viewportal)
     {
-		sprintf (name, "%s.p%i", filename, i);
-		fclose (polyfiles[i]);
-		polyfiles[i] = NULL;
-		unlink (name);
-		sprintf(name, "%s.b%i", filename, i);
-		fclose (brushfiles[i]);
-		brushfiles[i] = NULL;
-		unlink (name);
+        WriteCache(filename, "bsp", key, lumps, HEADER_LUMPS, files, sizeof(files) / sizeof(files[0]));
     }
-	safe_snprintf (name, _MAX_PATH, "%s.hsz", filename);
-	unlink (name);
-	safe_snprintf (name, _MAX_PATH, "%s.pln", filename);
-	unlink (name);
+
+    CloseHullFiles(filename);
 }
 
 // =====================================================================================
@@ -1643,8 +2133,7 @@ int             main(const int argc, char** argv)
         {
             if (i + 1 < argc)	//added "1" .--vluzacn
             {
-                int             g_numthreads = atoi(argv[++i]);
-
+                g_numthreads = atoi(argv[++i]);
                 if (g_numthreads < 1)
                 {
                     Log("Expected value of at least 1 for '-threads'\n");
@@ -1755,6 +2244,18 @@ int             main(const int argc, char** argv)
         {
             g_log = false;
         }
+        else if (!strcasecmp(argv[i], "-profile"))
+        {
+            g_profile = true;
+        }
+        else if (!strcasecmp(argv[i], "-deterministic"))
+        {
+            g_deterministic = true;
+        }
+        else if (!strcasecmp(argv[i], "-cache"))
+        {
+            g_cache = true;
+        }
 
         else if (!strcasecmp(argv[i], "-nonulltex"))
         {
@@ -1766,6 +2267,14 @@ int             main(const int argc, char** argv)
 		{
 			g_nohull2 = true;
 		}
+		else if (!strcasecmp (argv[i], "-noparallelhulls"))
+		{
+			g_parallelhulls = false;
+		}
+		else if (!strcasecmp (argv[i], "-noparallelsubtrees"))
+		{
+			g_parallelsubtrees = false;
+		}
 
 		else if (!strcasecmp(argv[i], "-noopt"))
 		{
@@ -1969,10 +2478,16 @@ int             main(const int argc, char** argv)
     // BEGIN BSP
     start = I_FloatTime();
 
-    ProcessFile(g_Mapname);
+    {
+        CacheKey        key;
+
+        key.addArguments(argc, argv);
+        ProcessFile(g_Mapname, key);
+    }
 
     end = I_FloatTime();
     LogTimeElapsed(end - start);
+    WriteProfile(g_Mapname);
     // END BSP
 
     FreeAllowableOutsideList();
@@ -20,33 +20,52 @@
 //  CalcNodeBounds
 //  CopyFacesToNode
 //  BuildBspTree_r
+//  QueueBspTask
 //  SolidBSP
+//  SolidBSPHulls
 
 //  Each node or leaf will have a set of portals that completely enclose
 //  the volume of the node and pass into an adjacent node.
 #include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 int             g_maxnode_size = DEFAULT_MAXNODE_SIZE;
+bool            g_parallelsubtrees = DEFAULT_PARALLELSUBTREES;
 
-static bool g_reportProgress = false;
-static int  g_numProcessed = 0;
-static int  g_numReported = 0;
+// subtrees with fewer surfaces than this are not worth handing to another thread
+#define BSPTASK_MINSURFACES	16
 
-static void ResetStatus(bool report_progress)
+// state of one SolidBSP call; kept off the globals so the hulls can be built in parallel
+typedef struct
 {
-	g_reportProgress = report_progress;
-	g_numProcessed = g_numReported = 0;
+	int				hullnum;
+	bool			reportprogress;
+	bool			threaded;                              // detail subtrees are queued as tasks
+	std::atomic<int> numprocessed;                         // nodes, counted for -profile too
+	std::atomic<int> numreported;                          // in 500s, only with reportprogress
+	double			start;                                 // for the -profile record of SolidBSPHulls
+	double			end;
+	double			busy[MAX_THREADS];
 }
+bspbuild_t;
 
-static void UpdateStatus(void)
+static void UpdateStatus(bspbuild_t* build)
 {
-	if(g_reportProgress)
+	const int numprocessed = ++build->numprocessed;
+	if(build->reportprogress)
 	{
-		++g_numProcessed;
-		if((g_numProcessed / 500) > g_numReported)
+		// only the thread that moves numreported on prints
+		int numreported = build->numreported;
+		while((numprocessed / 500) > numreported)
 		{
-			g_numReported = (g_numProcessed / 500);
-			Log("%d...",g_numProcessed);
+			if(build->numreported.compare_exchange_weak(numreported, numprocessed / 500))
+			{
+				Log("%d...",numprocessed);
+				break;
+			}
 		}
 	}
 }	
@@ -1152,7 +1171,7 @@ const char*     ContentsToString(int contents)
         return "UNKNOWN";
     }
 }
-static void     LinkLeafFaces(surface_t* planelist, node_t* leafnode)
+static void     LinkLeafFaces(surface_t* planelist, node_t* leafnode, const int hullnum)
 {
     face_t*         f;
     surface_t*      surf;
@@ -1211,7 +1230,7 @@ static void     LinkLeafFaces(surface_t* planelist, node_t* leafnode)
 		Warning ("Ambiguous leafnode content ( %s and %s ) at (%.0f,%.0f,%.0f)-(%.0f,%.0f,%.0f) in hull %d of model %d (entity: classname \"%s\", origin \"%s\", targetname \"%s\")", 
 			ContentsToString (ContentsForRank(r)), ContentsToString (ContentsForRank(rank)), 
 			leafnode->mins[0], leafnode->mins[1], leafnode->mins[2], leafnode->maxs[0], leafnode->maxs[1], leafnode->maxs[2], 
-			g_hullnum, g_nummodels - 1, 
+			hullnum, g_nummodels - 1, 
 			(ent? ValueForKey (ent, "classname"): "unknown"), 
 			(ent? ValueForKey (ent, "origin"): "unknown"), 
 			(ent? ValueForKey (ent, "targetname"): "unknown"));
@@ -1572,10 +1591,48 @@ static void     CopyFacesToNode(node_t* node, surface_t* surf)
     }
 }
 
+// =====================================================================================
+//  QueueBspTask
+//      Hands the subtree under node to the task queue, if it is big enough to be worth it
+// =====================================================================================
+typedef struct
+{
+	node_t*			node;
+	bspbuild_t*		build;
+}
+bsptask_t;
+
+static std::deque<bsptask_t> g_bsptasks;                  // protected by g_bsptaskmutex
+static int      g_numactivebsptasks = 0;                   // protected by g_bsptaskmutex
+static std::mutex g_bsptaskmutex;
+static std::condition_variable g_bsptaskready;             // a task was queued, or the last one finished
+
+static bool     QueueBspTask(node_t* node, bspbuild_t* build)
+{
+	surface_t*		surf;
+	int				numsurfaces = 0;
+
+	for (surf = node->surfaces; surf && numsurfaces < BSPTASK_MINSURFACES; surf = surf->next)
+	{
+		numsurfaces++;
+	}
+	if (numsurfaces < BSPTASK_MINSURFACES)
+	{
+		return false;
+	}
+	bsptask_t task = {node, build};
+	{
+		std::lock_guard<std::mutex> lock(g_bsptaskmutex);
+		g_bsptasks.push_back(task);
+	}
+	g_bsptaskready.notify_one();
+	return true;
+}
+
 // =====================================================================================
 //  BuildBspTree_r
 // =====================================================================================
-static void     BuildBspTree_r(node_t* node)
+static void     BuildBspTree_r(node_t* node, bspbuild_t* build)
 {
     surface_t*      split;
     bool            midsplit;
@@ -1604,7 +1661,7 @@ static void     BuildBspTree_r(node_t* node)
 	if (!node->isdetail && (!split || split->detaillevel > 0))
 	{
 		node->isportalleaf = true;
-		LinkLeafFaces (node->surfaces, node); // set contents
+		LinkLeafFaces (node->surfaces, node, build->hullnum); // set contents
 		if (node->contents == CONTENTS_SOLID)
 		{
 			split = NULL;
@@ -1674,9 +1731,81 @@ static void     BuildBspTree_r(node_t* node)
 	}
 
     // recursively do the children
-    BuildBspTree_r(node->children[0]);
-    BuildBspTree_r(node->children[1]);
-	UpdateStatus();
+	// no portal joins the children of a detail split, so the back one can be built by another thread
+	bool queued = build->threaded && split->detaillevel > 0 && QueueBspTask(node->children[1], build);
+    BuildBspTree_r(node->children[0], build);
+	if (!queued)
+	{
+	    BuildBspTree_r(node->children[1], build);
+	}
+	UpdateStatus(build);
+}
+
+// =====================================================================================
+//  BuildBspTasks
+//      Worker thread for the subtree tasks. The oldest task is taken first, as it is
+//      nearest the root and so usually the largest. The tree does not depend on which
+//      thread builds a subtree or when, so the output matches a serial build.
+// =====================================================================================
+static void     BuildBspTasks(int threadnum)
+{
+	bsptask_t		task;
+	double			start;
+
+	while (1)
+	{
+		{
+			std::unique_lock<std::mutex> lock(g_bsptaskmutex);
+			g_bsptaskready.wait(lock, [] { return !g_bsptasks.empty() || g_numactivebsptasks == 0; });
+			if (g_bsptasks.empty())
+			{
+				return;
+			}
+			task = g_bsptasks.front();
+			g_bsptasks.pop_front();
+			g_numactivebsptasks++;
+		}
+
+		SetBspPool(task.build->hullnum);
+		start = I_FloatTime();
+		BuildBspTree_r(task.node, task.build);
+		task.build->busy[threadnum] += I_FloatTime() - start;
+
+		bool done;
+		{
+			std::lock_guard<std::mutex> lock(g_bsptaskmutex);
+			done = --g_numactivebsptasks == 0 && g_bsptasks.empty();
+			task.build->end = qmax(task.build->end, I_FloatTime());
+		}
+		if (done)
+		{
+			g_bsptaskready.notify_all();
+		}
+	}
+}
+
+// =====================================================================================
+//  BeginSolidBSP
+//      Creates the headnode of a hull and the portals around it
+// =====================================================================================
+static node_t*  BeginSolidBSP(const surfchain_t* const surfhead, brush_t *detailbrushes, const int hullnum)
+{
+    node_t*         headnode;
+
+    headnode = AllocNode();
+    headnode->surfaces = surfhead->surfaces;
+	headnode->detailbrushes = detailbrushes;
+	headnode->isdetail = false;
+	vec3_t brushmins, brushmaxs;
+	VectorAddVec (surfhead->mins, -SIDESPACE, brushmins);
+	VectorAddVec (surfhead->maxs, SIDESPACE, brushmaxs);
+	headnode->boundsbrush = BrushFromBox (brushmins, brushmaxs);
+
+
+    // generate six portals that enclose the entire world
+    MakeHeadnodePortals(headnode, surfhead->mins, surfhead->maxs, hullnum);
+
+    return headnode;
 }
 
 // =====================================================================================
@@ -1687,42 +1816,83 @@ static void     BuildBspTree_r(node_t* node)
 // =====================================================================================
 node_t*         SolidBSP(const surfchain_t* const surfhead, 
 						 brush_t *detailbrushes, 
+						 const int hullnum, 
 						 bool report_progress)
 {
     node_t*         headnode;
+	bspbuild_t		build{};
+	char			name[32];
+
+	safe_snprintf(name, sizeof(name), "SolidBSP hull %d", hullnum);
+	ProfilePhase	phase(name);
 
-	ResetStatus(report_progress);
+	build.hullnum = hullnum;
+	build.reportprogress = report_progress;
+	// only the world is worth the threads; RunThreadsOn also logs its own timing line
+	build.threaded = report_progress && g_parallelsubtrees && g_numthreads > 1;
 	double start_time = I_FloatTime();
 	if(report_progress)
 	{
-		Log("SolidBSP [hull %d] ",g_hullnum);
+		Log("SolidBSP [hull %d] ",hullnum);
 	}
 	else
 	{
 	    Verbose("----- SolidBSP -----\n");
 	}
 
-    headnode = AllocNode();
-    headnode->surfaces = surfhead->surfaces;
-	headnode->detailbrushes = detailbrushes;
-	headnode->isdetail = false;
-	vec3_t brushmins, brushmaxs;
-	VectorAddVec (surfhead->mins, -SIDESPACE, brushmins);
-	VectorAddVec (surfhead->maxs, SIDESPACE, brushmaxs);
-	headnode->boundsbrush = BrushFromBox (brushmins, brushmaxs);
-
-
-    // generate six portals that enclose the entire world
-    MakeHeadnodePortals(headnode, surfhead->mins, surfhead->maxs);
+	headnode = BeginSolidBSP(surfhead, detailbrushes, hullnum);
 
     // recursively partition everything
-    BuildBspTree_r(headnode);
+	if (build.threaded)
+	{
+		g_bsptasks.push_back({headnode, &build});
+		RunThreadsOn(g_numthreads, false, BuildBspTasks);  // logs the time itself
+		phase.addItems(build.numprocessed);
+		return headnode;
+	}
+    BuildBspTree_r(headnode, &build);
+	phase.addItems(build.numprocessed);
 
 	double end_time = I_FloatTime();
 	if(report_progress)
 	{
-		Log("%d (%.2f seconds)\n",++g_numProcessed,(end_time - start_time));
+		Log("%d (%.2f seconds)\n",++build.numprocessed,(end_time - start_time));
 	}
 
     return headnode;
 }
+
+// =====================================================================================
+//  SolidBSPHulls
+//      Builds the trees of all hulls at once. Each hull starts as one task, and its
+//      detail subtrees are queued as more tasks as they are found.
+// =====================================================================================
+void            SolidBSPHulls(const surfchain_t* const surfheads[NUM_HULLS], 
+							  brush_t* const detailbrushes[NUM_HULLS], 
+							  node_t* nodes[NUM_HULLS])
+{
+	bspbuild_t		builds[NUM_HULLS] = {};
+	int				hullnum;
+	ProfilePhase	phase("SolidBSPHulls", NUM_HULLS);
+
+	for (hullnum = 0; hullnum < NUM_HULLS; hullnum++)
+	{
+		builds[hullnum].hullnum = hullnum;
+		builds[hullnum].start = builds[hullnum].end = I_FloatTime();
+		builds[hullnum].reportprogress = false;
+		builds[hullnum].threaded = g_parallelsubtrees;
+		SetBspPool(hullnum);
+		nodes[hullnum] = BeginSolidBSP(surfheads[hullnum], detailbrushes[hullnum], hullnum);
+		g_bsptasks.push_back({nodes[hullnum], &builds[hullnum]});
+	}
+	RunThreadsOn(g_numthreads, false, BuildBspTasks);
+
+	// the hulls share the threads, so each one only gets the time its own tasks took
+	for (hullnum = 0; hullnum < NUM_HULLS; hullnum++)
+	{
+		char			name[32];
+
+		safe_snprintf(name, sizeof(name), "SolidBSP hull %d", hullnum);
+		ProfileRecord(name, builds[hullnum].start, builds[hullnum].end, builds[hullnum].numprocessed, g_numthreads, builds[hullnum].busy);
+	}
+}
@@ -103,7 +103,7 @@ static int      WriteClipNodes_r(node_t* node
 	{
 		if (node->contents == CONTENTS_SOLID)
 		{
-			free (node);
+			FreeNode (node);
 			return CONTENTS_SOLID;
 		}
 		else
@@ -122,7 +122,7 @@ static int      WriteClipNodes_r(node_t* node
 			num = portalleaf->contents;
 		}
 		free (node->markfaces);
-		free (node);
+		FreeNode (node);
 		return num;
 	}
 
@@ -161,7 +161,7 @@ static int      WriteClipNodes_r(node_t* node
 		c = output->second; // use existing clipnode
 	}
 
-    free(node);
+    FreeNode(node);
     return c;
 }
 
@@ -436,7 +436,7 @@ static void     FreeDrawNodes_r(node_t* node)
         FreeFace(f);
     }
 
-    free(node);
+    FreeNode(node);
 }
 
 // =====================================================================================
@@ -1,13 +1,74 @@
 #include "csg.h"
 
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
 plane_t         g_mapplanes[MAX_INTERNAL_MAP_PLANES];
 int             g_nummapplanes;
+static threadlock_t g_mapplanelock("map planes");
 hullshape_t		g_defaulthulls[NUM_HULLS];
 int				g_numhullshapes;
 hullshape_t		g_hullshapes[MAX_HULLSHAPES];
 
 #define DIST_EPSILON   0.04
 
+// =====================================================================================
+//  Brush order
+//      With -deterministic, CreateBrush makes planes, texinfos and miptexes in brush order,
+//      as a run on one thread does: a brush that needs one nobody has made yet first waits
+//      until all of the brushes before it are done, and then looks for it again.
+// =====================================================================================
+static std::mutex g_brushordermutex;
+static std::condition_variable g_brushordercond;
+static std::vector<char> g_brushesdone;                   // protected by g_brushordermutex
+static int      g_numbrushesdone;                          // brushes before this one are all done
+static thread_local int t_orderedbrush = -1;               // brush being made in order, -1 if none
+static thread_local bool t_earlierbrushesdone;
+
+void            InitBrushOrder(const int numbrushes)
+{
+	g_brushesdone.assign(numbrushes, false);
+	g_numbrushesdone = 0;
+}
+
+void            FreeBrushOrder()
+{
+	std::vector<char>().swap(g_brushesdone);
+}
+
+bool            EarlierBrushesPending()
+{
+	return t_orderedbrush >= 0 && !t_earlierbrushesdone;
+}
+
+// returns false if there was nothing to wait for
+bool            WaitForEarlierBrushes()
+{
+	if (!EarlierBrushesPending())
+	{
+		return false;
+	}
+	std::unique_lock<std::mutex> lock(g_brushordermutex);
+	g_brushordercond.wait(lock, [] { return g_numbrushesdone >= t_orderedbrush; });
+	t_earlierbrushesdone = true;
+	return true;
+}
+
+static void     EndOrderedBrush()
+{
+	{
+		std::lock_guard<std::mutex> lock(g_brushordermutex);
+		g_brushesdone[t_orderedbrush] = true;
+		while (g_numbrushesdone < (int)g_brushesdone.size() && g_brushesdone[g_numbrushesdone])
+		{
+			g_numbrushesdone++;
+		}
+	}
+	g_brushordercond.notify_all();
+	t_orderedbrush = -1;
+}
+
 
 // =====================================================================================
 //  FindIntPlane, fast version (replacement by KGP)
@@ -40,10 +101,15 @@ int FindIntPlane(const vec_t* const normal, const vec_t* const origin)
 		}
 	}
 
-	ThreadLock();
+	if (WaitForEarlierBrushes())
+	{
+		goto find_plane; // planes of the earlier brushes may have been added meanwhile
+	}
+
+	ThreadLock(g_mapplanelock);
 	if(returnval != g_nummapplanes) // make sure we don't race
 	{
-		ThreadUnlock();
+		ThreadUnlock(g_mapplanelock);
 		goto find_plane; //check to see if other thread added plane we need
 	}
 
@@ -85,7 +151,7 @@ int FindIntPlane(const vec_t* const normal, const vec_t* const origin)
 	{ returnval = g_nummapplanes; }
 
 	g_nummapplanes += 2;
-	ThreadUnlock();
+	ThreadUnlock(g_mapplanelock);
 	return returnval;
 }
 
@@ -1157,7 +1223,7 @@ contents_t      CheckBrushContents(const brush_t* const b)
 //  CreateBrush
 //      makes a brush!
 // =====================================================================================
-void CreateBrush(const int brushnum) //--vluzacn
+static void MakeBrush(const int brushnum) //--vluzacn
 {
 	brush_t*        b;
 	int             contents;
@@ -1214,6 +1280,19 @@ void CreateBrush(const int brushnum) //--vluzacn
 		}
 	}
 }
+
+void CreateBrush(const int brushnum)
+{
+	if (g_brushesdone.empty())
+	{
+		MakeBrush(brushnum);
+		return;
+	}
+	t_orderedbrush = brushnum;
+	t_earlierbrushesdone = false;
+	MakeBrush(brushnum);
+	EndOrderedBrush();
+}
 hullbrush_t *CreateHullBrush (const brush_t *b)
 {
 	const int MAXSIZE = 256;
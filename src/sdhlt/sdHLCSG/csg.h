@@ -57,6 +57,7 @@
 #define DEFAULT_NOUTF8 false
 #endif
 #define DEFAULT_NULLIFYTRIGGER true
+#define DEFAULT_TEXTHULLS false
 
 // AJM: added in
 #define UNLESS(a)  if (!(a))
@@ -250,6 +251,10 @@ extern brush_t* Brush_LoadEntity(entity_t* ent, int hullnum);
 extern contents_t CheckBrushContents(const brush_t* const b);
 
 extern void     CreateBrush(int brushnum);
+extern void     InitBrushOrder(int numbrushes);            // -deterministic
+extern void     FreeBrushOrder();
+extern bool     EarlierBrushesPending();
+extern bool     WaitForEarlierBrushes();
 extern void		CreateHullShape (int entitynum, bool disabled, const char *id, int defaulthulls);
 extern void		InitDefaultHulls ();
 
@@ -14,10 +14,15 @@
 */
 
 #include "csg.h" 
+#include "surfacefile.h"
 #ifdef SYSTEM_WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h> //--vluzacn
 #endif
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <stdarg.h>
 
 /*
 
@@ -31,10 +36,14 @@
 static FILE*    out[NUM_HULLS]; // pointer to each of the hull out files (.p0, .p1, ect.)  
 static FILE*    out_view[NUM_HULLS];
 static FILE*    out_detailbrush[NUM_HULLS];
+static threadlock_t g_hullfilelock("hull files");         // out, out_view and out_detailbrush
 static int      c_tiny;        
-static int      c_tiny_clip;
+static std::atomic<int> c_tiny_clip;
 static int      c_outfaces;
 static int      c_csgfaces;
+static std::atomic<long long> c_brushpairs;                // pairs of brushes in the same entity and hull
+static std::atomic<long long> c_brushboundstests;
+static std::atomic<long long> c_brushclips;                // pairs that went on to clip faces
 BoundingBox     world_bounds;
 
 
@@ -70,6 +79,7 @@ bool g_noutf8 = DEFAULT_NOUTF8;
 #endif
 bool g_nullifytrigger = DEFAULT_NULLIFYTRIGGER;
 bool g_viewsurface = false;
+bool g_texthulls = DEFAULT_TEXTHULLS;
 
 // =====================================================================================
 //  GetParamsFromEnt
@@ -284,37 +294,114 @@ void            FreeFace(bface_t* f)
 }
 
 
+// =====================================================================================
+//  Hull buffers
+//      The faces and detail brushes of one brush are collected in a hullbuffer_t and
+//      appended to the hull files in one go, so the threads only take the lock once per brush
+//      and hull.
+// =====================================================================================
+typedef struct
+{
+	std::vector<char> faces[NUM_HULLS];
+	std::vector<char> brushes[NUM_HULLS];
+	int				numfaces;
+}
+hullbuffer_t;
+
+static void     HullBufferWrite(std::vector<char>& buffer, const void* const data, const size_t size)
+{
+	buffer.insert(buffer.end(), (const char*)data, (const char*)data + size);
+}
+
+static void     HullBufferPrintf(std::vector<char>& buffer, const char* const format, ...)
+{
+	char			text[256];
+	va_list			argptr;
+	int				length;
+
+	va_start(argptr, format);
+	length = vsnprintf(text, sizeof(text), format, argptr);
+	va_end(argptr);
+	if (length < 0 || length >= (int)sizeof(text))
+	{
+		Error("HullBufferPrintf: line too long");
+	}
+	HullBufferWrite(buffer, text, length);
+}
+
+static void     HullBufferChunk(std::vector<char>& buffer, const int type, const int length)
+{
+	surfacefile_chunk_t chunk;
+
+	chunk.type = type;
+	chunk.length = length;
+	HullBufferWrite(buffer, &chunk, sizeof(chunk));
+}
+
+static void     HullBufferPoints(std::vector<char>& buffer, const Winding* const w)
+{
+	unsigned int	i;
+
+	if (g_texthulls)
+	{
+		for (i = 0; i < w->m_NumPoints; i++)
+		{
+			HullBufferPrintf(buffer, "%5.8f %5.8f %5.8f\n", w->m_Points[i][0], w->m_Points[i][1], w->m_Points[i][2]);
+		}
+		return;
+	}
+	for (i = 0; i < w->m_NumPoints; i++)
+	{
+		double			v[3];
+
+		VectorCopy(w->m_Points[i], v);
+		HullBufferWrite(buffer, v, sizeof(v));
+	}
+}
+
 // =====================================================================================
 //  WriteFace
 // =====================================================================================
-void            WriteFace(const int hull, const bface_t* const f
+static void     WriteFace(hullbuffer_t* const buffer, const int hull, const bface_t* const f
 						  , int detaillevel
 						  )
 {
     unsigned int    i;
     Winding*        w;
 
-    ThreadLock();
     if (!hull)
-        c_csgfaces++;
+        buffer->numfaces++;
 
     // .p0 format
     w = f->w;
 
-    // plane summary
-	fprintf (out[hull], "%i %i %i %i %u\n", detaillevel, f->planenum, f->texinfo, f->contents, w->m_NumPoints);
+	if (g_texthulls)
+	{
+		// plane summary
+		HullBufferPrintf(buffer->faces[hull], "%i %i %i %i %u\n", detaillevel, f->planenum, f->texinfo, f->contents, w->m_NumPoints);
 
-    // for each of the points on the face
-    for (i = 0; i < w->m_NumPoints; i++)
-    {
-        // write the co-ords
-        fprintf(out[hull], "%5.8f %5.8f %5.8f\n", w->m_Points[i][0], w->m_Points[i][1], w->m_Points[i][2]);
-    }
+		// for each of the points on the face
+		HullBufferPoints(buffer->faces[hull], w);
 
-    // put in an extra line break
-    fprintf(out[hull], "\n");
+		// put in an extra line break
+		HullBufferPrintf(buffer->faces[hull], "\n");
+	}
+	else
+	{
+		surfacefile_face_t face;
+
+		face.detaillevel = detaillevel;
+		face.planenum = f->planenum;
+		face.texinfo = f->texinfo;
+		face.contents = f->contents;
+		face.numpoints = w->m_NumPoints;
+		HullBufferChunk(buffer->faces[hull], surfacechunk_face, sizeof(face) + w->m_NumPoints * 3 * sizeof(double));
+		HullBufferWrite(buffer->faces[hull], &face, sizeof(face));
+		HullBufferPoints(buffer->faces[hull], w);
+	}
 	if (g_viewsurface)
 	{
+		ThreadLock(g_hullfilelock);
 		static bool side = false;
 		side = !side;
 		if (side)
@@ -335,25 +422,60 @@ void            WriteFace(const int hull, const bface_t* const f
 			fprintf (out_view[hull], "%5.2f %5.2f %5.2f\n", center[0], center[1], center[2]);
 			fprintf (out_view[hull], "%5.2f %5.2f %5.2f\n", center2[0], center2[1], center2[2]);
 		}
+		ThreadUnlock(g_hullfilelock);
 	}
-
-    ThreadUnlock();
 }
-void WriteDetailBrush (int hull, const bface_t *faces)
+static void WriteDetailBrush (hullbuffer_t* const buffer, int hull, const bface_t *faces)
 {
-	ThreadLock ();
-	fprintf (out_detailbrush[hull], "0\n");
-	for (const bface_t *f = faces; f; f = f->next)
+	const bface_t *f;
+
+	if (g_texthulls)
 	{
-		Winding *w = f->w;
-		fprintf (out_detailbrush[hull], "%i %u\n", f->planenum, w->m_NumPoints);
-		for (int i = 0; i < w->m_NumPoints; i++)
+		HullBufferPrintf (buffer->brushes[hull], "0\n");
+		for (f = faces; f; f = f->next)
 		{
-			fprintf (out_detailbrush[hull], "%5.8f %5.8f %5.8f\n", w->m_Points[i][0], w->m_Points[i][1], w->m_Points[i][2]);
+			HullBufferPrintf (buffer->brushes[hull], "%i %u\n", f->planenum, f->w->m_NumPoints);
+			HullBufferPoints (buffer->brushes[hull], f->w);
 		}
+		HullBufferPrintf (buffer->brushes[hull], "-1 -1\n");
+		return;
+	}
+
+	int length = 0;
+	for (f = faces; f; f = f->next)
+	{
+		length += sizeof (surfacefile_side_t) + f->w->m_NumPoints * 3 * sizeof (double);
+	}
+	HullBufferChunk (buffer->brushes[hull], surfacechunk_brush, length);
+	for (f = faces; f; f = f->next)
+	{
+		surfacefile_side_t side;
+		side.planenum = f->planenum;
+		side.numpoints = f->w->m_NumPoints;
+		HullBufferWrite (buffer->brushes[hull], &side, sizeof (side));
+		HullBufferPoints (buffer->brushes[hull], f->w);
+	}
+}
+
+// =====================================================================================
+//  WriteEndModel
+//      Marks the end of a model in one hull file
+// =====================================================================================
+static void     WriteEndModel(const int hull)
+{
+	if (g_texthulls)
+	{
+		fprintf (out[hull], "-1 -1 -1 -1 -1\n");
+		fprintf (out_detailbrush[hull], "-1\n");
+	}
+	else
+	{
+		surfacefile_chunk_t chunk;
+		chunk.type = surfacechunk_endmodel;
+		chunk.length = 0;
+		SafeWrite (out[hull], &chunk, sizeof (chunk));
+		SafeWrite (out_detailbrush[hull], &chunk, sizeof (chunk));
 	}
-	fprintf (out_detailbrush[hull], "-1 -1\n");
-	ThreadUnlock ();
 }
 
 // =====================================================================================
@@ -363,7 +485,7 @@ void WriteDetailBrush (int hull, const bface_t *faces)
 //      Passable contents (water, lava, etc) will generate a mirrored copy of the face 
 //      to be seen from the inside.
 // =====================================================================================
-static void     SaveOutside(const brush_t* const b, const int hull, bface_t* outside, const int mirrorcontents)
+static void     SaveOutside(hullbuffer_t* const buffer, const brush_t* const b, const int hull, bface_t* outside, const int mirrorcontents)
 {
     bface_t*        f;
     bface_t*        f2;
@@ -507,7 +629,7 @@ static void     SaveOutside(const brush_t* const b, const int hull, bface_t* out
 			}
 		}
 
-        WriteFace(hull, f
+        WriteFace(buffer, hull, f
 			, 
 			(hull? b->clipnodedetaillevel: b->detaillevel)
 			);
@@ -526,7 +648,7 @@ static void     SaveOutside(const brush_t* const b, const int hull, bface_t* out
                 VectorCopy(f->w->m_Points[f->w->m_NumPoints - 1 - i], f->w->m_Points[i]);
                 VectorCopy(temp, f->w->m_Points[f->w->m_NumPoints - 1 - i]);
             }
-            WriteFace(hull, f
+            WriteFace(buffer, hull, f
 				, 
 				(hull? b->clipnodedetaillevel: b->detaillevel)
 				);
@@ -622,13 +744,241 @@ static bface_t* CopyFacesToOutside(brushhull_t* bh)
     return outside;
 }
 
+// =====================================================================================
+//  Brush bounds trees
+//      A brush can only be clipped by the brushes of its entity whose hull bounds touch its
+//      own. Instead of testing the bounds of every pair, the brushes of each entity and hull
+//      are put in a tree of bounding boxes, which returns the ones that touch in brush order,
+//      because the overwrite rules of CSGBrush depend on it.
+// =====================================================================================
+#define BRUSHTREE_LEAFSIZE 4
+
+typedef struct
+{
+	BoundingBox		bounds;
+	int				children[2];                           // -1 in a leaf
+	int				firstbrush;                            // into brushtree_t::brushes, in a leaf
+	int				numbrushes;
+}
+brushtreenode_t;
+
+typedef struct
+{
+	std::vector<brushtreenode_t> nodes;                    // node 0 is the root
+	std::vector<int> brushes;                              // numbers within the entity
+}
+brushtree_t;
+
+static std::vector<brushtree_t> g_brushtrees;              // [entity * NUM_HULLS + hull]
+
+static int      BuildBrushTree_r(brushtree_t* const tree, const entity_t* const e, const int hull, const int first, const int num)
+{
+	const int		nodenum = (int)tree->nodes.size();
+	brushtreenode_t	node;
+	BoundingBox		centers;
+	vec3_t			center;
+	int				i, axis;
+
+	for (i = first; i < first + num; i++)
+	{
+		const BoundingBox& bounds = g_mapbrushes[e->firstbrush + tree->brushes[i]].hulls[hull].bounds;
+
+		node.bounds.add(bounds);
+		VectorAdd(bounds.m_Mins, bounds.m_Maxs, center);
+		centers.add(center);
+	}
+	node.children[0] = node.children[1] = -1;
+	node.firstbrush = first;
+	node.numbrushes = num;
+	tree->nodes.push_back(node);
+	if (num <= BRUSHTREE_LEAFSIZE)
+	{
+		return nodenum;
+	}
+
+	// split at the median center along the longest axis
+	axis = 0;
+	for (i = 1; i < 3; i++)
+	{
+		if (centers.m_Maxs[i] - centers.m_Mins[i] > centers.m_Maxs[axis] - centers.m_Mins[axis])
+		{
+			axis = i;
+		}
+	}
+	std::nth_element(tree->brushes.begin() + first, tree->brushes.begin() + first + num / 2, tree->brushes.begin() + first + num,
+		[&](const int a, const int b)
+		{
+			const BoundingBox& ba = g_mapbrushes[e->firstbrush + a].hulls[hull].bounds;
+			const BoundingBox& bb = g_mapbrushes[e->firstbrush + b].hulls[hull].bounds;
+			return ba.m_Mins[axis] + ba.m_Maxs[axis] < bb.m_Mins[axis] + bb.m_Maxs[axis];
+		});
+	tree->nodes[nodenum].children[0] = BuildBrushTree_r(tree, e, hull, first, num / 2);
+	tree->nodes[nodenum].children[1] = BuildBrushTree_r(tree, e, hull, first + num / 2, num - num / 2);
+	return nodenum;
+}
+
+static void     BuildBrushTrees(const int entitynum)
+{
+	const entity_t*	e = &g_entities[entitynum];
+	int				hull, bn;
+
+	if ((int)g_brushtrees.size() < g_numentities * NUM_HULLS)
+	{
+		g_brushtrees.resize(g_numentities * NUM_HULLS);
+	}
+	for (hull = 0; hull < NUM_HULLS; hull++)
+	{
+		brushtree_t*	tree = &g_brushtrees[entitynum * NUM_HULLS + hull];
+		long long		numbrushes = 0;
+
+		tree->nodes.clear();
+		tree->brushes.clear();
+		for (bn = 0; bn < e->numbrushes; bn++)
+		{
+			const brush_t* b = &g_mapbrushes[e->firstbrush + bn];
+
+			if (b->hulls[hull].faces)
+			{
+				numbrushes++;
+				if (b->contents != CONTENTS_TOEMPTY)
+				{
+					tree->brushes.push_back(bn);
+				}
+			}
+		}
+		c_brushpairs += numbrushes * (e->numbrushes - 1);
+		if (!tree->brushes.empty())
+		{
+			BuildBrushTree_r(tree, e, hull, 0, (int)tree->brushes.size());
+		}
+	}
+}
+
+static void     FreeBrushTrees(const int entitynum)
+{
+	int				hull;
+
+	for (hull = 0; hull < NUM_HULLS; hull++)
+	{
+		brushtree_t*	tree = &g_brushtrees[entitynum * NUM_HULLS + hull];
+
+		std::vector<brushtreenode_t>().swap(tree->nodes);
+		std::vector<int>().swap(tree->brushes);
+	}
+}
+
+// the brushes of the entity whose bounds in this hull touch bounds, in brush order
+static void     FindTouchingBrushes(const int entitynum, const int hull, const BoundingBox& bounds, std::vector<int>& brushes)
+{
+	const brushtree_t* tree = &g_brushtrees[entitynum * NUM_HULLS + hull];
+	const entity_t*	e = &g_entities[entitynum];
+	int				stack[64];
+	int				depth = 0;
+	long long		numtests = 0;
+	int				i;
+
+	brushes.clear();
+	if (tree->nodes.empty())
+	{
+		return;
+	}
+	stack[depth++] = 0;
+	while (depth)
+	{
+		const brushtreenode_t* node = &tree->nodes[stack[--depth]];
+
+		numtests++;
+		if (bounds.testDisjoint(node->bounds))
+		{
+			continue;
+		}
+		if (node->children[0] != -1)
+		{
+			hlassume(depth + 2 <= (int)(sizeof(stack) / sizeof(stack[0])), assume_first);
+			stack[depth++] = node->children[1];
+			stack[depth++] = node->children[0];
+			continue;
+		}
+		for (i = node->firstbrush; i < node->firstbrush + node->numbrushes; i++)
+		{
+			numtests++;
+			if (!bounds.testDisjoint(g_mapbrushes[e->firstbrush + tree->brushes[i]].hulls[hull].bounds))
+			{
+				brushes.push_back(tree->brushes[i]);
+			}
+		}
+	}
+	std::sort(brushes.begin(), brushes.end());
+	c_brushboundstests += numtests;
+}
+
+// =====================================================================================
+//  CSG work queue
+//      The brushes of all models are csg'd as one list of (brush, hull) items, in model
+//      order. Each item collects its output in the hull buffer of its brush, and the buffers
+//      are appended to the hull files in list order as soon as the items before them are
+//      done, so the files are the same whatever the number of threads.
+// =====================================================================================
+static std::vector<int> g_csgbrushes;                      // brushnum of each queued brush
+static std::vector<bool> g_csgmodelend;                    // the brush is the last of its model
+static std::vector<hullbuffer_t> g_csgbuffers;             // per queued brush
+static std::vector<char> g_csgdone;                        // per item, protected by g_hullfilelock
+static int      g_csgwritten[NUM_HULLS];                   // queued brushes already in each hull file
+
+static void     QueueModelBrushes(const int entitynum)
+{
+	const entity_t*	e = &g_entities[entitynum];
+	int				bn;
+
+	for (bn = 0; bn < e->numbrushes; bn++)
+	{
+		g_csgbrushes.push_back(e->firstbrush + bn);
+		g_csgmodelend.push_back(bn == e->numbrushes - 1);
+	}
+}
+
+// writes out every finished item of this hull that is next in list order
+static void     CommitCSGItem(const int item)
+{
+	const int		hull = item % NUM_HULLS;
+
+	ThreadLock(g_hullfilelock);
+	g_csgdone[item] = true;
+	while (g_csgwritten[hull] < (int)g_csgbrushes.size() && g_csgdone[g_csgwritten[hull] * NUM_HULLS + hull])
+	{
+		hullbuffer_t*	buffer = &g_csgbuffers[g_csgwritten[hull]];
+
+		if (!buffer->faces[hull].empty())
+		{
+			SafeWrite(out[hull], buffer->faces[hull].data(), buffer->faces[hull].size());
+		}
+		if (!buffer->brushes[hull].empty())
+		{
+			SafeWrite(out_detailbrush[hull], buffer->brushes[hull].data(), buffer->brushes[hull].size());
+		}
+		std::vector<char>().swap(buffer->faces[hull]);
+		std::vector<char>().swap(buffer->brushes[hull]);
+		if (!hull)
+		{
+			c_csgfaces += buffer->numfaces;
+		}
+		if (g_csgmodelend[g_csgwritten[hull]])
+		{
+			WriteEndModel(hull);
+		}
+		g_csgwritten[hull]++;
+	}
+	ThreadUnlock(g_hullfilelock);
+}
+
 // =====================================================================================
 //  CSGBrush
+//      Clips one brush in one hull by the other brushes of its entity
 // =====================================================================================
 extern const char *ContentsToString (const contents_t type);
-static void     CSGBrush(int brushnum)
+static void     CSGBrush(int item)
 {
-    int             hull;
+    const int       hull = item % NUM_HULLS;
     brush_t*        b1;
     brush_t*        b2;
     brushhull_t*    bh1;
@@ -641,13 +991,18 @@ static void     CSGBrush(int brushnum)
     bface_t*        outside;
     entity_t*       e;
     vec_t           area;
+    hullbuffer_t*   buffer;
+    std::vector<int> touching;
+    int             brushnum;
+    int             i;
 
-    // get entity and brush info from the given brushnum that we can work with
+    // get entity and brush info from the given item that we can work with
+    brushnum = g_csgbrushes[item / NUM_HULLS];
+    buffer = &g_csgbuffers[item / NUM_HULLS];
     b1 = &g_mapbrushes[brushnum];
     e = &g_entities[b1->entitynum];
 
-    // for each of the hulls
-    for (hull = 0; hull < NUM_HULLS; hull++)
+    // in the hull of this item
     {
         bh1 = &b1->hulls[hull];
 		if (bh1->faces && 
@@ -667,7 +1022,7 @@ static void     CSGBrush(int brushnum)
 					ContentsToString((contents_t)b1->contents));
 				break;
 			case CONTENTS_SOLID:
-				WriteDetailBrush (hull, bh1->faces);
+				WriteDetailBrush (buffer, hull, bh1->faces);
 				break;
 			}
 		}
@@ -684,9 +1039,11 @@ static void     CSGBrush(int brushnum)
 			}
 		}
 
-        // for each brush in entity e
-        for (bn = 0; bn < e->numbrushes; bn++)
+        // for each brush in entity e that b1 touches
+        FindTouchingBrushes(b1->entitynum, hull, bh1->bounds, touching);
+        for (i = 0; i < (int)touching.size(); i++)
         {
+            bn = touching[i];
             // see if b2 needs to clip a chunk out of b1
 			if (e->firstbrush + bn == brushnum)
 			{
@@ -719,13 +1076,7 @@ static void     CSGBrush(int brushnum)
 
             if (!bh2->faces)
                 continue;                                  // brush isn't in this hull
-
-            // check brush bounding box first
-            // TODO: use boundingbox method instead
-            if (bh1->bounds.testDisjoint(bh2->bounds))
-            {
-                continue;
-            }
+            c_brushclips++;
 
             // divide faces by the planes of the b2 to find which
             // fragments are inside
@@ -937,8 +1288,10 @@ static void     CSGBrush(int brushnum)
         }
 
         // all of the faces left in outside are real surface faces
-        SaveOutside(b1, hull, outside, b1->contents);
+        SaveOutside(buffer, b1, hull, outside, b1->contents);
     }
+
+    CommitCSGItem(item);
 }
 
 //
@@ -1421,27 +1774,28 @@ static void     ProcessModels()
 		}
 		free (temps);
 
-        // csg them in order
-        if (i == 0) // if its worldspawn....
-        {
-            NamedRunThreadsOnIndividual(g_entities[i].numbrushes, g_estimate, CSGBrush);
-            CheckFatal();
-        }
-        else
-        {
-            for (j = 0; j < g_entities[i].numbrushes; j++)
-            {
-                CSGBrush(first + j);
-            }
-        }
+        BuildBrushTrees(i);
+        QueueModelBrushes(i);
+    }
 
-        // write end of model marker
-        for (j = 0; j < NUM_HULLS; j++)
+    // csg the brushes of all models at once, every item in its own hull
+    g_csgbuffers.resize(g_csgbrushes.size());
+    g_csgdone.assign(g_csgbrushes.size() * NUM_HULLS, false);
+    memset(g_csgwritten, 0, sizeof(g_csgwritten));
+    NamedRunThreadsOnIndividual((int)g_csgbrushes.size() * NUM_HULLS, g_estimate, CSGBrush);
+    CheckFatal();
+
+    for (i = 0; i < g_numentities; i++)
+    {
+        if (g_entities[i].numbrushes)
         {
-			fprintf (out[j], "-1 -1 -1 -1 -1\n");
-			fprintf (out_detailbrush[j], "-1\n");
+            FreeBrushTrees(i);
         }
     }
+    std::vector<int>().swap(g_csgbrushes);
+    std::vector<bool>().swap(g_csgmodelend);
+    std::vector<hullbuffer_t>().swap(g_csgbuffers);
+    std::vector<char>().swap(g_csgdone);
 }
 
 // =====================================================================================
@@ -1540,6 +1894,8 @@ static void     Usage()
     Log("    -chart           : display bsp statitics\n");
     Log("    -low | -high     : run program an altered priority level\n");
     Log("    -nolog           : don't generate the compile logfiles\n");
+    Log("    -profile         : write phase timings to mapname.profile.json\n");
+    Log("    -deterministic   : same output for any thread count\n");
 	Log("    -noresetlog      : Do not delete log file\n");
     Log("    -threads #       : manually specify the number of threads to run\n");
 #ifdef SYSTEM_WIN32
@@ -1553,6 +1909,7 @@ static void     Usage()
 
     Log("    -nonulltex       : Turns off null texture stripping\n");
 	Log("    -nonullifytrigger: don't remove 'aaatrigger' texture\n");
+	Log("    -texthulls       : write the hull files as text, for debugging\n");
 
 
 	Log("    -nolightopt      : don't optimize engine light entities\n");
@@ -1622,6 +1979,8 @@ static void     Settings()
     Log("developer             [ %7d ] [ %7d ]\n", g_developer, DEFAULT_DEVELOPER);
     Log("chart                 [ %7s ] [ %7s ]\n", g_chart ? "on" : "off", DEFAULT_CHART ? "on" : "off");
     Log("estimate              [ %7s ] [ %7s ]\n", g_estimate ? "on" : "off", DEFAULT_ESTIMATE ? "on" : "off");
+    Log("profile               [ %7s ] [ %7s ]\n", g_profile ? "on" : "off", DEFAULT_PROFILE ? "on" : "off");
+    Log("deterministic         [ %7s ] [ %7s ]\n", g_deterministic ? "on" : "off", DEFAULT_DETERMINISTIC ? "on" : "off");
     Log("max texture memory    [ %7d ] [ %7d ]\n", g_max_map_miptex, DEFAULT_MAX_MAP_MIPTEX);
 	Log("max lighting memory   [ %7d ] [ %7d ]\n", g_max_map_lightdata, DEFAULT_MAX_MAP_LIGHTDATA);
 
@@ -1660,6 +2019,7 @@ static void     Settings()
 	Log("wad.cfg config name   [ %7s ] [ %7s ]\n", g_wadconfigname? g_wadconfigname: "None", "None");
 	Log("nullfile              [ %7s ] [ %7s ]\n", g_nullfile ? g_nullfile : "None", "None");
 	Log("nullify trigger       [ %7s ] [ %7s ]\n", g_nullifytrigger? "on": "off", DEFAULT_NULLIFYTRIGGER? "on": "off");
+	Log("text hull files       [ %7s ] [ %7s ]\n", g_texthulls? "on": "off", DEFAULT_TEXTHULLS? "on": "off");
     // calc min surface area
     {
         char            tiny_penetration[10];
@@ -1828,6 +2188,14 @@ int             main(const int argc, char** argv)
         {
             g_log = false;
         }
+        else if (!strcasecmp(argv[i], "-profile"))
+        {
+            g_profile = true;
+        }
+        else if (!strcasecmp(argv[i], "-deterministic"))
+        {
+            g_deterministic = true;
+        }
         else if (!strcasecmp(argv[i], "-skyclip"))
         {
             g_skyclip = true;
@@ -2042,6 +2410,10 @@ int             main(const int argc, char** argv)
 		{
 			g_viewsurface = true;
 		}
+		else if (!strcasecmp (argv[i], "-texthulls"))
+		{
+			g_texthulls = true;
+		}
 		else if (!strcasecmp (argv[i], "-nonullifytrigger"))
 		{
 			g_nullifytrigger = false;
@@ -2296,13 +2668,19 @@ int             main(const int argc, char** argv)
 
         end = I_FloatTime();
         LogTimeElapsed(end - start);
+        WriteProfile(g_Mapname);
         return 0;
     }
 
     CheckForNoClip(); 
 
     // createbrush
+    if (g_deterministic)
+    {
+        InitBrushOrder(g_nummapbrushes);
+    }
     NamedRunThreadsOnIndividual(g_nummapbrushes, g_estimate, CreateBrush);
+    FreeBrushOrder();
     CheckFatal();
 
 
@@ -2312,7 +2690,7 @@ int             main(const int argc, char** argv)
     Verbose("%5i map planes\n", g_nummapplanes);
 
     // Set model centers
-    for (i = 0; i < g_numentities; i++) SetModelCenters (i); //NamedRunThreadsOnIndividual(g_numentities, g_estimate, SetModelCenters); //--vluzacn
+    NamedRunThreadsOnIndividual(g_numentities, g_estimate, SetModelCenters);
 
     // Calc brush unions
     if ((g_BrushUnionThreshold > 0.0) && (g_BrushUnionThreshold <= 100.0))
@@ -2327,14 +2705,22 @@ int             main(const int argc, char** argv)
 
         safe_snprintf(name, _MAX_PATH, "%s.p%i", g_Mapname, i);
 
-        out[i] = fopen(name, "w");
+        out[i] = fopen(name, g_texthulls? "w": "wb");
 
         if (!out[i]) 
             Error("Couldn't open %s", name);
 		safe_snprintf(name, _MAX_PATH, "%s.b%i", g_Mapname, i);
-		out_detailbrush[i] = fopen(name, "w");
+		out_detailbrush[i] = fopen(name, g_texthulls? "w": "wb");
 		if (!out_detailbrush[i])
 			Error("Couldn't open %s", name);
+		if (!g_texthulls)
+		{
+			surfacefile_header_t header;
+			header.magic = SURFACEFILE_MAGIC;
+			header.version = SURFACEFILE_VERSION;
+			SafeWrite (out[i], &header, sizeof (header));
+			SafeWrite (out_detailbrush[i], &header, sizeof (header));
+		}
 		if (g_viewsurface)
 		{
 			safe_snprintf (name, _MAX_PATH, "%s_surface%i.pts", g_Mapname, i);
@@ -2367,10 +2753,11 @@ int             main(const int argc, char** argv)
 
     ProcessModels();
 
+    Verbose("%5lld brush pairs, %lld bounds tests, %lld clipped\n", (long long)c_brushpairs, (long long)c_brushboundstests, (long long)c_brushclips);
     Verbose("%5i csg faces\n", c_csgfaces);
     Verbose("%5i used faces\n", c_outfaces);
     Verbose("%5i tiny faces\n", c_tiny);
-    Verbose("%5i tiny clips\n", c_tiny_clip);
+    Verbose("%5i tiny clips\n", (int)c_tiny_clip);
 
     // close hull files 
     for (i = 0; i < NUM_HULLS; i++)
@@ -2414,6 +2801,7 @@ int             main(const int argc, char** argv)
     // elapsed time
     end = I_FloatTime();
     LogTimeElapsed(end - start);
+    WriteProfile(g_Mapname);
 
 		}
 	}
@@ -48,13 +48,16 @@ static char *texmap[MAX_INTERNAL_MAP_TEXINFO];
 
 static int numtexmap = 0;
 
+static threadlock_t g_miptexlock("miptex");
+static threadlock_t g_texinfolock("texinfo");              // g_texinfo and texmap
+
 static int texmap_store (char *texname, bool shouldlock = true)
 	// This function should never be called unless a new entry in g_texinfo is being allocated.
 {
 	int i;
 	if (shouldlock)
 	{
-		ThreadLock ();
+		ThreadLock(g_texinfolock);
 	}
 
 	hlassume (numtexmap < MAX_INTERNAL_MAP_TEXINFO, assume_MAX_MAP_TEXINFO); // This error should never appear.
@@ -64,7 +67,7 @@ static int texmap_store (char *texname, bool shouldlock = true)
 	numtexmap++;
 	if (shouldlock)
 	{
-		ThreadUnlock ();
+		ThreadUnlock(g_texinfolock);
 	}
 	return i;
 }
@@ -78,13 +81,13 @@ static char *texmap_retrieve (int index)
 static void texmap_clear ()
 {
 	int i;
-	ThreadLock ();
+	ThreadLock(g_texinfolock);
 	for (i = 0; i < numtexmap; i++)
 	{
 		free (texmap[i]);
 	}
 	numtexmap = 0;
-	ThreadUnlock ();
+	ThreadUnlock(g_texinfolock);
 }
 
 // =====================================================================================
@@ -149,20 +152,27 @@ static int      FindMiptex(const char* const name)
 		Error ("Texture name is too long (%s)\n", name);
 	}
 
-    ThreadLock();
+find_miptex:
+    ThreadLock(g_miptexlock);
     for (i = 0; i < nummiptex; i++)
     {
         if (!strcmp(name, miptex[i].name))
         {
-            ThreadUnlock();
+            ThreadUnlock(g_miptexlock);
             return i;
         }
     }
+    if (EarlierBrushesPending())
+    {
+        ThreadUnlock(g_miptexlock);
+        WaitForEarlierBrushes();
+        goto find_miptex;
+    }
 
     hlassume(nummiptex < MAX_MAP_TEXTURES, assume_MAX_MAP_TEXTURES);
     safe_strncpy(miptex[i].name, name, MAXWADNAME);
     nummiptex++;
-    ThreadUnlock();
+    ThreadUnlock(g_miptexlock);
     return i;
 }
 
@@ -938,7 +948,8 @@ int             TexinfoForBrushTexture(const plane_t* const plane, brush_texture
     //
     // find the g_texinfo
     //
-    ThreadLock();
+find_texinfo:
+    ThreadLock(g_texinfolock);
     tc = g_texinfo;
     for (i = 0; i < g_numtexinfo; i++, tc++)
     {
@@ -961,17 +972,24 @@ int             TexinfoForBrushTexture(const plane_t* const plane, brush_texture
                 }
             }
         }
-        ThreadUnlock();
+        ThreadUnlock(g_texinfolock);
         return i;
 skip:;
     }
 
+    if (EarlierBrushesPending())
+    {
+        ThreadUnlock(g_texinfolock);
+        WaitForEarlierBrushes();
+        goto find_texinfo;
+    }
+
     hlassume(g_numtexinfo < MAX_INTERNAL_MAP_TEXINFO, assume_MAX_MAP_TEXINFO);
 
     *tc = tx;
 	tc->miptex = texmap_store (bt->name, false);
     g_numtexinfo++;
-    ThreadUnlock();
+    ThreadUnlock(g_texinfolock);
     return i;
 }
 
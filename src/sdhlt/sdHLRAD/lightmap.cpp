@@ -1,5 +1,12 @@
 #include "qrad.h"
 
+#include <map>
+
+#if defined (__SSE2__) || defined (_M_X64) || (defined (_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HLRAD_LIGHTBATCH_SSE
+#include <emmintrin.h>
+#endif
+
 edgeshare_t     g_edgeshare[MAX_MAP_EDGES];
 vec3_t          g_face_centroids[MAX_MAP_EDGES]; // BUG: should this be [MAX_MAP_FACES]?
 bool            g_sky_lighting_fix = DEFAULT_SKY_LIGHTING_FIX;
@@ -1604,6 +1611,163 @@ static directlight_t* directlights[MAX_MAP_LEAFS];
 static facelight_t facelight[MAX_MAP_FACES];
 static int      numdlights;
 
+// =====================================================================================
+//  Light candidates
+//      GatherSampleLight used to walk every visleaf for each sample, looking for the ones in
+//      the sample's PVS that hold lights. Leaves that share a PVS row see the same lights, so
+//      the lights of each row are collected once, in the same order as the walk, and lights
+//      that can't light any of those leaves are dropped: spotlights whose cone misses the
+//      leaves, and lights without intensity.
+// =====================================================================================
+#define LIGHTCANDIDATES_MARGIN 8.0                         // dleaf_t bounds are rounded to integers
+
+typedef struct
+{
+	int				firstlight;                            // into g_lightcandidates
+	int				numlights;
+}
+lightcandidates_t;
+
+static std::vector<directlight_t*> g_lightcandidates;
+static std::vector<lightcandidates_t> g_lightcandidatelists;
+static std::vector<int> g_leaflightcandidates;             // list of each leaf
+static int		g_novislightcandidates;                    // list used when there is no vis data
+
+// true when no point of the box can be inside the cone of the spotlight
+static bool		SpotlightMissesBox (const directlight_t* const dl, const vec3_t mins, const vec3_t maxs)
+{
+	vec3_t			center, v;
+	vec_t			radius, dist, theta, alpha, cone;
+
+	VectorAdd (mins, maxs, center);
+	VectorScale (center, 0.5, center);
+	VectorSubtract (maxs, center, v);
+	radius = VectorLength (v) + LIGHTCANDIDATES_MARGIN;
+	VectorSubtract (center, dl->origin, v);
+	dist = VectorLength (v);
+	if (dist <= radius + ON_EPSILON)
+	{
+		return false;
+	}
+	theta = acos (qmax (-1.0, qmin (DotProduct (v, dl->normal) / dist, 1.0)));
+	alpha = asin (radius / dist);
+	cone = acos (qmax (-1.0, qmin (dl->stopdot2, 1.0)));
+	return theta - alpha > cone + 0.01;
+}
+
+// adds the lights of the leaves set in pvs (every leaf when pvs is NULL) as a new list
+static int		AddLightCandidates (const byte* const pvs, const bool cull, const vec3_t mins, const vec3_t maxs, long long* const uncullednum)
+{
+	lightcandidates_t list;
+	directlight_t*	dl;
+	int				i;
+
+	list.firstlight = (int)g_lightcandidates.size ();
+	for (i = 0; i < 1 + g_dmodels[0].visleafs; i++)
+	{
+		if (i == 0? !g_sky_lighting_fix: pvs && !(pvs[(i - 1) >> 3] & (1 << ((i - 1) & 7))))
+		{
+			continue;
+		}
+		for (dl = directlights[i]; dl; dl = dl->next)
+		{
+			(*uncullednum)++;
+			if (dl->type != emit_skylight)
+			{
+				if (VectorCompare (dl->intensity, vec3_origin))
+				{
+					continue;
+				}
+				if (cull && dl->type == emit_spotlight && SpotlightMissesBox (dl, mins, maxs))
+				{
+					continue;
+				}
+			}
+			g_lightcandidates.push_back (dl);
+		}
+	}
+	list.numlights = (int)g_lightcandidates.size () - list.firstlight;
+	g_lightcandidatelists.push_back (list);
+	return (int)g_lightcandidatelists.size () - 1;
+}
+
+static void		BuildLightCandidates ()
+{
+	std::map<int, int> rows;                               // visofs -> first leaf with it
+	std::map<int, int> lists;                              // visofs -> list
+	std::vector<int> rowmins (3 * g_numleafs), rowmaxs (3 * g_numleafs);
+	byte			pvs[(MAX_MAP_LEAFS + 7) / 8];
+	long long		uncullednum = 0;
+	vec3_t			mins, maxs;
+	int				i, k;
+
+	// bounds of the leaves that share each row
+	for (i = 1; i < 1 + g_dmodels[0].visleafs; i++)
+	{
+		const dleaf_t *leaf = &g_dleafs[i];
+		int first;
+
+		if (leaf->visofs == -1)
+		{
+			continue;
+		}
+		first = rows.emplace (leaf->visofs, i).first->second;
+		for (k = 0; k < 3; k++)
+		{
+			rowmins[3 * first + k] = first == i? leaf->mins[k]: qmin ((int)leaf->mins[k], rowmins[3 * first + k]);
+			rowmaxs[3 * first + k] = first == i? leaf->maxs[k]: qmax ((int)leaf->maxs[k], rowmaxs[3 * first + k]);
+		}
+	}
+
+	g_lightcandidates.clear ();
+	g_lightcandidatelists.clear ();
+	g_leaflightcandidates.assign (g_numleafs, 0);
+	memset (pvs, 0, sizeof (pvs));
+	AddLightCandidates (pvs, false, vec3_origin, vec3_origin, &uncullednum); // list 0 for leaves without a row
+	if (!g_visdatasize)
+	{
+		g_novislightcandidates = AddLightCandidates (NULL, false, vec3_origin, vec3_origin, &uncullednum);
+	}
+	for (std::map<int, int>::iterator it = rows.begin (); g_visdatasize && it != rows.end (); it++)
+	{
+		for (k = 0; k < 3; k++)
+		{
+			mins[k] = rowmins[3 * it->second + k];
+			maxs[k] = rowmaxs[3 * it->second + k];
+		}
+		DecompressVis (&g_dvisdata[it->first], pvs, sizeof (pvs));
+		lists[it->first] = AddLightCandidates (pvs, true, mins, maxs, &uncullednum);
+	}
+	for (i = 0; i < g_numleafs; i++)
+	{
+		std::map<int, int>::const_iterator it = lists.find (g_dleafs[i].visofs);
+
+		if (g_dleafs[i].visofs != -1 && it != lists.end ())
+		{
+			g_leaflightcandidates[i] = it->second;
+		}
+	}
+	Log ("%i light candidate lists with %i candidates (%lld before culling)\n",
+		(int)g_lightcandidatelists.size (), (int)g_lightcandidates.size (), uncullednum);
+}
+
+static void		FreeLightCandidates ()
+{
+	std::vector<directlight_t*> ().swap (g_lightcandidates);
+	std::vector<lightcandidates_t> ().swap (g_lightcandidatelists);
+	std::vector<int> ().swap (g_leaflightcandidates);
+}
+
+// lights that a sample at pos may receive
+static const lightcandidates_t* GetLightCandidates (const vec3_t pos)
+{
+	if (!g_visdatasize)
+	{
+		return &g_lightcandidatelists[g_novislightcandidates];
+	}
+	return &g_lightcandidatelists[g_leaflightcandidates[PointInLeaf (pos) - g_dleafs]];
+}
+
 
 // =====================================================================================
 //  CreateDirectLights
@@ -2249,6 +2413,7 @@ void            CreateDirectLights()
 			Warning ("More than one light_environments are in use. Add entity info_sunlight to clarify the sunlight's brightness for in-game model(.mdl) rendering.");
 		}
 	}
+	BuildLightCandidates ();
 }
 
 // =====================================================================================
@@ -2269,6 +2434,7 @@ void            DeleteDirectLights()
             dl = directlights[l];
         }
     }
+	FreeLightCandidates ();
 
     // AJM: todo: strip light entities out at this point
 	// vluzacn: hlvis and hlrad must not modify entity data, because the following procedures are supposed to produce the same bsp file:
@@ -2283,6 +2449,7 @@ void            DeleteDirectLights()
 int		g_numskynormals[SKYLEVELMAX+1];
 vec3_t	*g_skynormals[SKYLEVELMAX+1];
 vec_t	*g_skynormalsizes[SKYLEVELMAX+1];
+static int (*s_skynormalparents)[2] = NULL;                // the two normals of the coarser level each normal was split between, -1 for the first 6
 typedef double point_t[3];
 typedef struct {int point[2]; bool divided; int child[2];} edge_t;
 typedef struct {int edge[3]; int dir[3];} triangle_t;
@@ -2375,6 +2542,12 @@ void BuildDiffuseNormals ()
 	triangles[5].edge[0] = 1, triangles[5].dir[0] = 1, triangles[5].edge[1] = 7, triangles[5].dir[1] = 1, triangles[5].edge[2] = 10, triangles[5].dir[2] = 0;
 	triangles[6].edge[0] = 2, triangles[6].dir[0] = 1, triangles[6].edge[1] = 10, triangles[6].dir[1] = 1, triangles[6].edge[2] = 6, triangles[6].dir[2] = 1;
 	triangles[7].edge[0] = 3, triangles[7].dir[0] = 1, triangles[7].edge[1] = 6, triangles[7].dir[1] = 0, triangles[7].edge[2] = 9, triangles[7].dir[2] = 1;
+	s_skynormalparents = (int (*)[2])malloc (((1 << (2 * SKYLEVELMAX)) + 2) * sizeof (int [2]));
+	hlassume (s_skynormalparents != NULL, assume_NoMemory);
+	for (j = 0; j < numpoints; j++)
+	{
+		s_skynormalparents[j][0] = s_skynormalparents[j][1] = -1;
+	}
 	CopyToSkynormals (1, numpoints, points, numedges, edges, numtriangles, triangles);
 	for (i = 1; i < SKYLEVELMAX; i++)
 	{
@@ -2392,6 +2565,8 @@ void BuildDiffuseNormals ()
 				VectorScale (mid, 1 / len, mid);
 				int p2 = numpoints;
 				VectorCopy (mid, points[numpoints]);
+				s_skynormalparents[p2][0] = edges[j].point[0];
+				s_skynormalparents[p2][1] = edges[j].point[1];
 				numpoints++;
 				hlassume (numedges < (1 << (2 * SKYLEVELMAX)) * 4 - 4, assume_first);
 				edges[j].child[0] = numedges;
@@ -2441,68 +2616,515 @@ void BuildDiffuseNormals ()
 	free (edges);
 	free (triangles);
 }
-static void     GatherSampleLight(const vec3_t pos, const byte* const pvs, const vec3_t normal, vec3_t* sample
-								  , byte* styles
-								  , int step
-								  , int miptex
-								  , int texlightgap_surfacenum
-								  )
+// s and t axes of the surface in world units, for the texlightgap of texlights
+static void     CalcTexLightGapVectors(const int surfacenum, vec3_t textoworld[2])
 {
-    int             i;
+	dface_t *f = &g_dfaces[surfacenum];
+	const dplane_t *dp = getPlaneFromFace (f);
+	texinfo_t *tex = &g_texinfo[f->texinfo];
+	int x;
+	vec_t len;
+
+	for (x = 0; x < 2; x++)
+	{
+		CrossProduct (tex->vecs[1 - x], dp->normal, textoworld[x]);
+		len = DotProduct (textoworld[x], tex->vecs[x]);
+		if (fabs (len) < NORMAL_EPSILON)
+		{
+			VectorClear (textoworld[x]);
+		}
+		else
+		{
+			VectorScale (textoworld[x], 1 / len, textoworld[x]);
+		}
+	}
+}
+
+// =====================================================================================
+//  GatherSampleLightBatch
+//      Direct light of up to SAMPLEBATCH_SIZE samples that share their light candidates, such
+//      as the neighbouring samples of a face. Each light is tested against the whole batch:
+//      direction, distance and dot product of every sample first, then the falloff and cone,
+//      then the shadow rays of the samples it reaches are traced together with TestLineBatch.
+//      The light of each sample is summed in the same order as one sample at a time, so the
+//      result doesn't depend on the batching.
+// =====================================================================================
+#define SAMPLEBATCH_SIZE 64
+#define NUMSKYNORMALS_SOFTSKYON ((1 << (2 * SKYLEVEL_SOFTSKYON)) + 2)
+#define NUMSKYNORMALS_ADAPTIVE ((1 << (2 * SKYLEVEL_ADAPTIVE)) + 2)
+
+#define SKYDIR_BLOCKED	0
+#define SKYDIR_OPEN		1
+#define SKYDIR_PARTIAL	2                                  // through translucent or styled opaque entities
+#define SKYDIR_HORIZON	3                                  // behind the sample
+
+#define SKYSEEN_OPEN	1
+#define SKYSEEN_BLOCKED	2
+#define SKYSEEN_MIXED	(SKYSEEN_OPEN | SKYSEEN_BLOCKED)
+
+static long long s_adaptiveskyrays = 0;
+static long long s_adaptiveskybudget = 0;
+static threadlock_t s_adaptiveskylock ("adaptive sky");
+
+typedef struct
+{
+	// the samples, padded with zeros to a multiple of 4
+	float			pos[3][SAMPLEBATCH_SIZE];
+	float			normal[3][SAMPLEBATCH_SIZE];
+
+	// direction to the light, distance and dot product with the sample normal
+	float			delta[3][SAMPLEBATCH_SIZE];
+	float			dist[SAMPLEBATCH_SIZE];
+	float			dot[SAMPLEBATCH_SIZE];
+
+	// falloff and cone of point lights and spotlights, and whether the light reaches the sample
+	float			ratio[SAMPLEBATCH_SIZE];
+	byte			lit[SAMPLEBATCH_SIZE];
+
+	// shadow rays of the samples the light reaches
+	int				numrays;
+	int				raysample[SAMPLEBATCH_SIZE];
+	vec3_t			raystart[SAMPLEBATCH_SIZE];
+	vec3_t			raystop[SAMPLEBATCH_SIZE];
+	vec3_t			rayskyhit[SAMPLEBATCH_SIZE];
+	vec3_t			rayadd[SAMPLEBATCH_SIZE];
+	int				rayresult[SAMPLEBATCH_SIZE];
+
+	// -adaptivesky, the soft sky directions of one sample at a time
+	const directlight_t* skylight;                         // of skyintensity
+	vec3_t			skyintensity[NUMSKYNORMALS_SOFTSKYON];
+	vec_t			skydot[NUMSKYNORMALS_SOFTSKYON];
+	byte			skyclass[NUMSKYNORMALS_SOFTSKYON];     // SKYDIR_
+	int				skyrays;
+}
+lightbatch_t;
+
+// the coarse sky directions that the samples of one face have seen open or blocked so far
+typedef struct
+{
+	const directlight_t* light;
+	byte			seen[NUMSKYNORMALS_ADAPTIVE];          // SKYSEEN_
+}
+skycache_t;
+
+// adds the light of the rays that weren't blocked
+static void     AddLightBatchRays(const lightbatch_t* const batch, const int contents, const vec3_t* const stops
+								  , const int lightstyle, vec3_t (*adds)[ALLSTYLES])
+{
+	int				m;
+	int				style;
+	vec3_t			add;
+
+	for (m = 0; m < batch->numrays; m++)
+	{
+		if (batch->rayresult[m] != contents)
+		{
+			continue;                                      // occluded
+		}
+		vec3_t transparency;
+		int opaquestyle;
+		if (TestSegmentAgainstOpaqueList (batch->raystart[m], 
+			stops[m]
+			, transparency
+			, opaquestyle))
+		{
+			continue;
+		}
+		VectorMultiply (batch->rayadd[m], transparency, add);
+		// add to the total brightness of this sample
+		style = lightstyle;
+		if (opaquestyle != -1)
+		{
+			if (style == 0 || style == opaquestyle)
+				style = opaquestyle;
+			else
+				continue; // dynamic light of other styles hits this toggleable opaque entity, then it completely vanishes.
+		}
+		VectorAdd (adds[batch->raysample[m]][style], add, adds[batch->raysample[m]][style]);
+	}
+}
+
+// traces the queued sky rays of one sample and sorts out their directions; rays through
+// translucent or styled opaque entities add their light here, open directions are added later
+static void     TraceAdaptiveSkyRays(lightbatch_t* const batch, const int lightstyle, vec3_t* const add)
+{
+	int				m;
+	int				style;
+	int				opaquestyle;
+	vec3_t			transparency;
+	vec3_t			v;
+
+	TestLineBatch (batch->numrays, batch->raystart, batch->raystop, batch->rayresult
+		, batch->rayskyhit
+		);
+	for (m = 0; m < batch->numrays; m++)
+	{
+		const int j = batch->raysample[m];
+
+		batch->skyclass[j] = SKYDIR_BLOCKED;
+		if (batch->rayresult[m] != CONTENTS_SKY)
+		{
+			continue;
+		}
+		if (TestSegmentAgainstOpaqueList (batch->raystart[m], batch->rayskyhit[m], transparency, opaquestyle))
+		{
+			continue;
+		}
+		if (opaquestyle == -1 && VectorCompare (transparency, vec3_one))
+		{
+			batch->skyclass[j] = SKYDIR_OPEN;
+			continue;
+		}
+		style = lightstyle;
+		if (opaquestyle != -1)
+		{
+			if (style == 0 || style == opaquestyle)
+				style = opaquestyle;
+			else
+				continue;
+		}
+		batch->skyclass[j] = SKYDIR_PARTIAL;
+		VectorScale (batch->skyintensity[j], batch->skydot[j], v);
+		VectorMultiply (v, transparency, v);
+		VectorAdd (add[style], v, add[style]);
+	}
+	batch->skyrays += batch->numrays;
+	batch->numrays = 0;
+}
+
+static void     QueueAdaptiveSkyRay(lightbatch_t* const batch, const vec3_t pos, const int j, const int lightstyle, vec3_t* const add)
+{
+	const int		m = batch->numrays++;
+
+	batch->raysample[m] = j;
+	VectorCopy (pos, batch->raystart[m]);
+	VectorMA (pos, -BOGUS_RANGE, g_skynormals[SKYLEVEL_SOFTSKYON][j], batch->raystop[m]);
+	VectorCopy (batch->raystop[m], batch->rayskyhit[m]);
+	if (batch->numrays == SAMPLEBATCH_SIZE)
+	{
+		TraceAdaptiveSkyRays (batch, lightstyle, add);
+	}
+}
+
+// =====================================================================================
+//  GatherAdaptiveSkyLight
+//      -adaptivesky: traces the sky directions of SKYLEVEL_ADAPTIVE from each sample, then
+//      each finer level up to SKYLEVEL_SOFTSKYON only where the two directions a direction was
+//      split from disagree, or where the earlier samples of the face disagreed about them.
+//      Every other direction takes the result of its parents without a ray, and all open
+//      directions are added with the weights of SKYLEVEL_SOFTSKYON.
+// =====================================================================================
+static void     GatherAdaptiveSkyLight(const int count, const vec3_t* const positions, const vec3_t* const normals
+										, const directlight_t* const l, skycache_t* const skycache
+										, vec3_t (*adds)[ALLSTYLES], lightbatch_t* const batch
+										, const bool lighting_diversify, const vec_t lighting_power, const vec_t lighting_scale)
+{
+	const int		numcoarse = g_numskynormals[SKYLEVEL_ADAPTIVE];
+	const vec3_t*	skynormals = g_skynormals[SKYLEVEL_SOFTSKYON];
+	const int		numskynormals = g_numskynormals[SKYLEVEL_SOFTSKYON];
+	int				budget = 0;
+	int				level, j, k;
+	vec_t			dot;
+
+	if (batch->skylight != l)
+	{
+		const vec_t *skyweights = g_skynormalsizes[SKYLEVEL_SOFTSKYON];
+		for (j = 0; j < numskynormals; j++)
+		{
+			vec_t factor = qmin (qmax (0.0, (1 - DotProduct (l->normal, skynormals[j])) / 2), 1.0); // how far this piece of sky has deviated from the sun
+			VectorScale (l->diffuse_intensity, 1 - factor, batch->skyintensity[j]);
+			VectorMA (batch->skyintensity[j], factor, l->diffuse_intensity2, batch->skyintensity[j]);
+			VectorScale (batch->skyintensity[j], skyweights[j] * g_indirect_sun / 2, batch->skyintensity[j]);
+		}
+		batch->skylight = l;
+	}
+	if (skycache->light != l)
+	{
+		memset (skycache->seen, 0, sizeof (skycache->seen));
+		skycache->light = l;
+	}
+	batch->skyrays = 0;
+
+	for (k = 0; k < count; k++)
+	{
+		vec3_t *add = adds[k];
+
+		for (j = 0; j < numskynormals; j++)
+		{
+			// make sure the angle is okay
+			dot = -DotProduct (normals[k], skynormals[j]);
+			if (dot <= NORMAL_EPSILON) //ON_EPSILON / 10 //--vluzacn
+			{
+				batch->skyclass[j] = SKYDIR_HORIZON;
+				continue;
+			}
+			if (lighting_diversify)
+			{
+				dot = lighting_scale * pow (dot, lighting_power);
+			}
+			batch->skydot[j] = dot;
+			batch->skyclass[j] = SKYDIR_BLOCKED;
+			budget++;
+		}
+
+		batch->numrays = 0;
+		for (j = 0; j < numcoarse; j++)
+		{
+			if (batch->skyclass[j] != SKYDIR_HORIZON)
+			{
+				QueueAdaptiveSkyRay (batch, positions[k], j, l->style, add);
+			}
+		}
+		if (batch->numrays > 0)
+		{
+			TraceAdaptiveSkyRays (batch, l->style, add);
+		}
+		for (j = 0; j < numcoarse; j++)
+		{
+			switch (batch->skyclass[j])
+			{
+			case SKYDIR_OPEN:
+				skycache->seen[j] |= SKYSEEN_OPEN;
+				break;
+			case SKYDIR_BLOCKED:
+				skycache->seen[j] |= SKYSEEN_BLOCKED;
+				break;
+			case SKYDIR_PARTIAL:
+				skycache->seen[j] |= SKYSEEN_MIXED;
+				break;
+			}
+		}
+
+		// the directions of each finer level lie between two of the level before
+		for (level = SKYLEVEL_ADAPTIVE + 1; level <= SKYLEVEL_SOFTSKYON; level++)
+		{
+			for (j = g_numskynormals[level - 1]; j < g_numskynormals[level]; j++)
+			{
+				if (batch->skyclass[j] == SKYDIR_HORIZON)
+				{
+					continue;
+				}
+				const int a = s_skynormalparents[j][0];
+				const int b = s_skynormalparents[j][1];
+				int classa = batch->skyclass[a];
+				int classb = batch->skyclass[b];
+				if (classa == SKYDIR_HORIZON)
+				{
+					classa = classb;
+				}
+				if (classb == SKYDIR_HORIZON)
+				{
+					classb = classa;
+				}
+				if (classa == classb && (classa == SKYDIR_OPEN || classa == SKYDIR_BLOCKED)
+					&& !(a < numcoarse && skycache->seen[a] == SKYSEEN_MIXED)
+					&& !(b < numcoarse && skycache->seen[b] == SKYSEEN_MIXED))
+				{
+					batch->skyclass[j] = classa;
+					continue;
+				}
+				QueueAdaptiveSkyRay (batch, positions[k], j, l->style, add);
+			}
+			if (batch->numrays > 0)
+			{
+				TraceAdaptiveSkyRays (batch, l->style, add);
+			}
+		}
+
+		for (j = 0; j < numskynormals; j++)
+		{
+			if (batch->skyclass[j] == SKYDIR_OPEN)
+			{
+				VectorMA (add[l->style], batch->skydot[j], batch->skyintensity[j], add[l->style]);
+			}
+		}
+	}
+
+	ThreadLock (s_adaptiveskylock);
+	s_adaptiveskyrays += batch->skyrays;
+	s_adaptiveskybudget += budget;
+	ThreadUnlock (s_adaptiveskylock);
+}
+
+void            LogAdaptiveSky ()
+{
+	Log ("adaptive sky: traced %lld of %lld soft sky rays (%.1f%%)\n",
+		s_adaptiveskyrays, s_adaptiveskybudget, s_adaptiveskybudget > 0? 100.0 * s_adaptiveskyrays / s_adaptiveskybudget: 0.0);
+}
+
+// direction, distance and dot product of every sample of the batch to a light; the same
+// arithmetic as VectorNormalize, which divides and takes the square root in double
+static void     CalcLightBatchDeltas(lightbatch_t* const batch, const directlight_t* const l, const int count)
+{
+	int				k;
+#ifdef HLRAD_LIGHTBATCH_SSE
+	const __m128	ox = _mm_set1_ps (l->origin[0]);
+	const __m128	oy = _mm_set1_ps (l->origin[1]);
+	const __m128	oz = _mm_set1_ps (l->origin[2]);
+	const __m128	hx = _mm_set1_ps ((float)(-PATCH_HUNT_OFFSET * l->normal[0]));
+	const __m128	hy = _mm_set1_ps ((float)(-PATCH_HUNT_OFFSET * l->normal[1]));
+	const __m128	hz = _mm_set1_ps ((float)(-PATCH_HUNT_OFFSET * l->normal[2]));
+	const __m128d	epsilon = _mm_set1_pd (NORMAL_EPSILON);
+
+	for (k = 0; k < count; k += 4)
+	{
+		__m128 dx = _mm_sub_ps (ox, _mm_loadu_ps (&batch->pos[0][k]));
+		__m128 dy = _mm_sub_ps (oy, _mm_loadu_ps (&batch->pos[1][k]));
+		__m128 dz = _mm_sub_ps (oz, _mm_loadu_ps (&batch->pos[2][k]));
+		if (l->type == emit_surface)
+		{
+			// move emitter back to its plane
+			dx = _mm_add_ps (dx, hx);
+			dy = _mm_add_ps (dy, hy);
+			dz = _mm_add_ps (dz, hz);
+		}
+		const __m128 length2 = _mm_add_ps (_mm_add_ps (_mm_mul_ps (dx, dx), _mm_mul_ps (dy, dy)), _mm_mul_ps (dz, dz));
+		const __m128d lengthlo = _mm_sqrt_pd (_mm_cvtps_pd (length2));
+		const __m128d lengthhi = _mm_sqrt_pd (_mm_cvtps_pd (_mm_movehl_ps (length2, length2)));
+		// lengths below NORMAL_EPSILON leave a zero direction and distance
+		const __m128 dist = _mm_movelh_ps (
+			_mm_cvtpd_ps (_mm_and_pd (_mm_cmpge_pd (lengthlo, epsilon), lengthlo)),
+			_mm_cvtpd_ps (_mm_and_pd (_mm_cmpge_pd (lengthhi, epsilon), lengthhi)));
+		const __m128 mask = _mm_cmpgt_ps (dist, _mm_setzero_ps ());
+		const __m128 ux = _mm_and_ps (mask, _mm_movelh_ps (
+			_mm_cvtpd_ps (_mm_div_pd (_mm_cvtps_pd (dx), lengthlo)),
+			_mm_cvtpd_ps (_mm_div_pd (_mm_cvtps_pd (_mm_movehl_ps (dx, dx)), lengthhi))));
+		const __m128 uy = _mm_and_ps (mask, _mm_movelh_ps (
+			_mm_cvtpd_ps (_mm_div_pd (_mm_cvtps_pd (dy), lengthlo)),
+			_mm_cvtpd_ps (_mm_div_pd (_mm_cvtps_pd (_mm_movehl_ps (dy, dy)), lengthhi))));
+		const __m128 uz = _mm_and_ps (mask, _mm_movelh_ps (
+			_mm_cvtpd_ps (_mm_div_pd (_mm_cvtps_pd (dz), lengthlo)),
+			_mm_cvtpd_ps (_mm_div_pd (_mm_cvtps_pd (_mm_movehl_ps (dz, dz)), lengthhi))));
+		_mm_storeu_ps (&batch->delta[0][k], ux);
+		_mm_storeu_ps (&batch->delta[1][k], uy);
+		_mm_storeu_ps (&batch->delta[2][k], uz);
+		_mm_storeu_ps (&batch->dist[k], dist);
+		_mm_storeu_ps (&batch->dot[k], _mm_add_ps (_mm_add_ps (
+			_mm_mul_ps (ux, _mm_loadu_ps (&batch->normal[0][k])),
+			_mm_mul_ps (uy, _mm_loadu_ps (&batch->normal[1][k]))),
+			_mm_mul_ps (uz, _mm_loadu_ps (&batch->normal[2][k]))));
+	}
+#else
+	vec3_t			delta;
+
+	for (k = 0; k < count; k++)
+	{
+		delta[0] = l->origin[0] - batch->pos[0][k];
+		delta[1] = l->origin[1] - batch->pos[1][k];
+		delta[2] = l->origin[2] - batch->pos[2][k];
+		if (l->type == emit_surface)
+		{
+			// move emitter back to its plane
+			VectorMA (delta, -PATCH_HUNT_OFFSET, l->normal, delta);
+		}
+		batch->dist[k] = VectorNormalize(delta);
+		batch->dot[k] = delta[0] * batch->normal[0][k] + delta[1] * batch->normal[1][k] + delta[2] * batch->normal[2][k];
+		batch->delta[0][k] = delta[0];
+		batch->delta[1][k] = delta[1];
+		batch->delta[2][k] = delta[2];
+	}
+#endif
+}
+
+#ifdef HLRAD_LIGHTBATCH_SSE
+// falloff and cone of a point light or spotlight over the batch, four samples at a time; the same
+// float arithmetic as the per-sample code in GatherSampleLightBatch, without lighting_diversify
+static void     CalcLightBatchRatios(lightbatch_t* const batch, const directlight_t* const l, const int count)
+{
+	int				k;
+	float			epsilon = (float)NORMAL_EPSILON;
+
+	if ((double)epsilon <= NORMAL_EPSILON)
+	{
+		epsilon = nextafterf (epsilon, 1.0f);              // smallest float that passes 'dot <= NORMAL_EPSILON'
+	}
+	const __m128	mindot = _mm_set1_ps (epsilon);
+	const __m128	one = _mm_set1_ps (1.0f);
+	const __m128	fade = _mm_set1_ps (l->fade);
+	const __m128	lnx = _mm_set1_ps (l->normal[0]);
+	const __m128	lny = _mm_set1_ps (l->normal[1]);
+	const __m128	lnz = _mm_set1_ps (l->normal[2]);
+	const __m128	stopdot = _mm_set1_ps (l->stopdot);
+	const __m128	stopdot2 = _mm_set1_ps (l->stopdot2);
+	const __m128	conerange = _mm_set1_ps (l->stopdot - l->stopdot2);
+
+	for (k = 0; k < count; k += 4)
+	{
+		const __m128 dot = _mm_loadu_ps (&batch->dot[k]);
+		const __m128 dist = _mm_max_ps (_mm_loadu_ps (&batch->dist[k]), one);
+		__m128 lit = _mm_cmpge_ps (dot, mindot);
+		__m128 ratio;
+
+		if (l->type == emit_spotlight)
+		{
+			const __m128 dot2 = _mm_sub_ps (_mm_setzero_ps (), _mm_add_ps (_mm_add_ps (
+				_mm_mul_ps (_mm_loadu_ps (&batch->delta[0][k]), lnx),
+				_mm_mul_ps (_mm_loadu_ps (&batch->delta[1][k]), lny)),
+				_mm_mul_ps (_mm_loadu_ps (&batch->delta[2][k]), lnz)));
+			lit = _mm_and_ps (lit, _mm_cmpgt_ps (dot2, stopdot2)); // outside light cone
+			ratio = _mm_div_ps (_mm_mul_ps (dot, dot2), _mm_mul_ps (_mm_mul_ps (dist, fade), dist));
+			const __m128 edge = _mm_cmple_ps (dot2, stopdot);
+			const __m128 edgeratio = _mm_mul_ps (ratio, _mm_div_ps (_mm_sub_ps (dot2, stopdot2), conerange));
+			ratio = _mm_or_ps (_mm_and_ps (edge, edgeratio), _mm_andnot_ps (edge, ratio));
+		}
+		else
+		{
+			ratio = _mm_div_ps (dot, _mm_mul_ps (_mm_mul_ps (dist, dist), fade));
+		}
+		_mm_storeu_ps (&batch->ratio[k], ratio);
+		const int bits = _mm_movemask_ps (lit);
+		batch->lit[k] = bits & 1;
+		batch->lit[k + 1] = (bits >> 1) & 1;
+		batch->lit[k + 2] = (bits >> 2) & 1;
+		batch->lit[k + 3] = (bits >> 3) & 1;
+	}
+}
+#endif
+
+static void     GatherSampleLightBatch(const int count, const vec3_t* const positions, const vec3_t* const normals
+									   , const vec3_t (*texlightgap_textoworld)[2]
+									   , const lightcandidates_t* const candidates
+									   , vec3_t (*adds)[ALLSTYLES]
+									   , lightbatch_t* const batch
+									   , skycache_t* const skycache
+									   , int step
+									   , int miptex
+									   )
+{
+    int             i, k;
     directlight_t*  l;
     vec3_t          delta;
     float           dot, dot2;
     float           dist;
     float           ratio;
-#ifdef HLRAD_OPACITY // AJM
-    float           l_opacity;
-#endif
-    int             style_index;
 	int				step_match;
 	bool			sky_used = false;
-	vec3_t			testline_origin;
-	vec3_t			adds[ALLSTYLES];
-	int				style;
-	memset (adds, 0, ALLSTYLES * sizeof(vec3_t));
+	memset (adds, 0, count * sizeof (vec3_t [ALLSTYLES]));
 	bool			lighting_diversify;
 	vec_t			lighting_power;
 	vec_t			lighting_scale;
 	lighting_power = g_lightingconeinfo[miptex][0];
 	lighting_scale = g_lightingconeinfo[miptex][1];
 	lighting_diversify = (lighting_power != 1.0 || lighting_scale != 1.0);
-	vec3_t			texlightgap_textoworld[2];
-	// calculates textoworld
-	{
-		dface_t *f = &g_dfaces[texlightgap_surfacenum];
-		const dplane_t *dp = getPlaneFromFace (f);
-		texinfo_t *tex = &g_texinfo[f->texinfo];
-		int x;
-		vec_t len;
 
-		for (x = 0; x < 2; x++)
-		{
-			CrossProduct (tex->vecs[1 - x], dp->normal, texlightgap_textoworld[x]);
-			len = DotProduct (texlightgap_textoworld[x], tex->vecs[x]);
-			if (fabs (len) < NORMAL_EPSILON)
-			{
-				VectorClear (texlightgap_textoworld[x]);
-			}
-			else
-			{
-				VectorScale (texlightgap_textoworld[x], 1 / len, texlightgap_textoworld[x]);
-			}
-		}
+	for (k = 0; k < count; k++)
+	{
+		batch->pos[0][k] = positions[k][0];
+		batch->pos[1][k] = positions[k][1];
+		batch->pos[2][k] = positions[k][2];
+		batch->normal[0][k] = normals[k][0];
+		batch->normal[1][k] = normals[k][1];
+		batch->normal[2][k] = normals[k][2];
+	}
+	for (; k & 3; k++)
+	{
+		batch->pos[0][k] = batch->pos[1][k] = batch->pos[2][k] = 0;
+		batch->normal[0][k] = batch->normal[1][k] = batch->normal[2][k] = 0;
 	}
 
-    for (i = 0; i < 1 + g_dmodels[0].visleafs; i++)
+    for (i = 0; i < candidates->numlights; i++)
     {
-        l = directlights[i];
-        if (l)
-		{
-            if (i == 0? g_sky_lighting_fix: pvs[(i - 1) >> 3] & (1 << ((i - 1) & 7)))
-            {
-                for (; l; l = l->next)
-                {
+        l = g_lightcandidates[candidates->firstlight + i];
                     // skylights work fundamentally differently than normal lights
                     if (l->type == emit_skylight)
                     {
@@ -2526,53 +3148,33 @@ static void     GatherSampleLight(const vec3_t pos, const byte* const pvs, const
 						  // loop over the normals
 						  for (int j = 0; j < l->numsunnormals; j++)
 						  {
-							// make sure the angle is okay
-							dot = -DotProduct (normal, l->sunnormals[j]);
-							if (dot <= NORMAL_EPSILON) //ON_EPSILON / 10 //--vluzacn
-							{
-								continue;
-							}
-
-							// search back to see if we can hit a sky brush
-							VectorScale (l->sunnormals[j], -BOGUS_RANGE, delta);
-							VectorAdd(pos, delta, delta);
-							vec3_t skyhit;
-							VectorCopy (delta, skyhit);
-							if (TestLine(pos, delta
-								, skyhit
-								) != CONTENTS_SKY)
+							batch->numrays = 0;
+							for (k = 0; k < count; k++)
 							{
-								continue;                      // occluded
-							}
-
-							vec3_t transparency;
-							int opaquestyle;
-							if (TestSegmentAgainstOpaqueList(pos, 
-								skyhit
-								, transparency
-								, opaquestyle
-								))
-							{
-								continue;
-							}
+								// make sure the angle is okay
+								dot = -DotProduct (normals[k], l->sunnormals[j]);
+								if (dot <= NORMAL_EPSILON) //ON_EPSILON / 10 //--vluzacn
+								{
+									continue;
+								}
+								if (lighting_diversify)
+								{
+									dot = lighting_scale * pow (dot, lighting_power);
+								}
 
-							vec3_t add_one;
-							if (lighting_diversify)
-							{
-								dot = lighting_scale * pow (dot, lighting_power);
-							}
-							VectorScale (l->intensity, dot * l->sunnormalweights[j], add_one);
-							VectorMultiply(add_one, transparency, add_one);
-							// add to the total brightness of this sample
-							style = l->style;
-							if (opaquestyle != -1)
-							{
-								if (style == 0 || style == opaquestyle)
-									style = opaquestyle;
-								else
-									continue; // dynamic light of other styles hits this toggleable opaque entity, then it completely vanishes.
+								// search back to see if we can hit a sky brush
+								const int m = batch->numrays++;
+								batch->raysample[m] = k;
+								VectorCopy (positions[k], batch->raystart[m]);
+								VectorScale (l->sunnormals[j], -BOGUS_RANGE, delta);
+								VectorAdd (positions[k], delta, batch->raystop[m]);
+								VectorCopy (batch->raystop[m], batch->rayskyhit[m]);
+								VectorScale (l->intensity, dot * l->sunnormalweights[j], batch->rayadd[m]);
 							}
-							VectorAdd (adds[style], add_one, adds[style]);
+							TestLineBatch (batch->numrays, batch->raystart, batch->raystop, batch->rayresult
+								, batch->rayskyhit
+								);
+							AddLightBatchRays (batch, CONTENTS_SKY, batch->rayskyhit, l->style, adds);
 						  } // (loop over the normals)
 						}
 						while (0);
@@ -2594,6 +3196,12 @@ static void     GatherSampleLight(const vec3_t pos, const byte* const pvs, const
 								&& VectorCompare (l->diffuse_intensity2, vec3_origin)
 								)
 								continue;
+							if (g_adaptivesky)
+							{
+								GatherAdaptiveSkyLight (count, positions, normals, l, skycache, adds, batch
+									, lighting_diversify, lighting_power, lighting_scale);
+								continue;
+							}
 
 							vec3_t sky_intensity;
 
@@ -2602,57 +3210,38 @@ static void     GatherSampleLight(const vec3_t pos, const byte* const pvs, const
 							vec_t *skyweights = g_skynormalsizes[g_softsky?SKYLEVEL_SOFTSKYON:SKYLEVEL_SOFTSKYOFF];
 							for (int j = 0; j < g_numskynormals[g_softsky?SKYLEVEL_SOFTSKYON:SKYLEVEL_SOFTSKYOFF]; j++)
 							{
-								// make sure the angle is okay
-								dot = -DotProduct (normal, skynormals[j]);
-								if (dot <= NORMAL_EPSILON) //ON_EPSILON / 10 //--vluzacn
-								{
-									continue;
-								}
-
-								// search back to see if we can hit a sky brush
-								VectorScale (skynormals[j], -BOGUS_RANGE, delta);
-								VectorAdd(pos, delta, delta);
-								vec3_t skyhit;
-								VectorCopy (delta, skyhit);
-								if (TestLine(pos, delta
-									, skyhit
-									) != CONTENTS_SKY)
-								{
-									continue;                                  // occluded
-								}
-
-								vec3_t transparency;
-								int opaquestyle;
-								if (TestSegmentAgainstOpaqueList(pos, 
-									skyhit
-									, transparency
-									, opaquestyle
-									))
-								{
-									continue;
-								}
-
 								vec_t factor = qmin (qmax (0.0, (1 - DotProduct (l->normal, skynormals[j])) / 2), 1.0); // how far this piece of sky has deviated from the sun
 								VectorScale (l->diffuse_intensity, 1 - factor, sky_intensity);
 								VectorMA (sky_intensity, factor, l->diffuse_intensity2, sky_intensity);
 								VectorScale (sky_intensity, skyweights[j] * g_indirect_sun / 2, sky_intensity);
-								vec3_t add_one;
-								if (lighting_diversify)
-								{
-									dot = lighting_scale * pow (dot, lighting_power);
-								}
-								VectorScale(sky_intensity, dot, add_one);
-								VectorMultiply(add_one, transparency, add_one);
-								// add to the total brightness of this sample
-								style = l->style;
-								if (opaquestyle != -1)
+
+								batch->numrays = 0;
+								for (k = 0; k < count; k++)
 								{
-									if (style == 0 || style == opaquestyle)
-										style = opaquestyle;
-									else
-										continue; // dynamic light of other styles hits this toggleable opaque entity, then it completely vanishes.
+									// make sure the angle is okay
+									dot = -DotProduct (normals[k], skynormals[j]);
+									if (dot <= NORMAL_EPSILON) //ON_EPSILON / 10 //--vluzacn
+									{
+										continue;
+									}
+									if (lighting_diversify)
+									{
+										dot = lighting_scale * pow (dot, lighting_power);
+									}
+
+									// search back to see if we can hit a sky brush
+									const int m = batch->numrays++;
+									batch->raysample[m] = k;
+									VectorCopy (positions[k], batch->raystart[m]);
+									VectorScale (skynormals[j], -BOGUS_RANGE, delta);
+									VectorAdd (positions[k], delta, batch->raystop[m]);
+									VectorCopy (batch->raystop[m], batch->rayskyhit[m]);
+									VectorScale (sky_intensity, dot, batch->rayadd[m]);
 								}
-								VectorAdd (adds[style], add_one, adds[style]);
+								TestLineBatch (batch->numrays, batch->raystart, batch->raystop, batch->rayresult
+									, batch->rayskyhit
+									);
+								AddLightBatchRays (batch, CONTENTS_SKY, batch->rayskyhit, l->style, adds);
 							} // (loop over the normals)
 
 						}
@@ -2666,230 +3255,245 @@ static void     GatherSampleLight(const vec3_t pos, const byte* const pvs, const
 							continue;
 						if (!(l->intensity[0] || l->intensity[1] || l->intensity[2]))
 							continue;
-						VectorCopy (l->origin, testline_origin);
-                        float           denominator;
 
-                        VectorSubtract(l->origin, pos, delta);
-						if (l->type == emit_surface)
+						// direction and distance to the light from every sample
+						CalcLightBatchDeltas (batch, l, count);
+#ifdef HLRAD_LIGHTBATCH_SSE
+						if ((l->type == emit_point || l->type == emit_spotlight) && !lighting_diversify)
 						{
-							// move emitter back to its plane
-							VectorMA (delta, -PATCH_HUNT_OFFSET, l->normal, delta);
-						}
-                        dist = VectorNormalize(delta);
-                        dot = DotProduct(delta, normal);
-                        //                        if (dot <= 0.0)
-                        //                            continue;
-
-                        if (dist < 1.0)
-                        {
-                            dist = 1.0;
-                        }
-
-						denominator = dist * dist * l->fade;
-
-						vec3_t add;
-                        switch (l->type)
-                        {
-                        case emit_point:
-                        {
-							if (dot <= NORMAL_EPSILON)
-							{
-								continue;
-							}
-							vec_t denominator = dist * dist * l->fade;
-							if (lighting_diversify)
+							CalcLightBatchRatios (batch, l, count);
+							batch->numrays = 0;
+							for (k = 0; k < count; k++)
 							{
-								dot = lighting_scale * pow (dot, lighting_power);
+								if (!batch->lit[k])
+								{
+									continue;
+								}
+								const int m = batch->numrays++;
+								batch->raysample[m] = k;
+								VectorCopy (positions[k], batch->raystart[m]);
+								VectorCopy (l->origin, batch->raystop[m]);
+								VectorScale (l->intensity, batch->ratio[k], batch->rayadd[m]);
 							}
-                            ratio = dot / denominator;
-                            VectorScale(l->intensity, ratio, add);
-                            break;
-                        }
+							TestLineBatch (batch->numrays, batch->raystart, batch->raystop, batch->rayresult);
+							AddLightBatchRays (batch, CONTENTS_EMPTY, batch->raystop, l->style, adds);
+							continue;
+						}
+#endif
 
-                        case emit_surface:
-                        {
-							bool light_behind_surface = false;
-							if (dot <= NORMAL_EPSILON)
+						batch->numrays = 0;
+						for (k = 0; k < count; k++)
+						{
+							const vec_t *pos = positions[k];
+							const vec_t *normal = normals[k];
+							const int m = batch->numrays;
+							vec3_t &testline_origin = batch->raystop[m];
+							vec_t *add = batch->rayadd[m];
+
+							VectorCopy (l->origin, testline_origin);
+							delta[0] = batch->delta[0][k];
+							delta[1] = batch->delta[1][k];
+							delta[2] = batch->delta[2][k];
+							dist = batch->dist[k];
+							dot = batch->dot[k];
+							//                        if (dot <= 0.0)
+							//                            continue;
+
+							if (dist < 1.0)
 							{
-								light_behind_surface = true;
+								dist = 1.0;
 							}
-							if (lighting_diversify
-								&& !light_behind_surface
-								)
+
+							switch (l->type)
 							{
-								dot = lighting_scale * pow (dot, lighting_power);
-							}
-                            dot2 = -DotProduct(delta, l->normal);
-							// discard the texlight if the spot is too close to the texlight plane
-							if (l->texlightgap > 0)
+							case emit_point:
 							{
-								vec_t test;
-
-								test = dot2 * dist; // distance from spot to texlight plane;
-								test -= l->texlightgap * fabs (DotProduct (l->normal, texlightgap_textoworld[0])); // maximum distance reduction if the spot is allowed to shift l->texlightgap pixels along s axis
-								test -= l->texlightgap * fabs (DotProduct (l->normal, texlightgap_textoworld[1])); // maximum distance reduction if the spot is allowed to shift l->texlightgap pixels along t axis
-								if (test < -ON_EPSILON)
+								if (dot <= NORMAL_EPSILON)
 								{
 									continue;
 								}
+								vec_t denominator = dist * dist * l->fade;
+								if (lighting_diversify)
+								{
+									dot = lighting_scale * pow (dot, lighting_power);
+								}
+								ratio = dot / denominator;
+								VectorScale(l->intensity, ratio, add);
+								break;
 							}
-							if (dot2 * dist <= MINIMUM_PATCH_DISTANCE)
-							{
-								continue;
-							}
-							vec_t range = l->patch_emitter_range;
-							if (l->stopdot > 0.0) // stopdot2 > 0.0 or stopdot > 0.0
+
+							case emit_surface:
 							{
-								vec_t range_scale;
-								range_scale = 1 - l->stopdot2 * l->stopdot2;
-								range_scale = 1 / sqrt (qmax (NORMAL_EPSILON, range_scale));
-								// range_scale = 1 / sin (cone2)
-								range_scale = qmin (range_scale, 2); // restrict this to 2, because skylevel has limit.
-								range *= range_scale; // because smaller cones are more likely to create the ugly grid effect.
-
-								if (dot2 <= l->stopdot2 + NORMAL_EPSILON)
+								bool light_behind_surface = false;
+								if (dot <= NORMAL_EPSILON)
+								{
+									light_behind_surface = true;
+								}
+								if (lighting_diversify
+									&& !light_behind_surface
+									)
 								{
-									if (dist >= range) // use the old method, which will merely give 0 in this case
+									dot = lighting_scale * pow (dot, lighting_power);
+								}
+								dot2 = -DotProduct(delta, l->normal);
+								// discard the texlight if the spot is too close to the texlight plane
+								if (l->texlightgap > 0)
+								{
+									vec_t test;
+
+									test = dot2 * dist; // distance from spot to texlight plane;
+									test -= l->texlightgap * fabs (DotProduct (l->normal, texlightgap_textoworld[k][0])); // maximum distance reduction if the spot is allowed to shift l->texlightgap pixels along s axis
+									test -= l->texlightgap * fabs (DotProduct (l->normal, texlightgap_textoworld[k][1])); // maximum distance reduction if the spot is allowed to shift l->texlightgap pixels along t axis
+									if (test < -ON_EPSILON)
 									{
 										continue;
 									}
-									ratio = 0.0;
 								}
-								else if (dot2 <= l->stopdot)
+								if (dot2 * dist <= MINIMUM_PATCH_DISTANCE)
 								{
-									ratio = dot * dot2 * (dot2 - l->stopdot2) / (dist * dist * (l->stopdot - l->stopdot2));
+									continue;
+								}
+								vec_t range = l->patch_emitter_range;
+								if (l->stopdot > 0.0) // stopdot2 > 0.0 or stopdot > 0.0
+								{
+									vec_t range_scale;
+									range_scale = 1 - l->stopdot2 * l->stopdot2;
+									range_scale = 1 / sqrt (qmax (NORMAL_EPSILON, range_scale));
+									// range_scale = 1 / sin (cone2)
+									range_scale = qmin (range_scale, 2); // restrict this to 2, because skylevel has limit.
+									range *= range_scale; // because smaller cones are more likely to create the ugly grid effect.
+
+									if (dot2 <= l->stopdot2 + NORMAL_EPSILON)
+									{
+										if (dist >= range) // use the old method, which will merely give 0 in this case
+										{
+											continue;
+										}
+										ratio = 0.0;
+									}
+									else if (dot2 <= l->stopdot)
+									{
+										ratio = dot * dot2 * (dot2 - l->stopdot2) / (dist * dist * (l->stopdot - l->stopdot2));
+									}
+									else
+									{
+										ratio = dot * dot2 / (dist * dist);
+									}
 								}
 								else
 								{
 									ratio = dot * dot2 / (dist * dist);
 								}
-							}
-							else
-							{
-								ratio = dot * dot2 / (dist * dist);
-							}
-							
-							// analogous to the one in MakeScales
-							// 0.4f is tested to be able to fully eliminate bright spots
-							if (ratio * l->patch_area > 0.4f)
-							{
-								ratio = 0.4f / l->patch_area;
-							}
-							if (dist < range - ON_EPSILON)
-							{ // do things slow
-								if (light_behind_surface)
+
+								// analogous to the one in MakeScales
+								// 0.4f is tested to be able to fully eliminate bright spots
+								if (ratio * l->patch_area > 0.4f)
 								{
-									dot = 0.0;
-									ratio = 0.0;
+									ratio = 0.4f / l->patch_area;
 								}
-								GetAlternateOrigin (pos, normal, l->patch, testline_origin);
-								vec_t sightarea;
-								int skylevel = l->patch->emitter_skylevel;
-								if (l->stopdot > 0.0) // stopdot2 > 0.0 or stopdot > 0.0
-								{
-									const vec_t *emitnormal = getPlaneFromFaceNumber (l->patch->faceNumber)->normal;
-									if (l->stopdot2 >= 0.8) // about 37deg
+								if (dist < range - ON_EPSILON)
+								{ // do things slow
+									if (light_behind_surface)
 									{
-										skylevel += 1; // because the range is larger
+										dot = 0.0;
+										ratio = 0.0;
 									}
-									sightarea = CalcSightArea_SpotLight (pos, normal, l->patch->winding, emitnormal, l->stopdot, l->stopdot2, skylevel
-										, lighting_power, lighting_scale
-										); // because we have doubled the range
+									GetAlternateOrigin (pos, normal, l->patch, testline_origin);
+									vec_t sightarea;
+									int skylevel = l->patch->emitter_skylevel;
+									if (l->stopdot > 0.0) // stopdot2 > 0.0 or stopdot > 0.0
+									{
+										const vec_t *emitnormal = getPlaneFromFaceNumber (l->patch->faceNumber)->normal;
+										if (l->stopdot2 >= 0.8) // about 37deg
+										{
+											skylevel += 1; // because the range is larger
+										}
+										sightarea = CalcSightArea_SpotLight (pos, normal, l->patch->winding, emitnormal, l->stopdot, l->stopdot2, skylevel
+											, lighting_power, lighting_scale
+											); // because we have doubled the range
+									}
+									else
+									{
+										sightarea = CalcSightArea (pos, normal, l->patch->winding, skylevel
+											, lighting_power, lighting_scale
+											);
+									}
+
+									vec_t frac = dist / range;
+									frac = (frac - 0.5) * 2; // make a smooth transition between the two methods
+									frac = qmax (0, qmin (frac, 1));
+
+									vec_t ratio2 = (sightarea / l->patch_area); // because l->patch->area has been multiplied into l->intensity
+									ratio = frac * ratio + (1 - frac) * ratio2;
 								}
 								else
 								{
-									sightarea = CalcSightArea (pos, normal, l->patch->winding, skylevel
-										, lighting_power, lighting_scale
-										);
+									if (light_behind_surface)
+									{
+										continue;
+									}
 								}
-
-								vec_t frac = dist / range;
-								frac = (frac - 0.5) * 2; // make a smooth transition between the two methods
-								frac = qmax (0, qmin (frac, 1));
-
-								vec_t ratio2 = (sightarea / l->patch_area); // because l->patch->area has been multiplied into l->intensity
-								ratio = frac * ratio + (1 - frac) * ratio2;
+								VectorScale(l->intensity, ratio, add);
+								break;
 							}
-							else
+
+							case emit_spotlight:
 							{
-								if (light_behind_surface)
+								if (dot <= NORMAL_EPSILON)
 								{
 									continue;
 								}
+								dot2 = -DotProduct(delta, l->normal);
+								if (dot2 <= l->stopdot2)
+								{
+									continue;                  // outside light cone
+								}
+
+								// Variable power falloff (1 = inverse linear, 2 = inverse square
+								vec_t           denominator = dist * l->fade;
+								{
+									denominator *= dist;
+								}
+								if (lighting_diversify)
+								{
+									dot = lighting_scale * pow (dot, lighting_power);
+								}
+								ratio = dot * dot2 / denominator;
+
+								if (dot2 <= l->stopdot)
+								{
+									ratio *= (dot2 - l->stopdot2) / (l->stopdot - l->stopdot2);
+								}
+								VectorScale(l->intensity, ratio, add);
+								break;
 							}
-                            VectorScale(l->intensity, ratio, add);
-                            break;
-                        }
 
-                        case emit_spotlight:
-                        {
-							if (dot <= NORMAL_EPSILON)
+							default:
 							{
-								continue;
+								hlassume(false, assume_BadLightType);
+								break;
 							}
-                            dot2 = -DotProduct(delta, l->normal);
-                            if (dot2 <= l->stopdot2)
-                            {
-                                continue;                  // outside light cone
-                            }
-
-                            // Variable power falloff (1 = inverse linear, 2 = inverse square
-                            vec_t           denominator = dist * l->fade;
-                            {
-                                denominator *= dist;
-                            }
-							if (lighting_diversify)
-							{
-								dot = lighting_scale * pow (dot, lighting_power);
 							}
-                            ratio = dot * dot2 / denominator;
-
-                            if (dot2 <= l->stopdot)
-                            {
-                                ratio *= (dot2 - l->stopdot2) / (l->stopdot - l->stopdot2);
-                            }
-                            VectorScale(l->intensity, ratio, add);
-                            break;
-                        }
-
-                        default:
-                        {
-                            hlassume(false, assume_BadLightType);
-                            break;
-                        }
-                        }
-						if (TestLine (pos, 
-							testline_origin
-							) != CONTENTS_EMPTY)
-						{
-							continue;
-						}
-						vec3_t transparency;
-						int opaquestyle;
-						if (TestSegmentAgainstOpaqueList (pos, 
-							testline_origin
-							, transparency
-							, opaquestyle))
-						{
-							continue;
-						}
-						VectorMultiply (add, transparency, add);
-						// add to the total brightness of this sample
-						style = l->style;
-						if (opaquestyle != -1)
-						{
-							if (style == 0 || style == opaquestyle)
-								style = opaquestyle;
-							else
-								continue; // dynamic light of other styles hits this toggleable opaque entity, then it completely vanishes.
+							batch->raysample[m] = k;
+							VectorCopy (pos, batch->raystart[m]);
+							batch->numrays++;
 						}
-						VectorAdd (adds[style], add, adds[style]);
+						TestLineBatch (batch->numrays, batch->raystart, batch->raystop, batch->rayresult);
+						AddLightBatchRays (batch, CONTENTS_EMPTY, batch->raystop, l->style, adds);
                     } // end emit_skylight
-
-                }
-            }
-        }
     }
+}
+
+// =====================================================================================
+//  StoreSampleLight
+//      Adds the gathered light of a sample into its styles
+// =====================================================================================
+static void     StoreSampleLight(const vec3_t pos, vec3_t adds[ALLSTYLES], vec3_t* sample
+								 , byte* styles
+								 )
+{
+    int             style_index;
+	int				style;
 
 	for (style = 0; style < ALLSTYLES; ++style)
 	{
@@ -2925,13 +3529,13 @@ static void     GatherSampleLight(const vec3_t pos, const byte* const pvs, const
 		{
 			if (VectorMaximum (adds[style]) > g_maxdiscardedlight + NORMAL_EPSILON)
 			{
-				ThreadLock ();
+				ThreadLock (g_maxdiscardedlock);
 				if (VectorMaximum (adds[style]) > g_maxdiscardedlight + NORMAL_EPSILON)
 				{
 					g_maxdiscardedlight = VectorMaximum (adds[style]);
 					VectorCopy (pos, g_maxdiscardedpos);
 				}
-				ThreadUnlock ();
+				ThreadUnlock (g_maxdiscardedlock);
 			}
 		}
 	}
@@ -3210,6 +3814,205 @@ const vec3_t    s_circuscolors[] = {
     {100000.0,  100000.0,   0.0     }                               // yellow
 };
 
+// =====================================================================================
+//  Sample batches
+//      CalcLightmap collects runs of neighbouring samples that receive the same lights and
+//      gathers their direct light together with GatherSampleLightBatch. The light of each
+//      sample is stored in sample order, so the styles of the face come out the same.
+// =====================================================================================
+typedef struct
+{
+	vec3_t			*sampled;
+	bool			blocked;
+	bool			nudged;
+	int				surface;
+	vec3_t			spot;
+	vec3_t			pointnormal;
+	vec3_t			spot2;                                 // translucent faces
+	vec3_t			pointnormal2;
+}
+batchsample_t;
+
+typedef struct
+{
+	int				numsamples;
+	const lightcandidates_t *lights;
+	const lightcandidates_t *lights2;
+	batchsample_t	samples[SAMPLEBATCH_SIZE];
+
+	int				texlightgap_surface;                   // surface of texlightgap_cache
+	vec3_t			texlightgap_cache[2];
+	vec3_t			positions[SAMPLEBATCH_SIZE];
+	vec3_t			normals[SAMPLEBATCH_SIZE];
+	vec3_t			texlightgap_textoworld[SAMPLEBATCH_SIZE][2];
+	vec3_t			adds[SAMPLEBATCH_SIZE][ALLSTYLES];
+	vec3_t			adds2[SAMPLEBATCH_SIZE][ALLSTYLES];
+	lightbatch_t	lightbatch;
+	skycache_t		skycache[2];                           // front and back
+}
+samplebatch_t;
+
+static void FlushSampleBatch (const lightinfo_t *l, samplebatch_t *batch, byte *styles)
+{
+	int k, n, j;
+	int back;
+
+	// the front, then the back of translucent faces
+	for (back = 0; back < (l->translucent_b? 2: 1); back++)
+	{
+		n = 0;
+		for (k = 0; k < batch->numsamples; k++)
+		{
+			const batchsample_t *sample = &batch->samples[k];
+
+			if (sample->blocked)
+			{
+				continue;
+			}
+			VectorCopy (back? sample->spot2: sample->spot, batch->positions[n]);
+			VectorCopy (back? sample->pointnormal2: sample->pointnormal, batch->normals[n]);
+			if (sample->surface != batch->texlightgap_surface)
+			{
+				batch->texlightgap_surface = sample->surface;
+				CalcTexLightGapVectors (sample->surface, batch->texlightgap_cache);
+			}
+			VectorCopy (batch->texlightgap_cache[0], batch->texlightgap_textoworld[n][0]);
+			VectorCopy (batch->texlightgap_cache[1], batch->texlightgap_textoworld[n][1]);
+			n++;
+		}
+		GatherSampleLightBatch (n, batch->positions, batch->normals
+			, batch->texlightgap_textoworld
+			, back? batch->lights2: batch->lights, back? batch->adds2: batch->adds, &batch->lightbatch
+			, &batch->skycache[back]
+			, 0
+			, l->miptex
+			);
+	}
+
+	for (k = 0, n = 0; k < batch->numsamples; k++)
+	{
+		const batchsample_t *sample = &batch->samples[k];
+		vec3_t *sampled = sample->sampled;
+
+		if (!sample->blocked)
+		{
+			StoreSampleLight (sample->spot, batch->adds[n], sampled
+				, styles
+				);
+		}
+		if (l->translucent_b)
+		{
+			vec3_t sampled2[ALLSTYLES];
+			memset (sampled2, 0, ALLSTYLES * sizeof (vec3_t));
+			if (!sample->blocked)
+			{
+				StoreSampleLight (sample->spot2, batch->adds2[n], sampled2
+					, styles
+					);
+			}
+			for (j = 0; j < ALLSTYLES && styles[j] != 255; j++)
+			{
+				for (int x = 0; x < 3; x++)
+				{
+					sampled[j][x] = (1.0 - l->translucent_v[x]) * sampled[j][x] + l->translucent_v[x] * sampled2[j][x];
+				}
+			}
+		}
+		if (!sample->blocked)
+		{
+			n++;
+		}
+		if (g_drawnudge)
+		{
+			for (j = 0; j < ALLSTYLES && styles[j] != 255; j++)
+			{
+				if (sample->blocked && styles[j] == 0)
+				{
+					sampled[j][0] = 200;
+					sampled[j][1] = 0;
+					sampled[j][2] = 0;
+				}
+				else if (sample->nudged && styles[j] == 0) // we assume style 0 is always present
+				{
+					VectorFill (sampled[j], 100);
+				}
+				else
+				{
+					VectorClear (sampled[j]);
+				}
+			}
+		}
+	}
+	batch->numsamples = 0;
+}
+
+// the patches of a face, with the lights at the patch origins
+static void FlushPatchBatch (const lightinfo_t *l, samplebatch_t *batch, patch_t **patches)
+{
+	int k, j, back;
+	vec3_t normal2;
+
+	VectorSubtract (vec3_origin, l->facenormal, normal2);
+	if (batch->texlightgap_surface != l->surfnum)
+	{
+		batch->texlightgap_surface = l->surfnum;
+		CalcTexLightGapVectors (l->surfnum, batch->texlightgap_cache);
+	}
+	for (back = 0; back < (l->translucent_b? 2: 1); back++)
+	{
+		for (k = 0; k < batch->numsamples; k++)
+		{
+			VectorCopy (back? batch->samples[k].spot2: patches[k]->origin, batch->positions[k]);
+			VectorCopy (back? normal2: l->facenormal, batch->normals[k]);
+			VectorCopy (batch->texlightgap_cache[0], batch->texlightgap_textoworld[k][0]);
+			VectorCopy (batch->texlightgap_cache[1], batch->texlightgap_textoworld[k][1]);
+		}
+		GatherSampleLightBatch (batch->numsamples, batch->positions, batch->normals
+			, batch->texlightgap_textoworld
+			, back? batch->lights2: batch->lights, back? batch->adds2: batch->adds, &batch->lightbatch
+			, &batch->skycache[back]
+			, 1
+			, l->miptex
+			);
+	}
+
+	for (k = 0; k < batch->numsamples; k++)
+	{
+		patch_t *patch = patches[k];
+
+		if (l->translucent_b)
+		{
+			vec3_t frontsampled[ALLSTYLES], backsampled[ALLSTYLES];
+			for (j = 0; j < ALLSTYLES; j++)
+			{
+				VectorClear (frontsampled[j]);
+				VectorClear (backsampled[j]);
+			}
+			StoreSampleLight (patch->origin, batch->adds[k], frontsampled
+				, patch->totalstyle_all
+				);
+			StoreSampleLight (batch->samples[k].spot2, batch->adds2[k], backsampled
+				, patch->totalstyle_all
+				);
+			for (j = 0; j < ALLSTYLES && patch->totalstyle_all[j] != 255; j++)
+			{
+				for (int x = 0; x < 3; x++)
+				{
+					patch->totallight_all[j][x] += (1.0 - l->translucent_v[x]) * frontsampled[j][x] + l->translucent_v[x] * backsampled[j][x];
+				}
+			}
+		}
+		else
+		{
+			StoreSampleLight (patch->origin, batch->adds[k], 
+				patch->totallight_all, 
+				patch->totalstyle_all
+				);
+		}
+	}
+	batch->numsamples = 0;
+}
+
 // =====================================================================================
 //  BuildFacelights
 // =====================================================================================
@@ -3217,13 +4020,18 @@ void CalcLightmap (lightinfo_t *l, byte *styles)
 {
 	int facenum;
 	int i, j;
-	byte pvs[(MAX_MAP_LEAFS + 7) / 8];
-	int lastoffset;
-	byte pvs2[(MAX_MAP_LEAFS + 7) / 8];
-	int lastoffset2;
+	const lightcandidates_t *lights;
+	const lightcandidates_t *lights2 = NULL;
+	samplebatch_t *batch;
 
 	facenum = l->surfnum;
 	memset (l->lmcache, 0, l->lmcachewidth * l->lmcacheheight * sizeof (vec3_t [ALLSTYLES]));
+	batch = (samplebatch_t *)malloc (sizeof (samplebatch_t));
+	hlassume (batch != NULL, assume_NoMemory);
+	batch->numsamples = 0;
+	batch->texlightgap_surface = -1;
+	batch->lightbatch.skylight = NULL;
+	batch->skycache[0].light = batch->skycache[1].light = NULL;
 
 	// for each sample whose light we need to calculate
 	for (i = 0; i < l->lmcachewidth * l->lmcacheheight; i++)
@@ -3238,7 +4046,7 @@ void CalcLightmap (lightinfo_t *l, byte *styles)
 		vec3_t pointnormal;
 		bool blocked;
 		vec3_t spot2;
-		vec3_t pointnormal2;
+		vec3_t pointnormal2 = {0, 0, 0};
 		vec3_t *sampled;
 		vec3_t *normal_out;
 		bool nudged;
@@ -3359,114 +4167,42 @@ void CalcLightmap (lightinfo_t *l, byte *styles)
 			}
 			VectorCopy (pointnormal, *normal_out);
 		}
-		// calculate visibility for the sample
+		// find the lights the sample may receive
 		{
-			if (!g_visdatasize)
-			{
-				if (i == 0)
-				{
-					memset (pvs, 255, (g_dmodels[0].visleafs + 7) / 8);
-				}
-			}
-			else
-			{
-				dleaf_t *leaf = PointInLeaf(spot);
-				int thisoffset = leaf->visofs;
-				if (i == 0 || thisoffset != lastoffset)
-				{
-					if (thisoffset == -1)
-					{
-						memset (pvs, 0, (g_dmodels[0].visleafs + 7) / 8);
-					}
-					else
-					{
-						DecompressVis(&g_dvisdata[leaf->visofs], pvs, sizeof(pvs));
-					}
-				}
-				lastoffset = thisoffset;
-			}
+			lights = GetLightCandidates (spot);
 			if (l->translucent_b)
 			{
-				if (!g_visdatasize)
-				{
-					if (i == 0)
-					{
-						memset (pvs2, 255, (g_dmodels[0].visleafs + 7) / 8);
-					}
-				}
-				else
-				{
-					dleaf_t *leaf2 = PointInLeaf(spot2);
-					int thisoffset2 = leaf2->visofs;
-					if (i == 0 || thisoffset2 != lastoffset2)
-					{
-						if (thisoffset2 == -1)
-						{
-							memset (pvs2, 0, (g_dmodels[0].visleafs + 7) / 8);
-						}
-						else
-						{
-							DecompressVis(&g_dvisdata[leaf2->visofs], pvs2, sizeof(pvs2));
-						}
-					}
-					lastoffset2 = thisoffset2;
-				}
+				lights2 = GetLightCandidates (spot2);
 			}
 		}
-		// gather light
+		// queue the sample; its light is gathered with the run of samples it belongs to
 		{
-			if (!blocked)
+			if (batch->numsamples == SAMPLEBATCH_SIZE
+				|| (batch->numsamples > 0 && (lights != batch->lights || lights2 != batch->lights2)))
 			{
-				GatherSampleLight(spot, pvs, pointnormal, sampled
-					, styles
-					, 0
-					, l->miptex
-					, surface
-					);
+				FlushSampleBatch (l, batch, styles);
 			}
+			batchsample_t *sample = &batch->samples[batch->numsamples++];
+			batch->lights = lights;
+			batch->lights2 = lights2;
+			sample->sampled = sampled;
+			sample->blocked = blocked;
+			sample->nudged = nudged;
+			sample->surface = surface;
+			VectorCopy (spot, sample->spot);
+			VectorCopy (pointnormal, sample->pointnormal);
 			if (l->translucent_b)
 			{
-				vec3_t sampled2[ALLSTYLES];
-				memset (sampled2, 0, ALLSTYLES * sizeof (vec3_t));
-				if (!blocked)
-				{
-					GatherSampleLight(spot2, pvs2, pointnormal2, sampled2
-						, styles
-						, 0
-						, l->miptex
-						, surface
-						);
-				}
-				for (j = 0; j < ALLSTYLES && styles[j] != 255; j++)
-				{
-					for (int x = 0; x < 3; x++)
-					{
-						sampled[j][x] = (1.0 - l->translucent_v[x]) * sampled[j][x] + l->translucent_v[x] * sampled2[j][x];
-					}
-				}
-			}
-			if (g_drawnudge)
-			{
-				for (j = 0; j < ALLSTYLES && styles[j] != 255; j++)
-				{
-					if (blocked && styles[j] == 0)
-					{
-						sampled[j][0] = 200;
-						sampled[j][1] = 0;
-						sampled[j][2] = 0;
-					}
-					else if (nudged && styles[j] == 0) // we assume style 0 is always present
-					{
-						VectorFill (sampled[j], 100);
-					}
-					else
-					{
-						VectorClear (sampled[j]);
-					}
-				}
+				VectorCopy (spot2, sample->spot2);
+				VectorCopy (pointnormal2, sample->pointnormal2);
 			}
 		}
 	}
+	if (batch->numsamples > 0)
+	{
+		FlushSampleBatch (l, batch, styles);
+	}
+	free (batch);
 }
 void            BuildFacelights(const int facenum)
 {
@@ -3481,15 +4217,13 @@ void            BuildFacelights(const int facenum)
     vec_t*          spot;
     patch_t*        patch;
     const dplane_t* plane;
-    byte            pvs[(MAX_MAP_LEAFS + 7) / 8];
-    int             thisoffset = -1, lastoffset = -1;
+    const lightcandidates_t* lights;
     int             lightmapwidth;
     int             lightmapheight;
     int             size;
-	vec3_t			spot2, normal2;
+	vec3_t			spot2;
 	vec3_t			delta;
-	byte			pvs2[(MAX_MAP_LEAFS + 7) / 8];
-	int				thisoffset2 = -1, lastoffset2 = -1;
+	const lightcandidates_t* lights2;
 
 	int				*sample_wallflags;
 
@@ -3732,95 +4466,46 @@ void            BuildFacelights(const int facenum)
             //LRC (ends)
         }
     }
-	for (patch = g_face_patches[facenum]; patch; patch = patch->next)
+	// gather the direct light of the patches in runs that receive the same lights
 	{
-		// get the PVS for the pos to limit the number of checks
-		if (!g_visdatasize)
-		{
-			memset (pvs, 255, (g_dmodels[0].visleafs + 7) / 8);
-			lastoffset = -1;
-		}
-		else
+		samplebatch_t *batch;
+		patch_t *batchpatches[SAMPLEBATCH_SIZE];
+
+		batch = (samplebatch_t *)malloc (sizeof (samplebatch_t));
+		hlassume (batch != NULL, assume_NoMemory);
+		batch->numsamples = 0;
+		batch->texlightgap_surface = -1;
+		batch->lightbatch.skylight = NULL;
+		batch->skycache[0].light = batch->skycache[1].light = NULL;
+		lights2 = NULL;
+		for (patch = g_face_patches[facenum]; patch; patch = patch->next)
 		{
-			dleaf_t*        leaf = PointInLeaf(patch->origin);
-
-			thisoffset = leaf->visofs;
-			if (patch == g_face_patches[facenum] || thisoffset != lastoffset)
-			{
-				if (thisoffset == -1)
-				{
-					memset (pvs, 0, (g_dmodels[0].visleafs + 7) / 8);
-				}
-				else
-				{
-					DecompressVis(&g_dvisdata[leaf->visofs], pvs, sizeof(pvs));
-				}
-			}
-			lastoffset = thisoffset;
-		}
-		if (l.translucent_b)
-		{
-			if (!g_visdatasize)
-			{
-				memset (pvs2, 255, (g_dmodels[0].visleafs + 7) / 8);
-				lastoffset2 = -1;
-			}
-			else
+			// find the lights the patch may receive
+			lights = GetLightCandidates (patch->origin);
+			if (l.translucent_b)
 			{
 				VectorMA (patch->origin, -(g_translucentdepth+2*PATCH_HUNT_OFFSET), l.facenormal, spot2);
-				dleaf_t*        leaf2 = PointInLeaf(spot2);
-
-				thisoffset2 = leaf2->visofs;
-				if (l.numsurfpt == 0 || thisoffset2 != lastoffset2)
-				{
-					if (thisoffset2 == -1)
-					{
-						memset (pvs2, 0, (g_dmodels[0].visleafs + 7) / 8);
-					}
-					else
-					{
-						DecompressVis(&g_dvisdata[leaf2->visofs], pvs2, sizeof(pvs2));
-					}
-				}
-				lastoffset2 = thisoffset2;
+				lights2 = GetLightCandidates (spot2);
 			}
-			vec3_t frontsampled[ALLSTYLES], backsampled[ALLSTYLES];
-			for (j = 0; j < ALLSTYLES; j++)
+			if (batch->numsamples == SAMPLEBATCH_SIZE
+				|| (batch->numsamples > 0 && (lights != batch->lights || lights2 != batch->lights2)))
 			{
-				VectorClear (frontsampled[j]);
-				VectorClear (backsampled[j]);
+				FlushPatchBatch (&l, batch, batchpatches);
 			}
-			VectorSubtract (vec3_origin, l.facenormal, normal2);
-			GatherSampleLight (patch->origin, pvs, l.facenormal, frontsampled, 
-				patch->totalstyle_all
-				, 1
-				, l.miptex
-				, facenum
-				);
-			GatherSampleLight (spot2, pvs2, normal2, backsampled, 
-				patch->totalstyle_all
-				, 1
-				, l.miptex
-				, facenum
-				);
-			for (j = 0; j < ALLSTYLES && patch->totalstyle_all[j] != 255; j++)
+			batch->lights = lights;
+			batch->lights2 = lights2;
+			batchpatches[batch->numsamples] = patch;
+			if (l.translucent_b)
 			{
-				for (int x = 0; x < 3; x++)
-				{
-					patch->totallight_all[j][x] += (1.0 - l.translucent_v[x]) * frontsampled[j][x] + l.translucent_v[x] * backsampled[j][x];
-				}
+				VectorCopy (spot2, batch->samples[batch->numsamples].spot2);
 			}
+			batch->numsamples++;
 		}
-		else
+		if (batch->numsamples > 0)
 		{
-			GatherSampleLight (patch->origin, pvs, l.facenormal, 
-				patch->totallight_all, 
-				patch->totalstyle_all
-				, 1
-				, l.miptex
-				, facenum
-				);
+			FlushPatchBatch (&l, batch, batchpatches);
 		}
+		free (batch);
 	}
 
     // add an ambient term if desired
@@ -3929,13 +4614,13 @@ void            BuildFacelights(const int facenum)
 			{
 				if (maxlights[j] > g_maxdiscardedlight + NORMAL_EPSILON)
 				{
-					ThreadLock ();
+					ThreadLock (g_maxdiscardedlock);
 					if (maxlights[j] > g_maxdiscardedlight + NORMAL_EPSILON)
 					{
 						g_maxdiscardedlight = maxlights[j];
 						VectorCopy (g_face_centroids[facenum], g_maxdiscardedpos);
 					}
-					ThreadUnlock ();
+					ThreadUnlock (g_maxdiscardedlock);
 				}
 				maxlights[j] = 0;
 			}
@@ -3977,13 +4662,13 @@ void            BuildFacelights(const int facenum)
 		{
 			if (maxlights[j] > g_maxdiscardedlight + NORMAL_EPSILON)
 			{
-				ThreadLock ();
+				ThreadLock (g_maxdiscardedlock);
 				if (maxlights[j] > g_maxdiscardedlight + NORMAL_EPSILON)
 				{
 					g_maxdiscardedlight = maxlights[j];
 					VectorCopy (g_face_centroids[facenum], g_maxdiscardedpos);
 				}
-				ThreadUnlock ();
+				ThreadUnlock (g_maxdiscardedlock);
 			}
 		}
 		for (j = 0; j < ALLSTYLES; j++)
@@ -4033,13 +4718,13 @@ void            BuildFacelights(const int facenum)
 		{
 			if (maxlights[j] > g_maxdiscardedlight + NORMAL_EPSILON)
 			{
-				ThreadLock ();
+				ThreadLock (g_maxdiscardedlock);
 				if (maxlights[j] > g_maxdiscardedlight + NORMAL_EPSILON)
 				{
 					g_maxdiscardedlight = maxlights[j];
 					VectorCopy (patch->origin, g_maxdiscardedpos);
 				}
-				ThreadUnlock ();
+				ThreadUnlock (g_maxdiscardedlock);
 			}
 		}
 		for (j = 0; j < ALLSTYLES && patch->totalstyle_all[j] != 255; j++)
@@ -4080,13 +4765,13 @@ void            BuildFacelights(const int facenum)
 		{
 			if (maxlights[j] > g_maxdiscardedlight + NORMAL_EPSILON)
 			{
-				ThreadLock ();
+				ThreadLock (g_maxdiscardedlock);
 				if (maxlights[j] > g_maxdiscardedlight + NORMAL_EPSILON)
 				{
 					g_maxdiscardedlight = maxlights[j];
 					VectorCopy (patch->origin, g_maxdiscardedpos);
 				}
-				ThreadUnlock ();
+				ThreadUnlock (g_maxdiscardedlock);
 			}
 		}
 		free (patch->totalstyle_all);
@@ -4792,13 +5477,13 @@ void AddPatchLights (int facenum)
 					{
 						if (VectorMaximum (v) > g_maxdiscardedlight + NORMAL_EPSILON)
 						{
-							ThreadLock ();
+							ThreadLock (g_maxdiscardedlock);
 							if (VectorMaximum (v) > g_maxdiscardedlight + NORMAL_EPSILON)
 							{
 								g_maxdiscardedlight = VectorMaximum (v);
 								VectorCopy (samp->pos, g_maxdiscardedpos);
 							}
-							ThreadUnlock ();
+							ThreadUnlock (g_maxdiscardedlock);
 						}
 					}
 				}
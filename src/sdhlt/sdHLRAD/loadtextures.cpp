@@ -78,6 +78,7 @@ void OpenWadFile (const char *name
    if (fullpath)
    {
 	safe_snprintf (wad->path, _MAX_PATH, "%s", name);
+	CacheInputFile (wad->path);
 	wad->file = fopen (wad->path, "rb");
 	if (!wad->file)
 	{
@@ -90,6 +91,7 @@ void OpenWadFile (const char *name
 	for (dir = g_waddirs; dir; dir = dir->next)
 	{
 		safe_snprintf (wad->path, _MAX_PATH, "%s\\%s", dir->path, name);
+		CacheInputFile (wad->path);
 		wad->file = fopen (wad->path, "rb");
 		if (wad->file)
 		{
@@ -150,6 +152,7 @@ void TryOpenWadFiles ()
 		g_wadfiles_opened = true;
 		char filename[_MAX_PATH];
 		safe_snprintf(filename, _MAX_PATH, "%s.wa_", g_Mapname);
+		CacheInputFile (filename);
 	   if (q_exists (filename))
 	   {
 		OpenWadFile (filename, true);
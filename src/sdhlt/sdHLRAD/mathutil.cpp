@@ -1,5 +1,7 @@
 #include "qrad.h"
 
+#include <algorithm>
+
 // =====================================================================================
 //  point_in_winding
 //      returns whether the point is in the winding (including its edges)
@@ -288,38 +290,314 @@ inline bool LineSegmentIntersectsBounds (const vec3_t p1, const vec3_t p2, const
 }
 
 // =====================================================================================
-//  TestSegmentAgainstOpaqueList
-//      Returns true if the segment intersects an item in the opaque list
+//  Opaque instance tree
+//      A bounding box tree over everything TestSegmentAgainstOpaqueList looks at: the opaque
+//      brush entities at their origins and the studio models that cast shadows. A segment
+//      only goes down to the opaque nodes or mesh tree of the instances whose boxes it hits.
 // =====================================================================================
-bool            TestSegmentAgainstOpaqueList(const vec_t* p1, const vec_t* p2
+#define OPAQUETREE_LEAF_INSTANCES	4
+#define OPAQUETREE_MAX_DEPTH		64
+#define OPAQUETREE_MAX_HITS			256
+
+typedef struct
+{
+	vec3_t mins, maxs;
+	vec3_t center;
+	int opaque; // index into g_opaque_face_list, or -1
+	int studio; // studio model number, or -1
+} opaqueinstance_t;
+
+typedef struct
+{
+	vec3_t mins, maxs;
+	int firstinstance;
+	int numinstances; // 0 for a node with children
+	int children[2];
+} opaquetreenode_t;
+
+static std::vector<opaqueinstance_t> g_opaqueinstances;
+static std::vector<opaquetreenode_t> g_opaquetree;
+
+static int		BuildOpaqueInstanceTree_r (int first, int count, int depth)
+{
+	const int nodenum = (int)g_opaquetree.size ();
+	opaquetreenode_t node;
+	int i, axis;
+
+	VectorFill (node.mins, BOGUS_RANGE);
+	VectorFill (node.maxs, -BOGUS_RANGE);
+	for (i = first; i < first + count; i++)
+	{
+		VectorCompareMinimum (node.mins, g_opaqueinstances[i].mins, node.mins);
+		VectorCompareMaximum (node.maxs, g_opaqueinstances[i].maxs, node.maxs);
+	}
+	node.firstinstance = first;
+	node.numinstances = count;
+	node.children[0] = node.children[1] = -1;
+	g_opaquetree.push_back (node);
+	if (count <= OPAQUETREE_LEAF_INSTANCES || depth >= OPAQUETREE_MAX_DEPTH - 2)
+	{
+		return nodenum;
+	}
+
+	// split at the median of the centers along the longest axis
+	axis = 0;
+	for (i = 1; i < 3; i++)
+	{
+		if (node.maxs[i] - node.mins[i] > node.maxs[axis] - node.mins[axis])
+		{
+			axis = i;
+		}
+	}
+	std::sort (g_opaqueinstances.begin () + first, g_opaqueinstances.begin () + first + count,
+		[axis] (const opaqueinstance_t &a, const opaqueinstance_t &b)
+		{
+			if (a.center[axis] != b.center[axis])
+			{
+				return a.center[axis] < b.center[axis];
+			}
+			return a.opaque != b.opaque ? a.opaque < b.opaque : a.studio < b.studio;
+		});
+	const int child0 = BuildOpaqueInstanceTree_r (first, count / 2, depth + 1);
+	const int child1 = BuildOpaqueInstanceTree_r (first + count / 2, count - count / 2, depth + 1);
+	g_opaquetree[nodenum].numinstances = 0;
+	g_opaquetree[nodenum].children[0] = child0;
+	g_opaquetree[nodenum].children[1] = child1;
+	return nodenum;
+}
+
+// =====================================================================================
+//  CreateOpaqueInstanceTree
+//      Needs the opaque entities and the studio models to be loaded
+// =====================================================================================
+void			CreateOpaqueInstanceTree ()
+{
+	opaqueinstance_t instance;
+	int i, j;
+
+	g_opaqueinstances.clear ();
+	g_opaquetree.clear ();
+	for (i = 0; i < g_opaque_face_count; i++)
+	{
+		const opaquemodel_t *om = &opaquemodels[g_opaque_face_list[i].modelnum];
+		for (j = 0; j < 3; j++)
+		{
+			// TestLineOpaque stops at these bounds (which have already been grown by 1 unit) less ON_EPSILON
+			instance.mins[j] = om->mins[j] + g_opaque_face_list[i].origin[j] - 1;
+			instance.maxs[j] = om->maxs[j] + g_opaque_face_list[i].origin[j] + 1;
+		}
+		instance.opaque = i;
+		instance.studio = -1;
+		g_opaqueinstances.push_back (instance);
+	}
+	for (i = 0; i < GetStudioModelCount (); i++)
+	{
+		if (!GetStudioModelBounds (i, instance.mins, instance.maxs))
+		{
+			continue;
+		}
+		for (j = 0; j < 3; j++)
+		{
+			// the mesh is tested against the bounds of the segment grown by 1 unit
+			instance.mins[j] -= 2;
+			instance.maxs[j] += 2;
+		}
+		instance.opaque = -1;
+		instance.studio = i;
+		g_opaqueinstances.push_back (instance);
+	}
+	if (g_opaqueinstances.empty ())
+	{
+		return;
+	}
+	for (i = 0; i < (int)g_opaqueinstances.size (); i++)
+	{
+		VectorAdd (g_opaqueinstances[i].mins, g_opaqueinstances[i].maxs, g_opaqueinstances[i].center);
+		VectorScale (g_opaqueinstances[i].center, 0.5, g_opaqueinstances[i].center);
+	}
+	BuildOpaqueInstanceTree_r (0, (int)g_opaqueinstances.size (), 0);
+	Verbose ("%d opaque instances in a tree of %d nodes\n", (int)g_opaqueinstances.size (), (int)g_opaquetree.size ());
+}
+
+void			FreeOpaqueInstanceTree ()
+{
+	g_opaqueinstances.clear ();
+	g_opaqueinstances.shrink_to_fit ();
+	g_opaquetree.clear ();
+	g_opaquetree.shrink_to_fit ();
+}
+
+// slab test of the segment p1 + t * delta, 0 <= t <= 1
+static bool		SegmentHitsBounds (const vec3_t p1, const vec3_t delta, const vec3_t invdelta, const vec3_t mins, const vec3_t maxs)
+{
+	vec_t enter = 0, leave = 1;
+	for (int i = 0; i < 3; i++)
+	{
+		if (delta[i] == 0)
+		{
+			if (p1[i] < mins[i] || p1[i] > maxs[i])
+			{
+				return false;
+			}
+			continue;
+		}
+		vec_t t0 = (mins[i] - p1[i]) * invdelta[i];
+		vec_t t1 = (maxs[i] - p1[i]) * invdelta[i];
+		if (t0 > t1)
+		{
+			vec_t t = t0;
+			t0 = t1;
+			t1 = t;
+		}
+		enter = qmax (enter, t0);
+		leave = qmin (leave, t1);
+		if (enter > leave)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// =====================================================================================
+//  TestOpaqueEntry
+//      Applies entry x of the opaque list to the segment; true if it blocks the light
+// =====================================================================================
+static bool		TestOpaqueEntry (int x, const vec_t* p1, const vec_t* p2
 					, vec3_t &scaleout
-					, int &opaquestyleout // light must convert to this style. -1 = no convert
+					, int &opaquestyleout
 					)
+{
+	if (!TestLineOpaque (g_opaque_face_list[x].modelnum, g_opaque_face_list[x].origin, p1, p2))
 	{
-		int x;
-		VectorFill (scaleout, 1.0);
-		opaquestyleout = -1;
-	    for (x = 0; x < g_opaque_face_count; x++)
+		return false;
+	}
+	if (g_opaque_face_list[x].transparency)
+	{
+		VectorMultiply (scaleout, g_opaque_face_list[x].transparency_scale, scaleout);
+		return false;
+	}
+	if (g_opaque_face_list[x].style != -1 && (opaquestyleout == -1 || g_opaque_face_list[x].style == opaquestyleout))
+	{
+		opaquestyleout = g_opaque_face_list[x].style;
+		return false;
+	}
+	return true;
+}
+
+static bool		TestSegmentAgainstOpaqueInstances (const vec_t* p1, const vec_t* p2
+					, vec3_t &scaleout
+					, int &opaquestyleout
+					)
+{
+	int opaquehits[OPAQUETREE_MAX_HITS];
+	int studiohits[OPAQUETREE_MAX_HITS];
+	int numopaquehits = 0, numstudiohits = 0;
+	int stack[OPAQUETREE_MAX_DEPTH];
+	int depth = 0;
+	vec3_t delta, invdelta;
+	int i, j;
+
+	if (g_opaquetree.empty ())
+	{
+		for (i = 0; i < g_opaque_face_count; i++)
 		{
-			if (!TestLineOpaque (g_opaque_face_list[x].modelnum, g_opaque_face_list[x].origin, p1, p2))
+			if (TestOpaqueEntry (i, p1, p2, scaleout, opaquestyleout))
 			{
-				continue;
+				return true;
 			}
-			if (g_opaque_face_list[x].transparency)
+		}
+		return TestSegmentAgainstStudioList (p1, p2);
+	}
+
+	VectorSubtract (p2, p1, delta);
+	for (i = 0; i < 3; i++)
+	{
+		invdelta[i] = delta[i] == 0 ? 0 : 1 / delta[i];
+	}
+	stack[depth++] = 0;
+	while (depth)
+	{
+		const opaquetreenode_t *node = &g_opaquetree[stack[--depth]];
+		if (!SegmentHitsBounds (p1, delta, invdelta, node->mins, node->maxs))
+		{
+			continue;
+		}
+		if (node->numinstances == 0)
+		{
+			stack[depth++] = node->children[1];
+			stack[depth++] = node->children[0];
+			continue;
+		}
+		for (i = node->firstinstance; i < node->firstinstance + node->numinstances; i++)
+		{
+			const opaqueinstance_t *instance = &g_opaqueinstances[i];
+			if (!SegmentHitsBounds (p1, delta, invdelta, instance->mins, instance->maxs))
 			{
-				VectorMultiply (scaleout, g_opaque_face_list[x].transparency_scale, scaleout);
 				continue;
 			}
-			if (g_opaque_face_list[x].style != -1 && (opaquestyleout == -1 || g_opaque_face_list[x].style == opaquestyleout))
+			if (numopaquehits == OPAQUETREE_MAX_HITS || numstudiohits == OPAQUETREE_MAX_HITS)
 			{
-				opaquestyleout = g_opaque_face_list[x].style;
-				continue;
+				// too many to keep, so go through the whole list as without the tree
+				for (j = 0; j < g_opaque_face_count; j++)
+				{
+					if (TestOpaqueEntry (j, p1, p2, scaleout, opaquestyleout))
+					{
+						return true;
+					}
+				}
+				return TestSegmentAgainstStudioList (p1, p2);
 			}
-			VectorFill (scaleout, 0.0);
-			opaquestyleout = -1;
+			if (instance->opaque != -1)
+			{
+				opaquehits[numopaquehits++] = instance->opaque;
+			}
+			else
+			{
+				studiohits[numstudiohits++] = instance->studio;
+			}
+		}
+	}
+
+	// in list order, so that the transparency is multiplied as it always was
+	for (i = 1; i < numopaquehits; i++)
+	{
+		const int x = opaquehits[i];
+		for (j = i; j > 0 && opaquehits[j - 1] > x; j--)
+		{
+			opaquehits[j] = opaquehits[j - 1];
+		}
+		opaquehits[j] = x;
+	}
+	for (i = 0; i < numopaquehits; i++)
+	{
+		if (TestOpaqueEntry (opaquehits[i], p1, p2, scaleout, opaquestyleout))
+		{
 			return true;
 		}
-		if (TestSegmentAgainstStudioList(p1, p2)) //seedee
+	}
+	for (i = 0; i < numstudiohits; i++)
+	{
+		if (TestSegmentAgainstStudioModel (studiohits[i], p1, p2))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// =====================================================================================
+//  TestSegmentAgainstOpaqueList
+//      Returns true if the segment intersects an item in the opaque list
+// =====================================================================================
+bool            TestSegmentAgainstOpaqueList(const vec_t* p1, const vec_t* p2
+					, vec3_t &scaleout
+					, int &opaquestyleout // light must convert to this style. -1 = no convert
+					)
+	{
+		VectorFill (scaleout, 1.0);
+		opaquestyleout = -1;
+		if (TestSegmentAgainstOpaqueInstances (p1, p2, scaleout, opaquestyleout))
 		{
 			VectorFill(scaleout, 0.0);
 			opaquestyleout = -1;
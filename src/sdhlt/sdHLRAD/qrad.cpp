@@ -21,6 +21,11 @@
 
 #include "qrad.h"
 
+#if defined (__SSE__) || defined (_M_X64) || (defined (_M_IX86_FP) && _M_IX86_FP >= 1)
+#define HLRAD_TRANSFERMATRIX_SSE
+#include <xmmintrin.h>
+#endif
+
 
 /*
  * NOTES
@@ -97,12 +102,14 @@ vec3_t		g_jitter_hack = { DEFAULT_JITTER_HACK_RED, DEFAULT_JITTER_HACK_GREEN, DE
 
 bool		g_customshadow_with_bouncelight = DEFAULT_CUSTOMSHADOW_WITH_BOUNCELIGHT;
 bool		g_rgb_transfers = DEFAULT_RGB_TRANSFERS;
+bool		g_csr_transfers = DEFAULT_CSR_TRANSFERS;
 
 float		g_transtotal_hack = DEFAULT_TRANSTOTAL_HACK;
 unsigned char g_minlight = DEFAULT_MINLIGHT;
 float_type g_transfer_compress_type = DEFAULT_TRANSFER_COMPRESS_TYPE;
 vector_type g_rgbtransfer_compress_type = DEFAULT_RGBTRANSFER_COMPRESS_TYPE;
 bool g_softsky = DEFAULT_SOFTSKY;
+bool g_adaptivesky = DEFAULT_ADAPTIVESKY;
 int g_blockopaque = DEFAULT_BLOCKOPAQUE;
 bool g_notextures = DEFAULT_NOTEXTURES;
 vec_t g_texreflectgamma = DEFAULT_TEXREFLECTGAMMA;
@@ -146,6 +153,7 @@ int				stylewarningcount = 0;
 int				stylewarningnext = 1;
 vec_t g_maxdiscardedlight = 0;
 vec3_t g_maxdiscardedpos = {0, 0, 0};
+threadlock_t g_maxdiscardedlock ("g_maxdiscardedlight");
 
 // =====================================================================================
 //  GetParamsFromEnt
@@ -2073,6 +2081,65 @@ static void     CollectLight()
     }
 }
 
+// =====================================================================================
+//  StoreGatheredLight
+//      Keep the brightest MAXLIGHTMAPS styles of the light gathered by a patch
+// =====================================================================================
+static void     StoreGatheredLight(const int j, const patch_t* const patch, vec3_t adds[ALLSTYLES])
+{
+	unsigned        m;
+	int				style;
+
+	vec_t maxlights[ALLSTYLES];
+	for (style = 0; style < ALLSTYLES; style++)
+	{
+		maxlights[style] = VectorMaximum (adds[style]);
+	}
+	for (m = 0; m < MAXLIGHTMAPS; m++)
+	{
+		unsigned char beststyle = 255;
+		if (m == 0)
+		{
+			beststyle = 0;
+		}
+		else
+		{
+			vec_t bestmaxlight = 0;
+			for (style = 1; style < ALLSTYLES; style++)
+			{
+				if (maxlights[style] > bestmaxlight + NORMAL_EPSILON)
+				{
+					bestmaxlight = maxlights[style];
+					beststyle = style;
+				}
+			}
+		}
+		if (beststyle != 255)
+		{
+			maxlights[beststyle] = 0;
+			newstyles[j][m] = beststyle;
+			VectorCopy (adds[beststyle], addlight[j][m]);
+		}
+		else
+		{
+			newstyles[j][m] = 255;
+		}
+	}
+	for (style = 1; style < ALLSTYLES; style++)
+	{
+		if (maxlights[style] > g_maxdiscardedlight + NORMAL_EPSILON)
+		{
+			ThreadLock (g_maxdiscardedlock);
+			if (maxlights[style] > g_maxdiscardedlight + NORMAL_EPSILON)
+			{
+				g_maxdiscardedlight = maxlights[style];
+				VectorCopy (patch->origin, g_maxdiscardedpos);
+			}
+			ThreadUnlock (g_maxdiscardedlock);
+		}
+	}
+}
+
 // =====================================================================================
 //  GatherLight
 //      Get light from other g_patches
@@ -2095,7 +2162,6 @@ static void     GatherLight(int threadnum)
     transfer_index_t* tIndex;
 	float f;
 	vec3_t			adds[ALLSTYLES];
-	int				style;
 	unsigned int	fastfind_index = 0;
 
     while (1)
@@ -2192,54 +2258,7 @@ static void     GatherLight(int threadnum)
             }
         }
 
-		vec_t maxlights[ALLSTYLES];
-		for (style = 0; style < ALLSTYLES; style++)
-		{
-			maxlights[style] = VectorMaximum (adds[style]);
-		}
-		for (m = 0; m < MAXLIGHTMAPS; m++)
-		{
-			unsigned char beststyle = 255;
-			if (m == 0)
-			{
-				beststyle = 0;
-			}
-			else
-			{
-				vec_t bestmaxlight = 0;
-				for (style = 1; style < ALLSTYLES; style++)
-				{
-					if (maxlights[style] > bestmaxlight + NORMAL_EPSILON)
-					{
-						bestmaxlight = maxlights[style];
-						beststyle = style;
-					}
-				}
-			}
-			if (beststyle != 255)
-			{
-				maxlights[beststyle] = 0;
-				newstyles[j][m] = beststyle;
-				VectorCopy (adds[beststyle], addlight[j][m]);
-			}
-			else
-			{
-				newstyles[j][m] = 255;
-			}
-		}
-		for (style = 1; style < ALLSTYLES; style++)
-		{
-			if (maxlights[style] > g_maxdiscardedlight + NORMAL_EPSILON)
-			{
-				ThreadLock ();
-				if (maxlights[style] > g_maxdiscardedlight + NORMAL_EPSILON)
-				{
-					g_maxdiscardedlight = maxlights[style];
-					VectorCopy (patch->origin, g_maxdiscardedpos);
-				}
-				ThreadUnlock ();
-			}
-		}
+		StoreGatheredLight (j, patch, adds);
     }
 }
 
@@ -2257,7 +2276,6 @@ static void     GatherRGBLight(int threadnum)
     transfer_index_t* tIndex;
 	float f[3];
 	vec3_t			adds[ALLSTYLES];
-	int				style;
 	unsigned int	fastfind_index = 0;
 
     while (1)
@@ -2353,55 +2371,385 @@ static void     GatherRGBLight(int threadnum)
             }
         }
 
-		vec_t maxlights[ALLSTYLES];
-		for (style = 0; style < ALLSTYLES; style++)
+		StoreGatheredLight (j, patch, adds);
+    }
+}
+
+// =====================================================================================
+//  Transfer matrix
+//      With -csrtransfers the RLE transfer lists are unpacked once after MakeScales into
+//      one compressed sparse row matrix. Each bounce then sums the light leaving every
+//      patch into one value per style, so gathering is a sparse matrix-vector product.
+//      Transfers through styled opaque entities (see GetStyle) are kept in a side list.
+// =====================================================================================
+typedef struct
+{
+	unsigned		patchnum;
+	int				style;
+	float			weight[3];
+}
+transfermatrix_styled_t;
+
+static size_t*	tm_rows = NULL;                            // [g_num_patches + 1] offsets into tm_cols
+static unsigned* tm_cols = NULL;                           // emitting patch of each transfer
+static float*	tm_weights = NULL;                         // 1 weight per transfer, 3 with rgb transfers
+static size_t*	tm_styledrows = NULL;                      // [g_num_patches + 1] offsets into tm_styled
+static transfermatrix_styled_t* tm_styled = NULL;
+
+static int		tm_numstyles = 0;                          // styles that bounce this time, style 0 first
+static int		tm_styles[ALLSTYLES];
+static int		tm_styleindex[ALLSTYLES];
+static float*	tm_emitlight = NULL;                       // [g_num_patches][tm_numstyles][4]
+
+static void     CountTransferMatrix(int threadnum)
+{
+	int				j;
+	unsigned		k, l;
+	unsigned int	fastfind_index = 0;
+
+	while ((j = GetThreadWork ()) != -1)
+	{
+		const patch_t* patch = &g_patches[j];
+		const transfer_index_t* tIndex = patch->tIndex;
+		size_t			count = 0;
+		size_t			styled = 0;
+
+		for (k = 0; k < patch->iIndex; k++, tIndex++)
 		{
-			maxlights[style] = VectorMaximum (adds[style]);
+			unsigned		patchnum = tIndex->index;
+
+			for (l = 0; l < (unsigned)tIndex->size + 1; l++, patchnum++)
+			{
+				int				opaquestyle = -1;
+				GetStyle (j, patchnum, opaquestyle, fastfind_index);
+				if (opaquestyle != -1)
+				{
+					styled++;
+				}
+				else
+				{
+					count++;
+				}
+			}
 		}
-		for (m = 0; m < MAXLIGHTMAPS; m++)
+		tm_rows[j + 1] = count;
+		tm_styledrows[j + 1] = styled;
+	}
+}
+
+static void     FillTransferMatrix(int threadnum)
+{
+	int				j;
+	unsigned		k, l;
+	unsigned int	fastfind_index = 0;
+
+	while ((j = GetThreadWork ()) != -1)
+	{
+		const patch_t* patch = &g_patches[j];
+		const transfer_index_t* tIndex = patch->tIndex;
+		const transfer_data_t* tData = patch->tData;
+		const rgb_transfer_data_t* tRGBData = patch->tRGBData;
+		size_t			entry = tm_rows[j];
+		transfermatrix_styled_t* styled = &tm_styled[tm_styledrows[j]];
+
+		for (k = 0; k < patch->iIndex; k++, tIndex++)
 		{
-			unsigned char beststyle = 255;
-			if (m == 0)
+			unsigned		patchnum = tIndex->index;
+
+			for (l = 0; l < (unsigned)tIndex->size + 1; l++, patchnum++)
 			{
-				beststyle = 0;
+				int				opaquestyle = -1;
+				float			f[3];
+
+				GetStyle (j, patchnum, opaquestyle, fastfind_index);
+				if (g_rgb_transfers)
+				{
+					vector_decompress (g_rgbtransfer_compress_type, tRGBData, &f[0], &f[1], &f[2]);
+					tRGBData += vector_size[g_rgbtransfer_compress_type];
+				}
+				else
+				{
+					float_decompress (g_transfer_compress_type, tData, &f[0]);
+					tData += float_size[g_transfer_compress_type];
+					f[1] = f[2] = f[0];
+				}
+				if (opaquestyle != -1)
+				{
+					styled->patchnum = patchnum;
+					styled->style = opaquestyle;
+					VectorCopy (f, styled->weight);
+					styled++;
+				}
+				else if (g_rgb_transfers)
+				{
+					tm_cols[entry] = patchnum;
+					VectorCopy (f, &tm_weights[entry * 3]);
+					entry++;
+				}
+				else
+				{
+					tm_cols[entry] = patchnum;
+					tm_weights[entry] = f[0];
+					entry++;
+				}
 			}
-			else
+		}
+	}
+}
+
+// =====================================================================================
+//  BuildTransferMatrix
+// =====================================================================================
+static void     BuildTransferMatrix()
+{
+	unsigned		i;
+	size_t			total, totalstyled;
+	double			size;
+
+	tm_rows = (size_t*)AllocBlock ((g_num_patches + 1) * sizeof (size_t));
+	tm_styledrows = (size_t*)AllocBlock ((g_num_patches + 1) * sizeof (size_t));
+	NamedRunThreadsOn (g_num_patches, g_estimate, CountTransferMatrix);
+
+	for (i = 0; i < g_num_patches; i++)
+	{
+		tm_rows[i + 1] += tm_rows[i];
+		tm_styledrows[i + 1] += tm_styledrows[i];
+	}
+	total = tm_rows[g_num_patches];
+	totalstyled = tm_styledrows[g_num_patches];
+
+	// one spare weight, so the last rgb weight can be loaded as a 4 float vector
+	tm_cols = (unsigned*)AllocBlock ((total + 1) * sizeof (unsigned));
+	tm_weights = (float*)AllocBlock (((g_rgb_transfers? 3: 1) * total + 1) * sizeof (float));
+	tm_styled = (transfermatrix_styled_t*)AllocBlock ((totalstyled + 1) * sizeof (transfermatrix_styled_t));
+	NamedRunThreadsOn (g_num_patches, g_estimate, FillTransferMatrix);
+
+	size = (double)(g_num_patches + 1) * 2 * sizeof (size_t)
+		+ (double)total * (sizeof (unsigned) + (g_rgb_transfers? 3: 1) * sizeof (float))
+		+ (double)totalstyled * sizeof (transfermatrix_styled_t);
+	Log ("Transfer matrix: %.0f transfers, %.0f through styled opaque entities, %.1f megs\n",
+		(double)total, (double)totalstyled, size / (1024.0 * 1024.0));
+}
+
+static void     FreeTransferMatrix()
+{
+	FreeBlock (tm_rows);
+	tm_rows = NULL;
+	FreeBlock (tm_styledrows);
+	tm_styledrows = NULL;
+	FreeBlock (tm_cols);
+	tm_cols = NULL;
+	FreeBlock (tm_weights);
+	tm_weights = NULL;
+	FreeBlock (tm_styled);
+	tm_styled = NULL;
+	if (tm_emitlight)
+	{
+		FreeBlock (tm_emitlight);
+		tm_emitlight = NULL;
+	}
+}
+
+// =====================================================================================
+//  BuildEmitLightTable
+//      Sum the light each patch bounces this time into one value per style,
+//      with the bounce style of the patch already applied
+// =====================================================================================
+static int      EmitStyle(const patch_t* const emitpatch, const int style)
+{
+	if (emitpatch->bouncestyle != -1)
+	{
+		if (style == 0 || style == emitpatch->bouncestyle)
+			return emitpatch->bouncestyle;
+		return -1;
+	}
+	return style;
+}
+
+static void     BuildEmitLightTable()
+{
+	unsigned		i;
+	int				k, style;
+	bool			used[ALLSTYLES];
+	const patch_t*	emitpatch;
+
+	memset (used, 0, sizeof (used));
+	used[0] = true;
+	for (i = 0, emitpatch = g_patches; i < g_num_patches; i++, emitpatch++)
+	{
+		for (k = 0; k < MAXLIGHTMAPS && emitpatch->directstyle[k] != 255; k++)
+		{
+			if ((style = EmitStyle (emitpatch, emitpatch->directstyle[k])) != -1)
+				used[style] = true;
+		}
+		for (k = 0; k < MAXLIGHTMAPS && emitpatch->totalstyle[k] != 255; k++)
+		{
+			if ((style = EmitStyle (emitpatch, emitpatch->totalstyle[k])) != -1)
+				used[style] = true;
+		}
+	}
+	tm_numstyles = 0;
+	for (style = 0; style < ALLSTYLES; style++)
+	{
+		tm_styleindex[style] = -1;
+		if (used[style])
+		{
+			tm_styleindex[style] = tm_numstyles;
+			tm_styles[tm_numstyles++] = style;
+		}
+	}
+
+	if (tm_emitlight)
+	{
+		FreeBlock (tm_emitlight);
+	}
+	tm_emitlight = (float*)AllocBlock (g_num_patches * tm_numstyles * 4 * sizeof (float));
+	for (i = 0, emitpatch = g_patches; i < g_num_patches; i++, emitpatch++)
+	{
+		float*			emit = &tm_emitlight[(size_t)i * tm_numstyles * 4];
+		vec3_t			v;
+
+		for (k = 0; k < MAXLIGHTMAPS && emitpatch->directstyle[k] != 255; k++)
+		{
+			VectorMultiply (emitpatch->directlight[k], emitpatch->bouncereflectivity, v);
+			if (isPointFinite (v) && (style = EmitStyle (emitpatch, emitpatch->directstyle[k])) != -1)
+			{
+				VectorAdd (&emit[tm_styleindex[style] * 4], v, &emit[tm_styleindex[style] * 4]);
+			}
+		}
+		for (k = 0; k < MAXLIGHTMAPS && emitpatch->totalstyle[k] != 255; k++)
+		{
+			VectorMultiply (emitlight[i][k], emitpatch->bouncereflectivity, v);
+			if (!isPointFinite (v))
+			{
+				Verbose ("BuildEmitLightTable, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
+					v[0], v[1], v[2], emitpatch->origin[0], emitpatch->origin[1], emitpatch->origin[2]);
+				continue;
+			}
+			if ((style = EmitStyle (emitpatch, emitpatch->totalstyle[k])) != -1)
 			{
-				vec_t bestmaxlight = 0;
-				for (style = 1; style < ALLSTYLES; style++)
+				VectorAdd (&emit[tm_styleindex[style] * 4], v, &emit[tm_styleindex[style] * 4]);
+			}
+		}
+	}
+}
+
+// =====================================================================================
+//  GatherLightMatrix
+//      GatherLight and GatherRGBLight on the transfer matrix
+//      Run multi-threaded
+// =====================================================================================
+static void     GatherLightMatrix(int threadnum)
+{
+	int				j;
+	int				a;
+	unsigned		m;
+	size_t			k;
+	const int		stride = tm_numstyles * 4;
+	vec3_t			adds[ALLSTYLES];
+#ifdef HLRAD_TRANSFERMATRIX_SSE
+	__m128			acc[ALLSTYLES];
+#else
+	vec3_t			acc[ALLSTYLES];
+#endif
+
+	while ((j = GetThreadWork ()) != -1)
+	{
+		const patch_t* patch = &g_patches[j];
+		const size_t	end = tm_rows[j + 1];
+
+		memset (adds, 0, ALLSTYLES * sizeof(vec3_t));
+		for (m = 0; m < MAXLIGHTMAPS && patch->totalstyle[m] != 255; m++)
+		{
+			VectorAdd (adds[patch->totalstyle[m]], patch->totallight[m], adds[patch->totalstyle[m]]);
+		}
+
+#ifdef HLRAD_TRANSFERMATRIX_SSE
+		for (a = 0; a < tm_numstyles; a++)
+		{
+			acc[a] = _mm_setzero_ps ();
+		}
+		if (g_rgb_transfers)
+		{
+			for (k = tm_rows[j]; k < end; k++)
+			{
+				const float*	emit = &tm_emitlight[(size_t)tm_cols[k] * stride];
+				const __m128	w = _mm_loadu_ps (&tm_weights[k * 3]); // 4th lane meets a zero
+
+				for (a = 0; a < tm_numstyles; a++)
 				{
-					if (maxlights[style] > bestmaxlight + NORMAL_EPSILON)
-					{
-						bestmaxlight = maxlights[style];
-						beststyle = style;
-					}
+					acc[a] = _mm_add_ps (acc[a], _mm_mul_ps (w, _mm_loadu_ps (&emit[a * 4])));
+				}
+			}
+		}
+		else
+		{
+			for (k = tm_rows[j]; k < end; k++)
+			{
+				const float*	emit = &tm_emitlight[(size_t)tm_cols[k] * stride];
+				const __m128	w = _mm_set1_ps (tm_weights[k]);
+
+				for (a = 0; a < tm_numstyles; a++)
+				{
+					acc[a] = _mm_add_ps (acc[a], _mm_mul_ps (w, _mm_loadu_ps (&emit[a * 4])));
 				}
 			}
-			if (beststyle != 255)
+		}
+		for (a = 0; a < tm_numstyles; a++)
+		{
+			float			sum[4];
+
+			_mm_storeu_ps (sum, acc[a]);
+			VectorAdd (adds[tm_styles[a]], sum, adds[tm_styles[a]]);
+		}
+#else
+		for (a = 0; a < tm_numstyles; a++)
+		{
+			VectorClear (acc[a]);
+		}
+		for (k = tm_rows[j]; k < end; k++)
+		{
+			const float*	emit = &tm_emitlight[(size_t)tm_cols[k] * stride];
+			vec3_t			w, v;
+
+			if (g_rgb_transfers)
 			{
-				maxlights[beststyle] = 0;
-				newstyles[j][m] = beststyle;
-				VectorCopy (adds[beststyle], addlight[j][m]);
+				VectorCopy (&tm_weights[k * 3], w);
 			}
 			else
 			{
-				newstyles[j][m] = 255;
+				VectorFill (w, tm_weights[k]);
+			}
+			for (a = 0; a < tm_numstyles; a++)
+			{
+				VectorMultiply (w, &emit[a * 4], v);
+				VectorAdd (acc[a], v, acc[a]);
 			}
 		}
-		for (style = 1; style < ALLSTYLES; style++)
+		for (a = 0; a < tm_numstyles; a++)
 		{
-			if (maxlights[style] > g_maxdiscardedlight + NORMAL_EPSILON)
+			VectorAdd (adds[tm_styles[a]], acc[a], adds[tm_styles[a]]);
+		}
+#endif
+
+		// styled opaque entities only pass style 0 and their own style
+		for (k = tm_styledrows[j]; k < tm_styledrows[j + 1]; k++)
+		{
+			const transfermatrix_styled_t* styled = &tm_styled[k];
+			const float*	emit = &tm_emitlight[(size_t)styled->patchnum * stride];
+			vec3_t			v;
+
+			VectorCopy (emit, v);
+			if (styled->style != 0 && tm_styleindex[styled->style] != -1)
 			{
-				ThreadLock ();
-				if (maxlights[style] > g_maxdiscardedlight + NORMAL_EPSILON)
-				{
-					g_maxdiscardedlight = maxlights[style];
-					VectorCopy (patch->origin, g_maxdiscardedpos);
-				}
-				ThreadUnlock ();
+				VectorAdd (v, &emit[tm_styleindex[styled->style] * 4], v);
 			}
+			VectorMultiply (v, styled->weight, v);
+			VectorAdd (adds[styled->style], v, adds[styled->style]);
 		}
-    }
+
+		StoreGatheredLight (j, patch, adds);
+	}
 }
 
 #ifdef SYSTEM_WIN32
@@ -2417,6 +2765,7 @@ static void     BounceLight()
     char            name[64];
 
     unsigned        j; //LRC
+    ProfilePhase    phase("BounceLight", g_numbounce);
 
     for (i = 0; i < g_num_patches; i++)
     {
@@ -2430,7 +2779,12 @@ static void     BounceLight()
     for (i = 0; i < g_numbounce; i++)
     {
         Log("Bounce %u ", i + 1);
-	if(g_rgb_transfers)
+	if (g_csr_transfers)
+		{
+			BuildEmitLightTable ();
+			NamedRunThreadsOn(g_num_patches, g_estimate, GatherLightMatrix);
+		}
+	else if(g_rgb_transfers)
 	       	{NamedRunThreadsOn(g_num_patches, g_estimate, GatherRGBLight);}
         else
         	{NamedRunThreadsOn(g_num_patches, g_estimate, GatherLight);}
@@ -2497,9 +2851,17 @@ static void     FreeTransfers()
 {
     unsigned        x;
     patch_t*        patch = g_patches;
+    const bool      mapped = unmaptransfers(); // transfers read from the .inc file point into its mapping
 
     for (x = 0; x < g_num_patches; x++, patch++)
     {
+        if (mapped)
+        {
+            patch->tData = NULL;
+            patch->tRGBData = NULL;
+            patch->tIndex = NULL;
+            continue;
+        }
         if (patch->tData)
         {
             FreeBlock(patch->tData);
@@ -2636,6 +2998,7 @@ static void     RadWorld()
     // create directlights out of g_patches and lights
     CreateDirectLights();
 	LoadStudioModels(); //seedee
+	CreateOpaqueInstanceTree();
     Log("\n");
 	
 	// generate a position map for each face
@@ -2643,6 +3006,10 @@ static void     RadWorld()
 
     // build initial facelights
     NamedRunThreadsOnIndividual(g_numfaces, g_estimate, BuildFacelights);
+	if (g_adaptivesky)
+	{
+		LogAdaptiveSky ();
+	}
 
 	FreePositionMaps ();
 
@@ -2653,6 +3020,11 @@ static void     RadWorld()
     {
         // build transfer lists
         MakeScalesStub();
+		if (g_csr_transfers)
+		{
+			BuildTransferMatrix ();
+			FreeTransfers ();
+		}
 
 		// these arrays are only used in CollectLight, GatherLight and BounceLight
 		emitlight = (vec3_t (*)[MAXLIGHTMAPS])AllocBlock ((g_num_patches + 1) * sizeof (vec3_t [MAXLIGHTMAPS]));
@@ -2667,6 +3039,10 @@ static void     RadWorld()
 		addlight = NULL;
 		FreeBlock (newstyles);
 		newstyles = NULL;
+		if (g_csr_transfers)
+		{
+			FreeTransferMatrix ();
+		}
     }
 
     FreeTransfers();
@@ -2750,6 +3126,9 @@ static void     Usage()
     Log("    -chart          : display bsp statitics\n");
     Log("    -low | -high    : run program an altered priority level\n");
     Log("    -nolog          : Do not generate the compile logfiles\n");
+    Log("    -profile        : Write phase timings to mapname.profile.json\n");
+    Log("    -deterministic  : Same output for any thread count\n");
+    Log("    -cache          : Reuse the output of the last run with the same inputs\n");
     Log("    -threads #      : manually specify the number of threads to run\n");
 #ifdef SYSTEM_WIN32
     Log("    -estimate       : display estimated time during compile\n");
@@ -2775,7 +3154,8 @@ static void     Usage()
     // ------------------------------------------------------------------------  
     
     Log("   -customshadowwithbounce : Enables custom shadows with bounce light\n");
-    Log("   -rgbtransfers           : Enables RGB Transfers (for custom shadows)\n\n");
+    Log("   -rgbtransfers           : Enables RGB Transfers (for custom shadows)\n");
+    Log("   -csrtransfers           : Unpack transfers into one matrix for faster bounces (uses more memory)\n\n");
 
 	Log("   -minlight #    : Minimum final light (integer from 0 to 255)\n");
 	{
@@ -2790,6 +3170,7 @@ static void     Usage()
 		Log(" )\n");
 	}
 	Log("   -softsky #     : Smooth skylight.(0=off 1=on)\n");
+	Log("   -adaptivesky   : Trace soft sky coarsely and refine only where directions disagree.\n");
 	Log("   -depth #       : Thickness of translucent objects.\n");
 	Log("   -blockopaque # : Remove the black areas around opaque entities.(0=off 1=on)\n");
 	Log("   -notextures    : Don't load textures.\n");
@@ -2843,6 +3224,9 @@ static void     Settings()
     Log("developer            [ %17d ] [ %17d ]\n", g_developer, DEFAULT_DEVELOPER);
     Log("chart                [ %17s ] [ %17s ]\n", g_chart ? "on" : "off", DEFAULT_CHART ? "on" : "off");
     Log("estimate             [ %17s ] [ %17s ]\n", g_estimate ? "on" : "off", DEFAULT_ESTIMATE ? "on" : "off");
+    Log("profile              [ %17s ] [ %17s ]\n", g_profile ? "on" : "off", DEFAULT_PROFILE ? "on" : "off");
+    Log("deterministic        [ %17s ] [ %17s ]\n", g_deterministic ? "on" : "off", DEFAULT_DETERMINISTIC ? "on" : "off");
+    Log("cache                [ %17s ] [ %17s ]\n", g_cache ? "on" : "off", DEFAULT_CACHE ? "on" : "off");
     Log("max texture memory   [ %17d ] [ %17d ]\n", g_max_map_miptex, DEFAULT_MAX_MAP_MIPTEX);
 		Log("max lighting memory  [ %17d ] [ %17d ]\n", g_max_map_lightdata, DEFAULT_MAX_MAP_LIGHTDATA); //lightdata
 
@@ -2970,6 +3354,7 @@ static void     Settings()
     Log("custom shadows with bounce light\n"
         "                     [ %17s ] [ %17s ]\n", g_customshadow_with_bouncelight ? "on" : "off", DEFAULT_CUSTOMSHADOW_WITH_BOUNCELIGHT ? "on" : "off");
     Log("rgb transfers        [ %17s ] [ %17s ]\n", g_rgb_transfers ? "on" : "off", DEFAULT_RGB_TRANSFERS ? "on" : "off"); 
+    Log("csr transfers        [ %17s ] [ %17s ]\n", g_csr_transfers ? "on" : "off", DEFAULT_CSR_TRANSFERS ? "on" : "off");
 
 	Log("minimum final light  [ %17d ] [ %17d ]\n", (int)g_minlight, (int)DEFAULT_MINLIGHT);
 	sprintf (buf1, "%d (%s)", g_transfer_compress_type, float_type_string[g_transfer_compress_type]);
@@ -2979,6 +3364,7 @@ static void     Settings()
 	sprintf (buf2, "%d (%s)", DEFAULT_RGBTRANSFER_COMPRESS_TYPE, vector_type_string[DEFAULT_RGBTRANSFER_COMPRESS_TYPE]);
 	Log("size of rgbtransfer  [ %17s ] [ %17s ]\n", buf1, buf2);
 	Log("soft sky             [ %17s ] [ %17s ]\n", g_softsky ? "on" : "off", DEFAULT_SOFTSKY ? "on" : "off");
+	Log("adaptive sky         [ %17s ] [ %17s ]\n", g_adaptivesky ? "on" : "off", DEFAULT_ADAPTIVESKY ? "on" : "off");
 	safe_snprintf(buf1, sizeof(buf1), "%3.3f", g_translucentdepth);
 	safe_snprintf(buf2, sizeof(buf2), "%3.3f", DEFAULT_TRANSLUCENTDEPTH);
 	Log("translucent depth    [ %17s ] [ %17s ]\n", buf1, buf2);
@@ -3087,6 +3473,17 @@ void            ReadInfoTexAndMinlights()
 
 const char* lights_rad = "lights.rad";
 const char* ext_rad = ".rad";
+// =====================================================================================
+//  RadFileExists
+//      Every place a .rad file could be is an input: one appearing earlier in the search
+//      changes the lights as much as an edit does
+// =====================================================================================
+static bool     RadFileExists(const char* const filename)
+{
+    CacheInputFile(filename);
+    return q_exists(filename);
+}
+
 // =====================================================================================
 //  LoadRadFiles
 // =====================================================================================
@@ -3119,7 +3516,7 @@ void            LoadRadFiles(const char* const mapname, const char* const user_r
     // Look for lights.rad in mapdir
     safe_strncpy(global_lights, mapdir, _MAX_PATH);
     safe_strncat(global_lights, lights_rad, _MAX_PATH);
-    if (q_exists(global_lights))
+    if (RadFileExists(global_lights))
     {
         ReadLightFile(global_lights);
     }
@@ -3128,7 +3525,7 @@ void            LoadRadFiles(const char* const mapname, const char* const user_r
         // Look for lights.rad in appdir
         safe_strncpy(global_lights, appdir, _MAX_PATH);
         safe_strncat(global_lights, lights_rad, _MAX_PATH);
-        if (q_exists(global_lights))
+        if (RadFileExists(global_lights))
         {
             ReadLightFile(global_lights);
         }
@@ -3136,7 +3533,7 @@ void            LoadRadFiles(const char* const mapname, const char* const user_r
         {
             // Look for lights.rad in current working directory
             safe_strncpy(global_lights, lights_rad, _MAX_PATH);
-            if (q_exists(global_lights))
+            if (RadFileExists(global_lights))
             {
                 ReadLightFile(global_lights);
             }
@@ -3147,7 +3544,7 @@ void            LoadRadFiles(const char* const mapname, const char* const user_r
     safe_strncpy(mapname_lights, mapdir, _MAX_PATH);
     safe_strncat(mapname_lights, mapfile, _MAX_PATH);
 	safe_strncat(mapname_lights, ext_rad, _MAX_PATH);
-    if (q_exists(mapname_lights))
+    if (RadFileExists(mapname_lights))
     {
         ReadLightFile(mapname_lights);
     }
@@ -3162,7 +3559,7 @@ void            LoadRadFiles(const char* const mapname, const char* const user_r
 
         // Look for user.rad from command line (raw)
         safe_strncpy(user_lights, user_rad, _MAX_PATH);
-        if (q_exists(user_lights))
+        if (RadFileExists(user_lights))
         {
             ReadLightFile(user_lights);
         }
@@ -3170,7 +3567,7 @@ void            LoadRadFiles(const char* const mapname, const char* const user_r
         {
             // Try again with .rad enforced as extension
             DefaultExtension(user_lights, ext_rad);
-            if (q_exists(user_lights))
+            if (RadFileExists(user_lights))
             {
                 ReadLightFile(user_lights);
             }
@@ -3180,7 +3577,7 @@ void            LoadRadFiles(const char* const mapname, const char* const user_r
                 safe_strncpy(user_lights, mapdir, _MAX_PATH);
                 safe_strncat(user_lights, userfile, _MAX_PATH);
                 DefaultExtension(user_lights, ext_rad);
-                if (q_exists(user_lights))
+                if (RadFileExists(user_lights))
                 {
                     ReadLightFile(user_lights);
                 }
@@ -3190,7 +3587,7 @@ void            LoadRadFiles(const char* const mapname, const char* const user_r
                     safe_strncpy(user_lights, appdir, _MAX_PATH);
                     safe_strncat(user_lights, userfile, _MAX_PATH);
                     DefaultExtension(user_lights, ext_rad);
-                    if (q_exists(user_lights))
+                    if (RadFileExists(user_lights))
                     {
                         ReadLightFile(user_lights);
                     }
@@ -3199,7 +3596,7 @@ void            LoadRadFiles(const char* const mapname, const char* const user_r
                         // Look for user.rad in current working directory
                         safe_strncpy(user_lights, userfile, _MAX_PATH);
                         DefaultExtension(user_lights, ext_rad);
-                        if (q_exists(user_lights))
+                        if (RadFileExists(user_lights))
                         {
                             ReadLightFile(user_lights);
                         }
@@ -3502,6 +3899,18 @@ int             main(const int argc, char** argv)
         {
             g_log = false;
         }
+        else if (!strcasecmp(argv[i], "-profile"))
+        {
+            g_profile = true;
+        }
+        else if (!strcasecmp(argv[i], "-deterministic"))
+        {
+            g_deterministic = true;
+        }
+        else if (!strcasecmp(argv[i], "-cache"))
+        {
+            g_cache = true;
+        }
         else if (!strcasecmp(argv[i], "-gamma"))
         {
             if (i + 1 < argc)	//added "1" .--vluzacn
@@ -3721,6 +4130,10 @@ int             main(const int argc, char** argv)
         {
         	g_rgb_transfers = true;
         }
+        else if (!strcasecmp(argv[i], "-csrtransfers"))
+        {
+        	g_csr_transfers = true;
+        }
 
 
 		else if (!strcasecmp(argv[i], "-bscale"))
@@ -3761,6 +4174,10 @@ int             main(const int argc, char** argv)
 				Usage();
 			}
 		}
+		else if (!strcasecmp(argv[i], "-adaptivesky"))
+		{
+			g_adaptivesky = true;
+		}
 		else if (!strcasecmp(argv[i], "-nostudioshadow"))
 		{
 			g_studioshadow = false;
@@ -4011,14 +4428,45 @@ int             main(const int argc, char** argv)
 		hlassume (false, assume_NO_EXTENT_FILE);
 	}
 	LoadExtentFile (extentfilename);
+	CacheInputFile (extentfilename);
 #endif
+
+    // rad rewrites the faces and textures as well as the lighting, so the cache keeps every lump;
+    // the .rad files, wads and models it reads are added as inputs while it runs
+    int             radlumps[HEADER_LUMPS];
+    CacheKey        key;
+
+    key.addArguments(argc, argv);
+    for (i = 0; i < HEADER_LUMPS; i++)
+    {
+        radlumps[i] = i;
+        key.addLump(i);
+    }
+
     ParseEntities();
 	if (g_fastmode)
 	{
 		g_numbounce = 0;
 		g_softsky = false;
 	}
+	if (g_adaptivesky && !g_softsky)
+	{
+		Warning ("-adaptivesky only refines soft sky; ignoring it with -softsky 0.");
+		g_adaptivesky = false;
+	}
     Settings();
+    if (LoadCache(g_Mapname, "rad", key, radlumps, HEADER_LUMPS, NULL, 0))
+    {
+        if (g_chart)
+            PrintBSPFileSizes();
+
+        WriteBSPFile(g_source);
+
+        end = I_FloatTime();
+        LogTimeElapsed(end - start);
+        WriteProfile(g_Mapname);
+        return 0;
+    }
 	DeleteEmbeddedLightmaps ();
 	LoadTextures ();
     LoadRadFiles(g_Mapname, user_lights, argv[0]);
@@ -4056,12 +4504,14 @@ int             main(const int argc, char** argv)
 		g_blur = 1.0;
 	}
     RadWorld();
+	FreeOpaqueInstanceTree();
 	FreeStudioModels(); //seedee
     FreeOpaqueFaceList();
     FreePatches();
 	DeleteOpaqueNodes ();
 
 	EmbedLightmapInTextures ();
+    WriteCache(g_Mapname, "rad", key, radlumps, HEADER_LUMPS, NULL, 0);
     if (g_chart)
         PrintBSPFileSizes();
 
@@ -4069,6 +4519,7 @@ int             main(const int argc, char** argv)
 
     end = I_FloatTime();
     LogTimeElapsed(end - start);
+    WriteProfile(g_Mapname);
     // END RAD
 
 		}
@@ -15,6 +15,7 @@
 #include "winding.h"
 #include "scriplib.h"
 #include "threads.h"
+#include "cache.h"
 #include "blockmem.h"
 #include "filelib.h"
 #include "winding.h"
@@ -122,6 +123,7 @@
 
 	// RGB Transfers support for HLRAD .. to be used with -customshadowwithbounce
 	#define DEFAULT_RGB_TRANSFERS false
+	#define DEFAULT_CSR_TRANSFERS false
 // o_O ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
 	#define DEFAULT_TRANSTOTAL_HACK 0.2 //0.5 //vluzacn
@@ -129,6 +131,7 @@
 	#define DEFAULT_TRANSFER_COMPRESS_TYPE FLOAT16
 	#define DEFAULT_RGBTRANSFER_COMPRESS_TYPE VECTOR32
 	#define DEFAULT_SOFTSKY true
+	#define DEFAULT_ADAPTIVESKY false
 	#define DEFAULT_BLOCKOPAQUE 1
 	#define DEFAULT_TRANSLUCENTDEPTH 2.0f
 	#define DEFAULT_NOTEXTURES false
@@ -249,7 +252,7 @@ typedef unsigned char rgb_transfer_data_t;
 #define MAX_COMPRESSED_TRANSFER_INDEX_SIZE ((1 << 12) - 1)
 
 #define	MAX_PATCHES	(65535*16) // limited by transfer_index_t
-#define MAX_VISMATRIX_PATCHES 65535
+#define MAX_VISMATRIX_PATCHES MAX_PATCHES
 #define MAX_SPARSE_VISMATRIX_PATCHES MAX_PATCHES
 
 typedef enum
@@ -443,6 +446,7 @@ extern vec3_t	g_jitter_hack;
 
 	extern bool	g_customshadow_with_bouncelight;
 	extern bool	g_rgb_transfers;
+	extern bool	g_csr_transfers;
 	extern const vec3_t vec3_one;
 
 	extern float g_transtotal_hack;
@@ -450,6 +454,7 @@ extern vec3_t	g_jitter_hack;
 	extern float_type g_transfer_compress_type;
 	extern vector_type g_rgbtransfer_compress_type;
 	extern bool g_softsky;
+	extern bool g_adaptivesky;
 	extern int g_blockopaque;
 	extern bool g_drawpatch;
 	extern bool g_drawsample;
@@ -472,6 +477,7 @@ extern vec3_t	g_jitter_hack;
 	extern bool g_bleedfix;
 	extern vec_t g_maxdiscardedlight;
 	extern vec3_t g_maxdiscardedpos;
+	extern threadlock_t g_maxdiscardedlock;
 	extern vec_t g_texlightgap;
 
 extern void     MakeTnodes(dmodel_t* bm);
@@ -479,6 +485,7 @@ extern void     PairEdges();
 #define SKYLEVELMAX 8
 #define SKYLEVEL_SOFTSKYON 7
 #define SKYLEVEL_SOFTSKYOFF 4
+#define SKYLEVEL_ADAPTIVE 4 // -adaptivesky traces this level and refines towards SKYLEVEL_SOFTSKYON
 #define SUNSPREAD_SKYLEVEL 7
 #define SUNSPREAD_THRESHOLD 15.0
 extern int		g_numskynormals[SKYLEVELMAX+1]; // 0, 6, 18, 66, 258, 1026, 4098, 16386, 65538
@@ -486,6 +493,7 @@ extern vec3_t*	g_skynormals[SKYLEVELMAX+1]; //[numskynormals]
 extern vec_t*	g_skynormalsizes[SKYLEVELMAX+1]; // the weight of each normal
 extern void     BuildDiffuseNormals ();
 extern void     BuildFacelights(int facenum);
+extern void     LogAdaptiveSky ();
 extern void     PrecompLightmapOffsets();
 extern void		ReduceLightmap ();
 extern void     FinalLightFace(int facenum);
@@ -496,6 +504,9 @@ extern void		FreeFacelightDependencyList ();
 extern int      TestLine(const vec3_t start, const vec3_t stop
 						 , vec_t *skyhitout = NULL
 						 );
+extern void     TestLineBatch(const int count, const vec3_t* starts, const vec3_t* stops, int* results
+							  , vec3_t* skyhitsout = NULL
+							  );
 #define OPAQUE_NODE_INLINECALL
 #ifdef OPAQUE_NODE_INLINECALL
 typedef struct
@@ -575,6 +586,7 @@ extern void     MakeScalesNoVismatrix();
 extern size_t   g_total_transfer;
 extern bool     readtransfers(const char* const transferfile, long numpatches);
 extern void     writetransfers(const char* const transferfile, long total_patches);
+extern bool     unmaptransfers();
 
 // vismatrixutil.c (shared between vismatrix.c and sparse.c)
 extern void     MakeScales(int threadnum);
@@ -599,6 +611,8 @@ extern void InterpolateSampleLight (const vec3_t position, int surface, int nums
 extern void FreeTriangulations ();
 
 // mathutil.c
+extern void     CreateOpaqueInstanceTree();
+extern void     FreeOpaqueInstanceTree();
 extern bool     TestSegmentAgainstOpaqueList(const vec_t* p1, const vec_t* p2
 					, vec3_t &scaleout
 					, int &opaquestyleout
@@ -625,6 +639,9 @@ extern void		GetAlternateOrigin (const vec3_t pos, const vec3_t normal, const pa
 extern void LoadStudioModels(void);
 extern void FreeStudioModels(void);
 extern bool TestSegmentAgainstStudioList(const vec_t* p1, const vec_t* p2);
+extern int GetStudioModelCount(void);
+extern bool GetStudioModelBounds(int modelnum, vec3_t mins, vec3_t maxs);
+extern bool TestSegmentAgainstStudioModel(int modelnum, const vec_t* p1, const vec_t* p2);
 extern bool g_studioshadow;
 
 #endif //HLRAD_H__
@@ -19,6 +19,7 @@ void LoadStudioModel( const char *modelname, const vec3_t origin, const vec3_t a
 	sprintf(m->name, "%s%s", g_Wadpath, modelname);
 	FlipSlashes(m->name);
 
+	CacheInputFile(m->name);
 	if (!q_exists(m->name))
 	{
 		Warning("LoadStudioModel: couldn't load %s\n", m->name);
@@ -40,6 +41,7 @@ void LoadStudioModel( const char *modelname, const vec3_t origin, const vec3_t a
 		sprintf(texpath, "%s%sT.mdl", g_Wadpath, texname);
 		FlipSlashes(texpath);
 
+		CacheInputFile(texpath);
 		LoadFile(texpath, (char**)&texdata);
 		moddata = (byte *)m->extradata;
 		phdr = (studiohdr_t *)moddata;
@@ -213,32 +215,52 @@ void MoveBounds( const vec3_t start, const vec3_t mins, const vec3_t maxs, const
 	}
 }
 
-bool TestSegmentAgainstStudioList( const vec_t* p1, const vec_t* p2 )
+int GetStudioModelCount( void )
 {
-	if( !num_models ) return false; // easy out
+	return num_models;
+}
+
+// false if the model has no mesh to cast a shadow with
+bool GetStudioModelBounds( int modelnum, vec3_t mins, vec3_t maxs )
+{
+	mmesh_t *pMesh = models[modelnum].mesh.GetMesh();
+
+	if( !pMesh )
+		return false;
 
+	VectorCopy( pMesh->mins, mins );
+	VectorCopy( pMesh->maxs, maxs );
+	return true;
+}
+
+bool TestSegmentAgainstStudioModel( int modelnum, const vec_t* p1, const vec_t* p2 )
+{
+	model_t *m = &models[modelnum];
 	vec3_t	trace_mins, trace_maxs;
 
-	MoveBounds( p1, vec3_origin, vec3_origin, p2, trace_mins, trace_maxs );
+	mmesh_t *pMesh = m->mesh.GetMesh();
+	areanode_t *pHeadNode = m->mesh.GetHeadNode();
 
-	for( int i = 0; i < num_models; i++ )
-	{
-		model_t *m = &models[i];
+	MoveBounds( p1, vec3_origin, vec3_origin, p2, trace_mins, trace_maxs );
 
-		mmesh_t *pMesh = m->mesh.GetMesh();
-		areanode_t *pHeadNode = m->mesh.GetHeadNode();
+	if( !pMesh || !m->mesh.Intersect( trace_mins, trace_maxs ))
+		return false; // bad model or not intersect with trace
 
-		if( !pMesh || !m->mesh.Intersect( trace_mins, trace_maxs ))
-			continue; // bad model or not intersect with trace
+	TraceMesh	trm;	// a name like Doom3 :-)
 
-		TraceMesh	trm;	// a name like Doom3 :-)
+	trm.SetTraceModExtradata( m->extradata );
+	trm.SetTraceMesh( pMesh, pHeadNode );
+	trm.SetupTrace( p1, vec3_origin, vec3_origin, p2 );
 
-		trm.SetTraceModExtradata( m->extradata );
-		trm.SetTraceMesh( pMesh, pHeadNode );
-		trm.SetupTrace( p1, vec3_origin, vec3_origin, p2 );
+	return trm.DoTrace(); // we hit studio model
+}
 
-		if( trm.DoTrace())
-			return true; // we hit studio model
+bool TestSegmentAgainstStudioList( const vec_t* p1, const vec_t* p2 )
+{
+	for( int i = 0; i < num_models; i++ )
+	{
+		if( TestSegmentAgainstStudioModel( i, p1, p2 ))
+			return true;
 	}
 
 	return false;
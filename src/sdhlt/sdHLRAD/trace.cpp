@@ -5,6 +5,11 @@
 #include "winding.h"
 #include "qrad.h"
 
+#if defined (__SSE__) || defined (_M_X64) || (defined (_M_IX86_FP) && _M_IX86_FP >= 1)
+#define HLRAD_TESTLINE_SSE
+#include <xmmintrin.h>
+#endif
+
 // #define      ON_EPSILON      0.001
 
 typedef struct tnode_s
@@ -18,6 +23,7 @@ typedef struct tnode_s
 
 static tnode_t* tnodes;
 static tnode_t* tnode_p;
+static int      tnode_maxdepth;
 
 /*
  * ==============
@@ -26,7 +32,7 @@ static tnode_t* tnode_p;
  * Converts the disk node structure into the efficient tracing structure
  * ==============
  */
-static void     MakeTnode(const int nodenum)
+static void     MakeTnode(const int nodenum, const int depth)
 {
     tnode_t*        t;
     dplane_t*       plane;
@@ -34,6 +40,10 @@ static void     MakeTnode(const int nodenum)
     dnode_t*        node;
 
     t = tnode_p++;
+    if (depth > tnode_maxdepth)
+    {
+        tnode_maxdepth = depth;
+    }
 
     node = g_dnodes + nodenum;
     plane = g_dplanes + node->planenum;
@@ -54,7 +64,7 @@ static void     MakeTnode(const int nodenum)
         else
         {
             t->children[i] = tnode_p - tnodes;
-            MakeTnode(node->children[i]);
+            MakeTnode(node->children[i], depth + 1);
         }
     }
 
@@ -299,8 +309,9 @@ void            MakeTnodes(dmodel_t* /*bm*/)
 	int ofs = 31 - (int)(((uintptr_t)tnodes + (uintptr_t)31) & (uintptr_t)31);
 	tnodes = (tnode_t *)((byte *)tnodes + ofs);
     tnode_p = tnodes;
+    tnode_maxdepth = 0;
 
-    MakeTnode(0);
+    MakeTnode(0, 1);
 #if 0 //debug. vluzacn
 	ViewTNode ();
 #endif
@@ -416,17 +427,383 @@ int             TestLine_r(const int node, const vec3_t start, const vec3_t stop
 		);
 }
 
+// =====================================================================================
+//  TestLine_i
+//      Same walk as TestLine_r, but iterative. tnodes are laid out depth first (the front child
+//      always directly follows its parent), so this mostly streams through the array.
+//      The stack holds the parts of the line that TestLine_r would visit after returning from
+//      its first recursive call; a line never has more of them pending than the tree is deep.
+// =====================================================================================
+#define TESTLINE_STACK_SIZE 256
+
+typedef enum
+{
+	testline_far,                                          // the far side of a split line
+	testline_onplane_back,                                 // line lies on the plane, back child not tested yet
+	testline_onplane_done                                  // line lies on the plane, waiting for the back child
+}
+testline_pending_t;
+
+typedef struct
+{
+	testline_pending_t pending;
+	int             node;
+	bool            sky;                                   // testline_onplane_done: the front child hit sky
+	vec3_t          start;
+	vec3_t          stop;
+}
+testline_frame_t;
+
+static int      TestLine_i(int node, const vec3_t linestart, const vec3_t linestop
+						   , vec_t *skyhit
+						   )
+{
+	testline_frame_t stack[TESTLINE_STACK_SIZE];
+	testline_frame_t* frame;
+	int             depth = 0;
+	int             linecontent = 0;
+	tnode_t*        tnode;
+	float           front, back;
+	float           frac;
+	int             side;
+	int             r;
+	vec3_t          start, stop;
+
+	VectorCopy (linestart, start);
+	VectorCopy (linestop, stop);
+	while (1)
+	{
+		while (node >= 0)
+		{
+			tnode = &tnodes[node];
+			switch (tnode->type)
+			{
+			case plane_x:
+				front = start[0] - tnode->dist;
+				back = stop[0] - tnode->dist;
+				break;
+			case plane_y:
+				front = start[1] - tnode->dist;
+				back = stop[1] - tnode->dist;
+				break;
+			case plane_z:
+				front = start[2] - tnode->dist;
+				back = stop[2] - tnode->dist;
+				break;
+			default:
+				front = (start[0] * tnode->normal[0] + start[1] * tnode->normal[1] + start[2] * tnode->normal[2]) - tnode->dist;
+				back = (stop[0] * tnode->normal[0] + stop[1] * tnode->normal[1] + stop[2] * tnode->normal[2]) - tnode->dist;
+				break;
+			}
+
+			if (front > ON_EPSILON/2 && back > ON_EPSILON/2)
+			{
+				node = tnode->children[0];
+				continue;
+			}
+			if (front < -ON_EPSILON/2 && back < -ON_EPSILON/2)
+			{
+				node = tnode->children[1];
+				continue;
+			}
+			frame = &stack[depth++];
+			if (fabs(front) <= ON_EPSILON && fabs(back) <= ON_EPSILON)
+			{
+				frame->pending = testline_onplane_back;
+				frame->node = tnode->children[1];
+				VectorCopy (start, frame->start);
+				VectorCopy (stop, frame->stop);
+				node = tnode->children[0];
+				continue;
+			}
+			side = (front - back) < 0;
+			frac = front / (front - back);
+			if (frac < 0) frac = 0;
+			if (frac > 1) frac = 1;
+			frame->pending = testline_far;
+			frame->node = tnode->children[!side];
+			frame->start[0] = start[0] + (stop[0] - start[0]) * frac;
+			frame->start[1] = start[1] + (stop[1] - start[1]) * frac;
+			frame->start[2] = start[2] + (stop[2] - start[2]) * frac;
+			VectorCopy (stop, frame->stop);
+			VectorCopy (frame->start, stop);
+			node = tnode->children[side];
+		}
+
+		if (node == linecontent)
+		{
+			r = CONTENTS_EMPTY;
+		}
+		else if (node == CONTENTS_SOLID)
+		{
+			r = CONTENTS_SOLID;
+		}
+		else if (node == CONTENTS_SKY)
+		{
+			if (skyhit)
+			{
+				VectorCopy (start, skyhit);
+			}
+			r = CONTENTS_SKY;
+		}
+		else if (linecontent)
+		{
+			r = CONTENTS_SOLID;
+		}
+		else
+		{
+			linecontent = node;
+			r = CONTENTS_EMPTY;
+		}
+
+		// hand the result back up until something is left to test
+		for (; depth > 0; depth--)
+		{
+			frame = &stack[depth - 1];
+			if (frame->pending == testline_far)
+			{
+				if (r == CONTENTS_EMPTY)
+				{
+					break;
+				}
+			}
+			else if (frame->pending == testline_onplane_back)
+			{
+				if (r != CONTENTS_SOLID)
+				{
+					break;
+				}
+			}
+			else if (r != CONTENTS_SOLID)
+			{
+				r = (frame->sky || r == CONTENTS_SKY)? CONTENTS_SKY: CONTENTS_EMPTY;
+			}
+		}
+		if (depth == 0)
+		{
+			return r;
+		}
+		node = frame->node;
+		VectorCopy (frame->start, start);
+		VectorCopy (frame->stop, stop);
+		if (frame->pending == testline_far)
+		{
+			depth--;
+		}
+		else
+		{
+			frame->pending = testline_onplane_done;
+			frame->sky = (r == CONTENTS_SKY);
+		}
+	}
+}
+
+static int      TestLineFromNode(const int node, const vec3_t start, const vec3_t stop
+								 , vec_t *skyhit
+								 )
+{
+	if (tnode_maxdepth >= TESTLINE_STACK_SIZE)
+	{
+		int linecontent = 0;
+		return TestLine_r(node, start, stop
+			, linecontent
+			, skyhit
+			);
+	}
+	return TestLine_i(node, start, stop
+		, skyhit
+		);
+}
+
 int             TestLine(const vec3_t start, const vec3_t stop
 						 , vec_t *skyhit
 						 )
 {
-	int linecontent = 0;
-    return TestLine_r(0, start, stop
-		, linecontent
+	return TestLineFromNode(0, start, stop
 		, skyhit
 		);
 }
 
+// =====================================================================================
+//  TestLineBatch
+//      Traces a batch of lines, TESTLINE_PACKET_SIZE at a time. A packet walks down the tree
+//      together for as long as every line in it lies entirely on the same side of each plane,
+//      which is the usual case near the root for coherent lines (the sample points of one face
+//      against one light). Such nodes only forward the line unchanged in TestLine_r, so once the
+//      packet diverges each line can finish on its own from that node with the same result.
+// =====================================================================================
+#define TESTLINE_PACKET_SIZE 4
+
+#ifdef HLRAD_TESTLINE_SSE
+static float    testline_packet_epsilon = -1;              // smallest float above ON_EPSILON/2
+
+static void     TestLinePacketEpsilon()
+{
+	float e = (float)(ON_EPSILON/2);
+	while ((double)e <= ON_EPSILON/2)
+	{
+		e = nextafterf (e, 1.0f);
+	}
+	testline_packet_epsilon = e;
+}
+#endif
+
+static void     TestLinePacket(const int count, const vec3_t* starts, const vec3_t* stops, int* results
+							   , vec3_t* skyhits
+							   )
+{
+	int             node = 0;
+	int             i;
+	const tnode_t*  tnode;
+#ifdef HLRAD_TESTLINE_SSE
+	float           soa[6][TESTLINE_PACKET_SIZE];
+	__m128          sx, sy, sz, ex, ey, ez;
+	__m128          front, back, dist;
+	const __m128    epsilon = _mm_set1_ps (testline_packet_epsilon);
+	const __m128    negepsilon = _mm_set1_ps (-testline_packet_epsilon);
+
+	for (i = 0; i < TESTLINE_PACKET_SIZE; i++)
+	{
+		// unused lanes repeat the last line so they never make the packet diverge
+		const int j = i < count? i: count - 1;
+		soa[0][i] = starts[j][0];
+		soa[1][i] = starts[j][1];
+		soa[2][i] = starts[j][2];
+		soa[3][i] = stops[j][0];
+		soa[4][i] = stops[j][1];
+		soa[5][i] = stops[j][2];
+	}
+	sx = _mm_loadu_ps (soa[0]);
+	sy = _mm_loadu_ps (soa[1]);
+	sz = _mm_loadu_ps (soa[2]);
+	ex = _mm_loadu_ps (soa[3]);
+	ey = _mm_loadu_ps (soa[4]);
+	ez = _mm_loadu_ps (soa[5]);
+
+	while (node >= 0)
+	{
+		tnode = &tnodes[node];
+		dist = _mm_set1_ps (tnode->dist);
+		switch (tnode->type)
+		{
+		case plane_x:
+			front = _mm_sub_ps (sx, dist);
+			back = _mm_sub_ps (ex, dist);
+			break;
+		case plane_y:
+			front = _mm_sub_ps (sy, dist);
+			back = _mm_sub_ps (ey, dist);
+			break;
+		case plane_z:
+			front = _mm_sub_ps (sz, dist);
+			back = _mm_sub_ps (ez, dist);
+			break;
+		default:
+			{
+				// same operation order as the scalar code so both classify lines identically
+				const __m128 nx = _mm_set1_ps (tnode->normal[0]);
+				const __m128 ny = _mm_set1_ps (tnode->normal[1]);
+				const __m128 nz = _mm_set1_ps (tnode->normal[2]);
+				front = _mm_sub_ps (_mm_add_ps (_mm_add_ps (_mm_mul_ps (sx, nx), _mm_mul_ps (sy, ny)), _mm_mul_ps (sz, nz)), dist);
+				back = _mm_sub_ps (_mm_add_ps (_mm_add_ps (_mm_mul_ps (ex, nx), _mm_mul_ps (ey, ny)), _mm_mul_ps (ez, nz)), dist);
+			}
+			break;
+		}
+		if (_mm_movemask_ps (_mm_and_ps (_mm_cmpge_ps (front, epsilon), _mm_cmpge_ps (back, epsilon))) == 0xF)
+		{
+			node = tnode->children[0];
+		}
+		else if (_mm_movemask_ps (_mm_and_ps (_mm_cmple_ps (front, negepsilon), _mm_cmple_ps (back, negepsilon))) == 0xF)
+		{
+			node = tnode->children[1];
+		}
+		else
+		{
+			break;
+		}
+	}
+#else
+	float           front, back;
+
+	while (node >= 0)
+	{
+		int allfront = 1, allback = 1;
+		tnode = &tnodes[node];
+		for (i = 0; i < count && (allfront || allback); i++)
+		{
+			switch (tnode->type)
+			{
+			case plane_x:
+				front = starts[i][0] - tnode->dist;
+				back = stops[i][0] - tnode->dist;
+				break;
+			case plane_y:
+				front = starts[i][1] - tnode->dist;
+				back = stops[i][1] - tnode->dist;
+				break;
+			case plane_z:
+				front = starts[i][2] - tnode->dist;
+				back = stops[i][2] - tnode->dist;
+				break;
+			default:
+				front = (starts[i][0] * tnode->normal[0] + starts[i][1] * tnode->normal[1] + starts[i][2] * tnode->normal[2]) - tnode->dist;
+				back = (stops[i][0] * tnode->normal[0] + stops[i][1] * tnode->normal[1] + stops[i][2] * tnode->normal[2]) - tnode->dist;
+				break;
+			}
+			allfront = allfront && front > ON_EPSILON/2 && back > ON_EPSILON/2;
+			allback = allback && front < -ON_EPSILON/2 && back < -ON_EPSILON/2;
+		}
+		if (allfront)
+		{
+			node = tnode->children[0];
+		}
+		else if (allback)
+		{
+			node = tnode->children[1];
+		}
+		else
+		{
+			break;
+		}
+	}
+#endif
+
+	for (i = 0; i < count; i++)
+	{
+		results[i] = TestLineFromNode(node, starts[i], stops[i]
+			, skyhits? skyhits[i]: NULL
+			);
+	}
+}
+
+void            TestLineBatch(const int count, const vec3_t* starts, const vec3_t* stops, int* results
+							  , vec3_t* skyhits
+							  )
+{
+	int             i;
+
+	if (count == 1)
+	{
+		// nothing to share
+		results[0] = TestLineFromNode(0, starts[0], stops[0]
+			, skyhits? skyhits[0]: NULL
+			);
+		return;
+	}
+#ifdef HLRAD_TESTLINE_SSE
+	if (testline_packet_epsilon < 0)
+	{
+		TestLinePacketEpsilon();
+	}
+#endif
+	for (i = 0; i < count; i += TESTLINE_PACKET_SIZE)
+	{
+		TestLinePacket(qmin (TESTLINE_PACKET_SIZE, count - i), &starts[i], &stops[i], &results[i]
+			, skyhits? &skyhits[i]: NULL
+			);
+	}
+}
+
 
 typedef struct
 {
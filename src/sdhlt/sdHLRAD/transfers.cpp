@@ -1,6 +1,9 @@
 #include "qrad.h"
+#include "meshtrace.h"
 
 #ifdef SYSTEM_WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "win32fix.h"
@@ -10,6 +13,158 @@
 #include <sys/stat.h>
 #endif
 
+#ifdef SYSTEM_POSIX
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
+extern model_t  models[];
+extern int      num_models;
+
+/*
+ * The transfer file (.inc) is laid out so that it can be mapped into memory and used in place:
+ *
+ *   transferfile_header_t
+ *   transferfile_patch_t[numpatches]                     offsets of each patch's blocks
+ *   blocks                                               tIndex, then tData or tRGBData (+ unused_size), 8 byte aligned
+ *
+ * The header records everything the transfers were built from, so a file made from
+ * different geometry or options is rejected instead of being silently used.
+ */
+
+#define TRANSFERFILE_MAGIC      (('C' << 24) + ('T' << 16) + ('L' << 8) + 'H')  // "HLTC"
+#define TRANSFERFILE_VERSION    1
+#define TRANSFERFILE_ALIGN      8
+
+typedef struct
+{
+    int             magic;
+    int             version;
+    int             numpatches;
+    int             rgb_transfers;
+    int             transfer_compress_type;
+    int             rgbtransfer_compress_type;
+    unsigned int    checksum;
+    unsigned int    index_size;                            // sizeof(transfer_index_t)
+    uint64_t        filesize;
+} transferfile_header_t;
+
+typedef struct
+{
+    unsigned        iIndex;
+    unsigned        iData;
+    uint64_t        indexofs;
+    uint64_t        dataofs;
+} transferfile_patch_t;
+
+static void*    transfermapping = NULL;
+static uint64_t transfermappingsize = 0;
+#ifdef SYSTEM_WIN32
+static HANDLE   transfermappinghandle = NULL;
+#endif
+
+/*
+ * =============
+ * TransferChecksum
+ *
+ * FNV-1a over the inputs of MakeScales: the patches, the trace and PVS data,
+ * opaque entities, studio model shadows and the options that change the transfers.
+ * Face lighting and entity keys that only affect direct light are left out on purpose.
+ * =============
+ */
+
+static unsigned int ChecksumBytes(unsigned int checksum, const void* const buffer, size_t bytes)
+{
+    const byte*     p = (const byte*)buffer;
+
+    while (bytes--)
+    {
+        checksum ^= *p++;
+        checksum *= 16777619u;
+    }
+    return checksum;
+}
+
+static unsigned int TransferChecksum()
+{
+    unsigned int    checksum = 2166136261u;
+    unsigned        x;
+    int             i;
+    const patch_t*  patch;
+
+    checksum = ChecksumBytes(checksum, &g_num_patches, sizeof(g_num_patches));
+    for (x = 0, patch = g_patches; x < g_num_patches; x++, patch++)
+    {
+        checksum = ChecksumBytes(checksum, patch->origin, sizeof(patch->origin));
+        checksum = ChecksumBytes(checksum, &patch->area, sizeof(patch->area));
+        checksum = ChecksumBytes(checksum, &patch->emitter_range, sizeof(patch->emitter_range));
+        checksum = ChecksumBytes(checksum, &patch->emitter_skylevel, sizeof(patch->emitter_skylevel));
+        checksum = ChecksumBytes(checksum, &patch->faceNumber, sizeof(patch->faceNumber));
+        checksum = ChecksumBytes(checksum, &patch->translucent_b, sizeof(patch->translucent_b));
+        checksum = ChecksumBytes(checksum, patch->translucent_v, sizeof(patch->translucent_v));
+    }
+
+    checksum = ChecksumBytes(checksum, g_dplanes, g_numplanes * sizeof(g_dplanes[0]));
+    checksum = ChecksumBytes(checksum, g_dnodes, g_numnodes * sizeof(g_dnodes[0]));
+    checksum = ChecksumBytes(checksum, g_dleafs, g_numleafs * sizeof(g_dleafs[0]));
+    checksum = ChecksumBytes(checksum, g_dmodels, g_nummodels * sizeof(g_dmodels[0]));
+    checksum = ChecksumBytes(checksum, g_dvisdata, g_visdatasize);
+
+    for (x = 0; x < g_opaque_face_count; x++)
+    {
+        const opaqueList_t* op = &g_opaque_face_list[x];
+
+        checksum = ChecksumBytes(checksum, &op->modelnum, sizeof(op->modelnum));
+        checksum = ChecksumBytes(checksum, op->origin, sizeof(op->origin));
+        checksum = ChecksumBytes(checksum, op->transparency_scale, sizeof(op->transparency_scale));
+        checksum = ChecksumBytes(checksum, &op->transparency, sizeof(op->transparency));
+        checksum = ChecksumBytes(checksum, &op->style, sizeof(op->style));
+    }
+
+    for (i = 0; i < num_models; i++)
+    {
+        checksum = ChecksumBytes(checksum, models[i].name, strlen(models[i].name));
+        checksum = ChecksumBytes(checksum, models[i].origin, sizeof(models[i].origin));
+        checksum = ChecksumBytes(checksum, models[i].angles, sizeof(models[i].angles));
+        checksum = ChecksumBytes(checksum, models[i].scale, sizeof(models[i].scale));
+        checksum = ChecksumBytes(checksum, &models[i].body, sizeof(models[i].body));
+        checksum = ChecksumBytes(checksum, &models[i].skin, sizeof(models[i].skin));
+        checksum = ChecksumBytes(checksum, &models[i].trace_mode, sizeof(models[i].trace_mode));
+    }
+
+    if (g_texdatasize)
+    {
+        for (i = 0; i < ((dmiptexlump_t*)g_dtexdata)->nummiptex; i++)
+        {
+            // only power and scale are set
+            checksum = ChecksumBytes(checksum, g_lightingconeinfo[i], 2 * sizeof(vec_t));
+        }
+    }
+    checksum = ChecksumBytes(checksum, &g_customshadow_with_bouncelight, sizeof(g_customshadow_with_bouncelight));
+    checksum = ChecksumBytes(checksum, &g_translucentdepth, sizeof(g_translucentdepth));
+    checksum = ChecksumBytes(checksum, &g_studioshadow, sizeof(g_studioshadow));
+
+    return checksum;
+}
+
+static uint64_t AlignTransferOffset(const uint64_t offset)
+{
+    return (offset + (TRANSFERFILE_ALIGN - 1)) & ~(uint64_t)(TRANSFERFILE_ALIGN - 1);
+}
+
+static size_t   TransferDataSize(const patch_t* const patch)
+{
+    if (!patch->iData)
+    {
+        return 0;
+    }
+    if (g_rgb_transfers)
+    {
+        return patch->iData * vector_size[g_rgbtransfer_compress_type] + unused_size;
+    }
+    return patch->iData * float_size[g_transfer_compress_type] + unused_size;
+}
+
 /*
  * =============
  * writetransfers
@@ -18,158 +173,291 @@
 
 void            writetransfers(const char* const transferfile, const long total_patches)
 {
-    FILE           *file;
+    FILE*           file;
+    transferfile_header_t header;
+    transferfile_patch_t* table;
+    uint64_t        offset;
+    patch_t*        patch;
+    long            x;
+    static const byte padding[TRANSFERFILE_ALIGN + 4] = { 0 };
+
+    table = (transferfile_patch_t*)calloc(total_patches > 0? total_patches: 1, sizeof(transferfile_patch_t));
+    hlassume(table != NULL, assume_NoMemory);
+
+    offset = sizeof(header) + total_patches * sizeof(transferfile_patch_t);
+    for (x = 0, patch = g_patches; x < total_patches; x++, patch++)
+    {
+        table[x].iIndex = patch->iIndex;
+        table[x].iData = patch->iData;
+        offset = AlignTransferOffset(offset);
+        table[x].indexofs = offset;
+        offset += patch->iIndex * sizeof(transfer_index_t);
+        offset = AlignTransferOffset(offset);
+        table[x].dataofs = offset;
+        offset += TransferDataSize(patch);
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = TRANSFERFILE_MAGIC;
+    header.version = TRANSFERFILE_VERSION;
+    header.numpatches = total_patches;
+    header.rgb_transfers = g_rgb_transfers;
+    header.transfer_compress_type = g_transfer_compress_type;
+    header.rgbtransfer_compress_type = g_rgbtransfer_compress_type;
+    header.checksum = TransferChecksum();
+    header.index_size = sizeof(transfer_index_t);
+    header.filesize = offset;
 
     file = fopen(transferfile, "w+b");
-    if (file != NULL)
+    if (file == NULL)
     {
-        unsigned        amtwritten;
-        patch_t*        patch;
+        free(table);
+        Error("Failed to open incremenetal file [%s] for writing\n", transferfile);
+    }
+
+    Log("Writing transfers file [%s]\n", transferfile);
 
-        Log("Writing transfers file [%s]\n", transferfile);
+    offset = 0;
+    if (fwrite(&header, sizeof(header), 1, file) != 1
+        || fwrite(table, sizeof(transferfile_patch_t), total_patches, file) != (size_t)total_patches)
+    {
+        goto FailedWrite;
+    }
+    offset = sizeof(header) + total_patches * sizeof(transferfile_patch_t);
 
-        amtwritten = fwrite(&total_patches, sizeof(total_patches), 1, file);
-        if (amtwritten != 1)
+    for (x = 0, patch = g_patches; x < total_patches; x++, patch++)
+    {
+        size_t          size;
+
+        if (fwrite(padding, 1, table[x].indexofs - offset, file) != table[x].indexofs - offset)
         {
             goto FailedWrite;
         }
-
-        long patchcount = total_patches;
-        for (patch = g_patches; patchcount-- > 0; patch++)
+        offset = table[x].indexofs;
+        if (patch->iIndex)
         {
-            amtwritten = fwrite(&patch->iIndex, sizeof(patch->iIndex), 1, file);
-            if (amtwritten != 1)
+            if (fwrite(patch->tIndex, sizeof(transfer_index_t), patch->iIndex, file) != patch->iIndex)
             {
                 goto FailedWrite;
             }
+            offset += patch->iIndex * sizeof(transfer_index_t);
+        }
 
-            if (patch->iIndex)
-            {
-                amtwritten = fwrite(patch->tIndex, sizeof(transfer_index_t), patch->iIndex, file);
-                if (amtwritten != patch->iIndex)
-                {
-                    goto FailedWrite;
-                }
-            }
+        if (fwrite(padding, 1, table[x].dataofs - offset, file) != table[x].dataofs - offset)
+        {
+            goto FailedWrite;
+        }
+        offset = table[x].dataofs;
+        size = TransferDataSize(patch);
+        if (size)
+        {
+            const void* data = g_rgb_transfers? (const void*)patch->tRGBData: (const void*)patch->tData;
 
-            amtwritten = fwrite(&patch->iData, sizeof(patch->iData), 1, file);
-            if (amtwritten != 1)
+            if (fwrite(data, 1, size, file) != size)
             {
                 goto FailedWrite;
             }
-            if (patch->iData)
-            {
-				if(g_rgb_transfers)
-				{
-			amtwritten = fwrite(patch->tRGBData, vector_size[g_rgbtransfer_compress_type], patch->iData, file);
-				}
-				else
-				{
-			amtwritten = fwrite(patch->tData, float_size[g_transfer_compress_type], patch->iData, file);
-				}
-                if (amtwritten != patch->iData)
-                {
-                    goto FailedWrite;
-                }
-            }
+            offset += size;
         }
-
-        fclose(file);
-    }
-    else
-    {
-        Error("Failed to open incremenetal file [%s] for writing\n", transferfile);
     }
+
+    free(table);
+    fclose(file);
     return;
 
   FailedWrite:
+    free(table);
     fclose(file);
     unlink(transferfile);
     //Warning("Failed to generate incremental file [%s] (probably ran out of disk space)\n");
     Warning("Failed to generate incremental file [%s] (probably ran out of disk space)\n", transferfile); //--vluzacn
 }
 
+/*
+ * =============
+ * MapTransferFile
+ * =============
+ */
+
+static void*    MapTransferFile(const char* const transferfile, uint64_t* size)
+{
+#if defined (SYSTEM_WIN32)
+    HANDLE          file;
+    HANDLE          mapping;
+    LARGE_INTEGER   filesize;
+    void*           view;
+
+    file = CreateFile(transferfile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return NULL;
+    }
+    if (!GetFileSizeEx(file, &filesize) || filesize.QuadPart == 0
+        || (uint64_t)filesize.QuadPart != (uint64_t)(size_t)filesize.QuadPart)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+    mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+    view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL)
+    {
+        CloseHandle(mapping);
+        return NULL;
+    }
+    transfermappinghandle = mapping;
+    *size = filesize.QuadPart;
+    return view;
+#elif defined (SYSTEM_POSIX)
+    int             fd;
+    struct stat     st;
+    void*           view;
+
+    fd = open(transferfile, O_RDONLY);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size == 0 || (uint64_t)st.st_size != (uint64_t)(size_t)st.st_size)
+    {
+        close(fd);
+        return NULL;
+    }
+    view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED)
+    {
+        return NULL;
+    }
+    *size = st.st_size;
+    return view;
+#else
+    char*           buffer;
+    int             length;
+
+    if (!q_exists(transferfile))
+    {
+        return NULL;
+    }
+    length = LoadFile(transferfile, &buffer);
+    *size = length;
+    return buffer;
+#endif
+}
+
+/*
+ * =============
+ * unmaptransfers
+ *
+ * Releases the mapping made by readtransfers. Returns false if the transfers
+ * were built in memory instead, in which case the caller frees them.
+ * =============
+ */
+
+bool            unmaptransfers()
+{
+    if (!transfermapping)
+    {
+        return false;
+    }
+#if defined (SYSTEM_WIN32)
+    UnmapViewOfFile(transfermapping);
+    CloseHandle(transfermappinghandle);
+    transfermappinghandle = NULL;
+#elif defined (SYSTEM_POSIX)
+    munmap(transfermapping, (size_t)transfermappingsize);
+#else
+    free(transfermapping);
+#endif
+    transfermapping = NULL;
+    transfermappingsize = 0;
+    return true;
+}
+
 /*
  * =============
  * readtransfers
+ *
+ * Maps the transfer file and points every patch straight into it.
+ * The patches must not be freed with FreeBlock afterwards; see unmaptransfers.
  * =============
  */
 
 bool            readtransfers(const char* const transferfile, const long numpatches)
 {
-    FILE*           file;
-    long            total_patches;
+    const transferfile_header_t* header;
+    const transferfile_patch_t* table;
+    const byte*     base;
+    patch_t*        patch;
+    long            x;
 
-    file = fopen(transferfile, "rb");
-    if (file != NULL)
+    transfermapping = MapTransferFile(transferfile, &transfermappingsize);
+    if (transfermapping == NULL)
     {
-        unsigned        amtread;
-        patch_t*        patch;
+        Warning("Failed to open transfers file [%s]\n", transferfile);
+        return false;
+    }
 
-        Log("Reading transfers file [%s]\n", transferfile);
+    Log("Reading transfers file [%s]\n", transferfile);
 
-        amtread = fread(&total_patches, sizeof(total_patches), 1, file);
-        if (amtread != 1)
+    base = (const byte*)transfermapping;
+    header = (const transferfile_header_t*)base;
+    if (transfermappingsize < sizeof(transferfile_header_t)
+        || header->magic != TRANSFERFILE_MAGIC
+        || header->version != TRANSFERFILE_VERSION)
+    {
+        Log("Transfers file [%s] is from an older version, rebuilding it\n", transferfile);
+        goto FailedRead;
+    }
+    if (header->numpatches != numpatches
+        || header->rgb_transfers != (int)g_rgb_transfers
+        || header->transfer_compress_type != (int)g_transfer_compress_type
+        || header->rgbtransfer_compress_type != (int)g_rgbtransfer_compress_type
+        || header->index_size != sizeof(transfer_index_t))
+    {
+        Log("Transfers file [%s] was made with different options, rebuilding it\n", transferfile);
+        goto FailedRead;
+    }
+    if (header->checksum != TransferChecksum())
+    {
+        Log("Transfers file [%s] does not match the map, rebuilding it\n", transferfile);
+        goto FailedRead;
+    }
+    if (header->filesize != transfermappingsize
+        || transfermappingsize < sizeof(transferfile_header_t) + numpatches * sizeof(transferfile_patch_t))
+    {
+        goto FailedRead;
+    }
+
+    table = (const transferfile_patch_t*)(base + sizeof(transferfile_header_t));
+    for (x = 0, patch = g_patches; x < numpatches; x++, patch++)
+    {
+        patch->iIndex = table[x].iIndex;
+        patch->iData = table[x].iData;
+        if (table[x].indexofs + (uint64_t)patch->iIndex * sizeof(transfer_index_t) > transfermappingsize
+            || table[x].dataofs + TransferDataSize(patch) > transfermappingsize)
         {
             goto FailedRead;
         }
-        if (total_patches != numpatches)
+        patch->tIndex = patch->iIndex? (transfer_index_t*)(base + table[x].indexofs): NULL;
+        if (g_rgb_transfers)
         {
-            goto FailedRead;
+            patch->tRGBData = patch->iData? (rgb_transfer_data_t*)(base + table[x].dataofs): NULL;
         }
-
-        long patchcount = total_patches;
-        for (patch = g_patches; patchcount-- > 0; patch++)
+        else
         {
-            amtread = fread(&patch->iIndex, sizeof(patch->iIndex), 1, file);
-            if (amtread != 1)
-            {
-                goto FailedRead;
-            }
-            if (patch->iIndex)
-            {
-                patch->tIndex = (transfer_index_t*)AllocBlock(patch->iIndex * sizeof(transfer_index_t *));
-                hlassume(patch->tIndex != NULL, assume_NoMemory);
-                amtread = fread(patch->tIndex, sizeof(transfer_index_t), patch->iIndex, file);
-                if (amtread != patch->iIndex)
-                {
-                    goto FailedRead;
-                }
-            }
-
-            amtread = fread(&patch->iData, sizeof(patch->iData), 1, file);
-            if (amtread != 1)
-            {
-                goto FailedRead;
-            }
-            if (patch->iData)
-            {
-				if(g_rgb_transfers)
-				{
-                    patch->tRGBData = (rgb_transfer_data_t*)AllocBlock(patch->iData * vector_size[g_rgbtransfer_compress_type] + unused_size);
-                    hlassume(patch->tRGBData != NULL, assume_NoMemory);
-                    amtread = fread(patch->tRGBData, vector_size[g_rgbtransfer_compress_type], patch->iData, file);		    
-				}
-				else
-				{
-                    patch->tData = (transfer_data_t*)AllocBlock(patch->iData * float_size[g_transfer_compress_type] + unused_size);
-                    hlassume(patch->tData != NULL, assume_NoMemory);
-                    amtread = fread(patch->tData, float_size[g_transfer_compress_type], patch->iData, file);		    
-				}
-                if (amtread != patch->iData)
-                {
-                    goto FailedRead;
-                }
-            }
+            patch->tData = patch->iData? (transfer_data_t*)(base + table[x].dataofs): NULL;
         }
-
-        fclose(file);
-        //Warning("Finished reading transfers file [%s] %d\n", transferfile);
-        Warning("Finished reading transfers file [%s]\n", transferfile); //--vluzacn
-        return true;
     }
-    Warning("Failed to open transfers file [%s]\n", transferfile);
-    return false;
+
+    //Warning("Finished reading transfers file [%s] %d\n", transferfile);
+    Warning("Finished reading transfers file [%s]\n", transferfile); //--vluzacn
+    return true;
 
   FailedRead:
     {
@@ -178,15 +466,14 @@ bool            readtransfers(const char* const transferfile, const long numpatc
 
         for (x = 0; x < g_num_patches; x++, patch++)
         {
-            FreeBlock(patch->tData);
-            FreeBlock(patch->tIndex);
             patch->iData = 0;
             patch->iIndex = 0;
             patch->tData = NULL;
+            patch->tRGBData = NULL;
             patch->tIndex = NULL;
         }
     }
-    fclose(file);
+    unmaptransfers();
     unlink(transferfile);
     return false;
 }
@@ -20,6 +20,7 @@ static unsigned int	s_max_trans_count = 0;
 static transList_t*	s_raw_list	= NULL;
 static unsigned int	s_raw_count	= 0;
 static unsigned int	s_max_raw_count	= 0;	// Current array maximum (used for reallocs)
+static threadlock_t	s_raw_lock ("transparency raw array");
 
 static transList_t*	s_sorted_list	= NULL;	// Sorted first by p1 then p2
 static unsigned int	s_sorted_count	= 0;
@@ -74,7 +75,7 @@ static unsigned AddTransparencyToDataList(const vec3_t trans)
 void	AddTransparencyToRawArray(const unsigned p1, const unsigned p2, const vec3_t trans)
 {
 	//make thread safe
-	ThreadLock();
+	ThreadLock(s_raw_lock);
 	
 	unsigned data_index = AddTransparencyToDataList(trans);
 	
@@ -102,7 +103,7 @@ void	AddTransparencyToRawArray(const unsigned p1, const unsigned p2, const vec3_
 	s_raw_count++;
 	
 	//unlock list
-	ThreadUnlock();
+	ThreadUnlock(s_raw_lock);
 }
 
 //===============================================
@@ -281,12 +282,13 @@ typedef struct {
 static styleList_t* s_style_list = NULL;
 static unsigned int	s_style_count = 0;
 static unsigned int	s_max_style_count = 0;
+static threadlock_t	s_style_lock ("style array");
 void	AddStyleToStyleArray(const unsigned p1, const unsigned p2, const int style)
 {
 	if (style == -1)
 		return;
 	//make thread safe
-	ThreadLock();
+	ThreadLock(s_style_lock);
 	
 	//realloc if needed
 	while( s_style_count >= s_max_style_count )
@@ -312,7 +314,7 @@ void	AddStyleToStyleArray(const unsigned p1, const unsigned p2, const int style)
 	s_style_count++;
 	
 	//unlock list
-	ThreadUnlock();
+	ThreadUnlock(s_style_lock);
 }
 static int CDECL SortStyleList(const void *a, const void *b)
 {
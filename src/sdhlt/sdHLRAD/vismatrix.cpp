@@ -1,9 +1,10 @@
 #include "qrad.h"
 
+#include <atomic>
+
 ////////////////////////////
 // begin old vismat.c
 //
-#define	HALFBIT
 
 // =====================================================================================
 //
@@ -11,18 +12,132 @@
 //      Determine which patches can see each other
 //      Use the PVS to accelerate if available
 //
+//      The upper triangle of the matrix is kept in tiles of VISTILE_PATCHES x VISTILE_PATCHES
+//      bits. A tile is only allocated once one of its bits is set, and tiles with every bit
+//      set are collapsed when the matrix is built, so a lookup is two array reads and large
+//      maps don't need the N*N/16 bytes of the flat matrix.
+//
 // =====================================================================================
 
-static byte*    s_vismatrix;
+#define VISTILE_SHIFT		6
+#define VISTILE_PATCHES		(1 << VISTILE_SHIFT)
+#define VISTILE_CHUNK_SHIFT	8                                  // tiles per allocation
+
+#define VISTILE_EMPTY		0                                  // directory entries; from VISTILE_FIRST on they
+#define VISTILE_FULL		1                                  // are VISTILE_FIRST + the number of a dense tile
+#define VISTILE_FIRST		2
+
+typedef struct
+{
+	unsigned long long rows[VISTILE_PATCHES];                  // bit (p2 & 63) of row (p1 & 63)
+} vistile_t;
+
+typedef struct
+{
+	alignas (64) std::atomic<unsigned long long> lookups[3];  // in empty, full and dense tiles
+} vistilehits_t;
+
+static unsigned* s_vistiledir = NULL;                      // [s_numvistiledir], upper triangle by rows of tiles
+static size_t   s_numvistiledir;
+static unsigned s_vistilesperside;
+static std::vector<vistile_t*> s_vistilechunks;
+static std::vector<size_t> s_vistileowners;                // directory entry of each dense tile
+static unsigned s_numvistiles;
+static unsigned s_numfullvistiles;
+static vistilehits_t s_vistilehits[MAX_THREADS];
+static std::atomic<int> s_vistilehitslots (0);
+static threadlock_t s_vismatrixlock ("vismatrix");
+
+inline static size_t VisTileIndex (const unsigned p1, const unsigned p2)
+{
+	const size_t ti = p1 >> VISTILE_SHIFT;
+	const size_t tj = p2 >> VISTILE_SHIFT;
 
+	return ti * s_vistilesperside - (ti * (ti + 1)) / 2 + tj;
+}
+
+inline static vistile_t* GetVisTile (const unsigned entry)
+{
+	const unsigned  tile = entry - VISTILE_FIRST;
+
+	return &s_vistilechunks[tile >> VISTILE_CHUNK_SHIFT][tile & ((1 << VISTILE_CHUNK_SHIFT) - 1)];
+}
+
+// =====================================================================================
+//  SetVisBit
+//      p1 < p2
+// =====================================================================================
+static void     SetVisBit (const unsigned p1, const unsigned p2)
+{
+	const size_t    index = VisTileIndex (p1, p2);
 
+	ThreadLock (s_vismatrixlock); //--vluzacn
+	if (s_vistiledir[index] == VISTILE_EMPTY)
+	{
+		if (s_numvistiles == (s_vistilechunks.size () << VISTILE_CHUNK_SHIFT))
+		{
+			vistile_t*      chunk = (vistile_t*)calloc (1 << VISTILE_CHUNK_SHIFT, sizeof (vistile_t));
 
+			hlassume (chunk != NULL, assume_NoMemory);
+			s_vistilechunks.push_back (chunk);
+		}
+		s_vistileowners.push_back (index);
+		s_vistiledir[index] = VISTILE_FIRST + s_numvistiles++;
+	}
+	GetVisTile (s_vistiledir[index])->rows[p1 & (VISTILE_PATCHES - 1)] |= 1ULL << (p2 & (VISTILE_PATCHES - 1));
+	ThreadUnlock (s_vismatrixlock); //--vluzacn
+}
+
+// =====================================================================================
+//  CompactVisMatrix
+//      Collapses the tiles with every bit set and packs the others in directory order
+// =====================================================================================
+static void     CompactVisMatrix ()
+{
+	unsigned        i, j, next;
+
+	next = 0;
+	s_numfullvistiles = 0;
+	for (i = 0; i < s_numvistiles; i++)
+	{
+		const vistile_t* tile = GetVisTile (VISTILE_FIRST + i);
+
+		for (j = 0; j < VISTILE_PATCHES; j++)
+		{
+			if (tile->rows[j] != ~0ULL)
+			{
+				break;
+			}
+		}
+		if (j == VISTILE_PATCHES)
+		{
+			s_vistiledir[s_vistileowners[i]] = VISTILE_FULL;
+			s_numfullvistiles++;
+			continue;
+		}
+		// next <= i, so this never overwrites a tile that hasn't been looked at
+		if (next != i)
+		{
+			*GetVisTile (VISTILE_FIRST + next) = *tile;
+		}
+		s_vistiledir[s_vistileowners[i]] = VISTILE_FIRST + next;
+		next++;
+	}
+	s_numvistiles = next;
+	while (s_vistilechunks.size () > ((size_t)(s_numvistiles + (1 << VISTILE_CHUNK_SHIFT) - 1) >> VISTILE_CHUNK_SHIFT))
+	{
+		free (s_vistilechunks.back ());
+		s_vistilechunks.pop_back ();
+	}
+	s_vistileowners.clear ();
+	s_vistileowners.shrink_to_fit ();
+}
 
 // =====================================================================================
 //  TestPatchToFace
 //      Sets vis bits for all patches in the face
 // =====================================================================================
-static void     TestPatchToFace(const unsigned patchnum, const int facenum, const int head, const unsigned int bitpos
+static void     TestPatchToFace(const unsigned patchnum, const int facenum, const int head
 								, byte *pvs
 								)
 {
@@ -109,17 +224,13 @@ static void     TestPatchToFace(const unsigned patchnum, const int facenum, cons
                     //Log("SDF::3\n");
 
                     // patchnum can see patch m
-                    unsigned        bitset = bitpos + m;
-
                     if(g_customshadow_with_bouncelight && !VectorCompare(transparency, vec3_one))
 					// zhlt3.4: if(g_customshadow_with_bouncelight && VectorCompare(transparency, vec3_one)) . --vluzacn
                     {
 						AddTransparencyToRawArray(patchnum, m, transparency);
                     }
 
-					ThreadLock (); //--vluzacn
-                    s_vismatrix[bitset >> 3] |= 1 << (bitset & 7);
-					ThreadUnlock (); //--vluzacn
+					SetVisBit (patchnum, m);
                 }
             }
         }
@@ -144,7 +255,6 @@ static void     BuildVisLeafs(int threadnum)
     dleaf_t*        leaf;
     patch_t*        patch;
     int             head;
-    unsigned        bitpos;
     unsigned        patchnum;
 
     while (1)
@@ -185,13 +295,8 @@ static void     BuildVisLeafs(int threadnum)
 				if (patch->leafnum != i)
 					continue;
 				patchnum = patch - g_patches;
-#ifdef HALFBIT
-				bitpos = patchnum * g_num_patches - (patchnum * (patchnum + 1)) / 2;
-#else
-				bitpos = patchnum * g_num_patches;
-#endif
 				for (facenum2 = facenum + 1; facenum2 < g_numfaces; facenum2++)
-					TestPatchToFace (patchnum, facenum2, head, bitpos, pvs);
+					TestPatchToFace (patchnum, facenum2, head, pvs);
 			}
 		}
 
@@ -207,43 +312,60 @@ static void     BuildVisLeafs(int threadnum)
 // =====================================================================================
 static void     BuildVisMatrix()
 {
-    int             c;
-
-#ifdef HALFBIT
-    c = ((g_num_patches + 1) * (g_num_patches + 1)) / 16;
-	c += 1; //--vluzacn
-#else
-    c = g_num_patches * ((g_num_patches + 7) / 8);
-#endif
-
-    Log("%-20s: %5.1f megs\n", "visibility matrix", c / (1024 * 1024.0));
-
-    s_vismatrix = (byte*)AllocBlock(c);
+    int             i;
 
-    if (!s_vismatrix)
+    s_vistilesperside = (g_num_patches + VISTILE_PATCHES - 1) >> VISTILE_SHIFT;
+    s_numvistiledir = ((size_t)s_vistilesperside * (s_vistilesperside + 1)) / 2;
+    s_vistiledir = (unsigned*)AllocBlock(s_numvistiledir * sizeof(unsigned));
+    hlassume(s_vistiledir != NULL, assume_NoMemory);
+    s_numvistiles = 0;
+    for (i = 0; i < MAX_THREADS; i++)
     {
-        Log("Failed to allocate s_vismatrix");
-        hlassume(s_vismatrix != NULL, assume_NoMemory);
+        s_vistilehits[i].lookups[VISTILE_EMPTY] = 0;
+        s_vistilehits[i].lookups[VISTILE_FULL] = 0;
+        s_vistilehits[i].lookups[VISTILE_FIRST] = 0;
     }
 
     NamedRunThreadsOn(g_dmodels[0].visleafs, g_estimate, BuildVisLeafs);
+
+    CompactVisMatrix();
+    Log("%-20s: %5.1f megs (%u dense and %u full of %.0f tiles; a flat matrix would be %.1f megs)\n", "visibility matrix",
+        (s_numvistiledir * sizeof(unsigned) + s_vistilechunks.size() * ((size_t)sizeof(vistile_t) << VISTILE_CHUNK_SHIFT)) / (1024 * 1024.0),
+        s_numvistiles, s_numfullvistiles, (double)s_numvistiledir,
+        ((double)(g_num_patches + 1) * (g_num_patches + 1)) / 16 / (1024 * 1024.0));
 }
 
 static void     FreeVisMatrix()
 {
-    if (s_vismatrix)
+    unsigned long long lookups[3] = {0, 0, 0};
+    size_t          i;
+
+    for (i = 0; i < MAX_THREADS; i++)
     {
-        if (FreeBlock(s_vismatrix))
+        lookups[0] += s_vistilehits[i].lookups[VISTILE_EMPTY];
+        lookups[1] += s_vistilehits[i].lookups[VISTILE_FULL];
+        lookups[2] += s_vistilehits[i].lookups[VISTILE_FIRST];
+    }
+    Log("%-20s: %llu in empty tiles, %llu in full tiles, %llu in dense tiles\n", "vismatrix lookups",
+        lookups[0], lookups[1], lookups[2]);
+
+    if (s_vistiledir)
+    {
+        if (FreeBlock(s_vistiledir))
         {
-            s_vismatrix = NULL;
+            s_vistiledir = NULL;
         }
         else
         {
-            Warning("Unable to free s_vismatrix");
+            Warning("Unable to free s_vistiledir");
         }
     }
-
-
+    for (i = 0; i < s_vistilechunks.size(); i++)
+    {
+        free(s_vistilechunks[i]);
+    }
+    s_vistilechunks.clear();
+    s_numvistiles = 0;
 }
 
 // =====================================================================================
@@ -254,7 +376,9 @@ static bool     CheckVisBitVismatrix(unsigned p1, unsigned p2
 									 , unsigned int &next_index
 									 )
 {
-    unsigned        bitpos;
+    static thread_local int hitslot = -1;
+    unsigned        entry;
+    bool            visible;
 
     const unsigned a = p1;
     const unsigned b = p2;
@@ -276,13 +400,23 @@ static bool     CheckVisBitVismatrix(unsigned p1, unsigned p2
         Warning("in CheckVisBit(), p2 > num_patches");
     }
 
-#ifdef HALFBIT
-    bitpos = p1 * g_num_patches - (p1 * (p1 + 1)) / 2 + p2;
-#else
-    bitpos = p1 * g_num_patches + p2;
-#endif
+    if (hitslot == -1)
+    {
+        hitslot = s_vistilehitslots++ % MAX_THREADS;
+    }
+    entry = s_vistiledir[VisTileIndex(p1, p2)];
+    if (entry >= VISTILE_FIRST)
+    {
+        s_vistilehits[hitslot].lookups[VISTILE_FIRST].fetch_add(1, std::memory_order_relaxed);
+        visible = (GetVisTile(entry)->rows[p1 & (VISTILE_PATCHES - 1)] >> (p2 & (VISTILE_PATCHES - 1))) & 1;
+    }
+    else
+    {
+        s_vistilehits[hitslot].lookups[entry].fetch_add(1, std::memory_order_relaxed);
+        visible = entry == VISTILE_FULL;
+    }
 
-    if (s_vismatrix[bitpos >> 3] & (1 << (bitpos & 7)))
+    if (visible)
     {
     	if(g_customshadow_with_bouncelight)
     	{
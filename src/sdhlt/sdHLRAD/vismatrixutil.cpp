@@ -5,6 +5,7 @@ funcCheckVisBit g_CheckVisBit = NULL;
 size_t          g_total_transfer = 0;
 size_t          g_transfer_index_bytes = 0;
 size_t          g_transfer_data_bytes = 0;
+static threadlock_t g_transfercountlock("transfer counts");
 
 #define COMPRESSED_TRANSFERS
 //#undef  COMPRESSED_TRANSFERS
@@ -117,9 +118,9 @@ static transfer_index_t* CompressTransferIndicies(transfer_raw_index_t* tRaw, co
 		Error ("CompressTransferIndicies: internal error");
 	}
 
-	ThreadLock();
+	ThreadLock(g_transfercountlock);
 	g_transfer_index_bytes += sizeof(transfer_index_t) * compressed_count;
-	ThreadUnlock();
+	ThreadUnlock(g_transfercountlock);
 
 	return CompressedArray;
 }
@@ -152,9 +153,9 @@ static transfer_index_t* CompressTransferIndicies(const transfer_raw_index_t* tR
 
     *iSize = compressed_count;
 
-	ThreadLock();
+	ThreadLock(g_transfercountlock);
 	g_transfer_index_bytes += sizeof(transfer_index_t) * size;
-	ThreadUnlock();
+	ThreadUnlock(g_transfercountlock);
 
 	return CompressedArray;
 }
@@ -384,9 +385,9 @@ void            MakeScales(const int threadnum)
             hlassume(patch->tData != NULL, assume_NoMemory);
             hlassume(patch->tIndex != NULL, assume_NoMemory);
 
-            ThreadLock();
+            ThreadLock(g_transfercountlock);
             g_transfer_data_bytes += data_size;
-            ThreadUnlock();
+            ThreadUnlock(g_transfercountlock);
 
 			total = 1 / Q_PI;
             {
@@ -407,9 +408,9 @@ void            MakeScales(const int threadnum)
     FreeBlock(tIndex_All);
     FreeBlock(tData_All);
 
-    ThreadLock();
+    ThreadLock(g_transfercountlock);
     g_total_transfer += count;
-    ThreadUnlock();
+    ThreadUnlock(g_transfercountlock);
 }
 
 #ifdef SYSTEM_WIN32
@@ -657,9 +658,9 @@ void            MakeRGBScales(const int threadnum)
             hlassume(patch->tRGBData != NULL, assume_NoMemory);
             hlassume(patch->tIndex != NULL, assume_NoMemory);
 
-            ThreadLock();
+            ThreadLock(g_transfercountlock);
             g_transfer_data_bytes += data_size;
-            ThreadUnlock();
+            ThreadUnlock(g_transfercountlock);
 
 			total = 1 / Q_PI;
             {
@@ -680,9 +681,9 @@ void            MakeRGBScales(const int threadnum)
     FreeBlock(tIndex_All);
     FreeBlock(tRGBData_All);
 
-    ThreadLock();
+    ThreadLock(g_transfercountlock);
     g_total_transfer += count;
-    ThreadUnlock();
+    ThreadUnlock(g_transfercountlock);
 }
 
 #ifdef SYSTEM_WIN32
@@ -1,5 +1,7 @@
 #include "vis.h"
 
+#include <atomic>
+
 // =====================================================================================
 //  CheckStack
 // =====================================================================================
@@ -366,6 +368,52 @@ inline static winding_t* ClipToSeperators(
     return target;
 }
 
+// =====================================================================================
+//  Bit stacks
+//      Every recursion level of RecursiveLeafFlow needs its own mightsee bit string. Instead of
+//      a MAX_MAP_LEAFS sized array in each stack frame, every thread keeps a list of g_bitbytes
+//      sized levels that only grows when a flow goes deeper than any before it on that thread.
+// =====================================================================================
+static bitstack_t g_bitstacks[MAX_THREADS];
+
+inline static byte* GetStackBits(bitstack_t* const bitstack, const unsigned depth)
+{
+    while (bitstack->levels.size() <= depth)
+    {
+        byte* bits = (byte*)malloc(g_bitbytes);
+        hlassume(bits != NULL, assume_NoMemory);
+        bitstack->levels.push_back(bits);
+    }
+    return bitstack->levels[depth];
+}
+
+size_t          GetStackBitsSize()
+{
+    size_t          size = 0;
+    int             i;
+
+    for (i = 0; i < MAX_THREADS; i++)
+    {
+        size += g_bitstacks[i].levels.size() * g_bitbytes;
+    }
+    return size;
+}
+
+void            FreeStackBits()
+{
+    int             i;
+
+    for (i = 0; i < MAX_THREADS; i++)
+    {
+        for (byte* bits : g_bitstacks[i].levels)
+        {
+            free(bits);
+        }
+        g_bitstacks[i].levels.clear();
+        g_bitstacks[i].levels.shrink_to_fit();
+    }
+}
+
 // =====================================================================================
 //  RecursiveLeafFlow
 //      Flood fill through the leafs
@@ -398,6 +446,8 @@ inline static void     RecursiveLeafFlow(const int leafnum, const threaddata_t*
     stack.next = NULL;
 #endif
     stack.head = prevstack->head;
+    stack.depth = prevstack->depth + 1;
+    stack.mightsee = GetStackBits(thread->bitstack, stack.depth);
     stack.leaf = leaf;
     stack.portal = NULL;
 #ifdef RVIS_LEVEL_2
@@ -439,7 +489,11 @@ inline static void     RecursiveLeafFlow(const int leafnum, const threaddata_t*
         {
             long* test;
 
+#ifndef ZHLT_NETVIS
+            if (g_deterministic ? PortalFlowedBefore(thread->base, p) : p->status == stat_done)
+#else
             if (p->status == stat_done)
+#endif
             {
                 test = (long*)p->visbits;
             }
@@ -593,7 +647,7 @@ inline static void     RecursiveLeafFlow(const int leafnum, const threaddata_t*
 // =====================================================================================
 //  PortalFlow
 // =====================================================================================
-void            PortalFlow(portal_t* p)
+void            PortalFlow(portal_t* p, int threadnum)
 {
     threaddata_t    data;
     unsigned        i;
@@ -605,12 +659,14 @@ void            PortalFlow(portal_t* p)
 
     memset(&data, 0, sizeof(data));
     data.leafvis = p->visbits;
+    data.bitstack = &g_bitstacks[threadnum];
     data.base = p;
 
     data.pstack_head.head = &data.pstack_head;
     data.pstack_head.portal = p;
     data.pstack_head.source = p->winding;
     data.pstack_head.portalplane = &p->plane;
+    data.pstack_head.mightsee = GetStackBits(data.bitstack, 0);
     for (i = 0; i < g_bitlongs; i++)
     {
         ((long*)data.pstack_head.mightsee)[i] = ((long*)p->mightsee)[i];
@@ -627,45 +683,140 @@ void            PortalFlow(portal_t* p)
 }
 
 // =====================================================================================
-//  SimpleFlood
-//      This is a rough first-order aproximation that is used to trivially reject some
-//      of the final calculations.
+//  Leaf portal lists
+//      The portals leading out of each leaf, as indices into g_portals in one flat array,
+//      so the flood doesn't have to go through the (large) leaf_t of every leaf it reaches.
 // =====================================================================================
-static void     SimpleFlood(byte* const srcmightsee, const int leafnum, byte* const portalsee, unsigned int* const c_leafsee)
+static std::vector<int> g_leafportalstart;                 // [g_portalleafs + 1]
+static std::vector<int> g_leafportals;
+
+void            BuildLeafPortalLists()
 {
-    unsigned        i;
-    leaf_t*         leaf;
-    portal_t*       p;
+    unsigned        i, j;
 
+    g_leafportalstart.resize(g_portalleafs + 1);
+    g_leafportals.clear();
+    g_leafportals.reserve(g_numportals * 2);
+    for (i = 0; i < g_portalleafs; i++)
     {
-        const unsigned  offset = leafnum >> 3;
-        const unsigned  bit = (1 << (leafnum & 7));
-    
-        if (srcmightsee[offset] & bit)
+        g_leafportalstart[i] = g_leafportals.size();
+        for (j = 0; j < g_leafs[i].numportals; j++)
         {
-            return;
+            g_leafportals.push_back(g_leafs[i].portals[j] - g_portals);
         }
-        else
+    }
+    g_leafportalstart[g_portalleafs] = g_leafportals.size();
+}
+
+void            FreeLeafPortalLists()
+{
+    g_leafportalstart.clear();
+    g_leafportalstart.shrink_to_fit();
+    g_leafportals.clear();
+    g_leafportals.shrink_to_fit();
+}
+
+// =====================================================================================
+//  PortalSeesPortal
+//      True if tp has a point in front of p and p has a point behind tp
+// =====================================================================================
+inline static bool PortalSeesPortal(const portal_t* const p, const portal_t* const tp)
+{
+    const winding_t* w;
+    float           d;
+    int             k;
+
+    w = tp->winding;
+    for (k = 0; k < w->numpoints; k++)
+    {
+        d = DotProduct(w->points[k], p->plane.normal) - p->plane.dist;
+        if (d > ON_EPSILON)
         {
-            srcmightsee[offset] |= bit;
+            break;
         }
     }
+    if (k == w->numpoints)
+    {
+        return false;                                      // no points on front
+    }
 
-    (*c_leafsee)++;
-    leaf = &g_leafs[leafnum];
+    w = p->winding;
+    for (k = 0; k < w->numpoints; k++)
+    {
+        d = DotProduct(w->points[k], tp->plane.normal) - tp->plane.dist;
+        if (d < -ON_EPSILON)
+        {
+            break;
+        }
+    }
+    if (k == w->numpoints)
+    {
+        return false;                                      // no points on front
+    }
 
-    for (i = 0; i < leaf->numportals; i++)
+    return true;
+}
+
+// =====================================================================================
+//  SimpleFlood
+//      This is a rough first-order aproximation that is used to trivially reject some
+//      of the final calculations.
+//      A portal is only tested when the flood reaches its leaf and the leaf behind it
+//      hasn't been reached yet. What gets reached doesn't depend on the order, so this
+//      gives the same mightsee as testing every pair of portals up front.
+// =====================================================================================
+static void     SimpleFlood(portal_t* const p, std::vector<int>& stack)
+{
+    byte* const     srcmightsee = p->mightsee;
+    int             leafnum;
+    int             i;
+
+#if ZHLT_ZONES
+    const UINT32    zone = p->zone;
+#endif
+
+    stack.clear();
+    stack.push_back(p->leaf);
+    srcmightsee[p->leaf >> 3] |= 1 << (p->leaf & 7);
+    p->nummightsee = 1;
+
+    while (!stack.empty())
     {
-        p = leaf->portals[i];
-        if (!portalsee[p - g_portals])
+        leafnum = stack.back();
+        stack.pop_back();
+
+        for (i = g_leafportalstart[leafnum]; i < g_leafportalstart[leafnum + 1]; i++)
         {
-            continue;
+            const portal_t* const tp = &g_portals[g_leafportals[i]];
+            const unsigned  offset = tp->leaf >> 3;
+            const unsigned  bit = 1 << (tp->leaf & 7);
+
+            if (srcmightsee[offset] & bit)
+            {
+                continue;
+            }
+            if (tp == p)
+            {
+                continue;
+            }
+#if ZHLT_ZONES
+            if (g_Zones->check(zone, tp->zone))
+            {
+                continue;
+            }
+#endif
+            if (!PortalSeesPortal(p, tp))
+            {
+                continue;
+            }
+
+            srcmightsee[offset] |= bit;
+            p->nummightsee++;
+            stack.push_back(tp->leaf);
         }
-        SimpleFlood(srcmightsee, p->leaf, portalsee, c_leafsee);
     }
 }
 
-#define PORTALSEE_SIZE (MAX_PORTALS*2)
 #ifdef SYSTEM_WIN32
 #pragma warning(push)
 #pragma warning(disable: 4100)                             // unreferenced formal parameter
@@ -677,13 +828,9 @@ static void     SimpleFlood(byte* const srcmightsee, const int leafnum, byte* co
 // =====================================================================================
 void            BasePortalVis(int unused)
 {
-    int             i, j, k;
-    portal_t*       tp;
+    int             i;
     portal_t*       p;
-    float           d;
-    winding_t*      w;
-    byte            portalsee[PORTALSEE_SIZE];
-    const int       portalsize = (g_numportals * 2);
+    std::vector<int> stack;
 
 #ifdef ZHLT_NETVIS
     {
@@ -696,62 +843,14 @@ void            BasePortalVis(int unused)
             break;
 #endif
         p = g_portals + i;
-
-        p->mightsee = (byte*)calloc(1, g_bitbytes);
-
-        memset(portalsee, 0, portalsize);
-
-#if ZHLT_ZONES
-        UINT32 zone = p->zone;
-#endif
-
-        for (j = 0, tp = g_portals; j < portalsize; j++, tp++)
+        if (p->mightsee)
         {
-            if (j == i)
-            {
-                continue;
-            }
-#if ZHLT_ZONES
-            if (g_Zones->check(zone, tp->zone))
-            {
-                continue;
-            }
-#endif
-
-            w = tp->winding;
-            for (k = 0; k < w->numpoints; k++)
-            {
-                d = DotProduct(w->points[k], p->plane.normal) - p->plane.dist;
-                if (d > ON_EPSILON)
-                {
-                    break;
-                }
-            }
-            if (k == w->numpoints)
-            {
-                continue;                                  // no points on front
-            }
-
-
-            w = p->winding;
-            for (k = 0; k < w->numpoints; k++)
-            {
-                d = DotProduct(w->points[k], tp->plane.normal) - tp->plane.dist;
-                if (d < -ON_EPSILON)
-                {
-                    break;
-                }
-            }
-            if (k == w->numpoints)
-            {
-                continue;                                  // no points on front
-            }
-
-
-            portalsee[j] = 1;
+            continue;                                      // reused from the last run by -incremental
         }
 
-        SimpleFlood(p->mightsee, p->leaf, portalsee, &p->nummightsee);
+        p->mightsee = (byte*)calloc(1, g_bitbytes);
+
+        SimpleFlood(p, stack);
         Verbose("portal:%4i  nummightsee:%4i \n", i, p->nummightsee);
     }
 }
@@ -1001,19 +1100,171 @@ vec_t WindingDist (const winding_t *w[2])
 	return (sqrt (minsqrdist));
 }
 // AJM: MVD
+static threadlock_t g_maxdistvislock("MaxDistVis visbits");
+
+// =====================================================================================
+//  MaxDistVis bounds
+//      What MaxDistVis needs of every leaf, worked out once instead of for every pair: the
+//      center and radius of its portal points for the rough check, the box around them,
+//      the box of each portal, and one row per leaf of the leafs it sees or is seen by.
+//      The boxes only decide a pair when they are clear of g_maxdistance by
+//      MAXDIST_BOUNDS_SLACK, so every pair gets the same answer as the rough and exact checks.
+// =====================================================================================
+#define MAXDIST_BOUNDS_SLACK 1.0
+
+typedef struct
+{
+	int count;                                             // portal points, 0 if the leaf has no portals
+	vec3_t center;
+	vec_t radius;
+	vec3_t mins, maxs;
+}
+maxdistleaf_t;
+
+static maxdistleaf_t *g_maxdistleafs = NULL;               // [g_portalleafs]
+static vec3_t (*g_maxdistportalbounds)[2] = NULL;          // [g_numportals * 2], mins and maxs
+static byte *g_maxdistvisible = NULL;                      // [g_portalleafs][g_bitbytes]
+static std::atomic<long long> g_maxdistpairs[3];           // decided by the boxes, the spheres, the windings
+
+static void WindingBounds (const winding_t *w, vec3_t mins, vec3_t maxs)
+{
+	for (int b = 0; b < w->numpoints; b++)
+	{
+		for (int x = 0; x < 3; x++)
+		{
+			mins[x] = qmin (mins[x], w->points[b][x]);
+			maxs[x] = qmax (maxs[x], w->points[b][x]);
+		}
+	}
+}
+
+// no point in the first box is closer to the second than this
+static vec_t BoundsMinDist (const vec3_t mins1, const vec3_t maxs1, const vec3_t mins2, const vec3_t maxs2)
+{
+	vec_t sqrdist = 0;
+	for (int x = 0; x < 3; x++)
+	{
+		vec_t gap = qmax (mins2[x] - maxs1[x], mins1[x] - maxs2[x]);
+		if (gap > 0)
+		{
+			sqrdist += gap * gap;
+		}
+	}
+	return sqrt (sqrdist);
+}
+
+// no point in the first box is further from the second than this
+static vec_t BoundsMaxDist (const vec3_t mins1, const vec3_t maxs1, const vec3_t mins2, const vec3_t maxs2)
+{
+	vec_t sqrdist = 0;
+	for (int x = 0; x < 3; x++)
+	{
+		vec_t span = qmax (maxs2[x] - mins1[x], maxs1[x] - mins2[x]);
+		sqrdist += span * span;
+	}
+	return sqrt (sqrdist);
+}
+
+void BuildMaxDistBounds ()
+{
+	int i, j, a, b;
+
+	g_maxdistleafs = (maxdistleaf_t *)calloc (g_portalleafs, sizeof (maxdistleaf_t));
+	g_maxdistportalbounds = (vec3_t (*)[2])malloc (g_numportals * 2 * sizeof (vec3_t[2]));
+	g_maxdistvisible = (byte *)calloc (g_portalleafs, g_bitbytes);
+	hlassume (g_maxdistleafs && g_maxdistportalbounds && g_maxdistvisible, assume_NoMemory);
+	for (a = 0; a < 3; a++)
+	{
+		g_maxdistpairs[a] = 0;
+	}
+
+	for (i = 0; i < g_numportals * 2; i++)
+	{
+		VectorFill (g_maxdistportalbounds[i][0], 999999999.999);
+		VectorFill (g_maxdistportalbounds[i][1], -999999999.999);
+		WindingBounds (g_portals[i].winding, g_maxdistportalbounds[i][0], g_maxdistportalbounds[i][1]);
+	}
+
+	for (i = 0; i < g_portalleafs; i++)
+	{
+		const leaf_t *leaf = &g_leafs[i];
+		maxdistleaf_t *md = &g_maxdistleafs[i];
+		const winding_t *w;
+		vec3_t v;
+		vec_t dist;
+
+		VectorClear (md->center);
+		VectorFill (md->mins, 999999999.999);
+		VectorFill (md->maxs, -999999999.999);
+		for (a = 0; a < leaf->numportals; a++)
+		{
+			w = leaf->portals[a]->winding;
+			for (b = 0; b < w->numpoints; b++)
+			{
+				VectorAdd (w->points[b], md->center, md->center);
+				md->count++;
+			}
+			WindingBounds (w, md->mins, md->maxs);
+		}
+		if (md->count)
+		{
+			VectorScale (md->center, 1.0 / (vec_t)md->count, md->center);
+			md->radius = 0;
+			for (a = 0; a < leaf->numportals; a++)
+			{
+				w = leaf->portals[a]->winding;
+				for (b = 0; b < w->numpoints; b++)
+				{
+					VectorSubtract (w->points[b], md->center, v);
+					dist = DotProduct (v, v);
+					md->radius = qmax (md->radius, dist);
+				}
+			}
+			md->radius = sqrt (md->radius);
+		}
+
+		// visible both ways, so a pair only has to look at its own row
+		for (a = 0; a < leaf->numportals; a++)
+		{
+			const byte *visbits = leaf->portals[a]->visbits;
+			for (j = 0; j < g_portalleafs; j++)
+			{
+				if (!visbits[j >> 3])
+				{
+					j |= 7;
+				}
+				else if (visbits[j >> 3] & (1 << (j & 7)))
+				{
+					g_maxdistvisible[i * g_bitbytes + (j >> 3)] |= 1 << (j & 7);
+					g_maxdistvisible[j * g_bitbytes + (i >> 3)] |= 1 << (i & 7);
+				}
+			}
+		}
+	}
+}
+
+void FreeMaxDistBounds ()
+{
+	Verbose ("MaxDistVis: %lld leaf pairs decided by bounding boxes, %lld by bounding spheres, %lld by portal windings\n",
+		(long long)g_maxdistpairs[0], (long long)g_maxdistpairs[1], (long long)g_maxdistpairs[2]);
+	free (g_maxdistleafs);
+	g_maxdistleafs = NULL;
+	free (g_maxdistportalbounds);
+	g_maxdistportalbounds = NULL;
+	free (g_maxdistvisible);
+	g_maxdistvisible = NULL;
+}
+
 // =====================================================================================
 //  MaxDistVis
+//      Needs BuildMaxDistBounds. The visbits of a pair of leafs are only changed by that
+//      pair, so the visible rows taken before the threads started stay right.
 // =====================================================================================
 void	MaxDistVis(int unused)
 {
 	int i, j, k, m;
-	int a, b, c, d;
 	leaf_t	*l;
 	leaf_t	*tl;
-	plane_t	*boundary = NULL;
-	vec3_t delta;
-
-	float new_dist;
 
 	unsigned offset_l;
 	unsigned bit_l;
@@ -1028,120 +1279,89 @@ void	MaxDistVis(int unused)
 			break;
 
 		l = &g_leafs[i];
+		const maxdistleaf_t *md = &g_maxdistleafs[i];
+		const byte *visible = &g_maxdistvisible[i * g_bitbytes];
+		long long pairs[3] = {0, 0, 0};
 
-		for(j = i + 1, tl = g_leafs + j; j < g_portalleafs; j++, tl++)
-		{
-
-			offset_l = i >> 3;
-			bit_l = (1 << (i & 7));
+		offset_l = i >> 3;
+		bit_l = (1 << (i & 7));
 
+		for(j = i + 1; j < g_portalleafs; j++)
+		{
 			offset_tl = j >> 3;
 			bit_tl = (1 << (j & 7));
 
+			if (!visible[offset_tl])
 			{
-				bool visible = false;
-				for (k = 0; k < l->numportals; k++)
-				{
-					if (l->portals[k]->visbits[offset_tl] & bit_tl)
-					{
-						visible = true;
-					}
-				}
-				for (m = 0; m < tl->numportals; m++)
-				{	
-					if (tl->portals[m]->visbits[offset_l] & bit_l)
-					{
-						visible = true;
-					}
-				}
-				if (!visible)
-				{
-					goto NoWork;
-				}
+				j |= 7;
+				continue;
 			}
-			
+			if (!(visible[offset_tl] & bit_tl))
+			{
+				continue;
+			}
+			tl = &g_leafs[j];
+			const maxdistleaf_t *tmd = &g_maxdistleafs[j];
+
+			if (!md->count || !tmd->count)
+			{
+				goto Work;
+			}
+
+			// box check
+			if (BoundsMinDist (md->mins, md->maxs, tmd->mins, tmd->maxs) >= g_maxdistance - ON_EPSILON + MAXDIST_BOUNDS_SLACK)
+			{
+				pairs[0]++;
+				goto Work;
+			}
+			if (BoundsMaxDist (md->mins, md->maxs, tmd->mins, tmd->maxs) < g_maxdistance - ON_EPSILON - MAXDIST_BOUNDS_SLACK)
+			{
+				pairs[0]++;
+				continue;
+			}
+
 			// rough check
 			{
 				vec3_t v;
 				vec_t dist;
-				const winding_t *w;
-				const leaf_t *leaf[2] = {l, tl};
-				vec3_t center[2];
-				vec_t radius[2];
-				int count[2];
-				for (int side = 0; side < 2; side++)
-				{
-					count[side] = 0;
-					VectorClear (center[side]);
-					for (a = 0; a < leaf[side]->numportals; a++)
-					{
-						w = leaf[side]->portals[a]->winding;
-						for (b = 0; b < w->numpoints; b++)
-						{
-							VectorAdd (w->points[b], center[side], center[side]);
-							count[side]++;
-						}
-					}
-				}
-				if (!count[0] && !count[1])
-				{
-					goto Work;
-				}
-				for (int side = 0; side < 2; side++)
-				{
-					VectorScale (center[side], 1.0 / (vec_t)count[side], center[side]);
-					radius[side] = 0;
-					for (a = 0; a < leaf[side]->numportals; a++)
-					{
-						w = leaf[side]->portals[a]->winding;
-						for (b = 0; b < w->numpoints; b++)
-						{
-							VectorSubtract (w->points[b], center[side], v);
-							dist = DotProduct (v, v);
-							radius[side] = qmax (radius[side], dist);
-						}
-					}
-					radius[side] = sqrt (radius[side]);
-				}
-				VectorSubtract (center[0], center[1], v);
+				VectorSubtract (md->center, tmd->center, v);
 				dist = VectorLength (v);
-				if (qmax (dist - radius[0] - radius[1], 0) >= g_maxdistance - ON_EPSILON)
+				if (qmax (dist - md->radius - tmd->radius, 0) >= g_maxdistance - ON_EPSILON)
 				{
+					pairs[1]++;
 					goto Work;
 				}
-				if (dist + radius[0] + radius[1] < g_maxdistance - ON_EPSILON)
+				if (dist + md->radius + tmd->radius < g_maxdistance - ON_EPSILON)
 				{
-					goto NoWork;
+					pairs[1]++;
+					continue;
 				}
 			}
 
-			// exact check
+			// exact check, which can stop at the first pair of portals in range
+			pairs[2]++;
+			for (k = 0; k < l->numportals; k++)
 			{
-				vec_t mindist = 9999999999;
-				vec_t dist;
-				for (k = 0; k < l->numportals; k++)
+				const vec3_t *bounds = g_maxdistportalbounds[l->portals[k] - g_portals];
+				for (m = 0; m < tl->numportals; m++)
 				{
-					for (m = 0; m < tl->numportals; m++)
+					const vec3_t *tbounds = g_maxdistportalbounds[tl->portals[m] - g_portals];
+					if (BoundsMinDist (bounds[0], bounds[1], tbounds[0], tbounds[1]) >= g_maxdistance - ON_EPSILON + MAXDIST_BOUNDS_SLACK)
 					{
-						const winding_t *w[2];
-						w[0] = l->portals[k]->winding;
-						w[1] = tl->portals[m]->winding;
-						dist = WindingDist (w);
-						mindist = qmin (dist, mindist);
+						continue;
+					}
+					const winding_t *w[2];
+					w[0] = l->portals[k]->winding;
+					w[1] = tl->portals[m]->winding;
+					if (WindingDist (w) < g_maxdistance - ON_EPSILON)
+					{
+						goto NoWork;
 					}
-				}
-				if (mindist >= g_maxdistance - ON_EPSILON)
-				{
-					goto Work;
-				}
-				else
-				{
-					goto NoWork;
 				}
 			}
 
 Work:
-			ThreadLock ();
+			ThreadLock (g_maxdistvislock);
 			for (k = 0; k < l->numportals; k++)
 			{
 				l->portals[k]->visbits[offset_tl] &= ~bit_tl;
@@ -1150,16 +1370,17 @@ Work:
 			{
 				tl->portals[m]->visbits[offset_l] &= ~bit_l;
 			}
-			ThreadUnlock ();
+			ThreadUnlock (g_maxdistvislock);
 			
 NoWork:
 			continue;	// Hack to keep label from causing compile error
 		}
-	}
 
-	// Release potential memory
-	if(boundary)
-		delete [] boundary;
+		for (k = 0; k < 3; k++)
+		{
+			g_maxdistpairs[k] += pairs[k];
+		}
+	}
 }
 
 #ifdef SYSTEM_WIN32
@@ -21,7 +21,6 @@
 #endif
 
 #ifdef SYSTEM_POSIX
-#include <algorithm>
 #define CLAMP(x, min, max) std::clamp(x, min, max)
 #endif
 
@@ -29,6 +28,11 @@
 #include "zlib.h"
 #endif
 #include <string>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <condition_variable>
+#include <mutex>
 #include <fstream> //FixPrt
 #include <vector> //FixPrt
 #include <iostream> //FixPrt
@@ -64,6 +68,7 @@ unsigned        g_bitlongs;
 
 bool            g_fastvis = DEFAULT_FASTVIS;
 bool            g_fullvis = DEFAULT_FULLVIS;
+bool            g_incremental = DEFAULT_INCREMENTAL;
 bool            g_nofixprt = DEFAULT_NOFIXPRT;                   //seedee
 bool            g_estimate = DEFAULT_ESTIMATE;
 bool            g_chart = DEFAULT_CHART;
@@ -247,6 +252,8 @@ static winding_t* NewWinding(const int points)
 // NETVIS
 #ifdef ZHLT_NETVIS
 
+static threadlock_t g_portalselectlock("portal selection");
+
 // =====================================================================================
 //  GetPortalPtr
 //      converts a portal index to a pointer
@@ -276,7 +283,7 @@ int             GetNextPortalIndex()
     portal_t*       tp;
     int             min;
 
-    ThreadLock();
+    ThreadLock(g_portalselectlock);
 
     min = 99999;
     p = NULL;
@@ -300,7 +307,7 @@ int             GetNextPortalIndex()
         best = NO_PORTAL_INDEX;                            // hack to return NO_PORTAL_INDEX to the queue'ing code
     }
 
-    ThreadUnlock();
+    ThreadUnlock(g_portalselectlock);
 
     return best;
 }
@@ -330,11 +337,729 @@ static int      AllPortalsDone()
 // NETVIS
 ///////////
 
+#ifndef ZHLT_NETVIS
+static portal_t** sortedportals = NULL;                    // [g_numportals * 2], least complex first
+static double   portalwait[MAX_THREADS];                   // time each thread spent waiting for work
+static int      portalcount[MAX_THREADS];                  // portals flowed by each thread
+
+// =====================================================================================
+//  Retired mightsee
+//      Once a portal is done, flows read its visbits instead of its mightsee. A flow that began
+//      before the portal finished may still be looking at the mightsee though, so the bit string
+//      is only freed after every thread that was busy at the time has started a new flow.
+// =====================================================================================
+typedef struct
+{
+    portal_t*       portal;
+    unsigned        sequence;                              // flows started before it was retired
+}
+retiredportal_t;
+
+static std::deque<retiredportal_t> retiredportals;
+static unsigned flowsequence;
+static unsigned flowstart[MAX_THREADS];                    // sequence of the thread's current flow, 0 when idle
+static size_t   portalbitbytes;                            // mightsee and visbits currently allocated
+static size_t   peakportalbitbytes;
+static threadlock_t g_portalflowlock("portal flow");        // all of the above
+
+static void     FreeRetiredPortals(const bool all)
+{
+    unsigned        oldest = UINT_MAX;
+    int             i;
+
+    for (i = 0; i < g_numthreads; i++)
+    {
+        if (flowstart[i] && flowstart[i] < oldest)
+        {
+            oldest = flowstart[i];
+        }
+    }
+    while (!retiredportals.empty() && (all || retiredportals.front().sequence < oldest))
+    {
+        portal_t*       p = retiredportals.front().portal;
+
+        free(p->mightsee);
+        p->mightsee = NULL;
+        portalbitbytes -= g_bitbytes;
+        retiredportals.pop_front();
+    }
+}
+
+static void     BeginPortalFlow(const int threadnum)
+{
+    ThreadLock(g_portalflowlock);
+    flowstart[threadnum] = ++flowsequence;
+    portalbitbytes += g_bitbytes;                          // visbits
+    peakportalbitbytes = qmax(peakportalbitbytes, portalbitbytes);
+    ThreadUnlock(g_portalflowlock);
+}
+
+// =====================================================================================
+//  Portal order
+//      A flow reads the visbits of the portals that are done and the mightsee of the rest,
+//      so which portals happen to be done changes the result a little. With -deterministic,
+//      a flow uses the visbits of exactly the portals before its own in the dispatch order,
+//      waiting for them if need be, which is what a run on one thread does. The mightsee of
+//      the later portals is still read then, so none is retired until the end.
+// =====================================================================================
+static int*     portalrank = NULL;                         // [g_numportals * 2], position in sortedportals
+static std::vector<char> portalflowed;                     // by rank, protected by portalordermutex
+static int      numportalsflowed;                          // portals before this rank are all done
+static std::mutex portalordermutex;
+static std::condition_variable portalordercond;
+static thread_local int t_numportalsflowed;                // last numportalsflowed the thread saw
+
+bool            PortalFlowedBefore(const portal_t* const base, const portal_t* const p)
+{
+    const int       rank = portalrank[p - g_portals];
+
+    if (rank >= portalrank[base - g_portals])
+    {
+        return false;
+    }
+    if (rank >= t_numportalsflowed)
+    {
+        std::unique_lock<std::mutex> lock(portalordermutex);
+        portalordercond.wait(lock, [rank] { return rank < numportalsflowed; });
+        t_numportalsflowed = numportalsflowed;
+    }
+    return true;
+}
+
+static void     EndOrderedPortalFlow(const portal_t* const p)
+{
+    {
+        std::lock_guard<std::mutex> lock(portalordermutex);
+        portalflowed[portalrank[p - g_portals]] = true;
+        while (numportalsflowed < (int)portalflowed.size() && portalflowed[numportalsflowed])
+        {
+            numportalsflowed++;
+        }
+    }
+    portalordercond.notify_all();
+}
+
+static void     EndPortalFlow(const int threadnum, portal_t* const p)
+{
+    if (g_deterministic)
+    {
+        EndOrderedPortalFlow(p);
+    }
+    ThreadLock(g_portalflowlock);
+    flowstart[threadnum] = 0;
+    retiredportal_t retired;
+    retired.portal = p;
+    retired.sequence = flowsequence;
+    retiredportals.push_back(retired);
+    if (!g_deterministic)
+    {
+        FreeRetiredPortals(false);
+    }
+    ThreadUnlock(g_portalflowlock);
+}
+
+// =====================================================================================
+//  ComparePortalComplexity
+// =====================================================================================
+static bool     ComparePortalComplexity(const portal_t* a, const portal_t* b)
+{
+    if (a->nummightsee != b->nummightsee)
+    {
+        return a->nummightsee < b->nummightsee;
+    }
+    return a < b;
+}
+
+// =====================================================================================
+//  SortPortals
+//      nummightsee is final once BasePortalVis is done, so the dispatch order can be built
+//      up front instead of rescanning every portal each time a thread wants work.
+//      Ties are broken by portal index, which is the order the old linear scan picked them in.
+// =====================================================================================
+static void     SortPortals()
+{
+    const int       numportals = g_numportals * 2;
+    int             i;
+
+    sortedportals = (portal_t**)malloc(numportals * sizeof(portal_t*));
+    hlassume(sortedportals != NULL, assume_NoMemory);
+    for (i = 0; i < numportals; i++)
+    {
+        sortedportals[i] = &g_portals[i];
+    }
+    std::sort(sortedportals, sortedportals + numportals, ComparePortalComplexity);
+    if (g_deterministic)
+    {
+        portalrank = (int*)malloc(numportals * sizeof(int));
+        hlassume(portalrank != NULL, assume_NoMemory);
+        for (i = 0; i < numportals; i++)
+        {
+            portalrank[sortedportals[i] - g_portals] = i;
+        }
+        portalflowed.assign(numportals, false);
+        numportalsflowed = 0;
+    }
+
+    memset(portalwait, 0, sizeof(portalwait));
+    memset(portalcount, 0, sizeof(portalcount));
+    memset(flowstart, 0, sizeof(flowstart));
+    flowsequence = 0;
+    portalbitbytes = peakportalbitbytes = (size_t)numportals * g_bitbytes;
+}
+
+// =====================================================================================
+//  Incremental vis
+//      mapname.pvd keeps the portals of the last run with their mightsee, visbits and rank.
+//      A portal is matched to its old self by its winding, and a leaf is unchanged if its
+//      portals match the old leaf's in the same order. A portal whose old mightsee only has
+//      unchanged leaves gets the same mightsee again. Its flow then only reads those leaves,
+//      the portals between them, and the part of those portals' visbits or mightsee that
+//      falls in its own mightsee, so if that part is the same as last time and each of them
+//      is still before or after it in the order, the flow gives the old visbits again.
+//      The others are flowed as usual, in the -deterministic order, so the result is the
+//      same as a full run.
+// =====================================================================================
+#define VISSTATE_IDENT "PVD1"
+
+static unsigned long long visstatekey;
+static bool     visstateloaded = false;
+static unsigned oldportalleafs;
+static int      oldnumportals;
+static unsigned oldbitbytes;
+static std::vector<int> oldportalleaf;                     // [oldnumportals * 2], the leaf each old portal leads into
+static std::vector<int> oldrank;                           // [oldnumportals * 2]
+static std::vector<byte> oldmightsee;                      // [oldnumportals * 2 * oldbitbytes]
+static std::vector<byte> oldvisbits;
+static std::vector<std::string> oldwindings;               // [oldnumportals], raw points
+static std::vector<int> oldportalof;                       // [g_numportals * 2], -1 if it has no match
+static std::vector<int> leaffromold;                       // [oldportalleafs], -1 if the leaf changed
+static std::vector<char> portalmightseereused;             // [g_numportals * 2]
+static std::vector<byte*> portalmightseediff;              // [g_numportals * 2], leafs whose bit changed, NULL if none
+static std::vector<byte*> portalvisbitsdiff;
+static std::atomic<int> numflowsreused;
+
+typedef struct
+{
+    const byte*     data;
+    size_t          left;
+}
+visstatereader_t;
+
+static bool     ReadVisState(visstatereader_t* const reader, void* const dest, const size_t size)
+{
+    if (size > reader->left)
+    {
+        return false;
+    }
+    memcpy(dest, reader->data, size);
+    reader->data += size;
+    reader->left -= size;
+    return true;
+}
+
+// the bit strings are stored with CompressVis
+static bool     ReadVisStateBits(visstatereader_t* const reader, byte* const dest, const unsigned length)
+{
+    unsigned        i = 0;
+
+    while (i < length)
+    {
+        if (!reader->left)
+        {
+            return false;
+        }
+        if (*reader->data)
+        {
+            dest[i++] = *reader->data++;
+            reader->left--;
+            continue;
+        }
+        if (reader->left < 2 || reader->data[1] > length - i)
+        {
+            return false;
+        }
+        memset(dest + i, 0, reader->data[1]);
+        i += reader->data[1];
+        reader->data += 2;
+        reader->left -= 2;
+    }
+    return true;
+}
+
+static void     WriteVisStateBits(FILE* const f, const byte* const bits)
+{
+    std::vector<byte> compressed(g_bitbytes * 2);
+    const int       size = CompressVis(bits, g_bitbytes, compressed.data(), compressed.size());
+
+    SafeWrite(f, compressed.data(), size);
+}
+
+static std::string WindingKey(const winding_t* const w)
+{
+    return std::string((const char*)w->points, w->numpoints * sizeof(vec3_t));
+}
+
+// the old bits of the leafs that are still there, in the new numbering
+static void     RemapOldBits(const byte* const oldbits, byte* const bits)
+{
+    unsigned        i;
+
+    memset(bits, 0, g_bitbytes);
+    for (i = 0; i < oldportalleafs; i++)
+    {
+        if ((oldbits[i >> 3] & (1 << (i & 7))) && leaffromold[i] >= 0)
+        {
+            bits[leaffromold[i] >> 3] |= 1 << (leaffromold[i] & 7);
+        }
+    }
+}
+
+// NULL if bits is the same as the remapped old bits, else the bits that differ
+static byte*    DiffOldBits(const byte* const oldbits, const byte* const bits)
+{
+    byte*           diff = (byte*)malloc(g_bitbytes);
+    unsigned        i;
+    bool            same = true;
+
+    hlassume(diff != NULL, assume_NoMemory);
+    RemapOldBits(oldbits, diff);
+    for (i = 0; i < g_bitbytes; i++)
+    {
+        diff[i] ^= bits[i];
+        if (diff[i])
+        {
+            same = false;
+        }
+    }
+    if (same)
+    {
+        free(diff);
+        return NULL;
+    }
+    return diff;
+}
+
+static bool     BitsMeet(const byte* const a, const byte* const b)
+{
+    unsigned        i;
+
+    for (i = 0; i < g_bitlongs; i++)
+    {
+        if (((const long*)a)[i] & ((const long*)b)[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool     LoadVisState(const char* const filename)
+{
+    visstatereader_t reader;
+    char            ident[4];
+    unsigned long long key;
+    char*           buffer;
+    int             numpoints;
+    int             leafnums[2];
+    int             i;
+    bool            ok = true;
+
+    reader.left = LoadFile(filename, &buffer);
+    reader.data = (const byte*)buffer;
+    if (!ReadVisState(&reader, ident, sizeof(ident)) || memcmp(ident, VISSTATE_IDENT, sizeof(ident))
+        || !ReadVisState(&reader, &key, sizeof(key)))
+    {
+        Log("Incremental vis: %s is not a portal vis file of this version\n", filename);
+        free(buffer);
+        return false;
+    }
+    if (key != visstatekey)
+    {
+        Log("Incremental vis: the options differ from the last run\n");
+        free(buffer);
+        return false;
+    }
+    ok = ReadVisState(&reader, &oldportalleafs, sizeof(oldportalleafs))
+        && ReadVisState(&reader, &oldnumportals, sizeof(oldnumportals))
+        && oldportalleafs <= MAX_MAP_LEAFS && oldnumportals >= 0
+        && (size_t)oldnumportals * (sizeof(numpoints) + sizeof(leafnums)) <= reader.left;
+    if (ok)
+    {
+        oldbitbytes = ((oldportalleafs + 63) & ~63) >> 3;
+        oldwindings.resize(oldnumportals);
+        oldportalleaf.resize(oldnumportals * 2);
+        oldrank.resize(oldnumportals * 2);
+        oldmightsee.assign((size_t)oldnumportals * 2 * oldbitbytes, 0);
+        oldvisbits.assign((size_t)oldnumportals * 2 * oldbitbytes, 0);
+    }
+    for (i = 0; ok && i < oldnumportals; i++)
+    {
+        ok = ReadVisState(&reader, &numpoints, sizeof(numpoints)) && ReadVisState(&reader, leafnums, sizeof(leafnums))
+            && numpoints >= 0 && numpoints <= MAX_POINTS_ON_WINDING
+            && (unsigned)leafnums[0] < oldportalleafs && (unsigned)leafnums[1] < oldportalleafs
+            && reader.left >= numpoints * sizeof(vec3_t);
+        if (ok)
+        {
+            oldwindings[i].assign((const char*)reader.data, numpoints * sizeof(vec3_t));
+            reader.data += numpoints * sizeof(vec3_t);
+            reader.left -= numpoints * sizeof(vec3_t);
+            oldportalleaf[i * 2] = leafnums[1];
+            oldportalleaf[i * 2 + 1] = leafnums[0];
+        }
+    }
+    for (i = 0; ok && i < oldnumportals * 2; i++)
+    {
+        ok = ReadVisState(&reader, &oldrank[i], sizeof(int))
+            && ReadVisStateBits(&reader, &oldmightsee[(size_t)i * oldbitbytes], oldbitbytes)
+            && ReadVisStateBits(&reader, &oldvisbits[(size_t)i * oldbitbytes], oldbitbytes);
+    }
+    free(buffer);
+    if (!ok || reader.left)
+    {
+        Log("Incremental vis: %s is damaged\n", filename);
+        return false;
+    }
+    return true;
+}
+
+// =====================================================================================
+//  BeginIncrementalVis
+//      Called with the portals loaded and the options set, before BasePortalVis
+// =====================================================================================
+void            BeginIncrementalVis(const CacheKey& key)
+{
+    char            filename[_MAX_PATH];
+    std::unordered_map<std::string, int> oldportals;
+    std::vector<std::vector<int> > oldleafportals;
+    const int       numportals = g_numportals * 2;
+    int             i, numunchangedleafs = 0, numreused = 0;
+    unsigned        j, k;
+
+    visstatekey = key.value();
+    safe_snprintf(filename, _MAX_PATH, "%s.pvd", g_Mapname);
+    if (!q_exists(filename))
+    {
+        Log("Incremental vis: no %s, flowing every portal\n", filename);
+        return;
+    }
+    if (!LoadVisState(filename))
+    {
+        return;
+    }
+    visstateloaded = true;
+
+    // match the portals by their windings; ones that aren't unique don't match anything
+    for (i = 0; i < oldnumportals; i++)
+    {
+        auto            inserted = oldportals.insert(std::make_pair(oldwindings[i], i));
+
+        if (!inserted.second)
+        {
+            inserted.first->second = -1;
+        }
+    }
+    oldportalof.assign(numportals, -1);
+    for (i = 0; i < g_numportals; i++)
+    {
+        auto            found = oldportals.find(WindingKey(g_portals[i * 2].winding));
+
+        if (found != oldportals.end() && found->second >= 0)
+        {
+            oldportalof[i * 2] = found->second * 2;
+            oldportalof[i * 2 + 1] = found->second * 2 + 1;
+        }
+    }
+    {
+        std::vector<int> newportalof(oldnumportals, -1);
+
+        for (i = 0; i < g_numportals; i++)
+        {
+            const int       oldp = oldportalof[i * 2] / 2;
+
+            if (oldportalof[i * 2] < 0)
+            {
+                continue;
+            }
+            if (newportalof[oldp] >= 0)                    // the same winding twice in the new portals
+            {
+                oldportalof[newportalof[oldp] * 2] = oldportalof[newportalof[oldp] * 2 + 1] = -1;
+                oldportalof[i * 2] = oldportalof[i * 2 + 1] = -1;
+                continue;
+            }
+            newportalof[oldp] = i;
+        }
+    }
+
+    // the old leaves' portal lists, built in the order LoadPortals builds them
+    oldleafportals.resize(oldportalleafs);
+    for (i = 0; i < oldnumportals * 2; i++)
+    {
+        oldleafportals[oldportalleaf[i ^ 1]].push_back(i);
+    }
+    leaffromold.assign(oldportalleafs, -1);
+    for (j = 0; j < g_portalleafs; j++)
+    {
+        const leaf_t*   leaf = &g_leafs[j];
+        int             oldleaf;
+
+        if (!leaf->numportals || oldportalof[leaf->portals[0] - g_portals] < 0)
+        {
+            continue;
+        }
+        oldleaf = oldportalleaf[oldportalof[leaf->portals[0] - g_portals] ^ 1];
+        if (oldleafportals[oldleaf].size() != leaf->numportals)
+        {
+            continue;
+        }
+        for (k = 0; k < leaf->numportals; k++)
+        {
+            if (oldportalof[leaf->portals[k] - g_portals] != oldleafportals[oldleaf][k])
+            {
+                break;
+            }
+        }
+        if (k == leaf->numportals)
+        {
+            leaffromold[oldleaf] = j;
+            numunchangedleafs++;
+        }
+    }
+
+    // a portal that can only see unchanged leaves gets its old mightsee, and BasePortalVis skips it
+    portalmightseereused.assign(numportals, false);
+    portalmightseediff.assign(numportals, NULL);
+    portalvisbitsdiff.assign(numportals, NULL);
+    numflowsreused = 0;
+    for (i = 0; i < numportals; i++)
+    {
+        portal_t*       p = &g_portals[i];
+        const byte*     bits;
+
+        if (oldportalof[i] < 0)
+        {
+            continue;
+        }
+        bits = &oldmightsee[(size_t)oldportalof[i] * oldbitbytes];
+        for (j = 0; j < oldportalleafs; j++)
+        {
+            if ((bits[j >> 3] & (1 << (j & 7))) && leaffromold[j] < 0)
+            {
+                break;
+            }
+        }
+        if (j < oldportalleafs)
+        {
+            continue;
+        }
+        p->mightsee = (byte*)malloc(g_bitbytes);
+        hlassume(p->mightsee != NULL, assume_NoMemory);
+        RemapOldBits(bits, p->mightsee);
+        p->nummightsee = 0;
+        for (j = 0; j < g_portalleafs; j++)
+        {
+            if (p->mightsee[j >> 3] & (1 << (j & 7)))
+            {
+                p->nummightsee++;
+            }
+        }
+        portalmightseereused[i] = true;
+        numreused++;
+    }
+    Log("Incremental vis: %i of %i leafs unchanged, mightsee of %i of %i portals reused\n",
+        numunchangedleafs, g_portalleafs, numreused, numportals);
+}
+
+// =====================================================================================
+//  CompareMightsee
+//      After BasePortalVis, notes which leafs changed in the mightsee of the portals it redid
+// =====================================================================================
+static void     CompareMightsee()
+{
+    const int       numportals = g_numportals * 2;
+    int             i;
+
+    for (i = 0; i < numportals; i++)
+    {
+        if (!portalmightseereused[i] && oldportalof[i] >= 0)
+        {
+            portalmightseediff[i] = DiffOldBits(&oldmightsee[(size_t)oldportalof[i] * oldbitbytes], g_portals[i].mightsee);
+        }
+    }
+}
+
+// =====================================================================================
+//  PortalFlowUnchanged
+//      Whether flowing p would give its old visbits, see above. Waits for the portals before
+//      it that it depends on, like the flow itself would.
+// =====================================================================================
+static bool     PortalFlowUnchanged(const portal_t* const p)
+{
+    const int       pnum = p - g_portals;
+    const int       oldp = oldportalof[pnum];
+    unsigned        i, j;
+
+    if (!portalmightseereused[pnum])
+    {
+        return false;
+    }
+    // every portal the flow can test, see RecursiveLeafFlow
+    for (i = 0; i < g_portalleafs; i++)
+    {
+        if (!(p->mightsee[i >> 3] & (1 << (i & 7))))
+        {
+            continue;
+        }
+        for (j = 0; j < g_leafs[i].numportals; j++)
+        {
+            const portal_t* const tp = g_leafs[i].portals[j];
+            const int       tpnum = tp - g_portals;
+            bool            before;
+            const byte*     diff;
+
+            if (!(p->mightsee[tp->leaf >> 3] & (1 << (tp->leaf & 7))))
+            {
+                continue;
+            }
+            if (oldportalof[tpnum] < 0)
+            {
+                return false;
+            }
+            before = PortalFlowedBefore(p, tp);
+            if (before != (oldrank[oldportalof[tpnum]] < oldrank[oldp]))
+            {
+                return false;
+            }
+            diff = before ? portalvisbitsdiff[tpnum] : portalmightseediff[tpnum];
+            if (diff && BitsMeet(diff, p->mightsee))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// =====================================================================================
+//  IncrementalPortalFlow
+//      Takes the place of PortalFlow
+// =====================================================================================
+static void     IncrementalPortalFlow(portal_t* const p, const int threadnum)
+{
+    const int       pnum = p - g_portals;
+    unsigned        i;
+
+    if (PortalFlowUnchanged(p))
+    {
+        p->visbits = (byte*)malloc(g_bitbytes);
+        hlassume(p->visbits != NULL, assume_NoMemory);
+        RemapOldBits(&oldvisbits[(size_t)oldportalof[pnum] * oldbitbytes], p->visbits);
+        p->numcansee = 0;
+        for (i = 0; i < g_portalleafs; i++)
+        {
+            if (p->visbits[i >> 3] & (1 << (i & 7)))
+            {
+                p->numcansee++;
+            }
+        }
+        p->status = stat_done;
+        numflowsreused++;
+        return;
+    }
+    PortalFlow(p, threadnum);
+    if (oldportalof[pnum] >= 0)
+    {
+        portalvisbitsdiff[pnum] = DiffOldBits(&oldvisbits[(size_t)oldportalof[pnum] * oldbitbytes], p->visbits);
+    }
+}
+
+// =====================================================================================
+//  SaveVisState
+//      Before the mightsee are freed
+// =====================================================================================
+static void     SaveVisState()
+{
+    char            filename[_MAX_PATH];
+    const int       numportals = g_numportals * 2;
+    FILE*           f;
+    int             i;
+
+    safe_snprintf(filename, _MAX_PATH, "%s.pvd", g_Mapname);
+    f = SafeOpenWrite(filename);
+    SafeWrite(f, VISSTATE_IDENT, 4);
+    SafeWrite(f, &visstatekey, sizeof(visstatekey));
+    SafeWrite(f, &g_portalleafs, sizeof(g_portalleafs));
+    SafeWrite(f, &g_numportals, sizeof(g_numportals));
+    for (i = 0; i < g_numportals; i++)
+    {
+        const winding_t* w = g_portals[i * 2].winding;
+        const int       leafnums[2] = {g_portals[i * 2 + 1].leaf, g_portals[i * 2].leaf};
+
+        SafeWrite(f, &w->numpoints, sizeof(w->numpoints));
+        SafeWrite(f, leafnums, sizeof(leafnums));
+        SafeWrite(f, w->points, w->numpoints * sizeof(vec3_t));
+    }
+    for (i = 0; i < numportals; i++)
+    {
+        SafeWrite(f, &portalrank[i], sizeof(int));
+        WriteVisStateBits(f, g_portals[i].mightsee);
+        WriteVisStateBits(f, g_portals[i].visbits);
+    }
+    fclose(f);
+}
+
+static void     FreeVisState()
+{
+    int             i;
+
+    if (visstateloaded)
+    {
+        Log("Incremental vis: flow of %i of %i portals reused\n", (int)numflowsreused, g_numportals * 2);
+        for (i = 0; i < g_numportals * 2; i++)
+        {
+            free(portalmightseediff[i]);
+            free(portalvisbitsdiff[i]);
+        }
+    }
+    std::vector<int>().swap(oldportalleaf);
+    std::vector<int>().swap(oldrank);
+    std::vector<byte>().swap(oldmightsee);
+    std::vector<byte>().swap(oldvisbits);
+    std::vector<std::string>().swap(oldwindings);
+    std::vector<int>().swap(oldportalof);
+    std::vector<int>().swap(leaffromold);
+    std::vector<char>().swap(portalmightseereused);
+    std::vector<byte*>().swap(portalmightseediff);
+    std::vector<byte*>().swap(portalvisbitsdiff);
+}
+#endif
+
 // =====================================================================================
 //  GetNextPortal
 //      Returns the next portal for a thread to work on
 //      Returns the portals from the least complex, so the later ones can reuse the earlier information.
 // =====================================================================================
+#ifndef ZHLT_NETVIS
+static portal_t* GetNextPortal(int threadnum)
+{
+    int             work;
+    portal_t*       p;
+    double          start;
+
+    start = I_FloatTime();
+    work = GetThreadWork();
+    portalwait[threadnum] += I_FloatTime() - start;
+    if (work == -1)
+    {
+        return NULL;
+    }
+
+    p = sortedportals[work];
+    p->status = stat_working;
+    portalcount[threadnum]++;
+
+    return p;
+}
+#else
 static portal_t* GetNextPortal()
 {
     int             j;
@@ -342,17 +1067,9 @@ static portal_t* GetNextPortal()
     portal_t*       tp;
     int             min;
 
-#ifdef ZHLT_NETVIS
     if (g_vismode == VIS_MODE_SERVER)
     {
-#else
-    {
-        if (GetThreadWork() == -1)
-        {
-            return NULL;
-        }
-#endif
-        ThreadLock();
+        ThreadLock(g_portalselectlock);
 
         min = 99999;
         p = NULL;
@@ -363,9 +1080,7 @@ static portal_t* GetNextPortal()
             {
                 min = tp->nummightsee;
                 p = tp;
-#ifdef ZHLT_NETVIS
                 g_visportalindex = j;
-#endif
             }
         }
 
@@ -374,11 +1089,10 @@ static portal_t* GetNextPortal()
             p->status = stat_working;
         }
 
-        ThreadUnlock();
+        ThreadUnlock(g_portalselectlock);
 
         return p;
     }
-#ifdef ZHLT_NETVIS
     else                                                   // AS CLIENT
     {
         while (getWorkFromClientQueue() == WAITING_FOR_PORTAL_INDEX)
@@ -409,8 +1123,8 @@ static portal_t* GetNextPortal()
         }
         return (tp);
     }
-#endif
 }
+#endif
 
 
 
@@ -424,18 +1138,27 @@ static portal_t* GetNextPortal()
 #endif
 
 #ifndef ZHLT_NETVIS
-static void     LeafThread(int unused)
+static void     LeafThread(int threadnum)
 {
     portal_t*       p;
 
     while (1)
     {
-        if (!(p = GetNextPortal()))
+        if (!(p = GetNextPortal(threadnum)))
         {
             return;
         }
 
-        PortalFlow(p);
+        BeginPortalFlow(threadnum);
+        if (visstateloaded)
+        {
+            IncrementalPortalFlow(p, threadnum);
+        }
+        else
+        {
+            PortalFlow(p, threadnum);
+        }
+        EndPortalFlow(threadnum, p);
 
         Verbose("portal:%4i  mightsee:%4i  cansee:%4i\n", (int)(p - g_portals), p->nummightsee, p->numcansee);
     }
@@ -470,7 +1193,7 @@ static void     LeafThread(int unused)
                 return;
             }
 
-            PortalFlow(p);
+            PortalFlow(p, 0);
             Send_VIS_DONE_PORTAL(g_visportalindex, p);
             g_vislocalportal++;
         }
@@ -505,7 +1228,7 @@ static void     LeafThread(int unused)
                 NetvisSleep(1000);                         // No need to churn while waiting on slow clients
                 continue;
             }
-            PortalFlow(p);
+            PortalFlow(p, 0);
             g_vislocalportal++;
         }
 #endif
@@ -698,7 +1421,49 @@ static void     CalcPortalVis()
 #ifdef ZHLT_NETVIS
     LeafThread(0);
 #else
+    SortPortals();
+    const size_t    baseportalbitbytes = portalbitbytes;
     NamedRunThreadsOn(g_numportals * 2, g_estimate, LeafThread);
+    if (g_incremental)
+    {
+        SaveVisState();
+        FreeVisState();
+    }
+    free(sortedportals);
+    sortedportals = NULL;
+    free(portalrank);
+    portalrank = NULL;
+    std::vector<char>().swap(portalflowed);
+    FreeRetiredPortals(true);
+
+    {
+        const size_t    stackbitbytes = GetStackBitsSize();
+
+        Log("bit string memory: BasePortalVis %.2f MB, PortalFlow peak %.2f MB (%.2f MB portals, %.2f MB flow stacks), LeafFlow %.2f MB\n",
+            baseportalbitbytes / (1024.0 * 1024.0),
+            (peakportalbitbytes + stackbitbytes) / (1024.0 * 1024.0),
+            peakportalbitbytes / (1024.0 * 1024.0),
+            stackbitbytes / (1024.0 * 1024.0),
+            (portalbitbytes + (size_t)g_portalleafs * g_bitbytes) / (1024.0 * 1024.0));
+        FreeStackBits();
+    }
+
+    {
+        int             i;
+        double          total = 0;
+        double          most = 0;
+
+        for (i = 0; i < g_numthreads; i++)
+        {
+            Verbose("thread %2i : %6i portals, %.3f seconds waiting for work\n", i, portalcount[i], portalwait[i]);
+            total += portalwait[i];
+            if (portalwait[i] > most)
+            {
+                most = portalwait[i];
+            }
+        }
+        Log("portal dispatch wait: %.3f seconds total, %.3f seconds worst thread\n", total, most);
+    }
 #endif
 }
 
@@ -718,6 +1483,7 @@ static void     CalcVis()
     {
         g_visstate = VIS_BASE_PORTAL_VIS;
         Log("BasePortalVis: \n");
+        BuildLeafPortalLists();
         
         for (x = 0, size = g_numportals * 2; x < size; x++)
         {
@@ -731,6 +1497,7 @@ static void     CalcVis()
             }
             BasePortalVis(x);
         }
+        FreeLeafPortalLists();
 		PrintConsole
 			("\n");
     }
@@ -834,7 +1601,13 @@ static void     CalcVis()
 //		InitVisBlock();
 //		SetupVisBlockLeafs();
 
+		BuildLeafPortalLists();
 		NamedRunThreadsOn(g_numportals * 2, g_estimate, BasePortalVis);
+		FreeLeafPortalLists();
+		if (visstateloaded)
+		{
+			CompareMightsee();
+		}
 
 //		if(g_numvisblockers)
 //			NamedRunThreadsOn(g_numvisblockers, g_estimate, BlockVis);
@@ -880,7 +1653,9 @@ static void     CalcVis()
 			vismap_p = g_dvisdata;
 
 			// We don't need to run BasePortalVis again			
+			BuildMaxDistBounds();
 			NamedRunThreadsOn(g_portalleafs, g_estimate, MaxDistVis);
+			FreeMaxDistBounds();
 
 			// No need to run this - MaxDistVis now writes directly to visbits after the initial VIS
 			//CalcPortalVis();
@@ -1197,6 +1972,10 @@ static void     Usage()
     Log("    -chart          : display bsp statitics\n");
     Log("    -low | -high    : run program an altered priority level\n");
     Log("    -nolog          : don't generate the compile logfiles\n");
+    Log("    -profile        : write phase timings to mapname.profile.json\n");
+    Log("    -deterministic  : same output for any thread count\n");
+    Log("    -cache          : reuse the output of the last run with the same inputs\n");
+    Log("    -incremental    : only flow the portals changed since the last run (implies -deterministic)\n");
     Log("    -threads #      : manually specify the number of threads to run\n");
 #ifdef SYSTEM_WIN32
     Log("    -estimate       : display estimated time during compile\n");
@@ -1254,6 +2033,10 @@ static void     Settings()
     Log("developer           [ %7d ] [ %7d ]\n", g_developer, DEFAULT_DEVELOPER);
     Log("chart               [ %7s ] [ %7s ]\n", g_chart ? "on" : "off", DEFAULT_CHART ? "on" : "off");
     Log("estimate            [ %7s ] [ %7s ]\n", g_estimate ? "on" : "off", DEFAULT_ESTIMATE ? "on" : "off");
+    Log("profile             [ %7s ] [ %7s ]\n", g_profile ? "on" : "off", DEFAULT_PROFILE ? "on" : "off");
+    Log("deterministic       [ %7s ] [ %7s ]\n", g_deterministic ? "on" : "off", DEFAULT_DETERMINISTIC ? "on" : "off");
+    Log("cache               [ %7s ] [ %7s ]\n", g_cache ? "on" : "off", DEFAULT_CACHE ? "on" : "off");
+    Log("incremental         [ %7s ] [ %7s ]\n", g_incremental ? "on" : "off", DEFAULT_INCREMENTAL ? "on" : "off");
     Log("max texture memory  [ %7d ] [ %7d ]\n", g_max_map_miptex, DEFAULT_MAX_MAP_MIPTEX);
 
     Log("max vis distance    [ %7d ] [ %7d ]\n", g_maxdistance, DEFAULT_MAXDISTANCE_RANGE);
@@ -1419,6 +2202,54 @@ void FixPrt(const char* portalfile)
 
     return;
 }
+
+#ifndef ZHLT_NETVIS
+// =====================================================================================
+//  MakeVisCacheKey
+//      Everything but the entities that vis doesn't look at, so an entity-only edit reuses the
+//      last visibility data
+// =====================================================================================
+static void     MakeVisCacheKey(CacheKey& key, const int argc, char** const argv, const char* const portalfile)
+{
+    int             i;
+    const epair_t*  ep;
+
+    key.addArguments(argc, argv);
+    key.addFile(portalfile);
+    for (i = 0; i < HEADER_LUMPS; i++)
+    {
+        if (i != LUMP_ENTITIES && i != LUMP_VISIBILITY && i != LUMP_LIGHTING && i != LUMP_LEAFS)
+        {
+            key.addLump(i);
+        }
+    }
+    for (i = 0; i < g_numleafs; i++)
+    {
+        dleaf_t         leaf = g_dleafs[i];
+
+        leaf.visofs = 0;                                   // what vis writes, so rerunning it on its own output still matches
+        key.add(&leaf, sizeof(leaf));
+    }
+    for (i = 0; i < g_numentities; i++)
+    {
+        const char*     classname = ValueForKey(&g_entities[i], "classname");
+
+        if (strcmp(classname, "info_overview_point") && strcmp(classname, "info_portal")
+            && strcmp(classname, "info_leaf") && strcasecmp(classname, "func_vis")
+            && strcmp(classname, "info_compile_parameters"))
+        {
+            continue;
+        }
+        key.add(&i, sizeof(i));
+        for (ep = g_entities[i].epairs; ep; ep = ep->next)
+        {
+            key.addString(ep->key);
+            key.addString(ep->value);
+        }
+    }
+}
+#endif
+
 // =====================================================================================
 //  main
 // =====================================================================================
@@ -1592,6 +2423,23 @@ int             main(const int argc, char** argv)
         {
             g_log = false;
         }
+        else if (!strcasecmp(argv[i], "-profile"))
+        {
+            g_profile = true;
+        }
+        else if (!strcasecmp(argv[i], "-deterministic"))
+        {
+            g_deterministic = true;
+        }
+        else if (!strcasecmp(argv[i], "-cache"))
+        {
+            g_cache = true;
+        }
+        else if (!strcasecmp(argv[i], "-incremental"))
+        {
+            g_incremental = true;
+            g_deterministic = true;                        // the old visbits are only valid in this order
+        }
         else if (!strcasecmp(argv[i], "-texdata"))
         {
             if (i + 1 < argc)	//added "1" .--vluzacn
@@ -1852,6 +2700,32 @@ int             main(const int argc, char** argv)
 
     LoadBSPFile(source);
     ParseEntities();
+
+    const int       vislumps[] = {LUMP_VISIBILITY, LUMP_LEAFS};
+    CacheKey        key;
+
+    if (g_cache)
+    {
+        MakeVisCacheKey(key, argc, argv, portalfile);
+        if (LoadCache(g_Mapname, "vis", key, vislumps, sizeof(vislumps) / sizeof(vislumps[0]), NULL, 0))
+        {
+            Settings();
+            if (!g_nofixprt)
+            {
+                FixPrt(portalfile);
+            }
+            if (g_chart)
+            {
+                PrintBSPFileSizes();
+            }
+            WriteBSPFile(source);
+
+            end = I_FloatTime();
+            LogTimeElapsed(end - start);
+            WriteProfile(g_Mapname);
+            return 0;
+        }
+    }
 	{
 		int i;
 		for (i = 0; i < g_numentities; i++)
@@ -1932,6 +2806,17 @@ int             main(const int argc, char** argv)
     Settings();
     g_uncompressed = (byte*)calloc(g_portalleafs, g_bitbytes);
 
+#ifndef ZHLT_NETVIS
+    if (g_incremental && !g_fastvis)
+    {
+        CacheKey        statekey;
+
+        statekey.addArguments(argc, argv);
+        statekey.add(&g_fullvis, sizeof(g_fullvis));
+        BeginIncrementalVis(statekey);
+    }
+#endif
+
     CalcVis();
 
 #ifdef ZHLT_NETVIS
@@ -1950,6 +2835,7 @@ int             main(const int argc, char** argv)
 
         end = I_FloatTime();
         LogTimeElapsed(end - start);
+        WriteProfile(g_Mapname);
 
         free(g_uncompressed);
         // END VIS
@@ -1970,6 +2856,7 @@ int             main(const int argc, char** argv)
 
         end = I_FloatTime();
         LogTimeElapsed(end - start);
+        WriteProfile(g_Mapname);
 
         free(g_uncompressed);
         // END VIS
@@ -1981,6 +2868,8 @@ int             main(const int argc, char** argv)
     g_visdatasize = vismap_p - g_dvisdata;
     Log("g_visdatasize:%i  compressed from %i\n", g_visdatasize, originalvismapsize);
 
+    WriteCache(g_Mapname, "vis", key, vislumps, sizeof(vislumps) / sizeof(vislumps[0]), NULL, 0);
+
     if (!g_nofixprt) //seedee
     {
         FixPrt(portalfile);
@@ -1995,6 +2884,7 @@ int             main(const int argc, char** argv)
 
     end = I_FloatTime();
     LogTimeElapsed(end - start);
+    WriteProfile(g_Mapname);
 
     free(g_uncompressed);
     // END VIS
@@ -14,6 +14,7 @@
 #include "bspfile.h"
 #include "threads.h"
 #include "filelib.h"
+#include "cache.h"
 
 #include "zones.h"
 #include "cmdlinecfg.h"
@@ -35,6 +36,7 @@
 #define DEFAULT_ESTIMATE    true
 #endif
 #define DEFAULT_FASTVIS     false
+#define DEFAULT_INCREMENTAL false
 #define DEFAULT_NETVIS_PORT 21212
 #define DEFAULT_NETVIS_RATE 60
 
@@ -107,7 +109,8 @@ typedef struct leaf_s
 
 typedef struct pstack_s
 {
-    byte            mightsee[MAX_MAP_LEAFS / 8];           // bit string
+    byte*           mightsee;                              // bit string, one level of the thread's bitstack
+    unsigned        depth;
 #ifdef USE_CHECK_STACK
     struct pstack_s* next;
 #endif
@@ -129,9 +132,16 @@ typedef struct pstack_s
 #endif
 } pstack_t;
 
+// Per-thread mightsee bit strings for RecursiveLeafFlow, one g_bitbytes level per recursion depth
+typedef struct
+{
+    std::vector<byte*> levels;
+} bitstack_t;
+
 typedef struct
 {
     byte*           leafvis;                               // bit string
+    bitstack_t*     bitstack;
     //      byte            fullportal[MAX_PORTALS/8];              // bit string
     portal_t*       base;
     pstack_t        pstack_head;
@@ -140,6 +150,7 @@ typedef struct
 
 extern bool     g_fastvis;
 extern bool     g_fullvis;
+extern bool     g_incremental;
 
 extern int      g_numportals;
 extern unsigned g_portalleafs;
@@ -199,13 +210,23 @@ extern volatile int g_vislocalpercent;
 
 extern Zones*          g_Zones;
 
+extern void     BuildLeafPortalLists();
+extern void     FreeLeafPortalLists();
 extern void     BasePortalVis(int threadnum);
 
 
+extern void     BuildMaxDistBounds();
+extern void     FreeMaxDistBounds();
 extern void		MaxDistVis(int threadnum);
 //extern void		PostMaxDistVis(int threadnum);
 
-extern void     PortalFlow(portal_t* p);
+extern void     PortalFlow(portal_t* p, int threadnum);
+#ifndef ZHLT_NETVIS
+extern bool     PortalFlowedBefore(const portal_t* base, const portal_t* p); // -deterministic
+extern void     BeginIncrementalVis(const CacheKey& key);
+#endif
+extern size_t   GetStackBitsSize();
+extern void     FreeStackBits();
 extern void     CalcAmbientSounds();
 
 #ifdef ZHLT_NETVIS
@@ -0,0 +1,60 @@
+#!/usr/bin/env bash
+#
+# Compiles tests/maps/deterministic.map with CSG, BSP, VIS and RAD under -deterministic at
+# 1, 4 and 32 threads, and fails if the three .bsp files differ.
+#
+# Usage: deterministic.sh [CSG BSP VIS RAD]
+#   The tools default to the ones the build puts in tools/.
+
+set -u
+
+testdir="$(cd "$(dirname "$0")" && pwd)"
+rootdir="$(dirname "$testdir")"
+
+if [ $# -eq 4 ]; then
+    tools=("$1" "$2" "$3" "$4")
+elif [ $# -eq 0 ]; then
+    tools=("$rootdir/tools/sdHLCSG" "$rootdir/tools/sdHLBSP" "$rootdir/tools/sdHLVIS" "$rootdir/tools/sdHLRAD")
+else
+    echo "usage: $0 [CSG BSP VIS RAD]" >&2
+    exit 2
+fi
+
+for tool in "${tools[@]}"; do
+    if [ ! -x "$tool" ]; then
+        echo "$tool: not found, build the tools first" >&2
+        exit 2
+    fi
+done
+
+workdir="$(mktemp -d)"
+trap 'rm -rf "$workdir"' EXIT
+
+status=0
+first=""
+for threads in 1 4 32; do
+    dir="$workdir/threads$threads"
+    mkdir "$dir"
+    cp "$testdir/maps/deterministic.map" "$testdir/maps/deterministic.wad" "$rootdir/tools/sdhlt.wad" "$dir/"
+
+    for tool in "${tools[@]}"; do
+        if ! (cd "$dir" && "$tool" -deterministic -threads "$threads" deterministic > /dev/null 2>&1); then
+            echo "$(basename "$tool") failed at -threads $threads:" >&2
+            cat "$dir/deterministic.log" >&2
+            exit 1
+        fi
+    done
+
+    sum="$(cd "$dir" && md5sum deterministic.bsp | cut -d ' ' -f 1)"
+    echo "-threads $threads: $sum"
+    if [ -z "$first" ]; then
+        first="$sum"
+    elif [ "$sum" != "$first" ]; then
+        status=1
+    fi
+done
+
+if [ $status -ne 0 ]; then
+    echo "the .bsp depends on the thread count" >&2
+fi
+exit $status